@@ -0,0 +1,35 @@
+// Copyright (c) Microsoft. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+#include <stddef.h>
+
+#include "alloc_counter.h"
+
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t count, size_t size);
+void* __real_realloc(void* ptr, size_t size);
+
+static uint64_t Allocations = 0;
+
+void* __wrap_malloc(size_t size)
+{
+	__atomic_add_fetch(&Allocations, 1, __ATOMIC_RELAXED);
+	return __real_malloc(size);
+}
+
+void* __wrap_calloc(size_t count, size_t size)
+{
+	__atomic_add_fetch(&Allocations, 1, __ATOMIC_RELAXED);
+	return __real_calloc(count, size);
+}
+
+void* __wrap_realloc(void* ptr, size_t size)
+{
+	__atomic_add_fetch(&Allocations, 1, __ATOMIC_RELAXED);
+	return __real_realloc(ptr, size);
+}
+
+uint64_t AllocCounter_Get(void)
+{
+	return __atomic_load_n(&Allocations, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,22 @@
+// Copyright (c) Microsoft. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+#ifndef ALLOC_COUNTER_H
+#define ALLOC_COUNTER_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Test hook for the send path. Built only with the count_mallocs CMake
+   option, which links with --wrap for malloc, calloc and realloc so every
+   heap allocation in the process, the SDK's included, goes through here. */
+uint64_t AllocCounter_Get(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* ALLOC_COUNTER_H */
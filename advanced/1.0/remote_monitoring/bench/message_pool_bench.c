@@ -0,0 +1,116 @@
+// Copyright (c) Microsoft. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+/* Time per telemetry message built in a pooled buffer against the malloc,
+   sprintf and free it replaced, and of the buffer handling alone. Both are
+   run with the heap warm and again after fragmenting it with interleaved
+   allocations of other sizes. Built with the build_benchmarks option. The
+   count_mallocs build of remote_monitoring counts the allocations. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "message_pool.h"
+
+#define ROUNDS 200000
+#define MALLOC_BUFFER_SIZE 256
+#define POOL_BUFFERS 4
+#define POOL_BUFFER_SIZE 16384
+#define CLUTTER_BLOCKS 4096
+
+static const char* telemetryData = "{"
+"\"DeviceID\": \"%s\","
+"\"Timestamp\" : %llu,"
+"\"Temperature\" : %.2f,"
+"\"Humidity\" : %.3f } ";
+static const char* deviceId = "raspberrypi";
+
+static volatile size_t Sink;
+static void* Clutter[CLUTTER_BLOCKS];
+
+static double NowNs(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (double)now.tv_sec * 1e9 + (double)now.tv_nsec;
+}
+
+/* Leaves every other block of assorted sizes allocated, so later mallocs
+   have to search around the holes */
+static void FragmentHeap(void)
+{
+	for (int i = 0; i < CLUTTER_BLOCKS; i++)
+	{
+		Clutter[i] = malloc(16 + (size_t)(i * 37) % 1024);
+	}
+	for (int i = 0; i < CLUTTER_BLOCKS; i += 2)
+	{
+		free(Clutter[i]);
+		Clutter[i] = NULL;
+	}
+}
+
+static double RunMalloc(int format)
+{
+	double startNs = NowNs();
+	for (int i = 0; i < ROUNDS; i++)
+	{
+		char* buffer = malloc(MALLOC_BUFFER_SIZE);
+		if (buffer == NULL)
+		{
+			return -1;
+		}
+		buffer[0] = '{';
+		Sink = format ? (size_t)sprintf(buffer, telemetryData, deviceId, 1500000000000ULL + (unsigned long long)i,
+			21.52 + (i % 50) * 0.01, 40.176 - (i % 70) * 0.001) : (size_t)buffer[0];
+		free(buffer);
+	}
+	return (NowNs() - startNs) / ROUNDS;
+}
+
+static double RunPool(MESSAGE_POOL_HANDLE pool, int format)
+{
+	double startNs = NowNs();
+	for (int i = 0; i < ROUNDS; i++)
+	{
+		MESSAGE_BUFFER* message = MessagePool_Acquire(pool);
+		if (message == NULL || (format &&
+			MessageBuffer_Printf(message, telemetryData, deviceId, 1500000000000ULL + (unsigned long long)i,
+				21.52 + (i % 50) * 0.01, 40.176 - (i % 70) * 0.001) != 0))
+		{
+			return -1;
+		}
+		Sink = message->length;
+		MessagePool_Release(message);
+	}
+	return (NowNs() - startNs) / ROUNDS;
+}
+
+static void Report(const char* heap, MESSAGE_POOL_HANDLE pool)
+{
+	printf("%s, ns/message:\n", heap);
+	printf("  malloc/free %8.1f  malloc/sprintf/free %8.1f\n", RunMalloc(0), RunMalloc(1));
+	printf("  pool        %8.1f  pool with printf    %8.1f\n", RunPool(pool, 0), RunPool(pool, 1));
+}
+
+int main(void)
+{
+	MESSAGE_POOL_HANDLE pool = MessagePool_Create(POOL_BUFFERS, POOL_BUFFER_SIZE);
+	if (pool == NULL)
+	{
+		printf("Failed to create the message pool\r\n");
+		return EXIT_FAILURE;
+	}
+
+	Report("warm heap", pool);
+	FragmentHeap();
+	Report("fragmented heap", pool);
+
+	for (int i = 1; i < CLUTTER_BLOCKS; i += 2)
+	{
+		free(Clutter[i]);
+	}
+	MessagePool_Destroy(pool);
+	return EXIT_SUCCESS;
+}
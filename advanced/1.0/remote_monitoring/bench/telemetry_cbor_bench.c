@@ -0,0 +1,135 @@
+// Copyright (c) Microsoft. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+/* Size and encode time of one telemetry message as CBOR and as the sprintf
+   JSON, for a single sample and for a batch. Built with the build_benchmarks
+   option; run it on the board, the numbers differ a lot between cores. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "message_pool.h"
+#include "telemetry_batch.h"
+#include "telemetry_cbor.h"
+
+#define ROUNDS 100000
+#define BATCH_SAMPLES 20
+#define BUFFER_SIZE 16384
+
+/* The JSON format and device id remote_monitoring sends with */
+static const char* telemetryData = "{"
+"\"DeviceID\": \"%s\","
+"\"Timestamp\" : %llu,"
+"\"Temperature\" : %.2f,"
+"\"Humidity\" : %.3f } ";
+static const char* deviceId = "raspberrypi";
+
+static volatile size_t Sink;
+
+static double NowNs(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (double)now.tv_sec * 1e9 + (double)now.tv_nsec;
+}
+
+static void MakeSample(TELEMETRY_SAMPLE* sample, int i)
+{
+	sample->timestampMs = 1500000000000ULL + (uint64_t)i * 3000;
+	sample->sensorCount = 1;
+	sample->status[0] = 1;
+	sample->temperature[0] = 21.52f + (float)(i % 50) * 0.01f;
+	sample->humidity[0] = 40.176f - (float)(i % 70) * 0.001f;
+	sample->pressure[0] = 101325.0f;
+}
+
+static void FillBatch(TELEMETRY_BATCH* batch)
+{
+	TELEMETRY_SAMPLE sample;
+	TelemetryBatch_Init(batch);
+	for (int i = 0; i < BATCH_SAMPLES; i++)
+	{
+		MakeSample(&sample, i);
+		(void)TelemetryBatch_Add(batch, &sample, sample.timestampMs);
+	}
+}
+
+static void Report(const char* name, size_t bytes, double startNs)
+{
+	printf("%-12s %5zu bytes %8.1f ns\n", name, bytes, (NowNs() - startNs) / ROUNDS);
+}
+
+int main(void)
+{
+	static TELEMETRY_BATCH batch;
+	static unsigned char buffer[BUFFER_SIZE];
+	TELEMETRY_SAMPLE sample;
+	size_t length = 0;
+	double startNs;
+	MESSAGE_POOL_HANDLE pool = MessagePool_Create(1, BUFFER_SIZE);
+	MESSAGE_BUFFER* message;
+
+	if (pool == NULL)
+	{
+		printf("Failed to create the message pool\r\n");
+		return EXIT_FAILURE;
+	}
+
+	startNs = NowNs();
+	for (int i = 0; i < ROUNDS; i++)
+	{
+		MakeSample(&sample, i);
+		int written = snprintf((char*)buffer, sizeof(buffer), telemetryData, deviceId,
+			(unsigned long long)sample.timestampMs, sample.temperature[0], sample.humidity[0]);
+		length = written < 0 ? 0 : (size_t)written;
+		Sink = length;
+	}
+	Report("sample JSON", length, startNs);
+
+	startNs = NowNs();
+	for (int i = 0; i < ROUNDS; i++)
+	{
+		MakeSample(&sample, i);
+		if (TelemetryCbor_EncodeSample(&sample, buffer, sizeof(buffer), &length) != 0)
+		{
+			printf("Failed to encode sample as CBOR\r\n");
+			return EXIT_FAILURE;
+		}
+		Sink = length;
+	}
+	Report("sample CBOR", length, startNs);
+
+	/* Refilling the batch is part of both loops */
+	startNs = NowNs();
+	for (int i = 0; i < ROUNDS; i++)
+	{
+		FillBatch(&batch);
+		message = MessagePool_Acquire(pool);
+		if (message == NULL || TelemetryBatch_Format(&batch, deviceId, message) != 0)
+		{
+			printf("Failed to format the batch as JSON\r\n");
+			return EXIT_FAILURE;
+		}
+		length = message->length;
+		Sink = length;
+		MessagePool_Release(message);
+	}
+	Report("batch JSON", length, startNs);
+
+	startNs = NowNs();
+	for (int i = 0; i < ROUNDS; i++)
+	{
+		FillBatch(&batch);
+		if (TelemetryCbor_EncodeBatch(&batch, buffer, sizeof(buffer), &length) != 0)
+		{
+			printf("Failed to encode the batch as CBOR\r\n");
+			return EXIT_FAILURE;
+		}
+		Sink = length;
+	}
+	Report("batch CBOR", length, startNs);
+
+	MessagePool_Destroy(pool);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,119 @@
+// Copyright (c) Microsoft. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+/* Time per telemetryData message rendered from the compiled template against
+   sprintf with the same format, and with the "%f" format used before the
+   precision was matched to the sensor. Built with the build_benchmarks
+   option. Exits non-zero if the template and sprintf ever differ. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "telemetry_template.h"
+
+#define ROUNDS 200000
+#define BUFFER_SIZE 256
+
+static const char* telemetryData = "{"
+"\"DeviceID\": \"%s\","
+"\"Timestamp\" : %llu,"
+"\"Temperature\" : %.2f,"
+"\"Humidity\" : %.3f } ";
+static const char* telemetryDataSixDecimals = "{"
+"\"DeviceID\": \"%s\","
+"\"Timestamp\" : %llu,"
+"\"Temperature\" : %f,"
+"\"Humidity\" : %f } ";
+static const char* deviceId = "raspberrypi";
+
+static volatile size_t Sink;
+
+static double NowNs(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (double)now.tv_sec * 1e9 + (double)now.tv_nsec;
+}
+
+/* Sensor values as floats, like TELEMETRY_SAMPLE holds them */
+static float Temperature(int i)
+{
+	return 21.52f + (float)(i % 500) * 0.01f;
+}
+
+static float Humidity(int i)
+{
+	return 40.176f - (float)(i % 700) * 0.001f;
+}
+
+static double RunSprintf(const char* format)
+{
+	char buffer[BUFFER_SIZE];
+	double startNs = NowNs();
+	for (int i = 0; i < ROUNDS; i++)
+	{
+		Sink = (size_t)snprintf(buffer, sizeof(buffer), format, deviceId, 1500000000000ULL + (unsigned long long)i,
+			Temperature(i), Humidity(i));
+	}
+	return (NowNs() - startNs) / ROUNDS;
+}
+
+static double RunTemplate(const TELEMETRY_TEMPLATE* compiled)
+{
+	char buffer[BUFFER_SIZE];
+	TEMPLATE_VALUE values[3];
+	size_t length;
+	double startNs = NowNs();
+	for (int i = 0; i < ROUNDS; i++)
+	{
+		values[0].u = 1500000000000ULL + (uint64_t)i;
+		values[1].d = Temperature(i);
+		values[2].d = Humidity(i);
+		if (TelemetryTemplate_Render(compiled, values, 3, buffer, sizeof(buffer), &length) != 0)
+		{
+			return -1;
+		}
+		Sink = length;
+	}
+	return (NowNs() - startNs) / ROUNDS;
+}
+
+int main(void)
+{
+	TELEMETRY_TEMPLATE compiled;
+	TEMPLATE_VALUE values[3];
+	char rendered[BUFFER_SIZE];
+	char printed[BUFFER_SIZE];
+	size_t length;
+
+	if (TelemetryTemplate_Compile(&compiled, telemetryData, deviceId) != 0)
+	{
+		printf("Failed to compile the telemetry template\r\n");
+		return EXIT_FAILURE;
+	}
+
+	for (int i = 0; i < ROUNDS; i++)
+	{
+		values[0].u = 1500000000000ULL + (uint64_t)i;
+		values[1].d = Temperature(i);
+		values[2].d = Humidity(i);
+		(void)snprintf(printed, sizeof(printed), telemetryData, deviceId, (unsigned long long)values[0].u,
+			Temperature(i), Humidity(i));
+		if (TelemetryTemplate_Render(&compiled, values, 3, rendered, sizeof(rendered), &length) != 0 ||
+			strcmp(rendered, printed) != 0)
+		{
+			printf("Template output differs from sprintf:\r\n%s\r\n%s\r\n", rendered, printed);
+			TelemetryTemplate_Destroy(&compiled);
+			return EXIT_FAILURE;
+		}
+	}
+
+	printf("sprintf \"%%f\"        %7.1f ns/message\n", RunSprintf(telemetryDataSixDecimals));
+	printf("sprintf \"%%.2f/%%.3f\" %7.1f ns/message\n", RunSprintf(telemetryData));
+	printf("template             %7.1f ns/message\n", RunTemplate(&compiled));
+
+	TelemetryTemplate_Destroy(&compiled);
+	return EXIT_SUCCESS;
+}
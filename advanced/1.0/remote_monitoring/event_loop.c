@@ -0,0 +1,263 @@
+// Copyright (c) Microsoft. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#include "event_loop.h"
+
+typedef enum SOURCE_KIND_TAG
+{
+	SOURCE_FREE,
+	SOURCE_FD,
+	SOURCE_TIMER,
+	SOURCE_SIGNAL
+} SOURCE_KIND;
+
+typedef struct EVENT_SOURCE_TAG
+{
+	SOURCE_KIND kind;
+	int fd;
+	int removed;                /* set while dispatching; the slot is reused on the next pass */
+	EVENT_LOOP_CALLBACK callback;
+	void* context;
+} EVENT_SOURCE;
+
+typedef struct EVENT_LOOP_TAG
+{
+	int epollFd;
+	int running;
+	uint64_t wakeups;
+	EVENT_SOURCE sources[EVENT_LOOP_MAX_SOURCES];
+} EVENT_LOOP;
+
+static EVENT_SOURCE* AddSource(EVENT_LOOP* loop, SOURCE_KIND kind, int fd, uint32_t events,
+	EVENT_LOOP_CALLBACK callback, void* context)
+{
+	struct epoll_event event;
+	EVENT_SOURCE* source = NULL;
+
+	for (int i = 0; i < EVENT_LOOP_MAX_SOURCES; i++)
+	{
+		if (loop->sources[i].kind == SOURCE_FREE)
+		{
+			source = &loop->sources[i];
+			break;
+		}
+	}
+	if (source == NULL)
+	{
+		printf("EventLoop: no free source for fd %d\r\n", fd);
+		return NULL;
+	}
+
+	memset(&event, 0, sizeof(event));
+	event.events = events;
+	event.data.ptr = source;
+	if (epoll_ctl(loop->epollFd, EPOLL_CTL_ADD, fd, &event) != 0)
+	{
+		printf("EventLoop: epoll_ctl failed for fd %d: %s\r\n", fd, strerror(errno));
+		return NULL;
+	}
+
+	source->kind = kind;
+	source->fd = fd;
+	source->removed = 0;
+	source->callback = callback;
+	source->context = context;
+	return source;
+}
+
+static void ArmTimer(int timerFd, unsigned int intervalMs)
+{
+	struct itimerspec spec;
+	spec.it_interval.tv_sec = intervalMs / 1000;
+	spec.it_interval.tv_nsec = (long)(intervalMs % 1000) * 1000000;
+	spec.it_value = spec.it_interval;
+	(void)timerfd_settime(timerFd, 0, &spec, NULL);
+}
+
+EVENT_LOOP_HANDLE EventLoop_Create(void)
+{
+	EVENT_LOOP* loop = calloc(1, sizeof(EVENT_LOOP));
+	if (loop != NULL)
+	{
+		loop->epollFd = epoll_create1(EPOLL_CLOEXEC);
+		if (loop->epollFd < 0)
+		{
+			free(loop);
+			loop = NULL;
+		}
+	}
+	return loop;
+}
+
+void EventLoop_Destroy(EVENT_LOOP_HANDLE loop)
+{
+	if (loop != NULL)
+	{
+		for (int i = 0; i < EVENT_LOOP_MAX_SOURCES; i++)
+		{
+			if (loop->sources[i].kind == SOURCE_TIMER || loop->sources[i].kind == SOURCE_SIGNAL)
+			{
+				close(loop->sources[i].fd);
+			}
+		}
+		close(loop->epollFd);
+		free(loop);
+	}
+}
+
+int EventLoop_Add(EVENT_LOOP_HANDLE loop, int fd, uint32_t events, EVENT_LOOP_CALLBACK callback, void* context)
+{
+	return AddSource(loop, SOURCE_FD, fd, events, callback, context) == NULL;
+}
+
+void EventLoop_Remove(EVENT_LOOP_HANDLE loop, int fd)
+{
+	for (int i = 0; i < EVENT_LOOP_MAX_SOURCES; i++)
+	{
+		EVENT_SOURCE* source = &loop->sources[i];
+		if (source->kind != SOURCE_FREE && !source->removed && source->fd == fd)
+		{
+			(void)epoll_ctl(loop->epollFd, EPOLL_CTL_DEL, fd, NULL);
+			if (source->kind != SOURCE_FD)
+			{
+				close(fd);
+			}
+			/* An event for it may still be pending in this pass, so the slot is only marked */
+			source->removed = 1;
+			break;
+		}
+	}
+}
+
+int EventLoop_AddTimer(EVENT_LOOP_HANDLE loop, unsigned int intervalMs, EVENT_LOOP_CALLBACK callback, void* context)
+{
+	int timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (timerFd < 0)
+	{
+		return -1;
+	}
+	if (AddSource(loop, SOURCE_TIMER, timerFd, EPOLLIN, callback, context) == NULL)
+	{
+		close(timerFd);
+		return -1;
+	}
+	ArmTimer(timerFd, intervalMs);
+	return timerFd;
+}
+
+int EventLoop_SetTimer(int timerFd, unsigned int intervalMs)
+{
+	ArmTimer(timerFd, intervalMs);
+	return 0;
+}
+
+int EventLoop_SetTimerDeadline(int timerFd, uint64_t deadlineNs)
+{
+	struct itimerspec spec;
+	memset(&spec, 0, sizeof(spec));
+	spec.it_value.tv_sec = (time_t)(deadlineNs / 1000000000);
+	spec.it_value.tv_nsec = (long)(deadlineNs % 1000000000);
+	/* A zero it_value would disarm the timer instead of firing it */
+	if (spec.it_value.tv_sec == 0 && spec.it_value.tv_nsec == 0)
+	{
+		spec.it_value.tv_nsec = 1;
+	}
+	return timerfd_settime(timerFd, TFD_TIMER_ABSTIME, &spec, NULL);
+}
+
+int EventLoop_AddSignals(EVENT_LOOP_HANDLE loop, const sigset_t* signals, EVENT_LOOP_CALLBACK callback, void* context)
+{
+	int signalFd = signalfd(-1, signals, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (signalFd < 0)
+	{
+		return -1;
+	}
+	if (AddSource(loop, SOURCE_SIGNAL, signalFd, EPOLLIN, callback, context) == NULL)
+	{
+		close(signalFd);
+		return -1;
+	}
+	return signalFd;
+}
+
+static void Dispatch(EVENT_SOURCE* source, uint32_t events)
+{
+	if (source->kind == SOURCE_TIMER)
+	{
+		uint64_t expirations;
+		if (read(source->fd, &expirations, sizeof(expirations)) == sizeof(expirations))
+		{
+			source->callback(source->context, expirations);
+		}
+	}
+	else if (source->kind == SOURCE_SIGNAL)
+	{
+		struct signalfd_siginfo info;
+		while (!source->removed && read(source->fd, &info, sizeof(info)) == sizeof(info))
+		{
+			source->callback(source->context, info.ssi_signo);
+		}
+	}
+	else
+	{
+		source->callback(source->context, events);
+	}
+}
+
+void EventLoop_Run(EVENT_LOOP_HANDLE loop)
+{
+	struct epoll_event events[EVENT_LOOP_MAX_SOURCES];
+
+	loop->running = 1;
+	while (loop->running)
+	{
+		int count = epoll_wait(loop->epollFd, events, EVENT_LOOP_MAX_SOURCES, -1);
+		if (count < 0)
+		{
+			if (errno != EINTR)
+			{
+				printf("EventLoop: epoll_wait failed: %s\r\n", strerror(errno));
+				break;
+			}
+			continue;
+		}
+
+		loop->wakeups++;
+		for (int i = 0; i < count; i++)
+		{
+			EVENT_SOURCE* source = events[i].data.ptr;
+			if (!source->removed)
+			{
+				Dispatch(source, events[i].events);
+			}
+		}
+
+		for (int i = 0; i < EVENT_LOOP_MAX_SOURCES; i++)
+		{
+			if (loop->sources[i].removed)
+			{
+				loop->sources[i].kind = SOURCE_FREE;
+				loop->sources[i].removed = 0;
+			}
+		}
+	}
+}
+
+void EventLoop_Stop(EVENT_LOOP_HANDLE loop)
+{
+	loop->running = 0;
+}
+
+uint64_t EventLoop_Wakeups(EVENT_LOOP_HANDLE loop)
+{
+	return loop->wakeups;
+}
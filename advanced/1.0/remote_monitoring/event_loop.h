@@ -0,0 +1,65 @@
+// Copyright (c) Microsoft. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#include <signal.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Single threaded epoll reactor. Sources are plain file descriptors,
+   periodic timers (timerfd, CLOCK_MONOTONIC) and signals (signalfd); every
+   callback runs on the thread calling EventLoop_Run. */
+
+#define EVENT_LOOP_MAX_SOURCES 16
+
+typedef struct EVENT_LOOP_TAG* EVENT_LOOP_HANDLE;
+
+/* value is the epoll event mask for descriptors, the number of expirations
+   for timers and the signal number for signals */
+typedef void(*EVENT_LOOP_CALLBACK)(void* context, uint64_t value);
+
+EVENT_LOOP_HANDLE EventLoop_Create(void);
+
+/* Closes the timer and signal descriptors the loop created; descriptors
+   added with EventLoop_Add stay open */
+void EventLoop_Destroy(EVENT_LOOP_HANDLE loop);
+
+/* Watches fd for the given EPOLL* events. Returns 0 on success. */
+int EventLoop_Add(EVENT_LOOP_HANDLE loop, int fd, uint32_t events, EVENT_LOOP_CALLBACK callback, void* context);
+
+/* Stops watching fd; safe to call from any callback, including fd's own */
+void EventLoop_Remove(EVENT_LOOP_HANDLE loop, int fd);
+
+/* Creates a timer firing every intervalMs, the first time intervalMs from
+   now. Returns its descriptor, or -1 on failure. */
+int EventLoop_AddTimer(EVENT_LOOP_HANDLE loop, unsigned int intervalMs, EVENT_LOOP_CALLBACK callback, void* context);
+
+/* Changes a timer's period, restarting it from now; 0 disarms it */
+int EventLoop_SetTimer(int timerFd, unsigned int intervalMs);
+
+/* Makes a timer fire once at an absolute CLOCK_MONOTONIC time */
+int EventLoop_SetTimerDeadline(int timerFd, uint64_t deadlineNs);
+
+/* Delivers the signals through the loop. They must already be blocked in
+   every thread, or one of them takes the default action instead: block
+   them with pthread_sigmask before the first thread is started. Returns
+   the descriptor, or -1 on failure. */
+int EventLoop_AddSignals(EVENT_LOOP_HANDLE loop, const sigset_t* signals, EVENT_LOOP_CALLBACK callback, void* context);
+
+/* Dispatches events until EventLoop_Stop is called */
+void EventLoop_Run(EVENT_LOOP_HANDLE loop);
+void EventLoop_Stop(EVENT_LOOP_HANDLE loop);
+
+/* Times epoll_wait has returned, for comparing wakeups with the threaded client */
+uint64_t EventLoop_Wakeups(EVENT_LOOP_HANDLE loop);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* EVENT_LOOP_H */
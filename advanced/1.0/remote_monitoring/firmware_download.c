@@ -0,0 +1,732 @@
+// Copyright (c) Microsoft. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <openssl/evp.h>
+#include <openssl/ssl.h>
+
+#include "firmware_download.h"
+
+#define HEADER_BUFFER_SIZE 8192
+#define URL_BUFFER_SIZE 2048
+#define MAX_RETRY_DELAY_MS 60000
+#define PART_KEY_LENGTH 16
+
+typedef struct URL_PARTS_TAG
+{
+	int tls;
+	int explicitPort;
+	char host[256];
+	char port[8];
+	char path[URL_BUFFER_SIZE];
+} URL_PARTS;
+
+typedef struct CONNECTION_TAG
+{
+	int fd;
+	SSL_CTX* context;
+	SSL* ssl;
+} CONNECTION;
+
+typedef struct DOWNLOAD_TAG
+{
+	int fd;
+	EVP_MD_CTX* hash;
+	uint64_t written;           /* bytes in the part file, all of them hashed */
+	uint64_t total;
+	unsigned char* chunk;
+	size_t chunkUsed;
+	char validator[256];        /* strong ETag or Last-Modified of the body in the part file, for If-Range */
+} DOWNLOAD;
+
+static int ParseUrl(const char* url, URL_PARTS* parts)
+{
+	const char* host;
+	size_t hostLength;
+	const char* path;
+
+	memset(parts, 0, sizeof(URL_PARTS));
+	if (strncasecmp(url, "https://", 8) == 0)
+	{
+		parts->tls = 1;
+		host = url + 8;
+		strcpy(parts->port, "443");
+	}
+	else if (strncasecmp(url, "http://", 7) == 0)
+	{
+		host = url + 7;
+		strcpy(parts->port, "80");
+	}
+	else
+	{
+		return 1;
+	}
+
+	path = host + strcspn(host, "/?#");
+	hostLength = (size_t)(path - host);
+	const char* colon = memchr(host, ':', hostLength);
+	if (colon != NULL)
+	{
+		size_t portLength = (size_t)(path - colon - 1);
+		if (portLength == 0 || portLength >= sizeof(parts->port))
+		{
+			return 1;
+		}
+		memcpy(parts->port, colon + 1, portLength);
+		parts->port[portLength] = '\0';
+		parts->explicitPort = 1;
+		hostLength = (size_t)(colon - host);
+	}
+	if (hostLength == 0 || hostLength >= sizeof(parts->host))
+	{
+		return 1;
+	}
+	memcpy(parts->host, host, hostLength);
+
+	/* The fragment never goes to the server */
+	size_t pathLength = strcspn(path, "#");
+	if (pathLength + 2 > sizeof(parts->path))
+	{
+		return 1;
+	}
+	if (*path != '/')
+	{
+		parts->path[0] = '/';
+		memcpy(parts->path + 1, path, pathLength);
+	}
+	else
+	{
+		memcpy(parts->path, path, pathLength);
+	}
+	return 0;
+}
+
+static void Disconnect(CONNECTION* connection)
+{
+	if (connection->ssl != NULL)
+	{
+		SSL_free(connection->ssl);
+		connection->ssl = NULL;
+	}
+	if (connection->context != NULL)
+	{
+		SSL_CTX_free(connection->context);
+		connection->context = NULL;
+	}
+	if (connection->fd >= 0)
+	{
+		close(connection->fd);
+		connection->fd = -1;
+	}
+}
+
+static int Connect(CONNECTION* connection, const URL_PARTS* parts, unsigned int stallTimeoutMs, const char** error)
+{
+	struct addrinfo hints;
+	struct addrinfo* addresses;
+	struct timeval timeout;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(parts->host, parts->port, &hints, &addresses) != 0)
+	{
+		*error = "host not found";
+		return 1;
+	}
+
+	/* The timeouts bound the connect and every read, which is how a stalled transfer is noticed */
+	timeout.tv_sec = stallTimeoutMs / 1000;
+	timeout.tv_usec = (stallTimeoutMs % 1000) * 1000;
+	connection->fd = -1;
+	for (struct addrinfo* address = addresses; address != NULL && connection->fd < 0; address = address->ai_next)
+	{
+		connection->fd = socket(address->ai_family, address->ai_socktype | SOCK_CLOEXEC, address->ai_protocol);
+		if (connection->fd >= 0)
+		{
+			(void)setsockopt(connection->fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+			(void)setsockopt(connection->fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+			if (connect(connection->fd, address->ai_addr, address->ai_addrlen) != 0)
+			{
+				close(connection->fd);
+				connection->fd = -1;
+			}
+		}
+	}
+	freeaddrinfo(addresses);
+	if (connection->fd < 0)
+	{
+		*error = "connect failed";
+		return 1;
+	}
+
+	if (parts->tls)
+	{
+		connection->context = SSL_CTX_new(TLS_client_method());
+		if (connection->context == NULL)
+		{
+			*error = "TLS setup failed";
+			return 1;
+		}
+		SSL_CTX_set_default_verify_paths(connection->context);
+		SSL_CTX_set_verify(connection->context, SSL_VERIFY_PEER, NULL);
+		connection->ssl = SSL_new(connection->context);
+		if (connection->ssl == NULL ||
+			SSL_set_fd(connection->ssl, connection->fd) != 1 ||
+			SSL_set_tlsext_host_name(connection->ssl, parts->host) != 1 ||
+			SSL_set1_host(connection->ssl, parts->host) != 1 ||
+			SSL_connect(connection->ssl) != 1)
+		{
+			*error = "TLS handshake failed";
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static int SendAll(CONNECTION* connection, const char* data, size_t length)
+{
+	while (length > 0)
+	{
+		ssize_t sent = connection->ssl != NULL ?
+			SSL_write(connection->ssl, data, (int)length) :
+			send(connection->fd, data, length, MSG_NOSIGNAL);
+		if (sent <= 0)
+		{
+			if (connection->ssl == NULL && sent < 0 && errno == EINTR)
+			{
+				continue;
+			}
+			return 1;
+		}
+		data += sent;
+		length -= (size_t)sent;
+	}
+	return 0;
+}
+
+/* Returns the bytes read, 0 at the end of the body and -1 on a drop or a stall */
+static ssize_t Receive(CONNECTION* connection, void* buffer, size_t size)
+{
+	ssize_t received;
+	if (connection->ssl != NULL)
+	{
+		received = SSL_read(connection->ssl, buffer, (int)size);
+		if (received <= 0)
+		{
+			return SSL_get_error(connection->ssl, (int)received) == SSL_ERROR_ZERO_RETURN ? 0 : -1;
+		}
+		return received;
+	}
+	do
+	{
+		received = recv(connection->fd, buffer, size, 0);
+	} while (received < 0 && errno == EINTR);
+	return received;
+}
+
+/* Writes the buffered bytes to the part file and adds them to the digest */
+static int FlushChunk(DOWNLOAD* download)
+{
+	size_t done = 0;
+	while (done < download->chunkUsed)
+	{
+		ssize_t written = write(download->fd, download->chunk + done, download->chunkUsed - done);
+		if (written < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			return 1;
+		}
+		done += (size_t)written;
+	}
+	EVP_DigestUpdate(download->hash, download->chunk, download->chunkUsed);
+	download->written += download->chunkUsed;
+	download->chunkUsed = 0;
+	return 0;
+}
+
+static int ResetPart(DOWNLOAD* download)
+{
+	download->chunkUsed = 0;
+	download->written = 0;
+	if (ftruncate(download->fd, 0) != 0 || lseek(download->fd, 0, SEEK_SET) != 0)
+	{
+		return 1;
+	}
+	return EVP_DigestInit_ex(download->hash, EVP_sha256(), NULL) == 1 ? 0 : 1;
+}
+
+/* Hashes what an earlier run left in the part file so the download can carry on after it */
+static int RehashPart(DOWNLOAD* download)
+{
+	ssize_t length;
+
+	download->chunkUsed = 0;
+	download->written = 0;
+	if (lseek(download->fd, 0, SEEK_SET) != 0 || EVP_DigestInit_ex(download->hash, EVP_sha256(), NULL) != 1)
+	{
+		return 1;
+	}
+	while ((length = read(download->fd, download->chunk, FIRMWARE_DOWNLOAD_CHUNK_SIZE)) > 0)
+	{
+		EVP_DigestUpdate(download->hash, download->chunk, (size_t)length);
+		download->written += (uint64_t)length;
+	}
+	return length < 0 ? 1 : 0;
+}
+
+/* Case-insensitive header lookup in a NUL terminated header block; the value runs to the line end */
+static const char* FindHeader(const char* headers, const char* name)
+{
+	size_t nameLength = strlen(name);
+	for (const char* line = strstr(headers, "\r\n"); line != NULL; line = strstr(line, "\r\n"))
+	{
+		line += 2;
+		if (strncasecmp(line, name, nameLength) == 0 && line[nameLength] == ':')
+		{
+			const char* value = line + nameLength + 1;
+			return value + strspn(value, " \t");
+		}
+	}
+	return NULL;
+}
+
+/* Keeps the strong ETag, or else the Last-Modified date, that a later Range request must match */
+static void KeepValidator(DOWNLOAD* download, const char* headers)
+{
+	const char* etag = FindHeader(headers, "ETag");
+	const char* value = etag != NULL && strncmp(etag, "W/", 2) != 0 ? etag : FindHeader(headers, "Last-Modified");
+	size_t length = value != NULL ? strcspn(value, "\r\n") : 0;
+
+	if (length >= sizeof(download->validator))
+	{
+		length = 0;
+	}
+	memcpy(download->validator, value, length);
+	download->validator[length] = '\0';
+}
+
+/* Replaces url with the redirect target, resolving a path relative to the current server */
+static int FollowRedirect(char* url, const URL_PARTS* parts, const char* location)
+{
+	size_t length = strcspn(location, "\r\n");
+	char target[URL_BUFFER_SIZE];
+	int prefix = 0;
+
+	if (location[0] == '/')
+	{
+		prefix = snprintf(target, sizeof(target), "%s://%s:%s", parts->tls ? "https" : "http", parts->host, parts->port);
+	}
+	if (prefix < 0 || (size_t)prefix + length >= sizeof(target))
+	{
+		return 1;
+	}
+	memcpy(target + prefix, location, length);
+	target[prefix + length] = '\0';
+	strcpy(url, target);
+	return 0;
+}
+
+/* One request, following redirects; appends to the part file until the body ends or the connection fails */
+static int Attempt(const FIRMWARE_DOWNLOAD_CONFIG* config, DOWNLOAD* download, FIRMWARE_DOWNLOAD_RESULT* result,
+	char* url)
+{
+	char headers[HEADER_BUFFER_SIZE];
+	CONNECTION connection;
+	URL_PARTS parts;
+	int status = 0;
+	size_t used = 0;
+	char* body = NULL;
+
+	for (unsigned int redirects = 0;; redirects++)
+	{
+		char request[URL_BUFFER_SIZE + 512];
+		int length;
+
+		if (ParseUrl(url, &parts) != 0)
+		{
+			result->error = "bad url";
+			return 1;
+		}
+		memset(&connection, 0, sizeof(connection));
+		connection.fd = -1;
+		if (Connect(&connection, &parts, config->stallTimeoutMs, &result->error) != 0)
+		{
+			Disconnect(&connection);
+			return 1;
+		}
+
+		length = snprintf(request, sizeof(request),
+			"GET %s HTTP/1.1\r\nHost: %s%s%s\r\nUser-Agent: remote_monitoring\r\nAccept-Encoding: identity\r\n"
+			"Connection: close\r\n",
+			parts.path, parts.host, parts.explicitPort ? ":" : "", parts.explicitPort ? parts.port : "");
+		if (download->written > 0)
+		{
+			length += snprintf(request + length, sizeof(request) - length, "Range: bytes=%llu-\r\n",
+				(unsigned long long)download->written);
+			/* A server whose package changed since the part file was started sends all of the new one */
+			if (download->validator[0] != '\0')
+			{
+				length += snprintf(request + length, sizeof(request) - length, "If-Range: %s\r\n",
+					download->validator);
+			}
+		}
+		length += snprintf(request + length, sizeof(request) - length, "\r\n");
+		if (SendAll(&connection, request, (size_t)length) != 0)
+		{
+			result->error = "request failed";
+			Disconnect(&connection);
+			return 1;
+		}
+
+		/* Read up to the blank line; whatever follows it is the start of the body */
+		used = 0;
+		body = NULL;
+		while (body == NULL)
+		{
+			ssize_t received = used < sizeof(headers) - 1 ?
+				Receive(&connection, headers + used, sizeof(headers) - 1 - used) : -1;
+			if (received <= 0)
+			{
+				result->error = used < sizeof(headers) - 1 ? "connection dropped in headers" : "headers too long";
+				Disconnect(&connection);
+				return 1;
+			}
+			used += (size_t)received;
+			headers[used] = '\0';
+			body = strstr(headers, "\r\n\r\n");
+		}
+		body[2] = '\0';
+		body += 4;
+
+		if (sscanf(headers, "HTTP/%*d.%*d %d", &status) != 1)
+		{
+			result->error = "malformed response";
+			Disconnect(&connection);
+			return 1;
+		}
+
+		const char* location = FindHeader(headers, "Location");
+		if (status >= 301 && status <= 308 && status != 304 && location != NULL)
+		{
+			Disconnect(&connection);
+			if (redirects == FIRMWARE_DOWNLOAD_MAX_REDIRECTS || FollowRedirect(url, &parts, location) != 0)
+			{
+				result->error = "too many redirects";
+				return 1;
+			}
+			result->redirects++;
+			continue;
+		}
+		break;
+	}
+
+	const char* contentLength = FindHeader(headers, "Content-Length");
+	const char* contentRange = FindHeader(headers, "Content-Range");
+	const char* transferEncoding = FindHeader(headers, "Transfer-Encoding");
+	uint64_t expected = contentLength != NULL ? strtoull(contentLength, NULL, 10) : 0;
+
+	if (transferEncoding != NULL && strncasecmp(transferEncoding, "identity", 8) != 0)
+	{
+		result->error = "chunked transfer encoding not supported";
+		Disconnect(&connection);
+		return 1;
+	}
+	if (status == 200)
+	{
+		/* The server ignored the range, so start over */
+		if (download->written > 0 && ResetPart(download) != 0)
+		{
+			result->error = "cannot truncate part file";
+			Disconnect(&connection);
+			return 1;
+		}
+		download->total = expected;
+		KeepValidator(download, headers);
+	}
+	else if (status == 206)
+	{
+		unsigned long long first, last, total;
+		if (contentRange == NULL || sscanf(contentRange, "bytes %llu-%llu/%llu", &first, &last, &total) != 3 ||
+			first != download->written)
+		{
+			result->error = "unexpected content range";
+			Disconnect(&connection);
+			return 1;
+		}
+		result->resumedBytes += download->written;
+		download->total = total;
+		if (download->validator[0] == '\0')
+		{
+			KeepValidator(download, headers);
+		}
+	}
+	else
+	{
+		unsigned long long total;
+		Disconnect(&connection);
+		if (status == 416 && contentRange != NULL && sscanf(contentRange, "bytes */%llu", &total) == 1 &&
+			total == download->written)
+		{
+			/* An earlier run got every byte but stopped before the rename */
+			result->resumedBytes += download->written;
+			download->total = total;
+			return 0;
+		}
+		if (status == 416)
+		{
+			/* The part file is longer than the package now on the server; start over next time */
+			(void)ResetPart(download);
+		}
+		result->error = "unexpected HTTP status";
+		return 1;
+	}
+
+	/* Stream the body through the chunk buffer, starting with what came in with the headers. With
+	   the length known, reading stops at the last byte: a server may keep the connection open, or
+	   close TLS without close_notify, once the body is complete. */
+	size_t leftover = used - (size_t)(body - headers);
+	if (download->total > 0 && leftover > download->total - download->written)
+	{
+		leftover = (size_t)(download->total - download->written);
+	}
+	memcpy(download->chunk, body, leftover);
+	download->chunkUsed = leftover;
+	for (;;)
+	{
+		if (download->chunkUsed == FIRMWARE_DOWNLOAD_CHUNK_SIZE)
+		{
+			if (FlushChunk(download) != 0)
+			{
+				result->error = "write failed";
+				Disconnect(&connection);
+				return 1;
+			}
+			if (config->progress != NULL)
+			{
+				config->progress(config->context, download->written, download->total);
+			}
+		}
+
+		size_t wanted = FIRMWARE_DOWNLOAD_CHUNK_SIZE - download->chunkUsed;
+		if (download->total > 0)
+		{
+			uint64_t remaining = download->total - download->written - download->chunkUsed;
+			if (remaining == 0)
+			{
+				break;
+			}
+			wanted = remaining < wanted ? (size_t)remaining : wanted;
+		}
+
+		ssize_t received = Receive(&connection, download->chunk + download->chunkUsed, wanted);
+		if (received <= 0)
+		{
+			if (received < 0)
+			{
+				result->error = errno == EAGAIN || errno == EWOULDBLOCK ? "transfer stalled" : "connection dropped";
+			}
+			break;
+		}
+		download->chunkUsed += (size_t)received;
+	}
+	Disconnect(&connection);
+
+	/* Keep what did arrive so the next attempt resumes after it */
+	if (FlushChunk(download) != 0)
+	{
+		result->error = "write failed";
+		return 1;
+	}
+	if (config->progress != NULL)
+	{
+		config->progress(config->context, download->written, download->total);
+	}
+	if (download->total > 0)
+	{
+		if (download->written != download->total)
+		{
+			if (result->error == NULL)
+			{
+				result->error = "connection closed early";
+			}
+			return 1;
+		}
+		/* Every byte arrived, whatever went wrong with the connection afterwards */
+		result->error = NULL;
+		return 0;
+	}
+	return result->error != NULL;
+}
+
+/* Names the part file after the package: the start of the expected digest, or of the url's digest
+   when none was given, so a part file is only ever resumed by a download of the same package */
+static int PartPath(const FIRMWARE_DOWNLOAD_CONFIG* config, char* partPath, size_t size)
+{
+	char key[PART_KEY_LENGTH + 1];
+
+	if (config->sha256 != NULL && strlen(config->sha256) >= PART_KEY_LENGTH)
+	{
+		for (int i = 0; i < PART_KEY_LENGTH; i++)
+		{
+			key[i] = (char)tolower((unsigned char)config->sha256[i]);
+		}
+	}
+	else
+	{
+		unsigned char digest[EVP_MAX_MD_SIZE];
+		unsigned int digestLength = 0;
+		if (EVP_Digest(config->url, strlen(config->url), digest, &digestLength, EVP_sha256(), NULL) != 1)
+		{
+			return 1;
+		}
+		for (int i = 0; i < PART_KEY_LENGTH / 2; i++)
+		{
+			sprintf(key + 2 * i, "%02x", digest[i]);
+		}
+	}
+	key[PART_KEY_LENGTH] = '\0';
+	return snprintf(partPath, size, "%s.%s.part", config->path, key) >= (int)size;
+}
+
+/* Removes the part files other downloads to path left behind; they can never be resumed */
+static void RemoveStaleParts(const char* path, const char* partPath)
+{
+	char directoryPath[URL_BUFFER_SIZE];
+	char basePath[URL_BUFFER_SIZE];
+	char stalePath[URL_BUFFER_SIZE * 2];
+	const char* partName;
+	const char* directoryName;
+	const char* baseName;
+	size_t baseLength;
+	struct dirent* entry;
+	DIR* directory;
+
+	strcpy(directoryPath, path);
+	strcpy(basePath, path);
+	baseName = basename(basePath);
+	baseLength = strlen(baseName);
+	partName = strrchr(partPath, '/') != NULL ? strrchr(partPath, '/') + 1 : partPath;
+	directoryName = dirname(directoryPath);
+	directory = opendir(directoryName);
+	if (directory == NULL)
+	{
+		return;
+	}
+	while ((entry = readdir(directory)) != NULL)
+	{
+		size_t length = strlen(entry->d_name);
+		if (length == baseLength + 1 + PART_KEY_LENGTH + 5 && strncmp(entry->d_name, baseName, baseLength) == 0 &&
+			entry->d_name[baseLength] == '.' && strcmp(entry->d_name + length - 5, ".part") == 0 &&
+			strcmp(entry->d_name, partName) != 0)
+		{
+			snprintf(stalePath, sizeof(stalePath), "%s/%s", directoryName, entry->d_name);
+			(void)unlink(stalePath);
+		}
+	}
+	closedir(directory);
+}
+
+int FirmwareDownload_Run(const FIRMWARE_DOWNLOAD_CONFIG* config, FIRMWARE_DOWNLOAD_RESULT* result)
+{
+	char partPath[URL_BUFFER_SIZE];
+	char url[URL_BUFFER_SIZE];
+	unsigned char digest[EVP_MAX_MD_SIZE];
+	unsigned int digestLength = 0;
+	unsigned int delayMs = config->retryDelayMs;
+	DOWNLOAD download;
+	int failed = 1;
+
+	memset(result, 0, sizeof(FIRMWARE_DOWNLOAD_RESULT));
+	memset(&download, 0, sizeof(download));
+	if (strlen(config->url) >= sizeof(url) || strlen(config->path) >= sizeof(partPath) - PART_KEY_LENGTH - 6 ||
+		PartPath(config, partPath, sizeof(partPath)) != 0)
+	{
+		result->error = "url or path too long";
+		return 1;
+	}
+	RemoveStaleParts(config->path, partPath);
+
+	download.fd = open(partPath, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	download.chunk = malloc(FIRMWARE_DOWNLOAD_CHUNK_SIZE);
+	download.hash = EVP_MD_CTX_new();
+	if (download.fd < 0 || download.chunk == NULL || download.hash == NULL || RehashPart(&download) != 0)
+	{
+		result->error = "cannot open part file";
+	}
+	else
+	{
+		for (unsigned int attempt = 1; attempt <= config->attempts; attempt++)
+		{
+			/* Every attempt starts from the original url so a stale redirect is not reused */
+			strcpy(url, config->url);
+			result->error = NULL;
+			result->attempts = attempt;
+			if (Attempt(config, &download, result, url) == 0)
+			{
+				failed = 0;
+				break;
+			}
+			printf("Firmware download attempt %u failed at %llu bytes: %s\r\n", attempt,
+				(unsigned long long)download.written, result->error);
+			if (attempt < config->attempts)
+			{
+				struct timespec delay = { delayMs / 1000, (long)(delayMs % 1000) * 1000000 };
+				while (nanosleep(&delay, &delay) != 0 && errno == EINTR);
+				delayMs = delayMs * 2 < MAX_RETRY_DELAY_MS ? delayMs * 2 : MAX_RETRY_DELAY_MS;
+			}
+		}
+	}
+
+	result->bytes = download.written;
+	result->total = download.total;
+	if (!failed)
+	{
+		EVP_DigestFinal_ex(download.hash, digest, &digestLength);
+		for (unsigned int i = 0; i < digestLength && i < 32; i++)
+		{
+			sprintf(result->sha256 + 2 * i, "%02x", digest[i]);
+		}
+		if (fsync(download.fd) != 0)
+		{
+			result->error = "fsync failed";
+			failed = 1;
+		}
+		else if (config->sha256 != NULL && strcasecmp(config->sha256, result->sha256) != 0)
+		{
+			/* A complete but wrong package cannot be resumed into a right one */
+			result->error = "sha256 mismatch";
+			failed = 1;
+			(void)unlink(partPath);
+		}
+	}
+	if (download.fd >= 0)
+	{
+		close(download.fd);
+	}
+	if (!failed && rename(partPath, config->path) != 0)
+	{
+		result->error = "rename failed";
+		failed = 1;
+	}
+	EVP_MD_CTX_free(download.hash);
+	free(download.chunk);
+	return failed;
+}
@@ -0,0 +1,64 @@
+// Copyright (c) Microsoft. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+#ifndef FIRMWARE_DOWNLOAD_H
+#define FIRMWARE_DOWNLOAD_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Downloads a firmware package over HTTP or HTTPS in process. The body is
+   streamed to a part file in fixed size chunks and hashed with SHA-256 as
+   each chunk is written. A dropped or stalled connection is retried with a
+   Range request from the last byte on disk, and the part file is only
+   renamed to path once it is complete and, when a digest was given,
+   matches it. Redirects are followed; chunked transfer encoding is not
+   supported.
+   The part file is path.<key>.part, where key is the first 16 hex digits of
+   the expected digest, or of the url's SHA-256 when no digest was given, so
+   a part file is only resumed for the same package. Retries send If-Range
+   with the ETag or Last-Modified seen first, and a server whose package
+   changed sends it all again. */
+
+#define FIRMWARE_DOWNLOAD_CHUNK_SIZE (64 * 1024)
+#define FIRMWARE_DOWNLOAD_MAX_REDIRECTS 5
+
+/* total is 0 while the size is unknown */
+typedef void(*FIRMWARE_DOWNLOAD_PROGRESS)(void* context, uint64_t received, uint64_t total);
+
+typedef struct FIRMWARE_DOWNLOAD_CONFIG_TAG
+{
+	const char* url;
+	const char* path;
+	const char* sha256;         /* expected digest in hex, or NULL to only compute it */
+	unsigned int attempts;
+	unsigned int retryDelayMs;  /* doubled after every failed attempt */
+	unsigned int stallTimeoutMs;    /* an attempt fails when no byte arrives for this long */
+	FIRMWARE_DOWNLOAD_PROGRESS progress;    /* called after every chunk, may be NULL */
+	void* context;
+} FIRMWARE_DOWNLOAD_CONFIG;
+
+typedef struct FIRMWARE_DOWNLOAD_RESULT_TAG
+{
+	uint64_t bytes;             /* size of the file on disk */
+	uint64_t total;
+	uint64_t resumedBytes;      /* bytes kept from earlier attempts instead of fetched again */
+	unsigned int attempts;
+	unsigned int redirects;
+	char sha256[65];
+	const char* error;          /* why the last attempt failed, NULL on success */
+} FIRMWARE_DOWNLOAD_RESULT;
+
+/* Returns 0 once path holds the complete package, non-zero after the last
+   attempt failed or the digest did not match */
+int FirmwareDownload_Run(const FIRMWARE_DOWNLOAD_CONFIG* config, FIRMWARE_DOWNLOAD_RESULT* result);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* FIRMWARE_DOWNLOAD_H */
@@ -0,0 +1,659 @@
+// Copyright (c) Microsoft. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <zlib.h>
+
+#include "firmware_install.h"
+
+#define EXTRACT_BUFFER_SIZE (64 * 1024)
+#define MAX_PATH_LENGTH 1024
+#define EOCD_SIZE 22
+#define EOCD_MAX_COMMENT 65535
+#define CENTRAL_HEADER_SIZE 46
+#define LOCAL_HEADER_SIZE 30
+#define SIGNATURE_EOCD 0x06054b50
+#define SIGNATURE_CENTRAL 0x02014b50
+#define SIGNATURE_LOCAL 0x04034b50
+#define METHOD_STORED 0
+#define METHOD_DEFLATED 8
+#define HOST_UNIX 3
+
+typedef struct ZIP_ENTRY_TAG
+{
+	uint16_t madeBy;
+	uint16_t flags;
+	uint16_t method;
+	uint32_t crc;
+	uint32_t compressedSize;
+	uint32_t size;
+	uint32_t externalAttributes;
+	uint32_t localOffset;
+	char name[MAX_PATH_LENGTH];
+} ZIP_ENTRY;
+
+typedef struct EXTRACTOR_TAG
+{
+	int zipFd;
+	unsigned char* input;
+	unsigned char* output;
+	FIRMWARE_INSTALL_RESULT* result;
+} EXTRACTOR;
+
+static uint16_t Get16(const unsigned char* p)
+{
+	return (uint16_t)(p[0] | p[1] << 8);
+}
+
+static uint32_t Get32(const unsigned char* p)
+{
+	return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static int ReadAt(int fd, void* buffer, size_t length, off_t offset)
+{
+	size_t done = 0;
+	while (done < length)
+	{
+		ssize_t got = pread(fd, (unsigned char*)buffer + done, length - done, offset + (off_t)done);
+		if (got < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		if (got <= 0)
+		{
+			return 1;
+		}
+		done += (size_t)got;
+	}
+	return 0;
+}
+
+static int WriteAll(int fd, const unsigned char* data, size_t length)
+{
+	while (length > 0)
+	{
+		ssize_t written = write(fd, data, length);
+		if (written < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		if (written <= 0)
+		{
+			return 1;
+		}
+		data += written;
+		length -= (size_t)written;
+	}
+	return 0;
+}
+
+/* Writes extracted bytes, dropping carriage returns from scripts */
+static int WriteOutput(int fd, unsigned char* data, size_t length, int stripCr)
+{
+	if (stripCr)
+	{
+		size_t kept = 0;
+		for (size_t i = 0; i < length; i++)
+		{
+			if (data[i] != '\r')
+			{
+				data[kept++] = data[i];
+			}
+		}
+		length = kept;
+	}
+	return WriteAll(fd, data, length);
+}
+
+/* Rejects absolute names and any ".." component so nothing lands outside the slot */
+static int IsSafeName(const char* name)
+{
+	const char* component = name;
+
+	if (name[0] == '\0' || name[0] == '/' || strchr(name, '\\') != NULL)
+	{
+		return 0;
+	}
+	while (component != NULL)
+	{
+		if (strncmp(component, "..", 2) == 0 && (component[2] == '/' || component[2] == '\0'))
+		{
+			return 0;
+		}
+		component = strchr(component, '/');
+		if (component != NULL)
+		{
+			component++;
+		}
+	}
+	return 1;
+}
+
+static int EndsWith(const char* text, const char* suffix)
+{
+	size_t textLength = strlen(text);
+	size_t suffixLength = strlen(suffix);
+	return textLength >= suffixLength && strcmp(text + textLength - suffixLength, suffix) == 0;
+}
+
+static mode_t EntryMode(const ZIP_ENTRY* entry)
+{
+	const char* base = strrchr(entry->name, '/');
+	base = base != NULL ? base + 1 : entry->name;
+
+	if ((entry->madeBy >> 8) == HOST_UNIX && (entry->externalAttributes >> 16) != 0)
+	{
+		return (mode_t)(entry->externalAttributes >> 16) & 0777;
+	}
+	return EndsWith(base, ".sh") || strchr(base, '.') == NULL ? 0755 : 0644;
+}
+
+/* Creates every directory on the way to path below its first prefixLength characters */
+static int MakeParents(char* path, size_t prefixLength)
+{
+	for (char* separator = strchr(path + prefixLength, '/'); separator != NULL; separator = strchr(separator + 1, '/'))
+	{
+		*separator = '\0';
+		int failed = mkdir(path, 0755) != 0 && errno != EEXIST;
+		*separator = '/';
+		if (failed)
+		{
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* Streams one entry's data from the package into fd, checking its size and CRC */
+static int ExtractData(EXTRACTOR* extractor, const ZIP_ENTRY* entry, off_t dataOffset, int fd, int stripCr)
+{
+	uLong crc = crc32(0L, Z_NULL, 0);
+	uint64_t produced = 0;
+	uint32_t consumed = 0;
+
+	if (entry->method == METHOD_STORED)
+	{
+		while (consumed < entry->compressedSize)
+		{
+			size_t length = entry->compressedSize - consumed < EXTRACT_BUFFER_SIZE ?
+				entry->compressedSize - consumed : EXTRACT_BUFFER_SIZE;
+			if (produced + length > entry->size)
+			{
+				extractor->result->error = "size or CRC mismatch";
+				return 1;
+			}
+			if (ReadAt(extractor->zipFd, extractor->output, length, dataOffset + consumed) != 0)
+			{
+				extractor->result->error = "package truncated";
+				return 1;
+			}
+			crc = crc32(crc, extractor->output, (uInt)length);
+			if (WriteOutput(fd, extractor->output, length, stripCr) != 0)
+			{
+				extractor->result->error = "write failed";
+				return 1;
+			}
+			consumed += (uint32_t)length;
+			produced += length;
+		}
+	}
+	else
+	{
+		z_stream stream;
+		int status = Z_OK;
+		int failed = 0;
+
+		memset(&stream, 0, sizeof(stream));
+		/* Zip entries are raw deflate streams without a zlib header */
+		if (inflateInit2(&stream, -MAX_WBITS) != Z_OK)
+		{
+			extractor->result->error = "inflate setup failed";
+			return 1;
+		}
+		while (status != Z_STREAM_END)
+		{
+			if (stream.avail_in == 0)
+			{
+				size_t length = entry->compressedSize - consumed < EXTRACT_BUFFER_SIZE ?
+					entry->compressedSize - consumed : EXTRACT_BUFFER_SIZE;
+				if (length == 0 || ReadAt(extractor->zipFd, extractor->input, length, dataOffset + consumed) != 0)
+				{
+					extractor->result->error = "package truncated";
+					failed = 1;
+					break;
+				}
+				consumed += (uint32_t)length;
+				stream.next_in = extractor->input;
+				stream.avail_in = (uInt)length;
+			}
+			stream.next_out = extractor->output;
+			stream.avail_out = EXTRACT_BUFFER_SIZE;
+			status = inflate(&stream, Z_NO_FLUSH);
+			if (status != Z_OK && status != Z_STREAM_END)
+			{
+				extractor->result->error = "corrupt deflate data";
+				failed = 1;
+				break;
+			}
+			size_t length = EXTRACT_BUFFER_SIZE - stream.avail_out;
+			/* A stream that inflates past the declared size is cut off before it fills the disk */
+			if (produced + length > entry->size)
+			{
+				extractor->result->error = "size or CRC mismatch";
+				failed = 1;
+				break;
+			}
+			crc = crc32(crc, extractor->output, (uInt)length);
+			if (WriteOutput(fd, extractor->output, length, stripCr) != 0)
+			{
+				extractor->result->error = "write failed";
+				failed = 1;
+				break;
+			}
+			produced += length;
+		}
+		inflateEnd(&stream);
+		if (failed || status != Z_STREAM_END)
+		{
+			return 1;
+		}
+	}
+
+	if (produced != entry->size || crc != entry->crc)
+	{
+		extractor->result->error = "size or CRC mismatch";
+		return 1;
+	}
+	extractor->result->bytes += produced;
+	return 0;
+}
+
+static int ExtractEntry(EXTRACTOR* extractor, const ZIP_ENTRY* entry, const char* directory)
+{
+	unsigned char local[LOCAL_HEADER_SIZE];
+	char path[2 * MAX_PATH_LENGTH];
+	size_t prefixLength = strlen(directory) + 1;
+	mode_t mode = EntryMode(entry);
+	int fd;
+
+	if (!IsSafeName(entry->name))
+	{
+		extractor->result->error = "unsafe entry name";
+		return 1;
+	}
+	if ((entry->flags & 1) != 0 || (entry->method != METHOD_STORED && entry->method != METHOD_DEFLATED))
+	{
+		extractor->result->error = "encrypted or unsupported entry";
+		return 1;
+	}
+	snprintf(path, sizeof(path), "%s/%s", directory, entry->name);
+	if (MakeParents(path, prefixLength) != 0)
+	{
+		extractor->result->error = "cannot create directory";
+		return 1;
+	}
+	if (EndsWith(entry->name, "/"))
+	{
+		return 0;
+	}
+
+	if (ReadAt(extractor->zipFd, local, sizeof(local), entry->localOffset) != 0 || Get32(local) != SIGNATURE_LOCAL)
+	{
+		extractor->result->error = "bad local header";
+		return 1;
+	}
+	off_t dataOffset = (off_t)entry->localOffset + LOCAL_HEADER_SIZE + Get16(local + 26) + Get16(local + 28);
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, mode);
+	if (fd < 0)
+	{
+		extractor->result->error = "cannot create file";
+		return 1;
+	}
+	int failed = ExtractData(extractor, entry, dataOffset, fd, EndsWith(entry->name, ".sh"));
+	/* fchmod because the umask may have narrowed the mode open applied */
+	if (!failed && (fchmod(fd, mode) != 0 || fsync(fd) != 0))
+	{
+		extractor->result->error = "cannot finish file";
+		failed = 1;
+	}
+	if (close(fd) != 0 && !failed)
+	{
+		extractor->result->error = "cannot finish file";
+		failed = 1;
+	}
+	if (!failed)
+	{
+		extractor->result->files++;
+	}
+	return failed;
+}
+
+/* Locates the central directory from the end of central directory record,
+   which sits in the last 22 bytes plus an optional comment */
+static int FindCentralDirectory(EXTRACTOR* extractor, off_t packageSize, uint16_t* entries, uint32_t* size,
+	uint32_t* offset)
+{
+	size_t tailLength = packageSize < EOCD_SIZE + EOCD_MAX_COMMENT ? (size_t)packageSize : EOCD_SIZE + EOCD_MAX_COMMENT;
+	unsigned char* tail = malloc(tailLength > 0 ? tailLength : 1);
+	const unsigned char* eocd = NULL;
+
+	if (tail != NULL && tailLength >= EOCD_SIZE &&
+		ReadAt(extractor->zipFd, tail, tailLength, packageSize - (off_t)tailLength) == 0)
+	{
+		for (size_t i = tailLength - EOCD_SIZE + 1; i-- > 0;)
+		{
+			if (Get32(tail + i) == SIGNATURE_EOCD)
+			{
+				eocd = tail + i;
+				break;
+			}
+		}
+	}
+	if (eocd == NULL)
+	{
+		extractor->result->error = "not a zip package";
+		free(tail);
+		return 1;
+	}
+
+	*entries = Get16(eocd + 10);
+	*size = Get32(eocd + 12);
+	*offset = Get32(eocd + 16);
+	free(tail);
+	if (*entries == 0xFFFF || *size == 0xFFFFFFFF || *offset == 0xFFFFFFFF)
+	{
+		extractor->result->error = "zip64 packages are not supported";
+		return 1;
+	}
+	if ((off_t)*offset + *size > packageSize)
+	{
+		extractor->result->error = "bad central directory";
+		return 1;
+	}
+	return 0;
+}
+
+/* Walks the central directory and extracts each entry in turn */
+static int ExtractEntries(EXTRACTOR* extractor, const unsigned char* central, uint32_t centralSize, uint16_t entries,
+	const char* directory)
+{
+	size_t position = 0;
+
+	for (uint16_t i = 0; i < entries; i++)
+	{
+		ZIP_ENTRY entry;
+		const unsigned char* header = central + position;
+		if (position + CENTRAL_HEADER_SIZE > centralSize || Get32(header) != SIGNATURE_CENTRAL)
+		{
+			extractor->result->error = "bad central directory";
+			return 1;
+		}
+		uint16_t nameLength = Get16(header + 28);
+		size_t headerLength = CENTRAL_HEADER_SIZE + nameLength + Get16(header + 30) + Get16(header + 32);
+		if (position + headerLength > centralSize || nameLength >= sizeof(entry.name))
+		{
+			extractor->result->error = "bad central directory";
+			return 1;
+		}
+		entry.madeBy = Get16(header + 4);
+		entry.flags = Get16(header + 8);
+		entry.method = Get16(header + 10);
+		entry.crc = Get32(header + 16);
+		entry.compressedSize = Get32(header + 20);
+		entry.size = Get32(header + 24);
+		entry.externalAttributes = Get32(header + 38);
+		entry.localOffset = Get32(header + 42);
+		memcpy(entry.name, header + CENTRAL_HEADER_SIZE, nameLength);
+		entry.name[nameLength] = '\0';
+
+		if (ExtractEntry(extractor, &entry, directory) != 0)
+		{
+			return 1;
+		}
+		position += headerLength;
+	}
+	return 0;
+}
+
+int FirmwareInstall_Extract(const char* packagePath, const char* directory, FIRMWARE_INSTALL_RESULT* result)
+{
+	EXTRACTOR extractor;
+	struct stat status;
+	uint16_t entries;
+	uint32_t centralSize;
+	uint32_t centralOffset;
+	unsigned char* central = NULL;
+	int failed = 1;
+
+	memset(&extractor, 0, sizeof(extractor));
+	extractor.result = result;
+	extractor.zipFd = open(packagePath, O_RDONLY | O_CLOEXEC);
+	extractor.input = malloc(EXTRACT_BUFFER_SIZE);
+	extractor.output = malloc(EXTRACT_BUFFER_SIZE);
+	if (extractor.zipFd < 0 || fstat(extractor.zipFd, &status) != 0 || extractor.input == NULL || extractor.output == NULL)
+	{
+		result->error = "cannot open package";
+	}
+	else if (FindCentralDirectory(&extractor, status.st_size, &entries, &centralSize, &centralOffset) == 0)
+	{
+		central = malloc(centralSize > 0 ? centralSize : 1);
+		if (central == NULL || ReadAt(extractor.zipFd, central, centralSize, centralOffset) != 0)
+		{
+			result->error = "bad central directory";
+		}
+		else
+		{
+			failed = ExtractEntries(&extractor, central, centralSize, entries, directory);
+		}
+	}
+
+	if (extractor.zipFd >= 0)
+	{
+		close(extractor.zipFd);
+	}
+	free(central);
+	free(extractor.output);
+	free(extractor.input);
+	return failed;
+}
+
+static int RemoveEntry(const char* path, const struct stat* status, int type, struct FTW* walk)
+{
+	(void)status;
+	(void)type;
+	(void)walk;
+	return remove(path);
+}
+
+static int RemoveTree(const char* path)
+{
+	if (nftw(path, RemoveEntry, 16, FTW_DEPTH | FTW_PHYS) != 0 && errno != ENOENT)
+	{
+		return 1;
+	}
+	return 0;
+}
+
+/* fsyncs the directory at path, or the one holding it when parent is set */
+static int SyncDirectory(const char* path, int parent)
+{
+	char directory[MAX_PATH_LENGTH];
+	const char* separator = strrchr(path, '/');
+
+	if (parent)
+	{
+		if (separator == NULL)
+		{
+			strcpy(directory, ".");
+		}
+		else
+		{
+			snprintf(directory, sizeof(directory), "%.*s", (int)(separator - path), path);
+		}
+		path = directory;
+	}
+	int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	int failed = fd < 0 || fsync(fd) != 0;
+	if (fd >= 0)
+	{
+		close(fd);
+	}
+	return failed;
+}
+
+/* Points link at target by renaming a fresh symlink over it, which is atomic */
+static int PointLink(const char* link, const char* target)
+{
+	char staging[MAX_PATH_LENGTH];
+
+	snprintf(staging, sizeof(staging), "%s.tmp", link);
+	(void)unlink(staging);
+	if (symlink(target, staging) != 0 || rename(staging, link) != 0)
+	{
+		(void)unlink(staging);
+		return 1;
+	}
+	return 0;
+}
+
+/* Exchanges the directory at path with a fresh symlink to target, so path resolves at every
+   instant; the directory is left at path.tmp */
+static int SwapInLink(const char* path, const char* target)
+{
+	char staging[MAX_PATH_LENGTH];
+
+	snprintf(staging, sizeof(staging), "%s.tmp", path);
+	(void)unlink(staging);
+	if (symlink(target, staging) != 0)
+	{
+		return 1;
+	}
+	if (renameat2(AT_FDCWD, staging, AT_FDCWD, path, RENAME_EXCHANGE) != 0)
+	{
+		(void)unlink(staging);
+		return 1;
+	}
+	return 0;
+}
+
+/* Moves a directory SwapInLink left at path.tmp to slot a; it is there only when the first
+   install stopped between the exchange and this rename */
+static int FinishAdopting(const char* activePath)
+{
+	char staging[MAX_PATH_LENGTH];
+	char adopted[MAX_PATH_LENGTH];
+	struct stat status;
+
+	snprintf(staging, sizeof(staging), "%s.tmp", activePath);
+	snprintf(adopted, sizeof(adopted), "%s.a", activePath);
+	if (lstat(staging, &status) != 0 || !S_ISDIR(status.st_mode))
+	{
+		return 0;
+	}
+	return RemoveTree(adopted) != 0 || rename(staging, adopted) != 0;
+}
+
+/* Reads where link points; empty when it is not a symlink */
+static void ReadLink(const char* link, char* target, size_t size)
+{
+	ssize_t length = readlink(link, target, size - 1);
+	target[length > 0 ? length : 0] = '\0';
+}
+
+int FirmwareInstall_Apply(const char* activePath, const char* packagePath, FIRMWARE_INSTALL_RESULT* result)
+{
+	char active[MAX_PATH_LENGTH];
+	char slotPath[MAX_PATH_LENGTH];
+	char slotName[MAX_PATH_LENGTH];
+	char previousLink[MAX_PATH_LENGTH];
+	const char* base = strrchr(activePath, '/');
+	struct stat status;
+	int adopt;
+
+	memset(result, 0, sizeof(FIRMWARE_INSTALL_RESULT));
+	base = base != NULL ? base + 1 : activePath;
+	if (FinishAdopting(activePath) != 0)
+	{
+		result->error = "cannot adopt the installed directory";
+		return 1;
+	}
+	ReadLink(activePath, active, sizeof(active));
+	adopt = active[0] == '\0' && lstat(activePath, &status) == 0 && S_ISDIR(status.st_mode);
+	if (adopt)
+	{
+		/* The first install turns the existing directory into slot a */
+		snprintf(active, sizeof(active), "%s.a", base);
+	}
+	strcpy(result->slot, EndsWith(active, ".a") ? "b" : "a");
+	snprintf(slotName, sizeof(slotName), "%s.%s", base, result->slot);
+	snprintf(slotPath, sizeof(slotPath), "%s.%s", activePath, result->slot);
+	snprintf(previousLink, sizeof(previousLink), "%s.previous", activePath);
+
+	/* Whatever a crashed install left in the inactive slot goes first */
+	if (RemoveTree(slotPath) != 0 || mkdir(slotPath, 0755) != 0)
+	{
+		result->error = "cannot clear the inactive slot";
+		return 1;
+	}
+	if (FirmwareInstall_Extract(packagePath, slotPath, result) != 0)
+	{
+		return 1;
+	}
+	if (SyncDirectory(slotPath, 0) != 0)
+	{
+		result->error = "cannot sync the slot";
+		return 1;
+	}
+
+	/* previous first: a crash between the two renames leaves the old slot active */
+	if ((active[0] != '\0' && PointLink(previousLink, active) != 0) ||
+		(adopt ? SwapInLink(activePath, slotName) : PointLink(activePath, slotName)) != 0 ||
+		SyncDirectory(activePath, 1) != 0)
+	{
+		result->error = "cannot switch slots";
+		return 1;
+	}
+	/* The first install's old directory becomes slot a only once path already leads to the new slot */
+	if (adopt && (FinishAdopting(activePath) != 0 || SyncDirectory(activePath, 1) != 0))
+	{
+		result->error = "cannot adopt the installed directory";
+		return 1;
+	}
+	return 0;
+}
+
+int FirmwareInstall_Rollback(const char* activePath)
+{
+	char active[MAX_PATH_LENGTH];
+	char previous[MAX_PATH_LENGTH];
+	char previousLink[MAX_PATH_LENGTH];
+
+	snprintf(previousLink, sizeof(previousLink), "%s.previous", activePath);
+	if (FinishAdopting(activePath) != 0)
+	{
+		return 1;
+	}
+	ReadLink(activePath, active, sizeof(active));
+	ReadLink(previousLink, previous, sizeof(previous));
+	if (active[0] == '\0' || previous[0] == '\0' || strcmp(previous, active) == 0)
+	{
+		return 1;
+	}
+	if (PointLink(previousLink, active) != 0 || PointLink(activePath, previous) != 0)
+	{
+		return 1;
+	}
+	return SyncDirectory(activePath, 1);
+}
@@ -0,0 +1,59 @@
+// Copyright (c) Microsoft. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+#ifndef FIRMWARE_INSTALL_H
+#define FIRMWARE_INSTALL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Installs a firmware package into one of two slot directories beside the
+   path the agent runs from, and switches between them atomically:
+
+     <path>.a, <path>.b   the slots
+     <path>               symlink to the active slot
+     <path>.previous      symlink to the slot it replaced, for rollback
+
+   The package is extracted in process into the inactive slot. Each entry
+   streams through a fixed buffer. Only then is <path> replaced with a
+   rename, so a crash leaves the old or the new slot active, never a half
+   written one. On the first install <path> is still a directory: it is
+   exchanged with a symlink to the new slot by renameat2(RENAME_EXCHANGE),
+   and only afterwards moved from <path>.tmp to <path>.a, so <path> resolves
+   throughout. A crash between the two leaves it at <path>.tmp, where the
+   next install or rollback picks it up. Scripts such as firmwarereboot.sh
+   keep working because they name <path>.
+
+   Stored and deflated entries are supported, zip64 is not. Entry names
+   that would leave the slot, and data longer than the size an entry
+   declares, are rejected. Shell scripts have their
+   carriage returns stripped. Entries without Unix permissions are made
+   executable when they are scripts or have no extension. */
+
+typedef struct FIRMWARE_INSTALL_RESULT_TAG
+{
+	char slot[2];               /* "a" or "b", the slot now active */
+	size_t files;
+	uint64_t bytes;             /* uncompressed bytes written */
+	const char* error;          /* NULL on success */
+} FIRMWARE_INSTALL_RESULT;
+
+/* Extracts the package into the inactive slot and makes it active.
+   Returns 0 on success; on failure the active slot is unchanged. */
+int FirmwareInstall_Apply(const char* activePath, const char* packagePath, FIRMWARE_INSTALL_RESULT* result);
+
+/* Makes the previous slot active again. Returns 0 on success. */
+int FirmwareInstall_Rollback(const char* activePath);
+
+/* Extracts every entry of the package below directory, which must exist */
+int FirmwareInstall_Extract(const char* packagePath, const char* directory, FIRMWARE_INSTALL_RESULT* result);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* FIRMWARE_INSTALL_H */
@@ -0,0 +1,217 @@
+// Copyright (c) Microsoft. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "hot_restart.h"
+
+#define HANDOFF_MAGIC 0x524d4852u   /* "RMHR" */
+#define HANDOFF_VERSION 2
+
+/* The old and new binary must agree on the state layout; the sizes catch
+   a mismatch between builds, and the new process then starts afresh */
+typedef struct HANDOFF_HEADER_TAG
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t stateSize;
+	uint32_t sampleSize;
+	uint64_t sampleCount;
+} HANDOFF_HEADER;
+
+#define SAMPLES_OFFSET ((off_t)(sizeof(HANDOFF_HEADER) + sizeof(HOT_RESTART_STATE)))
+
+typedef struct HOT_RESTART_TAG
+{
+	int fd;
+	size_t samples;
+} HOT_RESTART;
+
+static int PwriteAll(int fd, const void* data, size_t length, off_t offset)
+{
+	const unsigned char* next = data;
+	while (length > 0)
+	{
+		ssize_t written = pwrite(fd, next, length, offset);
+		if (written < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		if (written <= 0)
+		{
+			return 1;
+		}
+		next += written;
+		length -= (size_t)written;
+		offset += written;
+	}
+	return 0;
+}
+
+static int PreadAll(int fd, void* data, size_t length, off_t offset)
+{
+	unsigned char* next = data;
+	while (length > 0)
+	{
+		ssize_t count = pread(fd, next, length, offset);
+		if (count < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		if (count <= 0)
+		{
+			return 1;
+		}
+		next += count;
+		length -= (size_t)count;
+		offset += count;
+	}
+	return 0;
+}
+
+HOT_RESTART_HANDLE HotRestart_Create(void)
+{
+	HOT_RESTART* handoff = calloc(1, sizeof(HOT_RESTART));
+	if (handoff == NULL)
+	{
+		return NULL;
+	}
+	/* Not close-on-exec: the new binary must inherit it */
+	handoff->fd = memfd_create("remote_monitoring_handoff", 0);
+	if (handoff->fd < 0)
+	{
+		free(handoff);
+		return NULL;
+	}
+	return handoff;
+}
+
+void HotRestart_Destroy(HOT_RESTART_HANDLE handoff)
+{
+	if (handoff != NULL)
+	{
+		close(handoff->fd);
+		free(handoff);
+	}
+}
+
+int HotRestart_AddSample(HOT_RESTART_HANDLE handoff, const TELEMETRY_SAMPLE* sample)
+{
+	off_t offset = SAMPLES_OFFSET + (off_t)(handoff->samples * sizeof(TELEMETRY_SAMPLE));
+	if (PwriteAll(handoff->fd, sample, sizeof(TELEMETRY_SAMPLE), offset) != 0)
+	{
+		return 1;
+	}
+	handoff->samples++;
+	return 0;
+}
+
+size_t HotRestart_SampleCount(HOT_RESTART_HANDLE handoff)
+{
+	return handoff->samples;
+}
+
+/* Marks every descriptor but the kept one close-on-exec, so sockets, files
+   and the lock of the old process do not leak into the new one */
+static void CloseOnExec(int keep)
+{
+	DIR* directory = opendir("/proc/self/fd");
+	struct dirent* entry;
+
+	if (directory == NULL)
+	{
+		return;
+	}
+	while ((entry = readdir(directory)) != NULL)
+	{
+		int fd = atoi(entry->d_name);
+		if (entry->d_name[0] == '.' || fd <= STDERR_FILENO || fd == dirfd(directory))
+		{
+			continue;
+		}
+		(void)fcntl(fd, F_SETFD, fd == keep ? 0 : FD_CLOEXEC);
+	}
+	closedir(directory);
+}
+
+int HotRestart_Exec(HOT_RESTART_HANDLE handoff, const HOT_RESTART_STATE* state, const char* path)
+{
+	HANDOFF_HEADER header;
+	char number[16];
+	char* argv[2];
+
+	header.magic = HANDOFF_MAGIC;
+	header.version = HANDOFF_VERSION;
+	header.stateSize = sizeof(HOT_RESTART_STATE);
+	header.sampleSize = sizeof(TELEMETRY_SAMPLE);
+	header.sampleCount = handoff->samples;
+	snprintf(number, sizeof(number), "%d", handoff->fd);
+	argv[0] = (char*)path;
+	argv[1] = NULL;
+
+	if (PwriteAll(handoff->fd, &header, sizeof(header), 0) == 0 &&
+		PwriteAll(handoff->fd, state, sizeof(HOT_RESTART_STATE), sizeof(header)) == 0 &&
+		setenv(HOT_RESTART_ENV, number, 1) == 0)
+	{
+		CloseOnExec(handoff->fd);
+		(void)fflush(NULL);
+		execv(path, argv);
+		printf("Failed to exec %s: %s\r\n", path, strerror(errno));
+		unsetenv(HOT_RESTART_ENV);
+	}
+	HotRestart_Destroy(handoff);
+	return 1;
+}
+
+int HotRestart_Receive(HOT_RESTART_STATE* state, TELEMETRY_SAMPLE** samples, size_t* count)
+{
+	const char* number = getenv(HOT_RESTART_ENV);
+	HANDOFF_HEADER header;
+	int fd;
+	int failed;
+
+	*samples = NULL;
+	*count = 0;
+	if (number == NULL)
+	{
+		return 1;
+	}
+	fd = atoi(number);
+	/* A child started by this process must not take the handoff again */
+	unsetenv(HOT_RESTART_ENV);
+
+	failed = PreadAll(fd, &header, sizeof(header), 0) != 0 || header.magic != HANDOFF_MAGIC ||
+		header.version != HANDOFF_VERSION ||
+		header.stateSize != sizeof(HOT_RESTART_STATE) || header.sampleSize != sizeof(TELEMETRY_SAMPLE) ||
+		PreadAll(fd, state, sizeof(HOT_RESTART_STATE), sizeof(header)) != 0;
+	if (!failed && header.sampleCount > 0)
+	{
+		*samples = malloc((size_t)header.sampleCount * sizeof(TELEMETRY_SAMPLE));
+		failed = *samples == NULL ||
+			PreadAll(fd, *samples, (size_t)header.sampleCount * sizeof(TELEMETRY_SAMPLE), SAMPLES_OFFSET) != 0;
+		if (failed)
+		{
+			free(*samples);
+			*samples = NULL;
+		}
+		else
+		{
+			*count = (size_t)header.sampleCount;
+		}
+	}
+	close(fd);
+	if (failed)
+	{
+		printf("Hot restart handoff unreadable, starting afresh\r\n");
+	}
+	return failed;
+}
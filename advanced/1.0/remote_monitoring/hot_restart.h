@@ -0,0 +1,56 @@
+// Copyright (c) Microsoft. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+#ifndef HOT_RESTART_H
+#define HOT_RESTART_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "sample_ring.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Replaces the running agent with a new binary through exec() while keeping
+   what it has not sent yet. The state and the unsent samples are written to
+   an anonymous memory file. The new process inherits that file and finds
+   its descriptor number in HOT_RESTART_ENV. Every other descriptor is closed
+   on exec, the single instance lock included: the new binary takes the lock
+   again, so an image that knows nothing of the handoff still starts. */
+
+#define HOT_RESTART_ENV "REMOTE_MONITORING_HANDOFF_FD"
+
+typedef struct HOT_RESTART_STATE_TAG
+{
+	unsigned int samplingIntervalMs;
+	uint64_t lastSampleMs;      /* wall clock of the last sample the old process took */
+	uint64_t rebootBeginNs;     /* CLOCK_MONOTONIC when the old process began to restart */
+	char lastUpdateBegin[32];
+	char lastRebootBegin[32];
+} HOT_RESTART_STATE;
+
+typedef struct HOT_RESTART_TAG* HOT_RESTART_HANDLE;
+
+/* Old process: creates the memory file the samples are appended to */
+HOT_RESTART_HANDLE HotRestart_Create(void);
+void HotRestart_Destroy(HOT_RESTART_HANDLE handoff);
+
+int HotRestart_AddSample(HOT_RESTART_HANDLE handoff, const TELEMETRY_SAMPLE* sample);
+size_t HotRestart_SampleCount(HOT_RESTART_HANDLE handoff);
+
+/* Writes the state and execs path. Only returns, non-zero and with the
+   handoff destroyed, when exec failed. */
+int HotRestart_Exec(HOT_RESTART_HANDLE handoff, const HOT_RESTART_STATE* state, const char* path);
+
+/* New process: returns 0 and the handed over state when this process was
+   started by HotRestart_Exec. samples is malloc'ed, NULL when count is 0.
+   Returns non-zero on a normal start or when the handoff is unreadable. */
+int HotRestart_Receive(HOT_RESTART_STATE* state, TELEMETRY_SAMPLE** samples, size_t* count);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* HOT_RESTART_H */
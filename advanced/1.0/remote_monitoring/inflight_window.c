@@ -0,0 +1,276 @@
+// Copyright (c) Microsoft. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "inflight_window.h"
+
+typedef enum SLOT_STATE_TAG
+{
+	SLOT_FREE,
+	SLOT_SENDING,
+	SLOT_FAILED
+} SLOT_STATE;
+
+typedef struct INFLIGHT_SLOT_TAG
+{
+	struct INFLIGHT_WINDOW_TAG* window;
+	SLOT_STATE state;
+	uint64_t sentUs;
+	uint8_t flags;
+	size_t length;
+	unsigned char* payload;
+} INFLIGHT_SLOT;
+
+typedef struct INFLIGHT_WINDOW_TAG
+{
+	pthread_mutex_t lock;
+	pthread_cond_t changed;     /* signalled whenever a slot leaves SLOT_SENDING */
+	size_t capacity;
+	size_t maxPayload;
+	size_t taken;
+	size_t sending;
+	INFLIGHT_SLOT* slots;
+	unsigned char* payloads;
+	INFLIGHT_STATS stats;
+} INFLIGHT_WINDOW;
+
+static uint64_t MonotonicUs(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000 + (uint64_t)now.tv_nsec / 1000;
+}
+
+static void DeadlineAfter(struct timespec* deadline, unsigned int ms)
+{
+	clock_gettime(CLOCK_MONOTONIC, deadline);
+	deadline->tv_sec += ms / 1000;
+	deadline->tv_nsec += (long)(ms % 1000) * 1000000;
+	if (deadline->tv_nsec >= 1000000000)
+	{
+		deadline->tv_sec++;
+		deadline->tv_nsec -= 1000000000;
+	}
+}
+
+INFLIGHT_WINDOW_HANDLE InflightWindow_Create(size_t capacity, size_t maxPayload)
+{
+	INFLIGHT_WINDOW* window = calloc(1, sizeof(INFLIGHT_WINDOW));
+	pthread_condattr_t attributes;
+
+	if (window == NULL)
+	{
+		return NULL;
+	}
+	window->slots = calloc(capacity, sizeof(INFLIGHT_SLOT));
+	window->payloads = malloc(capacity * maxPayload);
+	if (window->slots == NULL || window->payloads == NULL)
+	{
+		free(window->slots);
+		free(window->payloads);
+		free(window);
+		return NULL;
+	}
+
+	pthread_mutex_init(&window->lock, NULL);
+	/* Waits are measured on the monotonic clock so a wall clock step cannot stretch them */
+	pthread_condattr_init(&attributes);
+	pthread_condattr_setclock(&attributes, CLOCK_MONOTONIC);
+	pthread_cond_init(&window->changed, &attributes);
+	pthread_condattr_destroy(&attributes);
+
+	window->capacity = capacity;
+	window->maxPayload = maxPayload;
+	for (size_t i = 0; i < capacity; i++)
+	{
+		window->slots[i].window = window;
+		window->slots[i].payload = window->payloads + i * maxPayload;
+	}
+	window->stats.capacity = capacity;
+	LatencyHistogram_Reset(&window->stats.ackLatency);
+	return window;
+}
+
+void InflightWindow_Destroy(INFLIGHT_WINDOW_HANDLE window)
+{
+	if (window != NULL)
+	{
+		pthread_cond_destroy(&window->changed);
+		pthread_mutex_destroy(&window->lock);
+		free(window->payloads);
+		free(window->slots);
+		free(window);
+	}
+}
+
+INFLIGHT_TICKET InflightWindow_Acquire(INFLIGHT_WINDOW_HANDLE window, const unsigned char* payload, size_t length,
+	uint8_t flags, unsigned int waitMs)
+{
+	INFLIGHT_SLOT* slot = NULL;
+	struct timespec deadline;
+	int timedOut = 0;
+
+	if (length > window->maxPayload)
+	{
+		return NULL;
+	}
+
+	pthread_mutex_lock(&window->lock);
+	/* Only a confirmation frees a slot here; failed slots wait for InflightWindow_TakeFailed,
+	   so with nothing left awaiting confirmation there is no point in waiting */
+	if (window->taken == window->capacity && window->sending > 0 && waitMs > 0)
+	{
+		window->stats.blocked++;
+		DeadlineAfter(&deadline, waitMs);
+		while (window->taken == window->capacity && window->sending > 0 && !timedOut)
+		{
+			timedOut = pthread_cond_timedwait(&window->changed, &window->lock, &deadline) == ETIMEDOUT;
+		}
+	}
+
+	if (window->taken == window->capacity)
+	{
+		window->stats.full++;
+	}
+	else
+	{
+		for (size_t i = 0; i < window->capacity; i++)
+		{
+			if (window->slots[i].state == SLOT_FREE)
+			{
+				slot = &window->slots[i];
+				break;
+			}
+		}
+		slot->state = SLOT_SENDING;
+		slot->flags = flags;
+		slot->length = length;
+		memcpy(slot->payload, payload, length);
+		slot->sentUs = MonotonicUs();
+		window->taken++;
+		window->sending++;
+		window->stats.sent++;
+		if (window->taken > window->stats.highWatermark)
+		{
+			window->stats.highWatermark = window->taken;
+		}
+	}
+	pthread_mutex_unlock(&window->lock);
+	return slot;
+}
+
+void InflightWindow_Cancel(INFLIGHT_TICKET ticket)
+{
+	INFLIGHT_WINDOW* window = ticket->window;
+
+	pthread_mutex_lock(&window->lock);
+	ticket->state = SLOT_FREE;
+	window->taken--;
+	window->sending--;
+	window->stats.sent--;
+	pthread_cond_broadcast(&window->changed);
+	pthread_mutex_unlock(&window->lock);
+}
+
+void InflightWindow_Complete(INFLIGHT_TICKET ticket, int succeeded)
+{
+	INFLIGHT_WINDOW* window = ticket->window;
+	uint64_t nowUs = MonotonicUs();
+
+	pthread_mutex_lock(&window->lock);
+	window->sending--;
+	if (succeeded)
+	{
+		LatencyHistogram_Add(&window->stats.ackLatency, nowUs - ticket->sentUs);
+		window->stats.acknowledged++;
+		ticket->state = SLOT_FREE;
+		window->taken--;
+	}
+	else
+	{
+		window->stats.failed++;
+		ticket->state = SLOT_FAILED;
+	}
+	pthread_cond_broadcast(&window->changed);
+	pthread_mutex_unlock(&window->lock);
+}
+
+size_t InflightWindow_TakeFailed(INFLIGHT_WINDOW_HANDLE window, INFLIGHT_FAILED callback, void* context)
+{
+	size_t taken = 0;
+
+	pthread_mutex_lock(&window->lock);
+	for (;;)
+	{
+		INFLIGHT_SLOT* oldest = NULL;
+		for (size_t i = 0; i < window->capacity; i++)
+		{
+			if (window->slots[i].state == SLOT_FAILED && (oldest == NULL || window->slots[i].sentUs < oldest->sentUs))
+			{
+				oldest = &window->slots[i];
+			}
+		}
+		if (oldest == NULL)
+		{
+			break;
+		}
+
+		/* Failed slots are only touched by this thread, so the lock can be
+		   dropped while the callback does I/O */
+		pthread_mutex_unlock(&window->lock);
+		callback(context, oldest->payload, oldest->length, oldest->flags);
+		pthread_mutex_lock(&window->lock);
+
+		oldest->state = SLOT_FREE;
+		window->taken--;
+		taken++;
+		pthread_cond_broadcast(&window->changed);
+	}
+	pthread_mutex_unlock(&window->lock);
+	return taken;
+}
+
+int InflightWindow_IsFull(INFLIGHT_WINDOW_HANDLE window)
+{
+	int full;
+	pthread_mutex_lock(&window->lock);
+	full = window->taken == window->capacity;
+	pthread_mutex_unlock(&window->lock);
+	return full;
+}
+
+void InflightWindow_CountDropped(INFLIGHT_WINDOW_HANDLE window)
+{
+	pthread_mutex_lock(&window->lock);
+	window->stats.dropped++;
+	pthread_mutex_unlock(&window->lock);
+}
+
+int InflightWindow_WaitIdle(INFLIGHT_WINDOW_HANDLE window, unsigned int timeoutMs)
+{
+	struct timespec deadline;
+	int timedOut = 0;
+
+	DeadlineAfter(&deadline, timeoutMs);
+	pthread_mutex_lock(&window->lock);
+	while (window->sending > 0 && !timedOut)
+	{
+		timedOut = pthread_cond_timedwait(&window->changed, &window->lock, &deadline) == ETIMEDOUT;
+	}
+	timedOut = window->sending > 0;
+	pthread_mutex_unlock(&window->lock);
+	return timedOut;
+}
+
+void InflightWindow_GetStats(INFLIGHT_WINDOW_HANDLE window, INFLIGHT_STATS* stats)
+{
+	pthread_mutex_lock(&window->lock);
+	*stats = window->stats;
+	stats->inFlight = window->taken;
+	pthread_mutex_unlock(&window->lock);
+}
@@ -0,0 +1,82 @@
+// Copyright (c) Microsoft. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+#ifndef INFLIGHT_WINDOW_H
+#define INFLIGHT_WINDOW_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "latency_histogram.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Bounds the number of messages handed to the SDK but not yet confirmed.
+   Each send takes a slot, which keeps a copy of the payload until the
+   confirmation callback releases it; a failed or timed out message stays
+   in its slot until the sending thread takes it back, for example to
+   spool it again. Acquire and TakeFailed are called from the sending
+   thread, Complete from the SDK's callback thread. */
+
+typedef struct INFLIGHT_WINDOW_TAG* INFLIGHT_WINDOW_HANDLE;
+typedef struct INFLIGHT_SLOT_TAG* INFLIGHT_TICKET;
+
+/* What the producer does when every slot is taken */
+typedef enum INFLIGHT_POLICY_TAG
+{
+	INFLIGHT_POLICY_BLOCK,      /* wait for a confirmation */
+	INFLIGHT_POLICY_BATCH,      /* hold samples back and send them as one batch */
+	INFLIGHT_POLICY_DROP        /* drop the message */
+} INFLIGHT_POLICY;
+
+typedef struct INFLIGHT_STATS_TAG
+{
+	size_t capacity;
+	size_t inFlight;            /* slots taken right now, failed ones included */
+	size_t highWatermark;
+	uint64_t sent;
+	uint64_t acknowledged;
+	uint64_t failed;            /* confirmed with an error, a timeout or on destroy */
+	uint64_t blocked;           /* acquires that had to wait */
+	uint64_t full;              /* acquires that found no slot in time */
+	uint64_t dropped;           /* messages the caller gave up on */
+	LATENCY_HISTOGRAM ackLatency;   /* send to confirmation, successful ones only */
+} INFLIGHT_STATS;
+
+/* Receives a failed message; the payload is only valid during the call */
+typedef void(*INFLIGHT_FAILED)(void* context, const unsigned char* payload, size_t length, uint8_t flags);
+
+INFLIGHT_WINDOW_HANDLE InflightWindow_Create(size_t capacity, size_t maxPayload);
+void InflightWindow_Destroy(INFLIGHT_WINDOW_HANDLE window);
+
+/* Takes a slot and copies the payload into it, waiting up to waitMs for a
+   confirmation when all are taken. Returns NULL when none frees up in time,
+   at once when every taken slot holds a failed message, or when the payload
+   is larger than maxPayload. */
+INFLIGHT_TICKET InflightWindow_Acquire(INFLIGHT_WINDOW_HANDLE window, const unsigned char* payload, size_t length,
+	uint8_t flags, unsigned int waitMs);
+
+/* Gives back a slot whose message never reached the SDK */
+void InflightWindow_Cancel(INFLIGHT_TICKET ticket);
+
+/* Confirmation from the SDK; on success the slot is freed and the latency recorded */
+void InflightWindow_Complete(INFLIGHT_TICKET ticket, int succeeded);
+
+/* Hands every failed message to the callback, oldest send first, and frees the slots */
+size_t InflightWindow_TakeFailed(INFLIGHT_WINDOW_HANDLE window, INFLIGHT_FAILED callback, void* context);
+
+int InflightWindow_IsFull(INFLIGHT_WINDOW_HANDLE window);
+void InflightWindow_CountDropped(INFLIGHT_WINDOW_HANDLE window);
+
+/* Waits until no message is awaiting confirmation; returns non-zero on timeout */
+int InflightWindow_WaitIdle(INFLIGHT_WINDOW_HANDLE window, unsigned int timeoutMs);
+
+void InflightWindow_GetStats(INFLIGHT_WINDOW_HANDLE window, INFLIGHT_STATS* stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* INFLIGHT_WINDOW_H */
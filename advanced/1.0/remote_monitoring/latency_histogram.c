@@ -0,0 +1,96 @@
+// Copyright (c) Microsoft. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+#include <stdio.h>
+#include <string.h>
+
+#include "latency_histogram.h"
+
+static int BucketOf(uint64_t valueUs)
+{
+	int bucket = valueUs == 0 ? 0 : 64 - __builtin_clzll(valueUs);
+	return bucket < LATENCY_HISTOGRAM_BUCKETS ? bucket : LATENCY_HISTOGRAM_BUCKETS - 1;
+}
+
+static uint64_t BucketUpperBound(int bucket)
+{
+	return bucket == 0 ? 0 : ((uint64_t)1 << bucket) - 1;
+}
+
+void LatencyHistogram_Reset(LATENCY_HISTOGRAM* histogram)
+{
+	memset(histogram, 0, sizeof(*histogram));
+}
+
+void LatencyHistogram_Add(LATENCY_HISTOGRAM* histogram, uint64_t valueUs)
+{
+	if (histogram->count == 0 || valueUs < histogram->minUs)
+	{
+		histogram->minUs = valueUs;
+	}
+	if (valueUs > histogram->maxUs)
+	{
+		histogram->maxUs = valueUs;
+	}
+	histogram->count++;
+	histogram->sumUs += valueUs;
+	histogram->buckets[BucketOf(valueUs)]++;
+}
+
+uint64_t LatencyHistogram_Percentile(const LATENCY_HISTOGRAM* histogram, double fraction)
+{
+	uint64_t rank, seen = 0;
+
+	if (histogram->count == 0)
+	{
+		return 0;
+	}
+	rank = (uint64_t)(fraction * histogram->count + 0.5);
+	if (rank < 1)
+	{
+		rank = 1;
+	}
+	for (int i = 0; i < LATENCY_HISTOGRAM_BUCKETS; i++)
+	{
+		seen += histogram->buckets[i];
+		if (seen >= rank)
+		{
+			uint64_t bound = BucketUpperBound(i);
+			return bound < histogram->maxUs ? bound : histogram->maxUs;
+		}
+	}
+	return histogram->maxUs;
+}
+
+int LatencyHistogram_Format(const LATENCY_HISTOGRAM* histogram, const char* name, char* buffer, size_t size)
+{
+	size_t used;
+	int written = snprintf(buffer, size, "%s: count %llu, min %llu us, mean %llu us, p50 %llu us, p99 %llu us, max %llu us\n",
+		name, (unsigned long long)histogram->count, (unsigned long long)histogram->minUs,
+		(unsigned long long)(histogram->count > 0 ? histogram->sumUs / histogram->count : 0),
+		(unsigned long long)LatencyHistogram_Percentile(histogram, 0.5),
+		(unsigned long long)LatencyHistogram_Percentile(histogram, 0.99),
+		(unsigned long long)histogram->maxUs);
+	if (written < 0 || (size_t)written >= size)
+	{
+		return 1;
+	}
+	used = (size_t)written;
+
+	for (int i = 0; i < LATENCY_HISTOGRAM_BUCKETS; i++)
+	{
+		if (histogram->buckets[i] == 0)
+		{
+			continue;
+		}
+		written = snprintf(buffer + used, size - used, "  <= %10llu us %10llu\n",
+			(unsigned long long)(i == LATENCY_HISTOGRAM_BUCKETS - 1 ? histogram->maxUs : BucketUpperBound(i)),
+			(unsigned long long)histogram->buckets[i]);
+		if (written < 0 || (size_t)written >= size - used)
+		{
+			return 1;
+		}
+		used += (size_t)written;
+	}
+	return 0;
+}
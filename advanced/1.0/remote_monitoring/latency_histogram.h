@@ -0,0 +1,43 @@
+// Copyright (c) Microsoft. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+#ifndef LATENCY_HISTOGRAM_H
+#define LATENCY_HISTOGRAM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Bucket 0 counts zero, bucket i counts values in [2^(i-1), 2^i); the last
+   bucket also takes everything larger. 32 buckets of microseconds cover
+   about 35 minutes. */
+#define LATENCY_HISTOGRAM_BUCKETS 32
+
+typedef struct LATENCY_HISTOGRAM_TAG
+{
+	uint64_t count;
+	uint64_t sumUs;
+	uint64_t minUs;
+	uint64_t maxUs;
+	uint64_t buckets[LATENCY_HISTOGRAM_BUCKETS];
+} LATENCY_HISTOGRAM;
+
+void LatencyHistogram_Reset(LATENCY_HISTOGRAM* histogram);
+void LatencyHistogram_Add(LATENCY_HISTOGRAM* histogram, uint64_t valueUs);
+
+/* Upper bound of the bucket holding the given fraction (0..1) of the
+   values, clamped to the largest value seen; 0 when empty */
+uint64_t LatencyHistogram_Percentile(const LATENCY_HISTOGRAM* histogram, double fraction);
+
+/* Writes a one line summary followed by one line per non-empty bucket.
+   Returns 0 on success, non-zero when it does not fit. */
+int LatencyHistogram_Format(const LATENCY_HISTOGRAM* histogram, const char* name, char* buffer, size_t size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* LATENCY_HISTOGRAM_H */
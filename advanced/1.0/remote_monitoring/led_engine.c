@@ -0,0 +1,263 @@
+// Copyright (c) Microsoft. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "led_engine.h"
+
+#define HEARTBEAT_PULSE_MS 100
+#define HEARTBEAT_PERIOD_MS 1000
+
+typedef struct LED_ENGINE_TAG
+{
+	pthread_mutex_t lock;
+	pthread_cond_t changed;     /* signalled when a command arrives or the engine stops */
+	pthread_t thread;
+	int stopping;
+	LED_WRITE write;
+	void* context;
+	int level;                  /* what the pin is driven to right now */
+	int steadyLevel;            /* where the LED rests between patterns */
+
+	int playing;
+	LED_STEP steps[LED_PATTERN_MAX_STEPS];
+	size_t stepCount;
+	size_t step;
+	unsigned int repeat;        /* runs left, LED_REPEAT_FOREVER for no limit */
+	struct timespec deadline;   /* when the current step ends */
+	LED_ENGINE_STATS stats;
+} LED_ENGINE;
+
+static void AddMs(struct timespec* time, unsigned int ms)
+{
+	time->tv_sec += ms / 1000;
+	time->tv_nsec += (long)(ms % 1000) * 1000000;
+	if (time->tv_nsec >= 1000000000)
+	{
+		time->tv_sec++;
+		time->tv_nsec -= 1000000000;
+	}
+}
+
+/* Called with the lock held */
+static void Drive(LED_ENGINE* engine, int level)
+{
+	if (level == engine->level)
+	{
+		engine->stats.unchanged++;
+	}
+	else
+	{
+		engine->write(engine->context, level);
+		engine->level = level;
+		engine->stats.writes++;
+	}
+}
+
+/* Called with the lock held; moves to the next step or ends the pattern */
+static void Advance(LED_ENGINE* engine, const struct timespec* now)
+{
+	uint64_t lateUs = (uint64_t)(now->tv_sec - engine->deadline.tv_sec) * 1000000 +
+		(now->tv_nsec - engine->deadline.tv_nsec) / 1000;
+	if (lateUs > engine->stats.lateUs)
+	{
+		engine->stats.lateUs = lateUs;
+	}
+
+	if (++engine->step == engine->stepCount)
+	{
+		engine->step = 0;
+		if (engine->repeat != LED_REPEAT_FOREVER && --engine->repeat == 0)
+		{
+			engine->playing = 0;
+			Drive(engine, engine->steadyLevel);
+			return;
+		}
+	}
+	Drive(engine, engine->steps[engine->step].level);
+	/* Step from the previous deadline, not from now, so the pattern keeps its
+	   rhythm; after a stall longer than a step start again from now rather
+	   than flicker through the missed steps */
+	AddMs(&engine->deadline, engine->steps[engine->step].durationMs);
+	if (engine->deadline.tv_sec < now->tv_sec ||
+		(engine->deadline.tv_sec == now->tv_sec && engine->deadline.tv_nsec < now->tv_nsec))
+	{
+		engine->deadline = *now;
+		AddMs(&engine->deadline, engine->steps[engine->step].durationMs);
+	}
+}
+
+static void* EngineThread(void* context)
+{
+	LED_ENGINE* engine = context;
+	struct timespec now;
+
+	pthread_mutex_lock(&engine->lock);
+	while (!engine->stopping)
+	{
+		if (!engine->playing)
+		{
+			pthread_cond_wait(&engine->changed, &engine->lock);
+		}
+		else if (pthread_cond_timedwait(&engine->changed, &engine->lock, &engine->deadline) == ETIMEDOUT &&
+			engine->playing)
+		{
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			Advance(engine, &now);
+		}
+	}
+	pthread_mutex_unlock(&engine->lock);
+	return NULL;
+}
+
+LED_ENGINE_HANDLE LedEngine_Create(LED_WRITE write, void* context)
+{
+	LED_ENGINE* engine = calloc(1, sizeof(LED_ENGINE));
+	pthread_condattr_t attributes;
+
+	if (engine == NULL)
+	{
+		return NULL;
+	}
+	engine->write = write;
+	engine->context = context;
+	write(context, 0);
+
+	pthread_mutex_init(&engine->lock, NULL);
+	/* Step deadlines are on the monotonic clock so a wall clock step cannot stretch them */
+	pthread_condattr_init(&attributes);
+	pthread_condattr_setclock(&attributes, CLOCK_MONOTONIC);
+	pthread_cond_init(&engine->changed, &attributes);
+	pthread_condattr_destroy(&attributes);
+
+	if (pthread_create(&engine->thread, NULL, &EngineThread, engine) != 0)
+	{
+		pthread_cond_destroy(&engine->changed);
+		pthread_mutex_destroy(&engine->lock);
+		free(engine);
+		return NULL;
+	}
+	return engine;
+}
+
+void LedEngine_Destroy(LED_ENGINE_HANDLE engine)
+{
+	if (engine != NULL)
+	{
+		pthread_mutex_lock(&engine->lock);
+		engine->stopping = 1;
+		pthread_cond_signal(&engine->changed);
+		pthread_mutex_unlock(&engine->lock);
+		pthread_join(engine->thread, NULL);
+
+		pthread_cond_destroy(&engine->changed);
+		pthread_mutex_destroy(&engine->lock);
+		free(engine);
+	}
+}
+
+/* Called with the lock held */
+static void Preempt(LED_ENGINE* engine)
+{
+	if (engine->playing)
+	{
+		engine->playing = 0;
+		engine->stats.preempted++;
+	}
+}
+
+void LedEngine_Set(LED_ENGINE_HANDLE engine, int level)
+{
+	pthread_mutex_lock(&engine->lock);
+	Preempt(engine);
+	engine->steadyLevel = level;
+	Drive(engine, level);
+	pthread_cond_signal(&engine->changed);
+	pthread_mutex_unlock(&engine->lock);
+}
+
+int LedEngine_Play(LED_ENGINE_HANDLE engine, const LED_STEP* steps, size_t stepCount, unsigned int repeat)
+{
+	if (stepCount == 0 || stepCount > LED_PATTERN_MAX_STEPS)
+	{
+		return 1;
+	}
+
+	pthread_mutex_lock(&engine->lock);
+	Preempt(engine);
+	memcpy(engine->steps, steps, stepCount * sizeof(LED_STEP));
+	engine->stepCount = stepCount;
+	engine->step = 0;
+	engine->repeat = repeat;
+	engine->playing = 1;
+	engine->stats.patterns++;
+
+	/* The first step starts on the caller's thread; the engine thread times the rest */
+	Drive(engine, steps[0].level);
+	clock_gettime(CLOCK_MONOTONIC, &engine->deadline);
+	AddMs(&engine->deadline, steps[0].durationMs);
+	pthread_cond_signal(&engine->changed);
+	pthread_mutex_unlock(&engine->lock);
+	return 0;
+}
+
+int LedEngine_Blink(LED_ENGINE_HANDLE engine, unsigned int count, unsigned int onMs, unsigned int offMs)
+{
+	LED_STEP steps[2] = { { 1, onMs }, { 0, offMs } };
+	if (count == 0)
+	{
+		return 1;
+	}
+	return LedEngine_Play(engine, steps, 2, count);
+}
+
+int LedEngine_Heartbeat(LED_ENGINE_HANDLE engine)
+{
+	LED_STEP steps[4] = {
+		{ 1, HEARTBEAT_PULSE_MS },
+		{ 0, HEARTBEAT_PULSE_MS },
+		{ 1, HEARTBEAT_PULSE_MS },
+		{ 0, HEARTBEAT_PERIOD_MS - 3 * HEARTBEAT_PULSE_MS }
+	};
+	return LedEngine_Play(engine, steps, 4, LED_REPEAT_FOREVER);
+}
+
+int LedEngine_DutyCycle(LED_ENGINE_HANDLE engine, unsigned int periodMs, unsigned int dutyPercent)
+{
+	LED_STEP steps[2];
+	if (periodMs == 0 || dutyPercent > 100)
+	{
+		return 1;
+	}
+	steps[0].level = dutyPercent > 0;
+	steps[0].durationMs = periodMs * dutyPercent / 100;
+	steps[1].level = 0;
+	steps[1].durationMs = periodMs - steps[0].durationMs;
+	if (dutyPercent == 0 || dutyPercent == 100)
+	{
+		/* A zero length step would glitch the pin once a period */
+		steps[0].durationMs = periodMs;
+		return LedEngine_Play(engine, steps, 1, LED_REPEAT_FOREVER);
+	}
+	return LedEngine_Play(engine, steps, 2, LED_REPEAT_FOREVER);
+}
+
+void LedEngine_Stop(LED_ENGINE_HANDLE engine)
+{
+	pthread_mutex_lock(&engine->lock);
+	Preempt(engine);
+	Drive(engine, engine->steadyLevel);
+	pthread_cond_signal(&engine->changed);
+	pthread_mutex_unlock(&engine->lock);
+}
+
+void LedEngine_GetStats(LED_ENGINE_HANDLE engine, LED_ENGINE_STATS* stats)
+{
+	pthread_mutex_lock(&engine->lock);
+	*stats = engine->stats;
+	pthread_mutex_unlock(&engine->lock);
+}
@@ -0,0 +1,72 @@
+// Copyright (c) Microsoft. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+#ifndef LED_ENGINE_H
+#define LED_ENGINE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Plays on/off patterns on one LED from a single timer thread, so callers
+   never sleep between writes. The pin level is cached and only written
+   when it changes. Starting a pattern or setting a steady level preempts
+   whatever is playing; when a finite pattern ends the LED goes back to
+   the last steady level. Every call is safe from any thread. */
+
+typedef struct LED_ENGINE_TAG* LED_ENGINE_HANDLE;
+
+/* Drives the pin; called with the engine's lock held, so keep it short */
+typedef void(*LED_WRITE)(void* context, int level);
+
+#define LED_PATTERN_MAX_STEPS 8
+#define LED_REPEAT_FOREVER 0
+
+typedef struct LED_STEP_TAG
+{
+	int level;
+	unsigned int durationMs;
+} LED_STEP;
+
+typedef struct LED_ENGINE_STATS_TAG
+{
+	uint64_t writes;            /* level changes written to the pin */
+	uint64_t unchanged;         /* writes skipped because the pin already had the level */
+	uint64_t patterns;          /* patterns started */
+	uint64_t preempted;         /* patterns cut short by a newer command */
+	uint64_t lateUs;            /* worst lateness of a step, in microseconds */
+} LED_ENGINE_STATS;
+
+/* Writes level 0 straight away so the cache matches the pin */
+LED_ENGINE_HANDLE LedEngine_Create(LED_WRITE write, void* context);
+void LedEngine_Destroy(LED_ENGINE_HANDLE engine);
+
+/* Stops any pattern and holds the LED at level */
+void LedEngine_Set(LED_ENGINE_HANDLE engine, int level);
+
+/* Plays the steps repeat times, or until preempted with LED_REPEAT_FOREVER.
+   Returns non-zero when there are no steps or too many. */
+int LedEngine_Play(LED_ENGINE_HANDLE engine, const LED_STEP* steps, size_t stepCount, unsigned int repeat);
+
+/* count on/off cycles */
+int LedEngine_Blink(LED_ENGINE_HANDLE engine, unsigned int count, unsigned int onMs, unsigned int offMs);
+
+/* Two short pulses a second until preempted */
+int LedEngine_Heartbeat(LED_ENGINE_HANDLE engine);
+
+/* On for dutyPercent of every period until preempted */
+int LedEngine_DutyCycle(LED_ENGINE_HANDLE engine, unsigned int periodMs, unsigned int dutyPercent);
+
+/* Ends the running pattern and goes back to the steady level */
+void LedEngine_Stop(LED_ENGINE_HANDLE engine);
+
+void LedEngine_GetStats(LED_ENGINE_HANDLE engine, LED_ENGINE_STATS* stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* LED_ENGINE_H */
@@ -0,0 +1,162 @@
+// Copyright (c) Microsoft. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "message_pool.h"
+
+typedef struct MESSAGE_POOL_TAG
+{
+	pthread_mutex_t lock;
+	MESSAGE_BUFFER* buffers;
+	unsigned char* storage;
+	MESSAGE_BUFFER** freeList;
+	size_t freeCount;
+	MESSAGE_POOL_STATS stats;
+} MESSAGE_POOL;
+
+MESSAGE_POOL_HANDLE MessagePool_Create(size_t bufferCount, size_t bufferSize)
+{
+	MESSAGE_POOL* pool = calloc(1, sizeof(MESSAGE_POOL));
+	if (pool != NULL)
+	{
+		pool->buffers = calloc(bufferCount, sizeof(MESSAGE_BUFFER));
+		pool->freeList = calloc(bufferCount, sizeof(MESSAGE_BUFFER*));
+		/* One extra byte per buffer so text payloads can always be NUL terminated */
+		pool->storage = malloc(bufferCount * (bufferSize + 1));
+		if (pool->buffers == NULL || pool->freeList == NULL || pool->storage == NULL ||
+			pthread_mutex_init(&pool->lock, NULL) != 0)
+		{
+			free(pool->buffers);
+			free(pool->freeList);
+			free(pool->storage);
+			free(pool);
+			pool = NULL;
+		}
+		else
+		{
+			for (size_t i = 0; i < bufferCount; i++)
+			{
+				pool->buffers[i].data = pool->storage + i * (bufferSize + 1);
+				pool->buffers[i].capacity = bufferSize;
+				pool->buffers[i].pool = pool;
+				pool->freeList[i] = &pool->buffers[i];
+			}
+			pool->freeCount = bufferCount;
+			pool->stats.bufferCount = bufferCount;
+			pool->stats.bufferSize = bufferSize;
+		}
+	}
+	return pool;
+}
+
+void MessagePool_Destroy(MESSAGE_POOL_HANDLE pool)
+{
+	if (pool != NULL)
+	{
+		pthread_mutex_destroy(&pool->lock);
+		free(pool->buffers);
+		free(pool->freeList);
+		free(pool->storage);
+		free(pool);
+	}
+}
+
+MESSAGE_BUFFER* MessagePool_Acquire(MESSAGE_POOL_HANDLE pool)
+{
+	MESSAGE_BUFFER* buffer = NULL;
+
+	pthread_mutex_lock(&pool->lock);
+	if (pool->freeCount == 0)
+	{
+		pool->stats.exhausted++;
+	}
+	else
+	{
+		buffer = pool->freeList[--pool->freeCount];
+		pool->stats.acquired++;
+		pool->stats.inUse++;
+		if (pool->stats.inUse > pool->stats.highWatermark)
+		{
+			pool->stats.highWatermark = pool->stats.inUse;
+		}
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	if (buffer != NULL)
+	{
+		buffer->length = 0;
+		buffer->overflow = 0;
+		buffer->data[0] = '\0';
+	}
+	return buffer;
+}
+
+void MessagePool_Release(MESSAGE_BUFFER* buffer)
+{
+	if (buffer != NULL)
+	{
+		MESSAGE_POOL* pool = buffer->pool;
+		pthread_mutex_lock(&pool->lock);
+		if (buffer->overflow)
+		{
+			pool->stats.overflows++;
+		}
+		pool->freeList[pool->freeCount++] = buffer;
+		pool->stats.inUse--;
+		pthread_mutex_unlock(&pool->lock);
+	}
+}
+
+void MessagePool_GetStats(MESSAGE_POOL_HANDLE pool, MESSAGE_POOL_STATS* stats)
+{
+	pthread_mutex_lock(&pool->lock);
+	*stats = pool->stats;
+	pthread_mutex_unlock(&pool->lock);
+}
+
+int MessageBuffer_Printf(MESSAGE_BUFFER* buffer, const char* format, ...)
+{
+	int result;
+	size_t available = buffer->capacity - buffer->length;
+	va_list args;
+
+	va_start(args, format);
+	/* The spare byte past capacity holds the terminator */
+	result = vsnprintf((char*)buffer->data + buffer->length, available + 1, format, args);
+	va_end(args);
+
+	if (result < 0 || (size_t)result > available)
+	{
+		buffer->data[buffer->length] = '\0';
+		buffer->overflow = 1;
+		result = 1;
+	}
+	else
+	{
+		buffer->length += (size_t)result;
+		result = 0;
+	}
+	return result;
+}
+
+unsigned char* MessageBuffer_Tail(MESSAGE_BUFFER* buffer, size_t* available)
+{
+	*available = buffer->capacity - buffer->length;
+	return buffer->data + buffer->length;
+}
+
+void MessageBuffer_Commit(MESSAGE_BUFFER* buffer, size_t written)
+{
+	if (written > buffer->capacity - buffer->length)
+	{
+		buffer->overflow = 1;
+	}
+	else
+	{
+		buffer->length += written;
+	}
+}
@@ -0,0 +1,62 @@
+// Copyright (c) Microsoft. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+#ifndef MESSAGE_POOL_H
+#define MESSAGE_POOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct MESSAGE_POOL_TAG* MESSAGE_POOL_HANDLE;
+
+/* One preallocated message payload. Writes are bounded by capacity; a write
+   that does not fit sets overflow and leaves the buffer otherwise unchanged. */
+typedef struct MESSAGE_BUFFER_TAG
+{
+	unsigned char* data;
+	size_t capacity;
+	size_t length;
+	int overflow;
+	MESSAGE_POOL_HANDLE pool;
+} MESSAGE_BUFFER;
+
+typedef struct MESSAGE_POOL_STATS_TAG
+{
+	size_t bufferCount;
+	size_t bufferSize;
+	size_t inUse;
+	size_t highWatermark;   /* most buffers out at once */
+	uint64_t acquired;
+	uint64_t exhausted;     /* acquires that found every buffer in use */
+	uint64_t overflows;     /* buffers released after a write did not fit */
+} MESSAGE_POOL_STATS;
+
+/* Allocates bufferCount buffers of bufferSize bytes up front; nothing is
+   allocated afterwards. */
+MESSAGE_POOL_HANDLE MessagePool_Create(size_t bufferCount, size_t bufferSize);
+void MessagePool_Destroy(MESSAGE_POOL_HANDLE pool);
+
+/* Returns an empty buffer, or NULL when all of them are in use. Thread safe. */
+MESSAGE_BUFFER* MessagePool_Acquire(MESSAGE_POOL_HANDLE pool);
+void MessagePool_Release(MESSAGE_BUFFER* buffer);
+
+void MessagePool_GetStats(MESSAGE_POOL_HANDLE pool, MESSAGE_POOL_STATS* stats);
+
+/* Appends formatted text, keeping the buffer NUL terminated. Returns 0, or
+   non-zero when the text did not fit. */
+int MessageBuffer_Printf(MESSAGE_BUFFER* buffer, const char* format, ...);
+
+/* The unused tail of the buffer for encoders that write in place; commit
+   what was written with MessageBuffer_Commit. */
+unsigned char* MessageBuffer_Tail(MESSAGE_BUFFER* buffer, size_t* available);
+void MessageBuffer_Commit(MESSAGE_BUFFER* buffer, size_t written);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* MESSAGE_POOL_H */
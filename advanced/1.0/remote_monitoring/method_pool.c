@@ -0,0 +1,337 @@
+// Copyright (c) Microsoft. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "method_pool.h"
+
+typedef enum JOB_STATE_TAG
+{
+	JOB_FREE,
+	JOB_QUEUED,
+	JOB_RUNNING,
+	JOB_DONE
+} JOB_STATE;
+
+typedef struct METHOD_SLOT_TAG
+{
+	JOB_STATE state;
+	int waited;                 /* the submitter is still waiting and frees the slot */
+	int result;
+	uint64_t sequence;
+	uint64_t queuedUs;
+	METHOD_JOB job;
+	void* argument;
+	METHOD_STATS* stats;
+} METHOD_SLOT;
+
+typedef struct METHOD_POOL_TAG
+{
+	pthread_mutex_t lock;
+	pthread_cond_t queued;      /* signalled when a job is queued or the pool stops */
+	pthread_cond_t finished;    /* signalled when a job finishes */
+	int stopping;
+	uint64_t nextSequence;
+	size_t queueLength;
+	METHOD_SLOT* slots;
+	size_t workerCount;
+	pthread_t* workers;
+	size_t methodCount;
+	METHOD_STATS methods[METHOD_POOL_MAX_METHODS];
+} METHOD_POOL;
+
+static uint64_t MonotonicUs(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000 + (uint64_t)now.tv_nsec / 1000;
+}
+
+static void DeadlineAfter(struct timespec* deadline, unsigned int ms)
+{
+	clock_gettime(CLOCK_MONOTONIC, deadline);
+	deadline->tv_sec += ms / 1000;
+	deadline->tv_nsec += (long)(ms % 1000) * 1000000;
+	if (deadline->tv_nsec >= 1000000000)
+	{
+		deadline->tv_sec++;
+		deadline->tv_nsec -= 1000000000;
+	}
+}
+
+/* Called with the lock held; NULL once the table is full */
+static METHOD_STATS* FindMethod(METHOD_POOL* pool, const char* name)
+{
+	for (size_t i = 0; i < pool->methodCount; i++)
+	{
+		if (strcmp(pool->methods[i].name, name) == 0)
+		{
+			return &pool->methods[i];
+		}
+	}
+	if (pool->methodCount == METHOD_POOL_MAX_METHODS)
+	{
+		return NULL;
+	}
+
+	METHOD_STATS* stats = &pool->methods[pool->methodCount++];
+	stats->name = name;
+	LatencyHistogram_Reset(&stats->queueTime);
+	LatencyHistogram_Reset(&stats->runTime);
+	return stats;
+}
+
+/* Called with the lock held; the oldest queued job or NULL */
+static METHOD_SLOT* OldestQueued(METHOD_POOL* pool)
+{
+	METHOD_SLOT* oldest = NULL;
+	for (size_t i = 0; i < pool->queueLength; i++)
+	{
+		if (pool->slots[i].state == JOB_QUEUED && (oldest == NULL || pool->slots[i].sequence < oldest->sequence))
+		{
+			oldest = &pool->slots[i];
+		}
+	}
+	return oldest;
+}
+
+static void* WorkerThread(void* context)
+{
+	METHOD_POOL* pool = context;
+	METHOD_SLOT* slot;
+
+	pthread_mutex_lock(&pool->lock);
+	while (!pool->stopping)
+	{
+		slot = OldestQueued(pool);
+		if (slot == NULL)
+		{
+			pthread_cond_wait(&pool->queued, &pool->lock);
+			continue;
+		}
+
+		uint64_t startUs = MonotonicUs();
+		slot->state = JOB_RUNNING;
+		LatencyHistogram_Add(&slot->stats->queueTime, startUs - slot->queuedUs);
+		pthread_mutex_unlock(&pool->lock);
+
+		int result = slot->job(slot->argument);
+		free(slot->argument);
+		uint64_t endUs = MonotonicUs();
+
+		pthread_mutex_lock(&pool->lock);
+		LatencyHistogram_Add(&slot->stats->runTime, endUs - startUs);
+		if (result == 0)
+		{
+			slot->stats->succeeded++;
+		}
+		else
+		{
+			slot->stats->failed++;
+		}
+		slot->result = result;
+		slot->state = slot->waited ? JOB_DONE : JOB_FREE;
+		pthread_cond_broadcast(&pool->finished);
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return NULL;
+}
+
+METHOD_POOL_HANDLE MethodPool_Create(size_t workers, size_t queueLength)
+{
+	METHOD_POOL* pool = calloc(1, sizeof(METHOD_POOL));
+	pthread_condattr_t attributes;
+
+	if (pool == NULL)
+	{
+		return NULL;
+	}
+	pool->slots = calloc(queueLength, sizeof(METHOD_SLOT));
+	pool->workers = calloc(workers, sizeof(pthread_t));
+	if (pool->slots == NULL || pool->workers == NULL)
+	{
+		free(pool->slots);
+		free(pool->workers);
+		free(pool);
+		return NULL;
+	}
+
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->queued, NULL);
+	/* Submitters wait on the monotonic clock so a wall clock step cannot stretch them */
+	pthread_condattr_init(&attributes);
+	pthread_condattr_setclock(&attributes, CLOCK_MONOTONIC);
+	pthread_cond_init(&pool->finished, &attributes);
+	pthread_condattr_destroy(&attributes);
+	pool->queueLength = queueLength;
+
+	for (size_t i = 0; i < workers; i++)
+	{
+		if (pthread_create(&pool->workers[i], NULL, &WorkerThread, pool) != 0)
+		{
+			printf("Failed to start method worker %zu\r\n", i);
+			break;
+		}
+		pool->workerCount++;
+	}
+	if (pool->workerCount == 0)
+	{
+		MethodPool_Destroy(pool);
+		pool = NULL;
+	}
+	return pool;
+}
+
+void MethodPool_Stop(METHOD_POOL_HANDLE pool)
+{
+	pthread_mutex_lock(&pool->lock);
+	pool->stopping = 1;
+	pthread_cond_broadcast(&pool->queued);
+	pthread_mutex_unlock(&pool->lock);
+	for (size_t i = 0; i < pool->workerCount; i++)
+	{
+		pthread_join(pool->workers[i], NULL);
+	}
+	pool->workerCount = 0;
+
+	for (size_t i = 0; i < pool->queueLength; i++)
+	{
+		if (pool->slots[i].state == JOB_QUEUED)
+		{
+			pool->slots[i].stats->discarded++;
+			free(pool->slots[i].argument);
+			pool->slots[i].state = JOB_FREE;
+		}
+	}
+}
+
+void MethodPool_Destroy(METHOD_POOL_HANDLE pool)
+{
+	if (pool != NULL)
+	{
+		MethodPool_Stop(pool);
+		pthread_cond_destroy(&pool->finished);
+		pthread_cond_destroy(&pool->queued);
+		pthread_mutex_destroy(&pool->lock);
+		free(pool->workers);
+		free(pool->slots);
+		free(pool);
+	}
+}
+
+METHOD_POOL_RESULT MethodPool_Submit(METHOD_POOL_HANDLE pool, const char* name, METHOD_JOB job, void* argument,
+	unsigned int waitMs)
+{
+	METHOD_POOL_RESULT result = METHOD_POOL_ACCEPTED;
+	METHOD_SLOT* slot = NULL;
+	METHOD_STATS* stats;
+	struct timespec deadline;
+	int timedOut = 0;
+
+	pthread_mutex_lock(&pool->lock);
+	stats = FindMethod(pool, name);
+	if (stats == NULL)
+	{
+		/* Lump the overflow into the last entry rather than lose the job */
+		stats = &pool->methods[METHOD_POOL_MAX_METHODS - 1];
+	}
+	stats->submitted++;
+
+	for (size_t i = 0; i < pool->queueLength && !pool->stopping; i++)
+	{
+		if (pool->slots[i].state == JOB_FREE)
+		{
+			slot = &pool->slots[i];
+			break;
+		}
+	}
+	if (slot == NULL)
+	{
+		stats->rejected++;
+		pthread_mutex_unlock(&pool->lock);
+		free(argument);
+		return METHOD_POOL_BUSY;
+	}
+
+	slot->state = JOB_QUEUED;
+	slot->waited = waitMs > 0;
+	slot->sequence = pool->nextSequence++;
+	slot->queuedUs = MonotonicUs();
+	slot->job = job;
+	slot->argument = argument;
+	slot->stats = stats;
+	pthread_cond_signal(&pool->queued);
+
+	if (waitMs > 0)
+	{
+		DeadlineAfter(&deadline, waitMs);
+		while (slot->state != JOB_DONE && !timedOut)
+		{
+			timedOut = pthread_cond_timedwait(&pool->finished, &pool->lock, &deadline) == ETIMEDOUT;
+		}
+		if (slot->state == JOB_DONE)
+		{
+			result = slot->result == 0 ? METHOD_POOL_SUCCEEDED : METHOD_POOL_FAILED;
+			slot->state = JOB_FREE;
+		}
+		else
+		{
+			/* Leave the slot to the worker */
+			slot->waited = 0;
+		}
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return result;
+}
+
+size_t MethodPool_GetStats(METHOD_POOL_HANDLE pool, METHOD_STATS* stats, size_t count)
+{
+	size_t methodCount;
+
+	pthread_mutex_lock(&pool->lock);
+	methodCount = pool->methodCount;
+	for (size_t i = 0; i < methodCount && i < count; i++)
+	{
+		stats[i] = pool->methods[i];
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return methodCount;
+}
+
+int MethodPool_Format(METHOD_POOL_HANDLE pool, char* buffer, size_t size)
+{
+	METHOD_STATS stats[METHOD_POOL_MAX_METHODS];
+	size_t count = MethodPool_GetStats(pool, stats, METHOD_POOL_MAX_METHODS);
+	size_t used = 0;
+
+	if (size > 0)
+	{
+		buffer[0] = '\0';
+	}
+	for (size_t i = 0; i < count; i++)
+	{
+		int written = snprintf(buffer + used, size - used,
+			"method %s: submitted %llu, succeeded %llu, failed %llu, rejected %llu, discarded %llu\n"
+			"method %s: queue p50 %llu us, p99 %llu us, max %llu us; run p50 %llu us, p99 %llu us, max %llu us\n",
+			stats[i].name, (unsigned long long)stats[i].submitted, (unsigned long long)stats[i].succeeded,
+			(unsigned long long)stats[i].failed, (unsigned long long)stats[i].rejected,
+			(unsigned long long)stats[i].discarded, stats[i].name,
+			(unsigned long long)LatencyHistogram_Percentile(&stats[i].queueTime, 0.5),
+			(unsigned long long)LatencyHistogram_Percentile(&stats[i].queueTime, 0.99),
+			(unsigned long long)stats[i].queueTime.maxUs,
+			(unsigned long long)LatencyHistogram_Percentile(&stats[i].runTime, 0.5),
+			(unsigned long long)LatencyHistogram_Percentile(&stats[i].runTime, 0.99),
+			(unsigned long long)stats[i].runTime.maxUs);
+		if (written < 0 || (size_t)written >= size - used)
+		{
+			return 1;
+		}
+		used += (size_t)written;
+	}
+	return 0;
+}
@@ -0,0 +1,73 @@
+// Copyright (c) Microsoft. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+#ifndef METHOD_POOL_H
+#define METHOD_POOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "latency_histogram.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Runs direct methods on a few worker threads so the SDK's callback thread
+   only queues them. The caller may wait a little for the result, which lets
+   quick methods answer with their outcome and slow ones answer "accepted"
+   and finish later. Queueing and run times are kept per method name. */
+
+typedef struct METHOD_POOL_TAG* METHOD_POOL_HANDLE;
+
+/* Returns 0 on success; runs on a worker thread */
+typedef int(*METHOD_JOB)(void* argument);
+
+#define METHOD_POOL_MAX_METHODS 8
+
+typedef enum METHOD_POOL_RESULT_TAG
+{
+	METHOD_POOL_SUCCEEDED,      /* the job ran within waitMs and returned 0 */
+	METHOD_POOL_FAILED,         /* the job ran within waitMs and returned non-zero */
+	METHOD_POOL_ACCEPTED,       /* the job is queued or running and finishes later */
+	METHOD_POOL_BUSY            /* the queue is full or the pool is stopping */
+} METHOD_POOL_RESULT;
+
+typedef struct METHOD_STATS_TAG
+{
+	const char* name;
+	uint64_t submitted;
+	uint64_t succeeded;
+	uint64_t failed;
+	uint64_t rejected;          /* submits turned away as busy */
+	uint64_t discarded;         /* queued jobs dropped on stop */
+	LATENCY_HISTOGRAM queueTime;    /* submit to start on a worker */
+	LATENCY_HISTOGRAM runTime;      /* start to finish */
+} METHOD_STATS;
+
+METHOD_POOL_HANDLE MethodPool_Create(size_t workers, size_t queueLength);
+
+/* Lets the running jobs finish, discards the queued ones and joins the
+   workers; later submits are turned away as busy */
+void MethodPool_Stop(METHOD_POOL_HANDLE pool);
+
+/* Stops the pool if needed and frees it */
+void MethodPool_Destroy(METHOD_POOL_HANDLE pool);
+
+/* Queues job(argument) and waits up to waitMs for it to finish. argument
+   must come from malloc or be NULL; the pool frees it once the job returns
+   or is discarded. name must outlive the pool. */
+METHOD_POOL_RESULT MethodPool_Submit(METHOD_POOL_HANDLE pool, const char* name, METHOD_JOB job, void* argument,
+	unsigned int waitMs);
+
+/* Copies the statistics of up to count methods; returns how many there are */
+size_t MethodPool_GetStats(METHOD_POOL_HANDLE pool, METHOD_STATS* stats, size_t count);
+
+/* Writes two lines per method. Returns 0 on success, non-zero when it does not fit. */
+int MethodPool_Format(METHOD_POOL_HANDLE pool, char* buffer, size_t size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* METHOD_POOL_H */
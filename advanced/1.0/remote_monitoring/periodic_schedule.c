@@ -0,0 +1,94 @@
+// Copyright (c) Microsoft. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+
+#include "periodic_schedule.h"
+
+#define NS_PER_MS 1000000ull
+#define NS_PER_S 1000000000ull
+
+static uint64_t ClockNs(clockid_t clock)
+{
+	struct timespec now;
+	clock_gettime(clock, &now);
+	return (uint64_t)now.tv_sec * NS_PER_S + (uint64_t)now.tv_nsec;
+}
+
+/* First monotonic instant at or after now that falls on the wall clock grid */
+static uint64_t AlignedDeadline(uint64_t periodNs, uint64_t phaseNs)
+{
+	uint64_t wallNs = ClockNs(CLOCK_REALTIME);
+	uint64_t monotonicNs = ClockNs(CLOCK_MONOTONIC);
+	uint64_t offset = (periodNs + phaseNs % periodNs - wallNs % periodNs) % periodNs;
+	return monotonicNs + (offset == 0 ? periodNs : offset);
+}
+
+uint64_t PeriodicSchedule_Now(void)
+{
+	return ClockNs(CLOCK_MONOTONIC);
+}
+
+void PeriodicSchedule_Init(PERIODIC_SCHEDULE* schedule, uint32_t periodMs, uint32_t phaseMs,
+	SCHEDULE_CATCH_UP catchUp, uint32_t maxBurst)
+{
+	memset(schedule, 0, sizeof(*schedule));
+	schedule->periodNs = (uint64_t)(periodMs > 0 ? periodMs : 1) * NS_PER_MS;
+	schedule->phaseNs = (uint64_t)phaseMs * NS_PER_MS;
+	schedule->catchUp = catchUp;
+	schedule->maxBurst = maxBurst;
+	schedule->nextNs = AlignedDeadline(schedule->periodNs, schedule->phaseNs);
+	LatencyHistogram_Reset(&schedule->jitter);
+}
+
+void PeriodicSchedule_SetPeriod(PERIODIC_SCHEDULE* schedule, uint32_t periodMs)
+{
+	schedule->periodNs = (uint64_t)(periodMs > 0 ? periodMs : 1) * NS_PER_MS;
+	schedule->nextNs = AlignedDeadline(schedule->periodNs, schedule->phaseNs);
+}
+
+uint32_t PeriodicSchedule_Poll(PERIODIC_SCHEDULE* schedule, uint64_t nowNs)
+{
+	uint64_t lateNs, missed, extra = 0;
+
+	if (nowNs < schedule->nextNs)
+	{
+		return 0;
+	}
+
+	lateNs = nowNs - schedule->nextNs;
+	LatencyHistogram_Add(&schedule->jitter, lateNs / 1000);
+	schedule->ticks++;
+
+	/* Every whole period of lateness is a deadline that came and went */
+	missed = lateNs / schedule->periodNs;
+	if (missed > 0)
+	{
+		schedule->missed += missed;
+		if (schedule->catchUp == SCHEDULE_CATCH_UP_BURST)
+		{
+			extra = missed < schedule->maxBurst ? missed : schedule->maxBurst;
+		}
+		schedule->burst += extra;
+		schedule->skipped += missed - extra;
+	}
+	schedule->nextNs += (missed + 1) * schedule->periodNs;
+	return (uint32_t)(1 + extra);
+}
+
+uint32_t PeriodicSchedule_Wait(PERIODIC_SCHEDULE* schedule)
+{
+	struct timespec deadline;
+	int result;
+
+	deadline.tv_sec = (time_t)(schedule->nextNs / NS_PER_S);
+	deadline.tv_nsec = (long)(schedule->nextNs % NS_PER_S);
+	result = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL);
+	if (result == EINTR)
+	{
+		return 0;
+	}
+	return PeriodicSchedule_Poll(schedule, ClockNs(CLOCK_MONOTONIC));
+}
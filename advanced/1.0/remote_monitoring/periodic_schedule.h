@@ -0,0 +1,62 @@
+// Copyright (c) Microsoft. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+#ifndef PERIODIC_SCHEDULE_H
+#define PERIODIC_SCHEDULE_H
+
+#include <stdint.h>
+
+#include "latency_histogram.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Fixed-rate schedule on absolute CLOCK_MONOTONIC deadlines. Deadline n is
+   first + n * period, so time spent in the work never stretches the period.
+   The first deadline is aligned to a multiple of the period on the wall
+   clock, plus a phase, so devices with synchronised clocks and the same
+   period sample at the same instants. */
+
+typedef enum SCHEDULE_CATCH_UP_TAG
+{
+	SCHEDULE_CATCH_UP_SKIP,     /* missed deadlines are dropped, the next run is on the grid */
+	SCHEDULE_CATCH_UP_BURST     /* missed deadlines are run back to back, up to maxBurst extra runs */
+} SCHEDULE_CATCH_UP;
+
+typedef struct PERIODIC_SCHEDULE_TAG
+{
+	uint64_t periodNs;
+	uint64_t phaseNs;
+	uint64_t nextNs;            /* next deadline, CLOCK_MONOTONIC */
+	SCHEDULE_CATCH_UP catchUp;
+	uint32_t maxBurst;
+
+	uint64_t ticks;             /* deadlines serviced */
+	uint64_t missed;            /* deadlines that passed entirely before being serviced */
+	uint64_t skipped;           /* missed deadlines dropped */
+	uint64_t burst;             /* missed deadlines made up */
+	LATENCY_HISTOGRAM jitter;   /* how late each deadline was serviced */
+} PERIODIC_SCHEDULE;
+
+uint64_t PeriodicSchedule_Now(void);
+
+void PeriodicSchedule_Init(PERIODIC_SCHEDULE* schedule, uint32_t periodMs, uint32_t phaseMs,
+	SCHEDULE_CATCH_UP catchUp, uint32_t maxBurst);
+
+/* Moves to a new period from the next aligned deadline; counters are kept */
+void PeriodicSchedule_SetPeriod(PERIODIC_SCHEDULE* schedule, uint32_t periodMs);
+
+/* Services the deadlines passed by nowNs and returns how many times the
+   work should run now: 0 before the deadline, otherwise 1 plus any burst */
+uint32_t PeriodicSchedule_Poll(PERIODIC_SCHEDULE* schedule, uint64_t nowNs);
+
+/* Sleeps until the next deadline and polls. Returns 0 when a signal
+   interrupted the sleep, so the caller can check for a stop request. */
+uint32_t PeriodicSchedule_Wait(PERIODIC_SCHEDULE* schedule);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* PERIODIC_SCHEDULE_H */
@@ -0,0 +1,178 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// bme280_compensation_bench.c:
+// Times the integer and the double compensation paths on the same raw
+// samples and prints the largest difference between them. The samples are
+// every raw value that the emulator's calibration maps into -40~85 DegC,
+// 300~1100 hPa and 0~100 %RH, thinned to a fixed count.
+// Build with the build_benchmarks CMake option and run on the target board.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "bme280.h"
+
+#define NUM_SAMPLES (4096)
+#define NUM_ROUNDS (200)
+
+// The emulator's calibration.
+static const bme280_calib_data_t Calib =
+{
+  27504, 26435, -1000, 36477, -10685, 3024, 2855, 140, -7, 15500, -14600, 6000,
+  75, 362, 0, 313, 50, 30
+};
+
+static int32_t Adc_T__i32a[NUM_SAMPLES];
+static int32_t Adc_P__i32a[NUM_SAMPLES];
+static int32_t Adc_H__i32a[NUM_SAMPLES];
+
+// Keeps the compensated values live so the loops are not optimised away.
+static volatile double Sink__d;
+
+///////////////////////////////////////////////////////////////////////////////
+static double now_ns(void)
+{
+  struct timespec Now;
+
+  clock_gettime(CLOCK_MONOTONIC, &Now);
+  return (double)Now.tv_sec * 1e9 + (double)Now.tv_nsec;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Spreads NUM_SAMPLES raw values evenly over the part of Range__i32 that
+// In_range__fp accepts.
+static void fill_adc(int32_t * Adc__i32p, int32_t Range__i32,
+  int (*In_range__fp)(int32_t Adc__i32))
+{
+  int32_t First__i32 = 0;
+  int32_t Last__i32 = Range__i32 - 1;
+  size_t Idx__z;
+
+  while (First__i32 < Last__i32 && !In_range__fp(First__i32))
+  {
+    First__i32++;
+  }
+  while (Last__i32 > First__i32 && !In_range__fp(Last__i32))
+  {
+    Last__i32--;
+  }
+  for (Idx__z = 0; Idx__z < NUM_SAMPLES; Idx__z++)
+  {
+    Adc__i32p[Idx__z] = First__i32 + (int32_t)((int64_t)(Last__i32 - First__i32)
+      * (int64_t)Idx__z / (NUM_SAMPLES - 1));
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+static int t_in_range(int32_t Adc__i32)
+{
+  int32_t T_fine__i32;
+  int32_t Temp__i32 = bme280_compensate_T_int32(&Calib, Adc__i32, &T_fine__i32);
+
+  return Temp__i32 >= -4000 && Temp__i32 <= 8500;
+}
+
+// Pressure falls as the raw value rises, so the bounds are at 25 DegC.
+static int p_in_range(int32_t Adc__i32)
+{
+  uint32_t Pres__u32 = bme280_compensate_P_int64(&Calib, Adc__i32, 128000);
+
+  return Pres__u32 >= 30000 * 256 && Pres__u32 <= 110000 * 256;
+}
+
+static int h_in_range(int32_t Adc__i32)
+{
+  uint32_t Hum__u32 = bme280_compensate_H_int32(&Calib, Adc__i32, 128000);
+
+  return Hum__u32 > 0 && Hum__u32 < 100 * 1024;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+int main(void)
+{
+  bme280_coeffs_t Coeffs;
+  double Max_T_err__d = 0.0;
+  double Max_P_err__d = 0.0;
+  double Max_H_err__d = 0.0;
+  double Start__d;
+  double Int_ns__d;
+  double Double_ns__d;
+  size_t Round__z;
+  size_t Idx__z;
+
+  bme280_derive_coeffs(&Calib, &Coeffs);
+  fill_adc(Adc_T__i32a, 1 << 20, t_in_range);
+  fill_adc(Adc_P__i32a, 1 << 20, p_in_range);
+  fill_adc(Adc_H__i32a, 1 << 16, h_in_range);
+
+  // Every raw temperature against every raw pressure and humidity would be
+  // NUM_SAMPLES squared, so sample i pairs the i-th value of each.
+  for (Idx__z = 0; Idx__z < NUM_SAMPLES; Idx__z++)
+  {
+    int32_t T_fine__i32;
+    double T_fine__d;
+    double Err__d;
+    int32_t Temp__i32 = bme280_compensate_T_int32(&Calib, Adc_T__i32a[Idx__z],
+      &T_fine__i32);
+    double Temp__d = bme280_compensate_T_double(&Coeffs, Adc_T__i32a[Idx__z],
+      &T_fine__d);
+
+    Err__d = fabs(Temp__d - Temp__i32 / 100.0);
+    Max_T_err__d = Err__d > Max_T_err__d ? Err__d : Max_T_err__d;
+    Err__d = fabs(bme280_compensate_P_double(&Coeffs, Adc_P__i32a[Idx__z],
+      T_fine__d) - bme280_compensate_P_int64(&Calib, Adc_P__i32a[Idx__z],
+      T_fine__i32) / 256.0);
+    Max_P_err__d = Err__d > Max_P_err__d ? Err__d : Max_P_err__d;
+    Err__d = fabs(bme280_compensate_H_double(&Coeffs, Adc_H__i32a[Idx__z],
+      T_fine__d) - bme280_compensate_H_int32(&Calib, Adc_H__i32a[Idx__z],
+      T_fine__i32) / 1024.0);
+    Max_H_err__d = Err__d > Max_H_err__d ? Err__d : Max_H_err__d;
+  }
+
+  // The conversions to DegC, Pa and %RH that bme280_dev_read_sensors() does on
+  // the integer results are included, so both sides produce the same units.
+  Start__d = now_ns();
+  for (Round__z = 0; Round__z < NUM_ROUNDS; Round__z++)
+  {
+    double Sum__d = 0.0;
+    for (Idx__z = 0; Idx__z < NUM_SAMPLES; Idx__z++)
+    {
+      int32_t T_fine__i32;
+      Sum__d += bme280_compensate_T_int32(&Calib, Adc_T__i32a[Idx__z],
+        &T_fine__i32) / 100.0;
+      Sum__d += bme280_compensate_P_int64(&Calib, Adc_P__i32a[Idx__z],
+        T_fine__i32) / 256.0;
+      Sum__d += bme280_compensate_H_int32(&Calib, Adc_H__i32a[Idx__z],
+        T_fine__i32) / 1024.0;
+    }
+    Sink__d = Sum__d;
+  }
+  Int_ns__d = (now_ns() - Start__d) / ((double)NUM_ROUNDS * NUM_SAMPLES);
+
+  Start__d = now_ns();
+  for (Round__z = 0; Round__z < NUM_ROUNDS; Round__z++)
+  {
+    double Sum__d = 0.0;
+    for (Idx__z = 0; Idx__z < NUM_SAMPLES; Idx__z++)
+    {
+      double T_fine__d;
+      Sum__d += bme280_compensate_T_double(&Coeffs, Adc_T__i32a[Idx__z],
+        &T_fine__d);
+      Sum__d += bme280_compensate_P_double(&Coeffs, Adc_P__i32a[Idx__z],
+        T_fine__d);
+      Sum__d += bme280_compensate_H_double(&Coeffs, Adc_H__i32a[Idx__z],
+        T_fine__d);
+    }
+    Sink__d = Sum__d;
+  }
+  Double_ns__d = (now_ns() - Start__d) / ((double)NUM_ROUNDS * NUM_SAMPLES);
+
+  printf("integer compensation  %7.1f ns/sample\n", Int_ns__d);
+  printf("double compensation   %7.1f ns/sample\n", Double_ns__d);
+  printf("max difference        %.4f DegC, %.3f Pa, %.4f %%RH\n",
+    Max_T_err__d, Max_P_err__d, Max_H_err__d);
+  return EXIT_SUCCESS;
+}
@@ -9,6 +9,206 @@
 #ifndef __BME280_H
 #define __BME280_H
 
+#include <stdint.h>
+
+///////////////////////////////////////////////////////////////////////////////
+// SPI transport used by the driver for every register access.
+// Data_rw__fn has the semantics of wiringPiSPIDataRW(): Len__i bytes from
+// Data__u8p are clocked out on the given chip enable and overwritten in place
+// by the bytes clocked back in.
+// Return: number of bytes transferred, < 0 on error.
+typedef struct
+{
+  int (*Data_rw__fn)(void * Context__p, int Chip_enable__i,
+    uint8_t * Data__u8p, int Len__i);
+  void * Context__p;
+} bme280_transport_t;
+
+///////////////////////////////////////////////////////////////////////////////
+// Replace the SPI transport used by the driver, e.g. with the one returned by
+// bme280_emul_get_transport(). The structure is copied.
+// Param: Transport__p  New transport, or NULL to restore the default wiringPi
+//                      transport.
+void bme280_set_transport(const bme280_transport_t * Transport__p);
+
+// Calibration data as read from the device.
+typedef struct
+{
+  uint16_t dig_T1;
+  int16_t  dig_T2;
+  int16_t  dig_T3;
+
+  uint16_t dig_P1;
+  int16_t  dig_P2;
+  int16_t  dig_P3;
+  int16_t  dig_P4;
+  int16_t  dig_P5;
+  int16_t  dig_P6;
+  int16_t  dig_P7;
+  int16_t  dig_P8;
+  int16_t  dig_P9;
+
+  uint8_t  dig_H1;
+  int16_t  dig_H2;
+  uint16_t dig_H3;
+  int16_t  dig_H4;
+  int16_t  dig_H5;
+  int8_t   dig_H6;
+} bme280_calib_data_t;
+
+// Coefficients derived once from the calibration data, laid out in the
+// order the floating point compensation path consumes them. Scale factors
+// and constant products of the datasheet formulas are folded in, so a
+// compensation is a short chain of multiply-adds.
+typedef struct
+{
+  double T_adc_scale__d;     // dig_T2 / 16384
+  double T_offset__d;        // dig_T1 / 1024 * dig_T2
+  double T_fine_offset__d;   // dig_T1 / 8192
+  double T3__d;              // dig_T3
+
+  double P1__d;              // dig_P1
+  double P1_scale__d;        // dig_P1 / 32768
+  double P2__d;              // dig_P2
+  double P3_scale__d;        // dig_P3 / 524288
+  double P4_scale__d;        // dig_P4 * 65536
+  double P5_x2__d;           // dig_P5 * 2
+  double P6_scale__d;        // dig_P6 / 32768
+  double P7__d;              // dig_P7
+  double P8_scale__d;        // dig_P8 / 32768
+  double P9_scale__d;        // dig_P9 / 2147483648
+
+  double H1_scale__d;        // dig_H1 / 524288
+  double H2_scale__d;        // dig_H2 / 65536
+  double H3_scale__d;        // dig_H3 / 67108864
+  double H4_x64__d;          // dig_H4 * 64
+  double H5_scale__d;        // dig_H5 / 16384
+  double H6_scale__d;        // dig_H6 / 67108864
+} bme280_coeffs_t;
+
+// Status register polling counters, see bme280_dev_get_poll_stats().
+typedef struct
+{
+  uint32_t Last_polls__u32;    // Status polls taken by the latest read.
+  uint32_t Max_polls__u32;     // Most status polls taken by a single read.
+  uint32_t Total_polls__u32;   // Status polls since start up.
+  uint32_t Reads__u32;         // Reads that got past the status check.
+  uint32_t Poll_timeouts__u32; // Reads that gave up waiting for not-busy.
+} bme280_poll_stats_t;
+
+///////////////////////////////////////////////////////////////////////////////
+// State of one sensor. Everything the driver knows about a chip lives here,
+// so sensors on different chip enables can be driven from the same process
+// and the compensation functions are reentrant. Treat the fields as private;
+// set them up with bme280_dev_init().
+typedef struct
+{
+  int Chip_enable__i;
+  bme280_calib_data_t Calib;
+  int32_t T_fine__i32;
+  bme280_coeffs_t Coeffs;
+  int Use_float_compensation__i;
+
+  // Settings last written to the measurement control registers, and when.
+  uint8_t Ctrl_hum_setting__u8;
+  uint8_t Ctrl_meas_setting__u8;
+  uint8_t Config_setting__u8;
+  uint64_t Conversion_start_us__u64;
+
+  bme280_poll_stats_t Poll_stats;
+} bme280_dev_t;
+
+// One compensated reading, see bme280_read_all_forced().
+typedef struct
+{
+  int Status__i;             // 1 if the read succeeded, as bme280_read_sensors.
+  float Temp_C__f;
+  float Pres_Pa__f;
+  float Hum_pct__f;
+  uint32_t Latency_us__u32;  // Trigger-to-data time.
+} bme280_sample_t;
+
+///////////////////////////////////////////////////////////////////////////////
+// Identifies the chip on Chip_enable_to_use__i, reads its calibration data
+// and starts it in normal mode. See bme280_init() for the return value.
+int bme280_dev_init(bme280_dev_t * Dev__p, int Chip_enable_to_use__i);
+
+///////////////////////////////////////////////////////////////////////////////
+// Per-device versions of the functions below.
+int bme280_dev_read_sensors(bme280_dev_t * Dev__p, float * Temp_C__fp,
+  float * Pres_Pa__fp, float * Hum_pct__fp);
+int bme280_dev_set_forced_mode(bme280_dev_t * Dev__p);
+int bme280_dev_read_sensors_forced(bme280_dev_t * Dev__p, float * Temp_C__fp,
+  float * Pres_Pa__fp, float * Hum_pct__fp, uint32_t * Latency_us__u32p);
+uint32_t bme280_dev_get_measurement_time_us(const bme280_dev_t * Dev__p);
+
+///////////////////////////////////////////////////////////////////////////////
+// Writes the temperature, pressure and humidity oversampling fields
+// (0 = skipped, 1 = x1, 2 = x2, 3 = x4, 4 = x8, 5 = x16) and keeps the
+// power mode. Shorter conversions allow higher sampling rates.
+// Return: 1 on success, 0 if a control register could not be written.
+int bme280_dev_set_oversampling(bme280_dev_t * Dev__p, uint8_t Osrs_t__u8,
+  uint8_t Osrs_p__u8, uint8_t Osrs_h__u8);
+
+///////////////////////////////////////////////////////////////////////////////
+// Return: the datasheet maximum measurement time, in microseconds, for the
+//         given oversampling fields, without touching a device.
+uint32_t bme280_measurement_time_us(uint8_t Osrs_t__u8, uint8_t Osrs_p__u8,
+  uint8_t Osrs_h__u8);
+void bme280_dev_get_poll_stats(const bme280_dev_t * Dev__p,
+  bme280_poll_stats_t * Stats__p);
+
+///////////////////////////////////////////////////////////////////////////////
+// Reads every sensor in one acquisition cycle. All devices are triggered
+// back to back, the driver sleeps once for the longest measurement time, and
+// the results are then collected in turn, so the cycle takes about one
+// conversion time regardless of the number of sensors.
+// Prerequisite: each device is in forced mode (bme280_dev_set_forced_mode()).
+// Param: Samples__p  Array of Num_devs__i entries receiving the results.
+// Return: the number of devices read successfully.
+int bme280_read_all_forced(bme280_dev_t * Devs__p, int Num_devs__i,
+  bme280_sample_t * Samples__p);
+
+///////////////////////////////////////////////////////////////////////////////
+// Compensation formulas from the datasheet, in integer arithmetic.
+// Temperature must be compensated first: it produces the t_fine value that
+// the pressure and humidity formulas take.
+// Return: temperature in 0.01 DegC, pressure in Pa as Q24.8, humidity in %RH
+//         as Q22.10.
+int32_t bme280_compensate_T_int32(const bme280_calib_data_t * Calib__p,
+  int32_t adc_T, int32_t * T_fine__i32p);
+uint32_t bme280_compensate_P_int64(const bme280_calib_data_t * Calib__p,
+  int32_t adc_P, int32_t t_fine);
+uint32_t bme280_compensate_H_int32(const bme280_calib_data_t * Calib__p,
+  int32_t adc_H, int32_t t_fine);
+
+///////////////////////////////////////////////////////////////////////////////
+// Floating point compensation (datasheet appendix 8.1) on precomputed
+// coefficients. Against the integer functions above, over -40~85 DegC,
+// 300~1100 hPa and 0~100 %RH, the results stay within:
+//   temperature  0.01 DegC  (mostly the integer path's 0.01 DegC rounding)
+//   pressure     0.5 Pa
+//   humidity     0.01 %RH
+// bench/bme280_compensation_bench.c measures the difference and times both.
+// Return: temperature in DegC, pressure in Pa, humidity in %RH (0~100).
+void bme280_derive_coeffs(const bme280_calib_data_t * Calib__p,
+  bme280_coeffs_t * Coeffs__p);
+double bme280_compensate_T_double(const bme280_coeffs_t * Coeffs__p,
+  int32_t adc_T, double * T_fine__dp);
+double bme280_compensate_P_double(const bme280_coeffs_t * Coeffs__p,
+  int32_t adc_P, double t_fine);
+double bme280_compensate_H_double(const bme280_coeffs_t * Coeffs__p,
+  int32_t adc_H, double t_fine);
+
+///////////////////////////////////////////////////////////////////////////////
+// Selects the compensation used by the read functions for this device.
+// Param: Enable__i  0 (default) for the integer reference formulas, 1 for the
+//                   floating point path, which avoids the 64 bit divide of
+//                   the integer pressure formula.
+void bme280_dev_set_float_compensation(bme280_dev_t * Dev__p, int Enable__i);
+
+///////////////////////////////////////////////////////////////////////////////
+// The functions below drive a single, process wide default device.
 
 ///////////////////////////////////////////////////////////////////////////////
 // Call this after setting the chip select (or SPI Enable) pin (via
@@ -44,5 +244,27 @@ int bme280_init(int Chip_enable_to_use__i);
 int bme280_read_sensors(float * Temp_C__fp, float * Pres_Pa__fp,
   float * Hum_pct__fp);
 
+///////////////////////////////////////////////////////////////////////////////
+// Switches the sensor from normal mode to forced mode: the chip sleeps until
+// bme280_read_sensors_forced() triggers a single conversion. Call after
+// bme280_init().
+// Return: 1 on success, 0 if the control register could not be written.
+int bme280_set_forced_mode(void);
+
+///////////////////////////////////////////////////////////////////////////////
+// Triggers one forced-mode conversion, sleeps for the computed measurement
+// time and reads the result. Parameters and return as bme280_read_sensors().
+// Param: Latency_us__u32p  Optional; receives the time from the trigger
+//                          write until the data was read, in microseconds.
+int bme280_read_sensors_forced(float * Temp_C__fp, float * Pres_Pa__fp,
+  float * Hum_pct__fp, uint32_t * Latency_us__u32p);
+
+///////////////////////////////////////////////////////////////////////////////
+// Return: the datasheet maximum measurement time, in microseconds, for the
+//         oversampling settings currently written to the sensor.
+uint32_t bme280_get_measurement_time_us(void);
+
+void bme280_get_poll_stats(bme280_poll_stats_t * Stats__p);
+
 #endif//__BME280_H
 
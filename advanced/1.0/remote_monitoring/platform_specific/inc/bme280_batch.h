@@ -0,0 +1,55 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// bme280_batch.h:
+// Batch compensation of raw BME280 ADC samples, for high rate capture and for
+// replaying recorded raw data. Results are bit-identical to the per-sample
+// bme280_compensate_* functions.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#ifndef __BME280_BATCH_H
+#define __BME280_BATCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "bme280.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// Compensates Num_samples__z raw temperatures.
+// Param: Temp__i32p    Receives temperatures in 0.01 DegC.
+// Param: T_fine__i32p  Receives the t_fine of each sample, needed by the
+//                      pressure and humidity batches.
+void bme280_compensate_T_batch(const bme280_calib_data_t * Calib__p,
+  const int32_t * Adc_T__i32p, int32_t * Temp__i32p, int32_t * T_fine__i32p,
+  size_t Num_samples__z);
+
+///////////////////////////////////////////////////////////////////////////////
+// Compensates Num_samples__z raw pressures into Pa as Q24.8.
+// The 64 bit multiply and divide of the datasheet formula have no SIMD
+// equivalent on the targets we build for, so this is always a scalar loop.
+void bme280_compensate_P_batch(const bme280_calib_data_t * Calib__p,
+  const int32_t * Adc_P__i32p, const int32_t * T_fine__i32p,
+  uint32_t * Pres__u32p, size_t Num_samples__z);
+
+///////////////////////////////////////////////////////////////////////////////
+// Compensates Num_samples__z raw humidities into %RH as Q22.10.
+void bme280_compensate_H_batch(const bme280_calib_data_t * Calib__p,
+  const int32_t * Adc_H__i32p, const int32_t * T_fine__i32p,
+  uint32_t * Hum__u32p, size_t Num_samples__z);
+
+///////////////////////////////////////////////////////////////////////////////
+// Scalar reference versions of the batches above. The SIMD kernels must match
+// these bit for bit.
+void bme280_compensate_T_batch_scalar(const bme280_calib_data_t * Calib__p,
+  const int32_t * Adc_T__i32p, int32_t * Temp__i32p, int32_t * T_fine__i32p,
+  size_t Num_samples__z);
+void bme280_compensate_H_batch_scalar(const bme280_calib_data_t * Calib__p,
+  const int32_t * Adc_H__i32p, const int32_t * T_fine__i32p,
+  uint32_t * Hum__u32p, size_t Num_samples__z);
+
+///////////////////////////////////////////////////////////////////////////////
+// Return: the name of the SIMD kernel compiled in ("avx2", "sse4.1", "neon"
+//         or "scalar").
+const char * bme280_batch_kernel_name(void);
+
+#endif//__BME280_BATCH_H
@@ -0,0 +1,84 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// bme280_emul.h:
+// In-memory BME280 register emulator. Provides a bme280_transport_t so the
+// bme280 driver can be exercised, benchmarked and soak-tested on any Linux
+// machine without a sensor attached.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#ifndef __BME280_EMUL_H
+#define __BME280_EMUL_H
+
+#include <stdint.h>
+#include "bme280.h"
+
+typedef struct bme280_emul_tag bme280_emul_t;
+
+// Transaction counters, see bme280_emul_get_stats().
+typedef struct
+{
+  uint32_t Transactions__u32;
+  uint32_t Bytes__u32;
+  uint32_t Status_reads__u32;
+  uint32_t Conversions__u32;
+} bme280_emul_stats_t;
+
+///////////////////////////////////////////////////////////////////////////////
+// Creates an emulated BME280 in its power-on state: chip ID 0x60, sleep mode,
+// a set of typical calibration constants and the datasheet example raw ADC
+// values. The NVM copy (status bit 0) stays busy for 2ms after creation.
+// Return: NULL if out of memory.
+bme280_emul_t * bme280_emul_create(void);
+
+void bme280_emul_destroy(bme280_emul_t * Emul__p);
+
+///////////////////////////////////////////////////////////////////////////////
+// Fills Transport__p with a transport backed by this emulator. The emulator
+// answers on both chip enables.
+void bme280_emul_get_transport(bme280_emul_t * Emul__p,
+  bme280_transport_t * Transport__p);
+
+///////////////////////////////////////////////////////////////////////////////
+// Two emulated sensors sharing the SPI bus, one per chip enable. A NULL entry
+// models an empty slot: reads return 0xFF.
+typedef struct
+{
+  bme280_emul_t * Chips__pa[2];
+} bme280_emul_bus_t;
+
+///////////////////////////////////////////////////////////////////////////////
+// Fills Transport__p with a transport that routes each transaction to the
+// emulator on its chip enable. Bus__p must outlive the transport.
+void bme280_emul_get_bus_transport(bme280_emul_bus_t * Bus__p,
+  bme280_transport_t * Transport__p);
+
+///////////////////////////////////////////////////////////////////////////////
+// Overwrites raw register contents, bypassing the SPI write rules. Use it to
+// load other calibration bytes (0x88~0xA1, 0xE1~0xE7) or a different chip ID.
+void bme280_emul_poke(bme280_emul_t * Emul__p, uint8_t Register__u8,
+  const uint8_t * Data__u8p, int Num_bytes__i);
+
+///////////////////////////////////////////////////////////////////////////////
+// Sets the raw ADC values latched into the data registers at the end of
+// every following conversion. T and P are 20 bit, H is 16 bit.
+void bme280_emul_set_raw_adc(bme280_emul_t * Emul__p, int32_t Adc_T__i32,
+  int32_t Adc_P__i32, int32_t Adc_H__i32);
+
+///////////////////////////////////////////////////////////////////////////////
+// Sets how long a conversion keeps status bit 3 (measuring) set.
+// Param: Latency_us__u32  Conversion time in microseconds. 0 selects the
+//                         datasheet maximum for the oversampling settings
+//                         written to ctrl_hum/ctrl_meas (the default).
+void bme280_emul_set_conversion_latency_us(bme280_emul_t * Emul__p,
+  uint32_t Latency_us__u32);
+
+///////////////////////////////////////////////////////////////////////////////
+// Injects a delay into every SPI transaction to model a slow or contended bus.
+void bme280_emul_set_spi_latency_us(bme280_emul_t * Emul__p,
+  uint32_t Latency_us__u32);
+
+void bme280_emul_get_stats(bme280_emul_t * Emul__p,
+  bme280_emul_stats_t * Stats__p);
+
+#endif//__BME280_EMUL_H
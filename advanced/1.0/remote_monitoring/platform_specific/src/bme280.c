@@ -6,21 +6,138 @@
 //
 ///////////////////////////////////////////////////////////////////////////////
 
+#define _POSIX_C_SOURCE 200809L
 #include "bme280.h"
 #include <wiringPi.h>
 #include <wiringPiSPI.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
 
 
 #define SENSOR_MODULE_MAX_XFER_LEN (128)
 static int Num_allowed_retries__i = 3;
-static int Chip_enable_selected__i = -1;
+
+// Number of status polls allowed after the computed conversion time has
+// elapsed, before reading the (shadowed) data registers anyway.
+#define MAX_STATUS_POLLS (8)
+
+// Device used by the single-sensor API.
+static bme280_dev_t Default_dev = { .Chip_enable__i = -1 };
 
 #define SHOW_DEBUG_OUTPUT
 
 
+///////////////////////////////////////////////////////////////////////////////
+// Default transport: the Pi's SPI bus through wiringPi.
+static int bme280_wiringpi_data_rw(void * Context__p, int Chip_enable__i,
+  uint8_t * Data__u8p, int Len__i)
+{
+  (void)Context__p;
+  return wiringPiSPIDataRW(Chip_enable__i, Data__u8p, Len__i);
+}
+
+static bme280_transport_t Transport = { bme280_wiringpi_data_rw, NULL };
+
+///////////////////////////////////////////////////////////////////////////////
+static uint64_t bme280_now_us(void)
+{
+  struct timespec Now;
+  clock_gettime(CLOCK_MONOTONIC, &Now);
+  return ((uint64_t)Now.tv_sec * 1000000ULL) + ((uint64_t)Now.tv_nsec / 1000);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+static void bme280_sleep_us(uint32_t Duration_us__u32)
+{
+  struct timespec Duration;
+  Duration.tv_sec = Duration_us__u32 / 1000000;
+  Duration.tv_nsec = (long)(Duration_us__u32 % 1000000) * 1000L;
+  while (nanosleep(&Duration, &Duration) != 0)
+  {
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Oversampling register field to number of samples (0 = skipped).
+static uint32_t bme280_osrs_samples(uint8_t Osrs__u8)
+{
+  static const uint32_t Samples__u32a[8] = { 0, 1, 2, 4, 8, 16, 16, 16 };
+  return Samples__u32a[Osrs__u8 & 0x07];
+}
+
+///////////////////////////////////////////////////////////////////////////////
+uint32_t bme280_measurement_time_us(uint8_t Osrs_t__u8, uint8_t Osrs_p__u8,
+  uint8_t Osrs_h__u8)
+{
+  // Datasheet section 9.1, maximum measurement time:
+  // 1.25 + 2.3 * T + (2.3 * P + 0.575) + (2.3 * H + 0.575) ms,
+  // where a skipped measurement contributes nothing.
+  uint32_t Osrs_t__u32 = bme280_osrs_samples(Osrs_t__u8);
+  uint32_t Osrs_p__u32 = bme280_osrs_samples(Osrs_p__u8);
+  uint32_t Osrs_h__u32 = bme280_osrs_samples(Osrs_h__u8);
+  uint32_t Time_us__u32 = 1250 + 2300 * Osrs_t__u32;
+  if (Osrs_p__u32 != 0) { Time_us__u32 += 2300 * Osrs_p__u32 + 575; }
+  if (Osrs_h__u32 != 0) { Time_us__u32 += 2300 * Osrs_h__u32 + 575; }
+  return Time_us__u32;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+uint32_t bme280_dev_get_measurement_time_us(const bme280_dev_t * Dev__p)
+{
+  return bme280_measurement_time_us(Dev__p->Ctrl_meas_setting__u8 >> 5,
+    Dev__p->Ctrl_meas_setting__u8 >> 2, Dev__p->Ctrl_hum_setting__u8);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Estimates how long until the conversion in progress completes.
+static uint32_t bme280_remaining_conversion_us(const bme280_dev_t * Dev__p)
+{
+  // Standby durations selected by config bits 7~5, in microseconds.
+  static const uint32_t Standby_us__u32a[8] =
+  {
+    500, 62500, 125000, 250000, 500000, 1000000, 10000, 20000
+  };
+
+  uint32_t Measure_us__u32 = bme280_dev_get_measurement_time_us(Dev__p);
+  uint64_t Elapsed_us__u64 = bme280_now_us() - Dev__p->Conversion_start_us__u64;
+  if ((Dev__p->Ctrl_meas_setting__u8 & 0x03) == 0x03)
+  {
+    // Normal mode converts back to back, separated by the standby time.
+    uint64_t Period_us__u64 = (uint64_t)Measure_us__u32
+      + Standby_us__u32a[(Dev__p->Config_setting__u8 >> 5) & 0x07];
+    Elapsed_us__u64 %= Period_us__u64;
+  }
+  if (Elapsed_us__u64 >= Measure_us__u32)
+  {
+    return 0;
+  }
+  return Measure_us__u32 - (uint32_t)Elapsed_us__u64;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void bme280_dev_get_poll_stats(const bme280_dev_t * Dev__p,
+  bme280_poll_stats_t * Stats__p)
+{
+  *Stats__p = Dev__p->Poll_stats;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void bme280_set_transport(const bme280_transport_t * Transport__p)
+{
+  if ((Transport__p == NULL) || (Transport__p->Data_rw__fn == NULL))
+  {
+    Transport.Data_rw__fn = bme280_wiringpi_data_rw;
+    Transport.Context__p = NULL;
+  }
+  else
+  {
+    Transport = *Transport__p;
+  }
+}
+
+
 ///////////////////////////////////////////////////////////////////////////////
 // Device registers
 enum
@@ -50,6 +167,7 @@ enum
   , eBME280reg_VERSION  = 0xD1
   , eBME280reg_SWRESET  = 0xE0
 
+  , eBME280reg_CTRL_HUM = 0xF2
   , eBME280reg_STATUS   = 0xF3
   , eBME280reg_CONTROL  = 0xF4
   , eBME280reg_CONFIG   = 0xF5
@@ -57,38 +175,20 @@ enum
   , eBME280reg_TEMPDATA = 0xFA
 };
 
-
-// Calibration data as read from the device.
-typedef struct
+// Status register bits.
+enum
 {
-  uint16_t dig_T1;
-  int16_t  dig_T2;
-  int16_t  dig_T3;
-
-  uint16_t dig_P1;
-  int16_t  dig_P2;
-  int16_t  dig_P3;
-  int16_t  dig_P4;
-  int16_t  dig_P5;
-  int16_t  dig_P6;
-  int16_t  dig_P7;
-  int16_t  dig_P8;
-  int16_t  dig_P9;
+    eBME280status_IM_UPDATE = 0x01
+  , eBME280status_MEASURING = 0x08
+};
 
-  uint8_t  dig_H1;
-  int16_t  dig_H2;
-  uint16_t dig_H3;
-  int16_t  dig_H4;
-  int16_t  dig_H5;
-  int8_t   dig_H6;
-} bme280_calib_data_t;
-bme280_calib_data_t Calib_data;
 
 
 ///////////////////////////////////////////////////////////////////////////////
-int bme280_read(const uint8_t Register__u8, uint8_t * Data__u8p, uint8_t Num_bytes__u8)
+static int bme280_read(const bme280_dev_t * Dev__p, const uint8_t Register__u8,
+  uint8_t * Data__u8p, uint8_t Num_bytes__u8)
 {
-  if (Chip_enable_selected__i == -1) { return 0; }
+  if (Dev__p->Chip_enable__i == -1) { return 0; }
   if (Num_bytes__u8 >= SENSOR_MODULE_MAX_XFER_LEN) { return 0; }
 
   uint8_t Buffer__u8a[SENSOR_MODULE_MAX_XFER_LEN];
@@ -96,8 +196,8 @@ int bme280_read(const uint8_t Register__u8, uint8_t * Data__u8p, uint8_t Num_byt
 
   // Set bit 7 high to tell it to read.
   Buffer__u8a[0] = (0x80 | Register__u8);
-  int Result__i =
-    wiringPiSPIDataRW(Chip_enable_selected__i, Buffer__u8a, Num_bytes__u8 + 1);
+  int Result__i = Transport.Data_rw__fn(Transport.Context__p,
+    Dev__p->Chip_enable__i, Buffer__u8a, Num_bytes__u8 + 1);
   int Out_idx__i = 0;
   while (Out_idx__i < (Result__i - 1))
   {
@@ -109,9 +209,10 @@ int bme280_read(const uint8_t Register__u8, uint8_t * Data__u8p, uint8_t Num_byt
 }
 
 ///////////////////////////////////////////////////////////////////////////////
-int bme280_write(const uint8_t Register__u8, const uint8_t * Data__u8p, uint8_t Num_bytes__u8)
+static int bme280_write(const bme280_dev_t * Dev__p, const uint8_t Register__u8,
+  const uint8_t * Data__u8p, uint8_t Num_bytes__u8)
 {
-  if (Chip_enable_selected__i == -1) { return 0; }
+  if (Dev__p->Chip_enable__i == -1) { return 0; }
   if (Num_bytes__u8 > SENSOR_MODULE_MAX_XFER_LEN) { return 0; }
 
   uint8_t Buffer__u8a[SENSOR_MODULE_MAX_XFER_LEN];
@@ -127,14 +228,14 @@ int bme280_write(const uint8_t Register__u8, const uint8_t * Data__u8p, uint8_t
     Data__u8p++;
   }
 
-  int Result__i = wiringPiSPIDataRW(Chip_enable_selected__i,
-    Buffer__u8a, Num_bytes__u8 * 2);
+  int Result__i = Transport.Data_rw__fn(Transport.Context__p,
+    Dev__p->Chip_enable__i, Buffer__u8a, Num_bytes__u8 * 2);
 
   return Result__i / 2;
 }
 
 ///////////////////////////////////////////////////////////////////////////////
-int bme280_init(int Chip_enable_to_use__i)
+int bme280_dev_init(bme280_dev_t * Dev__p, int Chip_enable_to_use__i)
 {
   #ifdef SHOW_DEBUG_OUTPUT
   printf("bme280_init(%i)\n", Chip_enable_to_use__i);
@@ -144,11 +245,12 @@ int bme280_init(int Chip_enable_to_use__i)
   {
     return 0;
   }
-  Chip_enable_selected__i = Chip_enable_to_use__i;
+  memset(Dev__p, 0, sizeof(*Dev__p));
+  Dev__p->Chip_enable__i = Chip_enable_to_use__i;
 
   // Verify that the chip is really a BME280.
   uint8_t ID_value__u8 = 0;
-  int Bytes_read__i = bme280_read(eBME280reg_CHIPID, &ID_value__u8, 1);
+  int Bytes_read__i = bme280_read(Dev__p, eBME280reg_CHIPID, &ID_value__u8, 1);
   if (Bytes_read__i != 1)
   {
     return 0;
@@ -167,7 +269,7 @@ int bme280_init(int Chip_enable_to_use__i)
   }
 
   #define T_P_CALIB_NUM_BYTES (24)
-  Bytes_read__i = bme280_read(eBME280reg_DIG_T1, (uint8_t *)&Calib_data,
+  Bytes_read__i = bme280_read(Dev__p, eBME280reg_DIG_T1, (uint8_t *)&Dev__p->Calib,
     T_P_CALIB_NUM_BYTES);
   if (Bytes_read__i != T_P_CALIB_NUM_BYTES)
   {
@@ -178,7 +280,7 @@ int bme280_init(int Chip_enable_to_use__i)
     return 0;
   }
   uint8_t Hum_calib_buf__u8a[9];
-  Bytes_read__i += bme280_read(eBME280reg_DIG_H1, &Hum_calib_buf__u8a[0], 1);
+  Bytes_read__i += bme280_read(Dev__p, eBME280reg_DIG_H1, &Hum_calib_buf__u8a[0], 1);
   if (Bytes_read__i != T_P_CALIB_NUM_BYTES + 1)
   {
     #ifdef SHOW_DEBUG_OUTPUT
@@ -187,7 +289,7 @@ int bme280_init(int Chip_enable_to_use__i)
     #endif
     return 0;
   }
-  Bytes_read__i += bme280_read(eBME280reg_DIG_H2, &Hum_calib_buf__u8a[1], 7);
+  Bytes_read__i += bme280_read(Dev__p, eBME280reg_DIG_H2, &Hum_calib_buf__u8a[1], 7);
   if (Bytes_read__i != T_P_CALIB_NUM_BYTES + 8)
   {
     #ifdef SHOW_DEBUG_OUTPUT
@@ -202,22 +304,25 @@ int bme280_init(int Chip_enable_to_use__i)
   #endif
 
   // Decode the humidity compensation constants.
-  Calib_data.dig_H1 = Hum_calib_buf__u8a[0];
-  Calib_data.dig_H2 = (int16_t)(((uint16_t)Hum_calib_buf__u8a[1])
+  Dev__p->Calib.dig_H1 = Hum_calib_buf__u8a[0];
+  Dev__p->Calib.dig_H2 = (int16_t)(((uint16_t)Hum_calib_buf__u8a[1])
     + (((uint16_t)Hum_calib_buf__u8a[2]) << 8));
-  Calib_data.dig_H3 = Hum_calib_buf__u8a[3];
-  Calib_data.dig_H4 = (int16_t)((((uint16_t)Hum_calib_buf__u8a[4]) << 4)
+  Dev__p->Calib.dig_H3 = Hum_calib_buf__u8a[3];
+  Dev__p->Calib.dig_H4 = (int16_t)((((uint16_t)Hum_calib_buf__u8a[4]) << 4)
     + (((uint16_t)Hum_calib_buf__u8a[5]) & 0x0F));
-  Calib_data.dig_H5 = (int16_t)((((uint16_t)Hum_calib_buf__u8a[5]) >> 4)
+  Dev__p->Calib.dig_H5 = (int16_t)((((uint16_t)Hum_calib_buf__u8a[5]) >> 4)
     + (((uint16_t)Hum_calib_buf__u8a[6]) << 4));
-  Calib_data.dig_H6 = (int8_t)Hum_calib_buf__u8a[7];
+  Dev__p->Calib.dig_H6 = (int8_t)Hum_calib_buf__u8a[7];
+  bme280_derive_coeffs(&Dev__p->Calib, &Dev__p->Coeffs);
 
   // bits 7~5 = 001 = temperature oversampling * 1
   // bits 4~2 = 111 = pressure oversampling * 16
   // bits 1~0 = 11  = normal power mode
   const uint8_t Control_setting__u8 = 0x3F;
-  uint8_t Bytes_written__u8 = bme280_write(eBME280reg_CONTROL,
+  uint8_t Bytes_written__u8 = bme280_write(Dev__p, eBME280reg_CONTROL,
     &Control_setting__u8, 1);
+  Dev__p->Ctrl_meas_setting__u8 = Control_setting__u8;
+  Dev__p->Conversion_start_us__u64 = bme280_now_us();
   if (Bytes_written__u8 != 1)
   {
     #ifdef SHOW_DEBUG_OUTPUT
@@ -237,20 +342,19 @@ int bme280_init(int Chip_enable_to_use__i)
 ///////////////////////////////////////////////////////////////////////////////
 // Returns temperature in DegC, resolution is 0.01 DegC.
 // For example: Output value of “5123” equals 51.23 DegC.
-// t_fine is stored globally since it is also used by the pressure comp calc.
-// Note: Must call this before calling compensate_P or compensate_H because of
-// the global t_fine variable.
-int32_t t_fine = 0;
-int32_t bme280_compensate_T_int32(int32_t adc_T)
+// t_fine is returned through T_fine__i32p since it is also used by the
+// pressure and humidity comp calcs.
+int32_t bme280_compensate_T_int32(const bme280_calib_data_t * Calib__p,
+  int32_t adc_T, int32_t * T_fine__i32p)
 {
   int32_t var1, var2, T;
-  var1 = ((((adc_T >> 3) - ((int32_t)Calib_data.dig_T1 << 1)))
-    * ((int32_t)Calib_data.dig_T2)) >> 11;
-  var2 = (((((adc_T >> 4) - ((int32_t)Calib_data.dig_T1))
-    * ((adc_T >> 4) - ((int32_t)Calib_data.dig_T1))) >> 12)
-    * ((int32_t)Calib_data.dig_T3)) >> 14;
-  t_fine = var1 + var2;
-  T = (t_fine * 5 + 128) >> 8;
+  var1 = ((((adc_T >> 3) - ((int32_t)Calib__p->dig_T1 << 1)))
+    * ((int32_t)Calib__p->dig_T2)) >> 11;
+  var2 = (((((adc_T >> 4) - ((int32_t)Calib__p->dig_T1))
+    * ((adc_T >> 4) - ((int32_t)Calib__p->dig_T1))) >> 12)
+    * ((int32_t)Calib__p->dig_T3)) >> 14;
+  *T_fine__i32p = var1 + var2;
+  T = (*T_fine__i32p * 5 + 128) >> 8;
   return T;
 }
 
@@ -259,17 +363,17 @@ int32_t bme280_compensate_T_int32(int32_t adc_T)
 // integer bits and 8 fractional bits).
 // For example: Output value of “24674867” represents 24674867/256 = 96386.2 Pa
 // = 963.862 hPa
-// Note: Must call compensate_T before calling this because of
-// the global t_fine variable.
-uint32_t bme280_compensate_P_int64(int32_t adc_P)
+// Note: t_fine comes from compensate_T on the same sample.
+uint32_t bme280_compensate_P_int64(const bme280_calib_data_t * Calib__p,
+  int32_t adc_P, int32_t t_fine)
 {
   int64_t var1, var2, p;
   var1 = ((int64_t)t_fine) - 128000LL;
-  var2 = var1 * var1 * (int64_t)Calib_data.dig_P6;
-  var2 = var2 + ((var1*(int64_t)Calib_data.dig_P5) << 17);
-  var2 = var2 + (((int64_t)Calib_data.dig_P4) << 35);
-  var1 = ((var1 * var1 * (int64_t)Calib_data.dig_P3)>>8) + ((var1 * (int64_t)Calib_data.dig_P2) << 12);
-  var1 = (((((int64_t)1) << 47) + var1)) * ((int64_t)Calib_data.dig_P1) >> 33;
+  var2 = var1 * var1 * (int64_t)Calib__p->dig_P6;
+  var2 = var2 + ((var1*(int64_t)Calib__p->dig_P5) << 17);
+  var2 = var2 + (((int64_t)Calib__p->dig_P4) << 35);
+  var1 = ((var1 * var1 * (int64_t)Calib__p->dig_P3)>>8) + ((var1 * (int64_t)Calib__p->dig_P2) << 12);
+  var1 = (((((int64_t)1) << 47) + var1)) * ((int64_t)Calib__p->dig_P1) >> 33;
   if (var1 == 0)
   {
     // Avoid divide by zero exception.
@@ -277,9 +381,9 @@ uint32_t bme280_compensate_P_int64(int32_t adc_P)
   }
   p = 1048576 - adc_P;
   p = (((p << 31) - var2) * 3125) / var1;
-  var1 = (((int64_t)Calib_data.dig_P9) * (p >> 13) * (p >> 13)) >> 25;
-  var2 = (((int64_t)Calib_data.dig_P8) * p) >> 19;
-  p = ((p + var1 + var2) >> 8) + (((int64_t)Calib_data.dig_P7) << 4);
+  var1 = (((int64_t)Calib__p->dig_P9) * (p >> 13) * (p >> 13)) >> 25;
+  var2 = (((int64_t)Calib__p->dig_P8) * p) >> 19;
+  p = ((p + var1 + var2) >> 8) + (((int64_t)Calib__p->dig_P7) << 4);
   return (uint32_t)p;
 }
 
@@ -287,49 +391,179 @@ uint32_t bme280_compensate_P_int64(int32_t adc_P)
 // Returns humidity as a relative percentage.
 // Encoded as Q22.10 format (22 integer bits and 10 fractional bits).
 // For example: Output value of “47445” represents 47445/1024 = 46.333 %RH
-// Note: Must call compensate_T before calling this because of
-// the global t_fine variable.
-uint32_t bme280_compensate_H_int32(int32_t adc_H)
+// Note: t_fine comes from compensate_T on the same sample.
+uint32_t bme280_compensate_H_int32(const bme280_calib_data_t * Calib__p,
+  int32_t adc_H, int32_t t_fine)
 {
   int32_t v_x1_u32r;
   v_x1_u32r = (t_fine - ((int32_t)76800L));
-  v_x1_u32r = (((((adc_H << 14) - (((int32_t)Calib_data.dig_H4) << 20)
-    - (((int32_t)Calib_data.dig_H5) * v_x1_u32r)) + ((int32_t)16384)) >> 15)
-    * (((((((v_x1_u32r * ((int32_t)Calib_data.dig_H6)) >> 10)
-    * (((v_x1_u32r * ((int32_t)Calib_data.dig_H3)) >> 11)
+  v_x1_u32r = (((((adc_H << 14) - (((int32_t)Calib__p->dig_H4) << 20)
+    - (((int32_t)Calib__p->dig_H5) * v_x1_u32r)) + ((int32_t)16384)) >> 15)
+    * (((((((v_x1_u32r * ((int32_t)Calib__p->dig_H6)) >> 10)
+    * (((v_x1_u32r * ((int32_t)Calib__p->dig_H3)) >> 11)
     + ((int32_t)32768))) >> 10) + ((int32_t)2097152))
-    * ((int32_t)Calib_data.dig_H2) + 8192) >> 14));
+    * ((int32_t)Calib__p->dig_H2) + 8192) >> 14));
   v_x1_u32r = (v_x1_u32r - (((((v_x1_u32r >> 15) * (v_x1_u32r >> 15)) >> 7)
-    * ((int32_t)Calib_data.dig_H1)) >> 4));
+    * ((int32_t)Calib__p->dig_H1)) >> 4));
   v_x1_u32r = (v_x1_u32r < 0 ? 0 : v_x1_u32r);
   v_x1_u32r = (v_x1_u32r > 419430400 ? 419430400 : v_x1_u32r);
   return (uint32_t)(v_x1_u32r >> 12);
 }
 
 ///////////////////////////////////////////////////////////////////////////////
-int bme280_read_sensors(float * Temp_c__fp, float * Pres_Pa__fp,
-  float * Hum_pct__fp)
+void bme280_derive_coeffs(const bme280_calib_data_t * Calib__p,
+  bme280_coeffs_t * Coeffs__p)
 {
-  int Return_status__i = 0;
+  Coeffs__p->T_adc_scale__d = (double)Calib__p->dig_T2 / 16384.0;
+  Coeffs__p->T_offset__d = (double)Calib__p->dig_T1 / 1024.0
+    * (double)Calib__p->dig_T2;
+  Coeffs__p->T_fine_offset__d = (double)Calib__p->dig_T1 / 8192.0;
+  Coeffs__p->T3__d = (double)Calib__p->dig_T3;
+
+  Coeffs__p->P1__d = (double)Calib__p->dig_P1;
+  Coeffs__p->P1_scale__d = (double)Calib__p->dig_P1 / 32768.0;
+  Coeffs__p->P2__d = (double)Calib__p->dig_P2;
+  Coeffs__p->P3_scale__d = (double)Calib__p->dig_P3 / 524288.0;
+  Coeffs__p->P4_scale__d = (double)Calib__p->dig_P4 * 65536.0;
+  Coeffs__p->P5_x2__d = (double)Calib__p->dig_P5 * 2.0;
+  Coeffs__p->P6_scale__d = (double)Calib__p->dig_P6 / 32768.0;
+  Coeffs__p->P7__d = (double)Calib__p->dig_P7;
+  Coeffs__p->P8_scale__d = (double)Calib__p->dig_P8 / 32768.0;
+  Coeffs__p->P9_scale__d = (double)Calib__p->dig_P9 / 2147483648.0;
+
+  Coeffs__p->H1_scale__d = (double)Calib__p->dig_H1 / 524288.0;
+  Coeffs__p->H2_scale__d = (double)Calib__p->dig_H2 / 65536.0;
+  Coeffs__p->H3_scale__d = (double)Calib__p->dig_H3 / 67108864.0;
+  Coeffs__p->H4_x64__d = (double)Calib__p->dig_H4 * 64.0;
+  Coeffs__p->H5_scale__d = (double)Calib__p->dig_H5 / 16384.0;
+  Coeffs__p->H6_scale__d = (double)Calib__p->dig_H6 / 67108864.0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Returns temperature in DegC. t_fine is on the same scale as the integer
+// t_fine, so it can be compared directly.
+double bme280_compensate_T_double(const bme280_coeffs_t * Coeffs__p,
+  int32_t adc_T, double * T_fine__dp)
+{
+  double var1, var2, x;
+  var1 = (double)adc_T * Coeffs__p->T_adc_scale__d - Coeffs__p->T_offset__d;
+  x = (double)adc_T * (1.0 / 131072.0) - Coeffs__p->T_fine_offset__d;
+  var2 = x * x * Coeffs__p->T3__d;
+  *T_fine__dp = var1 + var2;
+  return *T_fine__dp * (1.0 / 5120.0);
+}
 
-  // Make sure the sensor isn't busy updating values.
-  uint8_t Status__u8 = 0x01;
-  while ((Status__u8 & 0x01) != 0)
+///////////////////////////////////////////////////////////////////////////////
+// Returns pressure in Pa.
+double bme280_compensate_P_double(const bme280_coeffs_t * Coeffs__p,
+  int32_t adc_P, double t_fine)
+{
+  double var1, var2, p;
+  var1 = t_fine * 0.5 - 64000.0;
+  var2 = var1 * var1 * Coeffs__p->P6_scale__d + var1 * Coeffs__p->P5_x2__d;
+  var2 = var2 * 0.25 + Coeffs__p->P4_scale__d;
+  var1 = (Coeffs__p->P3_scale__d * var1 * var1 + Coeffs__p->P2__d * var1)
+    * (1.0 / 524288.0);
+  var1 = Coeffs__p->P1__d + var1 * Coeffs__p->P1_scale__d;
+  if (var1 == 0.0)
   {
-    uint8_t Num_bytes_read__u8 = bme280_read(eBME280reg_STATUS, &Status__u8, 1);
+    // Avoid divide by zero exception.
+    return 0.0;
+  }
+  p = 1048576.0 - (double)adc_P;
+  p = (p - var2 * (1.0 / 4096.0)) * 6250.0 / var1;
+  var1 = Coeffs__p->P9_scale__d * p * p;
+  var2 = p * Coeffs__p->P8_scale__d;
+  return p + (var1 + var2 + Coeffs__p->P7__d) * (1.0 / 16.0);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Returns humidity in %RH.
+double bme280_compensate_H_double(const bme280_coeffs_t * Coeffs__p,
+  int32_t adc_H, double t_fine)
+{
+  double h = t_fine - 76800.0;
+  h = ((double)adc_H - (Coeffs__p->H4_x64__d + Coeffs__p->H5_scale__d * h))
+    * (Coeffs__p->H2_scale__d * (1.0 + Coeffs__p->H6_scale__d * h
+    * (1.0 + Coeffs__p->H3_scale__d * h)));
+  h = h * (1.0 - Coeffs__p->H1_scale__d * h);
+  if (h > 100.0) { h = 100.0; }
+  if (h < 0.0) { h = 0.0; }
+  return h;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void bme280_dev_set_float_compensation(bme280_dev_t * Dev__p, int Enable__i)
+{
+  Dev__p->Use_float_compensation__i = Enable__i;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Return: 1 once the sensor is no longer busy (or polling gave up), 0 if the
+//         status register could not be read.
+static int bme280_wait_not_busy(bme280_dev_t * Dev__p)
+{
+  // Make sure the sensor isn't busy updating values. Rather than spinning on
+  // the status register, sleep for the remainder of the conversion computed
+  // from the oversampling settings, then poll a bounded number of times.
+  uint32_t Num_polls__u32 = 0;
+  uint8_t Status__u8 = 0;
+  while (1)
+  {
+    uint8_t Num_bytes_read__u8 = bme280_read(Dev__p, eBME280reg_STATUS,
+      &Status__u8, 1);
+    Num_polls__u32++;
     if (Num_bytes_read__u8 != 1)
     {
-      return Return_status__i;
+      Dev__p->Poll_stats.Total_polls__u32 += Num_polls__u32;
+      return 0;
     }
+    if ((Status__u8 & (eBME280status_MEASURING | eBME280status_IM_UPDATE)) == 0)
+    {
+      break;
+    }
+    if (Num_polls__u32 > MAX_STATUS_POLLS)
+    {
+      // The data registers are shadowed, so the previous sample is still
+      // consistent; take it instead of waiting indefinitely.
+      Dev__p->Poll_stats.Poll_timeouts__u32++;
+      break;
+    }
+
+    uint32_t Wait_us__u32 = bme280_remaining_conversion_us(Dev__p);
+    if (Wait_us__u32 == 0)
+    {
+      // The estimate has run out (oscillator drift, NVM copy); back off in
+      // small steps.
+      Wait_us__u32 = bme280_dev_get_measurement_time_us(Dev__p)
+        / MAX_STATUS_POLLS;
+    }
+    bme280_sleep_us(Wait_us__u32);
+  }
+
+  Dev__p->Poll_stats.Last_polls__u32 = Num_polls__u32;
+  Dev__p->Poll_stats.Total_polls__u32 += Num_polls__u32;
+  if (Num_polls__u32 > Dev__p->Poll_stats.Max_polls__u32)
+  {
+    Dev__p->Poll_stats.Max_polls__u32 = Num_polls__u32;
   }
+  Dev__p->Poll_stats.Reads__u32++;
+  return 1;
+}
 
+///////////////////////////////////////////////////////////////////////////////
+// Reads and compensates the data registers.
+static int bme280_read_data(bme280_dev_t * Dev__p, float * Temp_c__fp,
+  float * Pres_Pa__fp, float * Hum_pct__fp)
+{
+  int Return_status__i = 0;
   const uint8_t Num_bytes_to_read__u8 = 8;
   uint8_t Buffer__u8a[Num_bytes_to_read__u8];
   int Num_retries__i = 0;
   while (Num_retries__i <= Num_allowed_retries__i)
   {
     uint8_t Register__u8 = eBME280reg_PRESDATA;
-    int Num_bytes_read__i = bme280_read(Register__u8, Buffer__u8a,
+    int Num_bytes_read__i = bme280_read(Dev__p, Register__u8, Buffer__u8a,
       Num_bytes_to_read__u8);
     if (Num_bytes_read__i == (int)Num_bytes_to_read__u8)
     {
@@ -358,11 +592,26 @@ int bme280_read_sensors(float * Temp_c__fp, float * Pres_Pa__fp,
       int32_t Humidity_raw_adc__i32 = (((int32_t)Buffer__u8a[6]) << 8);
       // Least Significant Bits [7:0] of Humidity ADC value.
       Humidity_raw_adc__i32 += ((int32_t)Buffer__u8a[7]);
-printf("raw H = 0x%08x\n", Humidity_raw_adc__i32);
 
-      *Temp_c__fp = bme280_compensate_T_int32(Temperature_raw_adc__i32) / 100.0;
-      *Pres_Pa__fp = bme280_compensate_P_int64(Pressure_raw_adc__i32) / 256.0;
-      *Hum_pct__fp = bme280_compensate_H_int32(Humidity_raw_adc__i32) / 1024.0;
+      if (Dev__p->Use_float_compensation__i)
+      {
+        double T_fine__d;
+        *Temp_c__fp = bme280_compensate_T_double(&Dev__p->Coeffs,
+          Temperature_raw_adc__i32, &T_fine__d);
+        *Pres_Pa__fp = bme280_compensate_P_double(&Dev__p->Coeffs,
+          Pressure_raw_adc__i32, T_fine__d);
+        *Hum_pct__fp = bme280_compensate_H_double(&Dev__p->Coeffs,
+          Humidity_raw_adc__i32, T_fine__d);
+      }
+      else
+      {
+        *Temp_c__fp = bme280_compensate_T_int32(&Dev__p->Calib,
+          Temperature_raw_adc__i32, &Dev__p->T_fine__i32) / 100.0;
+        *Pres_Pa__fp = bme280_compensate_P_int64(&Dev__p->Calib,
+          Pressure_raw_adc__i32, Dev__p->T_fine__i32) / 256.0;
+        *Hum_pct__fp = bme280_compensate_H_int32(&Dev__p->Calib,
+          Humidity_raw_adc__i32, Dev__p->T_fine__i32) / 1024.0;
+      }
 
       Return_status__i = 1;
       break;
@@ -375,3 +624,196 @@ printf("raw H = 0x%08x\n", Humidity_raw_adc__i32);
   return Return_status__i;
 }
 
+
+///////////////////////////////////////////////////////////////////////////////
+int bme280_dev_read_sensors(bme280_dev_t * Dev__p, float * Temp_c__fp,
+  float * Pres_Pa__fp, float * Hum_pct__fp)
+{
+  if (bme280_wait_not_busy(Dev__p) != 1)
+  {
+    return 0;
+  }
+  return bme280_read_data(Dev__p, Temp_c__fp, Pres_Pa__fp, Hum_pct__fp);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+int bme280_dev_set_forced_mode(bme280_dev_t * Dev__p)
+{
+  // Keep the oversampling bits, clear mode bits 1~0 = 00 = sleep mode.
+  const uint8_t Control_setting__u8 =
+    Dev__p->Ctrl_meas_setting__u8 & (uint8_t)~0x03;
+  uint8_t Bytes_written__u8 = bme280_write(Dev__p, eBME280reg_CONTROL,
+    &Control_setting__u8, 1);
+  if (Bytes_written__u8 != 1)
+  {
+    #ifdef SHOW_DEBUG_OUTPUT
+    printf("Err: Could not write 0x%02x to register 0x%02x.\n",
+      Control_setting__u8, eBME280reg_CONTROL);
+    #endif
+    return 0;
+  }
+  Dev__p->Ctrl_meas_setting__u8 = Control_setting__u8;
+  return 1;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+int bme280_dev_set_oversampling(bme280_dev_t * Dev__p, uint8_t Osrs_t__u8,
+  uint8_t Osrs_p__u8, uint8_t Osrs_h__u8)
+{
+  // ctrl_hum only takes effect with the next write to ctrl_meas, so it goes
+  // first. The mode bits 1~0 are kept.
+  const uint8_t Hum_setting__u8 = Osrs_h__u8 & 0x07;
+  const uint8_t Control_setting__u8 = (uint8_t)(((Osrs_t__u8 & 0x07) << 5)
+    | ((Osrs_p__u8 & 0x07) << 2) | (Dev__p->Ctrl_meas_setting__u8 & 0x03));
+  if (bme280_write(Dev__p, eBME280reg_CTRL_HUM, &Hum_setting__u8, 1) != 1
+    || bme280_write(Dev__p, eBME280reg_CONTROL, &Control_setting__u8, 1) != 1)
+  {
+    #ifdef SHOW_DEBUG_OUTPUT
+    printf("Err: Could not write oversampling 0x%02x/0x%02x.\n",
+      Hum_setting__u8, Control_setting__u8);
+    #endif
+    return 0;
+  }
+  Dev__p->Ctrl_hum_setting__u8 = Hum_setting__u8;
+  Dev__p->Ctrl_meas_setting__u8 = Control_setting__u8;
+  return 1;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Starts a single forced-mode conversion.
+// Return: 1 on success, 0 if the control register could not be written.
+static int bme280_trigger_forced(bme280_dev_t * Dev__p)
+{
+  // bits 1~0 = 01 = forced mode: one conversion, then back to sleep.
+  const uint8_t Control_setting__u8 =
+    (Dev__p->Ctrl_meas_setting__u8 & (uint8_t)~0x03) | 0x01;
+  uint64_t Trigger_us__u64 = bme280_now_us();
+  uint8_t Bytes_written__u8 = bme280_write(Dev__p, eBME280reg_CONTROL,
+    &Control_setting__u8, 1);
+  if (Bytes_written__u8 != 1)
+  {
+    return 0;
+  }
+  Dev__p->Conversion_start_us__u64 = Trigger_us__u64;
+  Dev__p->Ctrl_meas_setting__u8 = Control_setting__u8;
+  return 1;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Collects the result of a conversion started by bme280_trigger_forced().
+static int bme280_collect_forced(bme280_dev_t * Dev__p, float * Temp_c__fp,
+  float * Pres_Pa__fp, float * Hum_pct__fp, uint32_t * Latency_us__u32p)
+{
+  int Return_status__i = bme280_wait_not_busy(Dev__p);
+  if (Return_status__i == 1)
+  {
+    Return_status__i = bme280_read_data(Dev__p, Temp_c__fp, Pres_Pa__fp,
+      Hum_pct__fp);
+  }
+
+  // The chip has returned to sleep by itself.
+  Dev__p->Ctrl_meas_setting__u8 &= (uint8_t)~0x03;
+  if (Latency_us__u32p != NULL)
+  {
+    *Latency_us__u32p =
+      (uint32_t)(bme280_now_us() - Dev__p->Conversion_start_us__u64);
+  }
+  return Return_status__i;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+int bme280_dev_read_sensors_forced(bme280_dev_t * Dev__p, float * Temp_c__fp,
+  float * Pres_Pa__fp, float * Hum_pct__fp, uint32_t * Latency_us__u32p)
+{
+  if (bme280_trigger_forced(Dev__p) != 1)
+  {
+    return 0;
+  }
+
+  // Sleep through the conversion; the first status poll is expected to find
+  // the sensor idle.
+  bme280_sleep_us(bme280_dev_get_measurement_time_us(Dev__p));
+  return bme280_collect_forced(Dev__p, Temp_c__fp, Pres_Pa__fp, Hum_pct__fp,
+    Latency_us__u32p);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+int bme280_read_all_forced(bme280_dev_t * Devs__p, int Num_devs__i,
+  bme280_sample_t * Samples__p)
+{
+  uint32_t Longest_us__u32 = 0;
+  int Dev_idx__i;
+
+  // Start every conversion first so they run in parallel.
+  for (Dev_idx__i = 0; Dev_idx__i < Num_devs__i; Dev_idx__i++)
+  {
+    Samples__p[Dev_idx__i].Status__i =
+      bme280_trigger_forced(&Devs__p[Dev_idx__i]);
+    uint32_t Measure_us__u32 =
+      bme280_dev_get_measurement_time_us(&Devs__p[Dev_idx__i]);
+    if (Measure_us__u32 > Longest_us__u32)
+    {
+      Longest_us__u32 = Measure_us__u32;
+    }
+  }
+
+  bme280_sleep_us(Longest_us__u32);
+
+  int Num_read__i = 0;
+  for (Dev_idx__i = 0; Dev_idx__i < Num_devs__i; Dev_idx__i++)
+  {
+    bme280_sample_t * Sample__p = &Samples__p[Dev_idx__i];
+    if (Sample__p->Status__i != 1)
+    {
+      continue;
+    }
+    Sample__p->Status__i = bme280_collect_forced(&Devs__p[Dev_idx__i],
+      &Sample__p->Temp_C__f, &Sample__p->Pres_Pa__f, &Sample__p->Hum_pct__f,
+      &Sample__p->Latency_us__u32);
+    if (Sample__p->Status__i == 1)
+    {
+      Num_read__i++;
+    }
+  }
+  return Num_read__i;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+int bme280_init(int Chip_enable_to_use__i)
+{
+  return bme280_dev_init(&Default_dev, Chip_enable_to_use__i);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+int bme280_read_sensors(float * Temp_c__fp, float * Pres_Pa__fp,
+  float * Hum_pct__fp)
+{
+  return bme280_dev_read_sensors(&Default_dev, Temp_c__fp, Pres_Pa__fp,
+    Hum_pct__fp);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+int bme280_set_forced_mode(void)
+{
+  return bme280_dev_set_forced_mode(&Default_dev);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+int bme280_read_sensors_forced(float * Temp_c__fp, float * Pres_Pa__fp,
+  float * Hum_pct__fp, uint32_t * Latency_us__u32p)
+{
+  return bme280_dev_read_sensors_forced(&Default_dev, Temp_c__fp, Pres_Pa__fp,
+    Hum_pct__fp, Latency_us__u32p);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+uint32_t bme280_get_measurement_time_us(void)
+{
+  return bme280_dev_get_measurement_time_us(&Default_dev);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void bme280_get_poll_stats(bme280_poll_stats_t * Stats__p)
+{
+  bme280_dev_get_poll_stats(&Default_dev, Stats__p);
+}
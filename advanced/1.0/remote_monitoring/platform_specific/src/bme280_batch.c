@@ -0,0 +1,204 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// bme280_batch.c:
+// Batch compensation of raw BME280 ADC samples. The temperature and humidity
+// formulas are pure 32 bit integer arithmetic, so they map lane for lane onto
+// AVX2, SSE4.1 or NEON; the kernel is selected when compiling. Overflow wraps
+// the same way in every lane as in the scalar code, which keeps the results
+// bit-identical.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#include "bme280_batch.h"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define BATCH_KERNEL_NAME "avx2"
+#define VEC_LANES (8)
+typedef __m256i vec_t;
+#define VEC_LOAD(p)      _mm256_loadu_si256((const __m256i *)(p))
+#define VEC_STORE(p, v)  _mm256_storeu_si256((__m256i *)(p), (v))
+#define VEC_SET1(x)      _mm256_set1_epi32(x)
+#define VEC_ADD(a, b)    _mm256_add_epi32((a), (b))
+#define VEC_SUB(a, b)    _mm256_sub_epi32((a), (b))
+#define VEC_MUL(a, b)    _mm256_mullo_epi32((a), (b))
+#define VEC_SRA(a, n)    _mm256_srai_epi32((a), (n))
+#define VEC_SLL(a, n)    _mm256_slli_epi32((a), (n))
+#define VEC_MAX(a, b)    _mm256_max_epi32((a), (b))
+#define VEC_MIN(a, b)    _mm256_min_epi32((a), (b))
+
+#elif defined(__SSE4_1__)
+#include <smmintrin.h>
+#define BATCH_KERNEL_NAME "sse4.1"
+#define VEC_LANES (4)
+typedef __m128i vec_t;
+#define VEC_LOAD(p)      _mm_loadu_si128((const __m128i *)(p))
+#define VEC_STORE(p, v)  _mm_storeu_si128((__m128i *)(p), (v))
+#define VEC_SET1(x)      _mm_set1_epi32(x)
+#define VEC_ADD(a, b)    _mm_add_epi32((a), (b))
+#define VEC_SUB(a, b)    _mm_sub_epi32((a), (b))
+#define VEC_MUL(a, b)    _mm_mullo_epi32((a), (b))
+#define VEC_SRA(a, n)    _mm_srai_epi32((a), (n))
+#define VEC_SLL(a, n)    _mm_slli_epi32((a), (n))
+#define VEC_MAX(a, b)    _mm_max_epi32((a), (b))
+#define VEC_MIN(a, b)    _mm_min_epi32((a), (b))
+
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define BATCH_KERNEL_NAME "neon"
+#define VEC_LANES (4)
+typedef int32x4_t vec_t;
+#define VEC_LOAD(p)      vld1q_s32((const int32_t *)(p))
+#define VEC_STORE(p, v)  vst1q_s32((int32_t *)(p), (v))
+#define VEC_SET1(x)      vdupq_n_s32(x)
+#define VEC_ADD(a, b)    vaddq_s32((a), (b))
+#define VEC_SUB(a, b)    vsubq_s32((a), (b))
+#define VEC_MUL(a, b)    vmulq_s32((a), (b))
+#define VEC_SRA(a, n)    vshrq_n_s32((a), (n))
+#define VEC_SLL(a, n)    vshlq_n_s32((a), (n))
+#define VEC_MAX(a, b)    vmaxq_s32((a), (b))
+#define VEC_MIN(a, b)    vminq_s32((a), (b))
+
+#else
+#define BATCH_KERNEL_NAME "scalar"
+#define VEC_LANES (0)
+#endif
+
+
+///////////////////////////////////////////////////////////////////////////////
+void bme280_compensate_T_batch_scalar(const bme280_calib_data_t * Calib__p,
+  const int32_t * Adc_T__i32p, int32_t * Temp__i32p, int32_t * T_fine__i32p,
+  size_t Num_samples__z)
+{
+  size_t Idx__z;
+  for (Idx__z = 0; Idx__z < Num_samples__z; Idx__z++)
+  {
+    Temp__i32p[Idx__z] = bme280_compensate_T_int32(Calib__p,
+      Adc_T__i32p[Idx__z], &T_fine__i32p[Idx__z]);
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void bme280_compensate_H_batch_scalar(const bme280_calib_data_t * Calib__p,
+  const int32_t * Adc_H__i32p, const int32_t * T_fine__i32p,
+  uint32_t * Hum__u32p, size_t Num_samples__z)
+{
+  size_t Idx__z;
+  for (Idx__z = 0; Idx__z < Num_samples__z; Idx__z++)
+  {
+    Hum__u32p[Idx__z] = bme280_compensate_H_int32(Calib__p,
+      Adc_H__i32p[Idx__z], T_fine__i32p[Idx__z]);
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void bme280_compensate_T_batch(const bme280_calib_data_t * Calib__p,
+  const int32_t * Adc_T__i32p, int32_t * Temp__i32p, int32_t * T_fine__i32p,
+  size_t Num_samples__z)
+{
+  size_t Idx__z = 0;
+
+#if VEC_LANES > 0
+  const vec_t T1__v = VEC_SET1((int32_t)Calib__p->dig_T1);
+  const vec_t T1_x2__v = VEC_SET1((int32_t)Calib__p->dig_T1 << 1);
+  const vec_t T2__v = VEC_SET1((int32_t)Calib__p->dig_T2);
+  const vec_t T3__v = VEC_SET1((int32_t)Calib__p->dig_T3);
+  const vec_t Five__v = VEC_SET1(5);
+  const vec_t Round__v = VEC_SET1(128);
+
+  for (; Idx__z + VEC_LANES <= Num_samples__z; Idx__z += VEC_LANES)
+  {
+    vec_t Adc__v = VEC_LOAD(&Adc_T__i32p[Idx__z]);
+
+    // var1 = (((adc_T >> 3) - (dig_T1 << 1)) * dig_T2) >> 11
+    vec_t Var1__v = VEC_SRA(VEC_MUL(VEC_SUB(VEC_SRA(Adc__v, 3), T1_x2__v),
+      T2__v), 11);
+
+    // var2 = (((((adc_T >> 4) - dig_T1) ^ 2) >> 12) * dig_T3) >> 14
+    vec_t Delta__v = VEC_SUB(VEC_SRA(Adc__v, 4), T1__v);
+    vec_t Var2__v = VEC_SRA(VEC_MUL(VEC_SRA(VEC_MUL(Delta__v, Delta__v), 12),
+      T3__v), 14);
+
+    vec_t T_fine__v = VEC_ADD(Var1__v, Var2__v);
+    VEC_STORE(&T_fine__i32p[Idx__z], T_fine__v);
+    VEC_STORE(&Temp__i32p[Idx__z],
+      VEC_SRA(VEC_ADD(VEC_MUL(T_fine__v, Five__v), Round__v), 8));
+  }
+#endif
+
+  bme280_compensate_T_batch_scalar(Calib__p, &Adc_T__i32p[Idx__z],
+    &Temp__i32p[Idx__z], &T_fine__i32p[Idx__z], Num_samples__z - Idx__z);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void bme280_compensate_P_batch(const bme280_calib_data_t * Calib__p,
+  const int32_t * Adc_P__i32p, const int32_t * T_fine__i32p,
+  uint32_t * Pres__u32p, size_t Num_samples__z)
+{
+  size_t Idx__z;
+  for (Idx__z = 0; Idx__z < Num_samples__z; Idx__z++)
+  {
+    Pres__u32p[Idx__z] = bme280_compensate_P_int64(Calib__p,
+      Adc_P__i32p[Idx__z], T_fine__i32p[Idx__z]);
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void bme280_compensate_H_batch(const bme280_calib_data_t * Calib__p,
+  const int32_t * Adc_H__i32p, const int32_t * T_fine__i32p,
+  uint32_t * Hum__u32p, size_t Num_samples__z)
+{
+  size_t Idx__z = 0;
+
+#if VEC_LANES > 0
+  const vec_t H1__v = VEC_SET1((int32_t)Calib__p->dig_H1);
+  const vec_t H2__v = VEC_SET1((int32_t)Calib__p->dig_H2);
+  const vec_t H3__v = VEC_SET1((int32_t)Calib__p->dig_H3);
+  const vec_t H4_shl20__v = VEC_SET1((int32_t)Calib__p->dig_H4 << 20);
+  const vec_t H5__v = VEC_SET1((int32_t)Calib__p->dig_H5);
+  const vec_t H6__v = VEC_SET1((int32_t)Calib__p->dig_H6);
+  const vec_t T_offset__v = VEC_SET1(76800);
+  const vec_t C16384__v = VEC_SET1(16384);
+  const vec_t C32768__v = VEC_SET1(32768);
+  const vec_t C2097152__v = VEC_SET1(2097152);
+  const vec_t C8192__v = VEC_SET1(8192);
+  const vec_t Zero__v = VEC_SET1(0);
+  const vec_t Max__v = VEC_SET1(419430400);
+
+  for (; Idx__z + VEC_LANES <= Num_samples__z; Idx__z += VEC_LANES)
+  {
+    vec_t Adc__v = VEC_LOAD(&Adc_H__i32p[Idx__z]);
+    vec_t V__v = VEC_SUB(VEC_LOAD(&T_fine__i32p[Idx__z]), T_offset__v);
+
+    // ((adc_H << 14) - (dig_H4 << 20) - (dig_H5 * v) + 16384) >> 15
+    vec_t Left__v = VEC_SRA(VEC_ADD(VEC_SUB(VEC_SUB(VEC_SLL(Adc__v, 14),
+      H4_shl20__v), VEC_MUL(H5__v, V__v)), C16384__v), 15);
+
+    // ((((((v * dig_H6) >> 10) * (((v * dig_H3) >> 11) + 32768)) >> 10)
+    //   + 2097152) * dig_H2 + 8192) >> 14
+    vec_t Right__v = VEC_MUL(VEC_SRA(VEC_MUL(V__v, H6__v), 10),
+      VEC_ADD(VEC_SRA(VEC_MUL(V__v, H3__v), 11), C32768__v));
+    Right__v = VEC_ADD(VEC_SRA(Right__v, 10), C2097152__v);
+    Right__v = VEC_SRA(VEC_ADD(VEC_MUL(Right__v, H2__v), C8192__v), 14);
+
+    V__v = VEC_MUL(Left__v, Right__v);
+
+    // v - (((((v >> 15) * (v >> 15)) >> 7) * dig_H1) >> 4)
+    vec_t V15__v = VEC_SRA(V__v, 15);
+    V__v = VEC_SUB(V__v, VEC_SRA(VEC_MUL(VEC_SRA(VEC_MUL(V15__v, V15__v), 7),
+      H1__v), 4));
+
+    V__v = VEC_MIN(VEC_MAX(V__v, Zero__v), Max__v);
+    VEC_STORE(&Hum__u32p[Idx__z], VEC_SRA(V__v, 12));
+  }
+#endif
+
+  bme280_compensate_H_batch_scalar(Calib__p, &Adc_H__i32p[Idx__z],
+    &T_fine__i32p[Idx__z], &Hum__u32p[Idx__z], Num_samples__z - Idx__z);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+const char * bme280_batch_kernel_name(void)
+{
+  return BATCH_KERNEL_NAME;
+}
@@ -0,0 +1,433 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// bme280_emul.c:
+// In-memory BME280 register emulator. Models the SPI register protocol, the
+// calibration NVM, the status busy bits and the conversion timing of the
+// sleep, forced and normal power modes.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#define _POSIX_C_SOURCE 200809L
+#include "bme280_emul.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+
+#define EMUL_NUM_REGISTERS (256)
+#define EMUL_NVM_COPY_US (2000)
+
+enum
+{
+    eEmulreg_CHIPID    = 0xD0
+  , eEmulreg_SWRESET   = 0xE0
+  , eEmulreg_CTRL_HUM  = 0xF2
+  , eEmulreg_STATUS    = 0xF3
+  , eEmulreg_CTRL_MEAS = 0xF4
+  , eEmulreg_CONFIG    = 0xF5
+  , eEmulreg_PRESDATA  = 0xF7
+  , eEmulreg_TEMPDATA  = 0xFA
+  , eEmulreg_HUMDATA   = 0xFD
+};
+
+struct bme280_emul_tag
+{
+  pthread_mutex_t Lock;
+  uint8_t Registers__u8a[EMUL_NUM_REGISTERS];
+
+  // ctrl_hum only takes effect on the next write to ctrl_meas.
+  uint8_t Active_osrs_h__u8;
+
+  int32_t Adc_T__i32;
+  int32_t Adc_P__i32;
+  int32_t Adc_H__i32;
+
+  uint32_t Conversion_latency_us__u32;
+  uint32_t Spi_latency_us__u32;
+
+  uint64_t Nvm_busy_until_us__u64;
+  uint64_t Conversion_start_us__u64;
+  uint64_t Conversions_latched__u64;
+
+  bme280_emul_stats_t Stats;
+};
+
+// Typical calibration constants, little endian as laid out in 0x88~0x9F.
+static const uint8_t Default_tp_calib__u8a[24] =
+{
+  0x70, 0x6B,  0x43, 0x67,  0x18, 0xFC,              // T1..T3
+  0x7D, 0x8E,  0x43, 0xD6,  0xD0, 0x0B,  0x27, 0x0B, // P1..P4
+  0x8C, 0x00,  0xF9, 0xFF,  0x8C, 0x3C,  0xF8, 0xC6, // P5..P8
+  0x70, 0x17                                         // P9
+};
+// dig_H1 at 0xA1, then dig_H2..dig_H6 packed into 0xE1~0xE7.
+static const uint8_t Default_h1_calib__u8 = 0x4B;
+static const uint8_t Default_h_calib__u8a[7] =
+{
+  0x6A, 0x01, 0x00, 0x13, 0x29, 0x03, 0x1E
+};
+
+// Standby durations selected by config bits 7~5, in microseconds.
+static const uint32_t Standby_us__u32a[8] =
+{
+  500, 62500, 125000, 250000, 500000, 1000000, 10000, 20000
+};
+
+
+///////////////////////////////////////////////////////////////////////////////
+static uint64_t emul_now_us(void)
+{
+  struct timespec Now;
+  clock_gettime(CLOCK_MONOTONIC, &Now);
+  return ((uint64_t)Now.tv_sec * 1000000ULL) + ((uint64_t)Now.tv_nsec / 1000);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+static void emul_sleep_us(uint32_t Duration_us__u32)
+{
+  struct timespec Duration;
+  Duration.tv_sec = Duration_us__u32 / 1000000;
+  Duration.tv_nsec = (long)(Duration_us__u32 % 1000000) * 1000L;
+  while (nanosleep(&Duration, &Duration) != 0)
+  {
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Oversampling register field to number of samples (0 = skipped).
+static uint32_t emul_osrs_samples(uint8_t Osrs__u8)
+{
+  static const uint32_t Samples__u32a[8] = { 0, 1, 2, 4, 8, 16, 16, 16 };
+  return Samples__u32a[Osrs__u8 & 0x07];
+}
+
+///////////////////////////////////////////////////////////////////////////////
+static uint32_t emul_conversion_us(const bme280_emul_t * Emul__p)
+{
+  if (Emul__p->Conversion_latency_us__u32 != 0)
+  {
+    return Emul__p->Conversion_latency_us__u32;
+  }
+
+  // Datasheet section 9.1, maximum measurement time.
+  uint8_t Ctrl_meas__u8 = Emul__p->Registers__u8a[eEmulreg_CTRL_MEAS];
+  uint32_t Osrs_t__u32 = emul_osrs_samples(Ctrl_meas__u8 >> 5);
+  uint32_t Osrs_p__u32 = emul_osrs_samples(Ctrl_meas__u8 >> 2);
+  uint32_t Osrs_h__u32 = emul_osrs_samples(Emul__p->Active_osrs_h__u8);
+  uint32_t Time_us__u32 = 1250 + 2300 * Osrs_t__u32;
+  if (Osrs_p__u32 != 0) { Time_us__u32 += 2300 * Osrs_p__u32 + 575; }
+  if (Osrs_h__u32 != 0) { Time_us__u32 += 2300 * Osrs_h__u32 + 575; }
+  return Time_us__u32;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+static void emul_store_20bit(uint8_t * Register__u8p, int32_t Value__i32)
+{
+  Register__u8p[0] = (uint8_t)(Value__i32 >> 12);
+  Register__u8p[1] = (uint8_t)(Value__i32 >> 4);
+  Register__u8p[2] = (uint8_t)((Value__i32 & 0x0F) << 4);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Copies the raw ADC values into the data registers, as the chip does at the
+// end of a conversion. Skipped channels read back as 0x80000 / 0x8000.
+static void emul_latch_data(bme280_emul_t * Emul__p)
+{
+  uint8_t Ctrl_meas__u8 = Emul__p->Registers__u8a[eEmulreg_CTRL_MEAS];
+  uint8_t * Reg__u8p = Emul__p->Registers__u8a;
+
+  emul_store_20bit(&Reg__u8p[eEmulreg_PRESDATA],
+    emul_osrs_samples(Ctrl_meas__u8 >> 2) ? Emul__p->Adc_P__i32 : 0x80000);
+  emul_store_20bit(&Reg__u8p[eEmulreg_TEMPDATA],
+    emul_osrs_samples(Ctrl_meas__u8 >> 5) ? Emul__p->Adc_T__i32 : 0x80000);
+
+  int32_t Adc_H__i32 = emul_osrs_samples(Emul__p->Active_osrs_h__u8)
+    ? Emul__p->Adc_H__i32 : 0x8000;
+  Reg__u8p[eEmulreg_HUMDATA] = (uint8_t)(Adc_H__i32 >> 8);
+  Reg__u8p[eEmulreg_HUMDATA + 1] = (uint8_t)Adc_H__i32;
+
+  Emul__p->Stats.Conversions__u32++;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Advances the conversion state machine to Now and refreshes the status
+// register.
+static void emul_update(bme280_emul_t * Emul__p, uint64_t Now_us__u64)
+{
+  uint8_t * Ctrl_meas__u8p = &Emul__p->Registers__u8a[eEmulreg_CTRL_MEAS];
+  uint8_t Mode__u8 = *Ctrl_meas__u8p & 0x03;
+  uint64_t Elapsed_us__u64 = Now_us__u64 - Emul__p->Conversion_start_us__u64;
+  uint32_t Conversion_us__u32 = emul_conversion_us(Emul__p);
+  int Measuring__i = 0;
+
+  if ((Mode__u8 == 0x01) || (Mode__u8 == 0x02))
+  {
+    // Forced mode: one conversion, then back to sleep.
+    if (Elapsed_us__u64 >= Conversion_us__u32)
+    {
+      emul_latch_data(Emul__p);
+      *Ctrl_meas__u8p &= (uint8_t)~0x03;
+    }
+    else
+    {
+      Measuring__i = 1;
+    }
+  }
+  else if (Mode__u8 == 0x03)
+  {
+    uint8_t Config__u8 = Emul__p->Registers__u8a[eEmulreg_CONFIG];
+    uint64_t Period_us__u64 = (uint64_t)Conversion_us__u32
+      + Standby_us__u32a[(Config__u8 >> 5) & 0x07];
+    uint64_t Completed__u64 = 0;
+    if (Elapsed_us__u64 >= Conversion_us__u32)
+    {
+      Completed__u64 = (Elapsed_us__u64 - Conversion_us__u32)
+        / Period_us__u64 + 1;
+    }
+    if (Completed__u64 > Emul__p->Conversions_latched__u64)
+    {
+      emul_latch_data(Emul__p);
+      Emul__p->Conversions_latched__u64 = Completed__u64;
+    }
+    Measuring__i = ((Elapsed_us__u64 % Period_us__u64) < Conversion_us__u32);
+  }
+
+  uint8_t Status__u8 = 0;
+  if (Measuring__i) { Status__u8 |= 0x08; }
+  if (Now_us__u64 < Emul__p->Nvm_busy_until_us__u64) { Status__u8 |= 0x01; }
+  Emul__p->Registers__u8a[eEmulreg_STATUS] = Status__u8;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+static void emul_reset(bme280_emul_t * Emul__p, uint64_t Now_us__u64)
+{
+  Emul__p->Registers__u8a[eEmulreg_CTRL_HUM] = 0x00;
+  Emul__p->Registers__u8a[eEmulreg_CTRL_MEAS] = 0x00;
+  Emul__p->Registers__u8a[eEmulreg_CONFIG] = 0x00;
+  Emul__p->Active_osrs_h__u8 = 0;
+  Emul__p->Nvm_busy_until_us__u64 = Now_us__u64 + EMUL_NVM_COPY_US;
+
+  // Data registers hold the reset values until the first conversion.
+  emul_store_20bit(&Emul__p->Registers__u8a[eEmulreg_PRESDATA], 0x80000);
+  emul_store_20bit(&Emul__p->Registers__u8a[eEmulreg_TEMPDATA], 0x80000);
+  Emul__p->Registers__u8a[eEmulreg_HUMDATA] = 0x80;
+  Emul__p->Registers__u8a[eEmulreg_HUMDATA + 1] = 0x00;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+static void emul_write_register(bme280_emul_t * Emul__p, uint8_t Register__u8,
+  uint8_t Value__u8, uint64_t Now_us__u64)
+{
+  switch (Register__u8)
+  {
+  case eEmulreg_SWRESET:
+    if (Value__u8 == 0xB6)
+    {
+      emul_reset(Emul__p, Now_us__u64);
+    }
+    break;
+
+  case eEmulreg_CTRL_HUM:
+    Emul__p->Registers__u8a[eEmulreg_CTRL_HUM] = Value__u8 & 0x07;
+    break;
+
+  case eEmulreg_CTRL_MEAS:
+    Emul__p->Registers__u8a[eEmulreg_CTRL_MEAS] = Value__u8;
+    Emul__p->Active_osrs_h__u8 = Emul__p->Registers__u8a[eEmulreg_CTRL_HUM];
+    Emul__p->Conversion_start_us__u64 = Now_us__u64;
+    Emul__p->Conversions_latched__u64 = 0;
+    break;
+
+  case eEmulreg_CONFIG:
+    Emul__p->Registers__u8a[eEmulreg_CONFIG] = Value__u8 & 0xFD;
+    break;
+
+  default:
+    // Everything else is read only.
+    break;
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+static int emul_data_rw(void * Context__p, int Chip_enable__i,
+  uint8_t * Data__u8p, int Len__i)
+{
+  bme280_emul_t * Emul__p = (bme280_emul_t *)Context__p;
+  (void)Chip_enable__i;
+
+  if ((Emul__p == NULL) || (Data__u8p == NULL) || (Len__i < 1))
+  {
+    return -1;
+  }
+
+  pthread_mutex_lock(&Emul__p->Lock);
+
+  if (Emul__p->Spi_latency_us__u32 != 0)
+  {
+    emul_sleep_us(Emul__p->Spi_latency_us__u32);
+  }
+
+  uint64_t Now_us__u64 = emul_now_us();
+  emul_update(Emul__p, Now_us__u64);
+  Emul__p->Stats.Transactions__u32++;
+  Emul__p->Stats.Bytes__u32 += (uint32_t)Len__i;
+
+  if ((Data__u8p[0] & 0x80) != 0)
+  {
+    // Read: the address auto-increments for as long as the transfer runs.
+    uint8_t Register__u8 = Data__u8p[0];
+    if (Register__u8 == eEmulreg_STATUS)
+    {
+      Emul__p->Stats.Status_reads__u32++;
+    }
+    Data__u8p[0] = 0xFF;
+    int Idx__i = 1;
+    while (Idx__i < Len__i)
+    {
+      Data__u8p[Idx__i] = Emul__p->Registers__u8a[Register__u8];
+      Register__u8 = (Register__u8 == 0xFF) ? 0xFF : (uint8_t)(Register__u8 + 1);
+      Idx__i++;
+    }
+  }
+  else
+  {
+    // Write: (address with bit 7 cleared, value) pairs.
+    int Idx__i = 0;
+    while (Idx__i + 1 < Len__i)
+    {
+      emul_write_register(Emul__p, (uint8_t)(Data__u8p[Idx__i] | 0x80),
+        Data__u8p[Idx__i + 1], Now_us__u64);
+      Data__u8p[Idx__i] = 0xFF;
+      Data__u8p[Idx__i + 1] = 0xFF;
+      Idx__i += 2;
+    }
+  }
+
+  pthread_mutex_unlock(&Emul__p->Lock);
+  return Len__i;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+bme280_emul_t * bme280_emul_create(void)
+{
+  bme280_emul_t * Emul__p = calloc(1, sizeof(bme280_emul_t));
+  if (Emul__p == NULL)
+  {
+    return NULL;
+  }
+
+  pthread_mutex_init(&Emul__p->Lock, NULL);
+  Emul__p->Registers__u8a[eEmulreg_CHIPID] = 0x60;
+  memcpy(&Emul__p->Registers__u8a[0x88], Default_tp_calib__u8a,
+    sizeof(Default_tp_calib__u8a));
+  Emul__p->Registers__u8a[0xA1] = Default_h1_calib__u8;
+  memcpy(&Emul__p->Registers__u8a[0xE1], Default_h_calib__u8a,
+    sizeof(Default_h_calib__u8a));
+
+  // Datasheet example values, roughly 25 *C, 1006 hPa and 50 %RH.
+  Emul__p->Adc_T__i32 = 519888;
+  Emul__p->Adc_P__i32 = 415148;
+  Emul__p->Adc_H__i32 = 0x6E50;
+
+  emul_reset(Emul__p, emul_now_us());
+  return Emul__p;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void bme280_emul_destroy(bme280_emul_t * Emul__p)
+{
+  if (Emul__p != NULL)
+  {
+    pthread_mutex_destroy(&Emul__p->Lock);
+    free(Emul__p);
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void bme280_emul_get_transport(bme280_emul_t * Emul__p,
+  bme280_transport_t * Transport__p)
+{
+  Transport__p->Data_rw__fn = emul_data_rw;
+  Transport__p->Context__p = Emul__p;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+static int emul_bus_data_rw(void * Context__p, int Chip_enable__i,
+  uint8_t * Data__u8p, int Len__i)
+{
+  bme280_emul_bus_t * Bus__p = (bme280_emul_bus_t *)Context__p;
+
+  if ((Chip_enable__i < 0) || (Chip_enable__i > 1))
+  {
+    return -1;
+  }
+  if (Bus__p->Chips__pa[Chip_enable__i] == NULL)
+  {
+    // Nothing drives MISO on an empty slot.
+    memset(Data__u8p, 0xFF, (size_t)Len__i);
+    return Len__i;
+  }
+  return emul_data_rw(Bus__p->Chips__pa[Chip_enable__i], Chip_enable__i,
+    Data__u8p, Len__i);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void bme280_emul_get_bus_transport(bme280_emul_bus_t * Bus__p,
+  bme280_transport_t * Transport__p)
+{
+  Transport__p->Data_rw__fn = emul_bus_data_rw;
+  Transport__p->Context__p = Bus__p;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void bme280_emul_poke(bme280_emul_t * Emul__p, uint8_t Register__u8,
+  const uint8_t * Data__u8p, int Num_bytes__i)
+{
+  pthread_mutex_lock(&Emul__p->Lock);
+  int Idx__i = 0;
+  while ((Idx__i < Num_bytes__i) && (Register__u8 + Idx__i < EMUL_NUM_REGISTERS))
+  {
+    Emul__p->Registers__u8a[Register__u8 + Idx__i] = Data__u8p[Idx__i];
+    Idx__i++;
+  }
+  pthread_mutex_unlock(&Emul__p->Lock);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void bme280_emul_set_raw_adc(bme280_emul_t * Emul__p, int32_t Adc_T__i32,
+  int32_t Adc_P__i32, int32_t Adc_H__i32)
+{
+  pthread_mutex_lock(&Emul__p->Lock);
+  Emul__p->Adc_T__i32 = Adc_T__i32 & 0xFFFFF;
+  Emul__p->Adc_P__i32 = Adc_P__i32 & 0xFFFFF;
+  Emul__p->Adc_H__i32 = Adc_H__i32 & 0xFFFF;
+  pthread_mutex_unlock(&Emul__p->Lock);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void bme280_emul_set_conversion_latency_us(bme280_emul_t * Emul__p,
+  uint32_t Latency_us__u32)
+{
+  pthread_mutex_lock(&Emul__p->Lock);
+  Emul__p->Conversion_latency_us__u32 = Latency_us__u32;
+  pthread_mutex_unlock(&Emul__p->Lock);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void bme280_emul_set_spi_latency_us(bme280_emul_t * Emul__p,
+  uint32_t Latency_us__u32)
+{
+  pthread_mutex_lock(&Emul__p->Lock);
+  Emul__p->Spi_latency_us__u32 = Latency_us__u32;
+  pthread_mutex_unlock(&Emul__p->Lock);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void bme280_emul_get_stats(bme280_emul_t * Emul__p,
+  bme280_emul_stats_t * Stats__p)
+{
+  pthread_mutex_lock(&Emul__p->Lock);
+  *Stats__p = Emul__p->Stats;
+  pthread_mutex_unlock(&Emul__p->Lock);
+}
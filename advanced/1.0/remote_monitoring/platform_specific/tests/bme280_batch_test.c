@@ -0,0 +1,194 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// bme280_batch_test.c:
+// Checks that the batch compensation kernel compiled in gives the same
+// results as the per-sample functions, bit for bit. Every 20 bit raw
+// temperature and every 16 bit raw humidity is compensated, the latter
+// across the t_fine range of the sensor, with a few calibration sets. Every
+// length up to three vectors is run as well, so the scalar tail is covered.
+// Exits non-zero on the first mismatch, or when a kernel name is given as the
+// argument and another one was compiled in.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "bme280_batch.h"
+
+#define ADC_T_RANGE (1 << 20)
+#define ADC_H_RANGE (1 << 16)
+#define ADC_P_STEP (97)
+// t_fine is about 5120 per degree, so this sweeps -40 to 85 DegC.
+#define T_FINE_MIN (-204800)
+#define T_FINE_MAX (435200)
+#define T_FINE_STEP (1021)
+#define TAIL_MAX (24)
+
+// The emulator's calibration, then two others seen on real parts.
+static const bme280_calib_data_t Calib_sets__a[] =
+{
+  { 27504, 26435, -1000, 36477, -10685, 3024, 2855, 140, -7, 15500, -14600, 6000,
+    75, 362, 0, 313, 50, 30 },
+  { 28485, 26735, 50, 37892, -10499, 3024, 5723, -99, -7, 9900, -10230, 4285,
+    75, 353, 0, 340, 0, 30 },
+  { 27000, 27000, -500, 36000, -10500, 3000, 4000, 100, -7, 12000, -12000, 5000,
+    100, 380, 12, 290, 40, 25 },
+};
+
+static int32_t Adc__i32a[ADC_T_RANGE];
+static int32_t T_fine__i32a[ADC_T_RANGE];
+static int32_t Batch_out__i32a[ADC_T_RANGE];
+static int32_t Batch_t_fine__i32a[ADC_T_RANGE];
+static int32_t Scalar_out__i32a[ADC_T_RANGE];
+
+///////////////////////////////////////////////////////////////////////////////
+static int check_T(const bme280_calib_data_t * Calib__p, size_t Offset__z,
+  size_t Num_samples__z)
+{
+  size_t Idx__z;
+
+  bme280_compensate_T_batch(Calib__p, &Adc__i32a[Offset__z], Batch_out__i32a,
+    Batch_t_fine__i32a, Num_samples__z);
+  for (Idx__z = 0; Idx__z < Num_samples__z; Idx__z++)
+  {
+    int32_t T_fine__i32;
+    int32_t Temp__i32 = bme280_compensate_T_int32(Calib__p,
+      Adc__i32a[Offset__z + Idx__z], &T_fine__i32);
+    if (Batch_out__i32a[Idx__z] != Temp__i32
+      || Batch_t_fine__i32a[Idx__z] != T_fine__i32)
+    {
+      printf("T mismatch at adc_T 0x%05x, length %zu: %d/%d, expected %d/%d\n",
+        (unsigned)Adc__i32a[Offset__z + Idx__z], Num_samples__z,
+        Batch_out__i32a[Idx__z], Batch_t_fine__i32a[Idx__z], Temp__i32,
+        T_fine__i32);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+static int check_H(const bme280_calib_data_t * Calib__p, size_t Offset__z,
+  size_t Num_samples__z)
+{
+  size_t Idx__z;
+
+  bme280_compensate_H_batch(Calib__p, &Adc__i32a[Offset__z],
+    &T_fine__i32a[Offset__z], (uint32_t *)Batch_out__i32a, Num_samples__z);
+  bme280_compensate_H_batch_scalar(Calib__p, &Adc__i32a[Offset__z],
+    &T_fine__i32a[Offset__z], (uint32_t *)Scalar_out__i32a, Num_samples__z);
+  for (Idx__z = 0; Idx__z < Num_samples__z; Idx__z++)
+  {
+    if (Batch_out__i32a[Idx__z] != Scalar_out__i32a[Idx__z])
+    {
+      printf("H mismatch at adc_H 0x%04x, t_fine %d, length %zu: %u, "
+        "expected %u\n", (unsigned)Adc__i32a[Offset__z + Idx__z],
+        T_fine__i32a[Offset__z + Idx__z], Num_samples__z,
+        (uint32_t)Batch_out__i32a[Idx__z], (uint32_t)Scalar_out__i32a[Idx__z]);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+static int check_P(const bme280_calib_data_t * Calib__p, int32_t T_fine__i32)
+{
+  size_t Num_samples__z = 0;
+  size_t Idx__z;
+  int32_t Adc__i32;
+
+  for (Adc__i32 = 0; Adc__i32 < ADC_T_RANGE; Adc__i32 += ADC_P_STEP)
+  {
+    Adc__i32a[Num_samples__z] = Adc__i32;
+    T_fine__i32a[Num_samples__z] = T_fine__i32;
+    Num_samples__z++;
+  }
+  bme280_compensate_P_batch(Calib__p, Adc__i32a, T_fine__i32a,
+    (uint32_t *)Batch_out__i32a, Num_samples__z);
+  for (Idx__z = 0; Idx__z < Num_samples__z; Idx__z++)
+  {
+    uint32_t Pres__u32 = bme280_compensate_P_int64(Calib__p, Adc__i32a[Idx__z],
+      T_fine__i32);
+    if ((uint32_t)Batch_out__i32a[Idx__z] != Pres__u32)
+    {
+      printf("P mismatch at adc_P 0x%05x, t_fine %d: %u, expected %u\n",
+        (unsigned)Adc__i32a[Idx__z], T_fine__i32,
+        (uint32_t)Batch_out__i32a[Idx__z], Pres__u32);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+int main(int argc, char * argv[])
+{
+  size_t Set__z;
+  size_t Length__z;
+  int32_t Adc__i32;
+  int32_t T_fine__i32;
+  unsigned long long Checked__ull = 0;
+
+  printf("bme280_batch_test: %s kernel\n", bme280_batch_kernel_name());
+  if (argc > 1 && strcmp(argv[1], bme280_batch_kernel_name()) != 0)
+  {
+    printf("bme280_batch_test: expected the %s kernel\n", argv[1]);
+    return EXIT_FAILURE;
+  }
+  for (Set__z = 0; Set__z < sizeof(Calib_sets__a) / sizeof(Calib_sets__a[0]);
+    Set__z++)
+  {
+    const bme280_calib_data_t * Calib__p = &Calib_sets__a[Set__z];
+
+    // Every raw temperature in one batch, then every short length.
+    for (Adc__i32 = 0; Adc__i32 < ADC_T_RANGE; Adc__i32++)
+    {
+      Adc__i32a[Adc__i32] = Adc__i32;
+    }
+    if (check_T(Calib__p, 0, ADC_T_RANGE) != 0)
+    {
+      return EXIT_FAILURE;
+    }
+    for (Length__z = 0; Length__z <= TAIL_MAX; Length__z++)
+    {
+      if (check_T(Calib__p, 0x80000 + Length__z, Length__z) != 0)
+      {
+        return EXIT_FAILURE;
+      }
+    }
+    Checked__ull += ADC_T_RANGE;
+
+    // Every raw humidity at each t_fine of the sweep.
+    for (T_fine__i32 = T_FINE_MIN; T_fine__i32 <= T_FINE_MAX;
+      T_fine__i32 += T_FINE_STEP)
+    {
+      for (Adc__i32 = 0; Adc__i32 < ADC_H_RANGE; Adc__i32++)
+      {
+        Adc__i32a[Adc__i32] = Adc__i32;
+        T_fine__i32a[Adc__i32] = T_fine__i32;
+      }
+      if (check_H(Calib__p, 0, ADC_H_RANGE) != 0)
+      {
+        return EXIT_FAILURE;
+      }
+      Checked__ull += ADC_H_RANGE;
+    }
+    for (Length__z = 0; Length__z <= TAIL_MAX; Length__z++)
+    {
+      if (check_H(Calib__p, 0x8000 + Length__z, Length__z) != 0)
+      {
+        return EXIT_FAILURE;
+      }
+    }
+
+    if (check_P(Calib__p, T_FINE_MIN) != 0 || check_P(Calib__p, 0)
+      != 0 || check_P(Calib__p, T_FINE_MAX) != 0)
+    {
+      return EXIT_FAILURE;
+    }
+  }
+  printf("bme280_batch_test: %llu samples match\n", Checked__ull);
+  return EXIT_SUCCESS;
+}
@@ -15,15 +15,76 @@
 #include <sys/types.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <sys/resource.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <errno.h>
+#ifdef USE_EVENT_LOOP
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
 
 #include <wiringPi.h>
 #include <wiringPiSPI.h>
 #include "bme280.h"
 #include "locking.h"
+#include "sample_ring.h"
+#include "telemetry_aggregator.h"
+#include "telemetry_deadband.h"
+#include "telemetry_batch.h"
+#include "telemetry_cbor.h"
+#include "message_pool.h"
+#include "telemetry_template.h"
+#include "store_forward.h"
+#include "firmware_download.h"
+#include "firmware_install.h"
+#include "hot_restart.h"
+#include "inflight_window.h"
+#include "led_engine.h"
+#include "method_pool.h"
+#include "periodic_schedule.h"
+#include "reported_state.h"
+#include "startup_phases.h"
+#ifdef COUNT_MALLOCS
+#include "alloc_counter.h"
+#endif
+#ifdef USE_BME280_EMULATOR
+#include "bme280_emul.h"
+#endif
+#ifdef USE_EVENT_LOOP
+#include "event_loop.h"
+#endif
+
+#ifdef USE_EVENT_LOOP
+/* Event loop mode drives the lower layer client from one epoll reactor
+   instead of letting the convenience layer run its own worker thread */
+typedef IOTHUB_CLIENT_LL_HANDLE HUB_CLIENT_HANDLE;
+#define HubClient_CreateFromConnectionString IoTHubClient_LL_CreateFromConnectionString
+#define HubClient_Destroy IoTHubClient_LL_Destroy
+#define HubClient_SetOption IoTHubClient_LL_SetOption
+#define HubClient_SetConnectionStatusCallback IoTHubClient_LL_SetConnectionStatusCallback
+#define HubClient_SendEventAsync IoTHubClient_LL_SendEventAsync
+#define HubClient_SendReportedState IoTHubClient_LL_SendReportedState
+#define HubDeviceTwin_CreateThermostat IoTHubDeviceTwin_LL_CreateThermostat
+#define HubDeviceTwin_DestroyThermostat IoTHubDeviceTwin_LL_DestroyThermostat
+#else
+typedef IOTHUB_CLIENT_HANDLE HUB_CLIENT_HANDLE;
+#define HubClient_CreateFromConnectionString IoTHubClient_CreateFromConnectionString
+#define HubClient_Destroy IoTHubClient_Destroy
+#define HubClient_SetOption IoTHubClient_SetOption
+#define HubClient_SetConnectionStatusCallback IoTHubClient_SetConnectionStatusCallback
+#define HubClient_SendEventAsync IoTHubClient_SendEventAsync
+#define HubClient_SendReportedState IoTHubClient_SendReportedState
+#define HubDeviceTwin_CreateThermostat IoTHubDeviceTwin_CreateThermostat
+#define HubDeviceTwin_DestroyThermostat IoTHubDeviceTwin_DestroyThermostat
+#endif
 
 static char* deviceId;
 static char* connectionString;
@@ -35,25 +96,269 @@ static const char* deviceInfo = "{ \"ObjectType\": \"DeviceInfo\","
 "{\"DeviceID\": \"%s\", \"TelemetryInterval\" : 1, \"HubEnabledState\" : true},"
 "\"Telemetry\" : ["
 "{\"Name\": \"Temperature\", \"DisplayName\" : \"Temperature\", \"Type\" : \"double\"},"
-"{ \"Name\": \"Humidity\", \"DisplayName\" : \"Humidity\", \"Type\" : \"double\" }] }";
-
+"{ \"Name\": \"Humidity\", \"DisplayName\" : \"Humidity\", \"Type\" : \"double\" },"
+"{\"Name\": \"TemperatureMin\", \"DisplayName\" : \"Temperature (min)\", \"Type\" : \"double\"},"
+"{\"Name\": \"TemperatureMax\", \"DisplayName\" : \"Temperature (max)\", \"Type\" : \"double\"},"
+"{\"Name\": \"TemperatureStdDev\", \"DisplayName\" : \"Temperature (stddev)\", \"Type\" : \"double\"},"
+"{ \"Name\": \"HumidityMin\", \"DisplayName\" : \"Humidity (min)\", \"Type\" : \"double\" },"
+"{ \"Name\": \"HumidityMax\", \"DisplayName\" : \"Humidity (max)\", \"Type\" : \"double\" },"
+"{ \"Name\": \"HumidityStdDev\", \"DisplayName\" : \"Humidity (stddev)\", \"Type\" : \"double\" },"
+"{ \"Name\": \"SampleCount\", \"DisplayName\" : \"Samples in window\", \"Type\" : \"int\" }] }";
+
+/* Schema when a second BME280 is attached on CE1 */
+static const char* deviceInfoDualSensor = "{ \"ObjectType\": \"DeviceInfo\","
+"\"IsSimulatedDevice\": 0,"
+"\"Version\" : '1.0',"
+"\"DeviceProperties\" :"
+"{\"DeviceID\": \"%s\", \"TelemetryInterval\" : 1, \"HubEnabledState\" : true},"
+"\"Telemetry\" : ["
+"{\"Name\": \"Temperature\", \"DisplayName\" : \"Temperature\", \"Type\" : \"double\"},"
+"{ \"Name\": \"Humidity\", \"DisplayName\" : \"Humidity\", \"Type\" : \"double\" },"
+"{\"Name\": \"TemperatureMin\", \"DisplayName\" : \"Temperature (min)\", \"Type\" : \"double\"},"
+"{\"Name\": \"TemperatureMax\", \"DisplayName\" : \"Temperature (max)\", \"Type\" : \"double\"},"
+"{\"Name\": \"TemperatureStdDev\", \"DisplayName\" : \"Temperature (stddev)\", \"Type\" : \"double\"},"
+"{ \"Name\": \"HumidityMin\", \"DisplayName\" : \"Humidity (min)\", \"Type\" : \"double\" },"
+"{ \"Name\": \"HumidityMax\", \"DisplayName\" : \"Humidity (max)\", \"Type\" : \"double\" },"
+"{ \"Name\": \"HumidityStdDev\", \"DisplayName\" : \"Humidity (stddev)\", \"Type\" : \"double\" },"
+"{ \"Name\": \"SampleCount\", \"DisplayName\" : \"Samples in window\", \"Type\" : \"int\" },"
+"{\"Name\": \"Temperature1\", \"DisplayName\" : \"Temperature (CE1)\", \"Type\" : \"double\"},"
+"{ \"Name\": \"Humidity1\", \"DisplayName\" : \"Humidity (CE1)\", \"Type\" : \"double\" },"
+"{\"Name\": \"Temperature1Min\", \"DisplayName\" : \"Temperature (CE1, min)\", \"Type\" : \"double\"},"
+"{\"Name\": \"Temperature1Max\", \"DisplayName\" : \"Temperature (CE1, max)\", \"Type\" : \"double\"},"
+"{\"Name\": \"Temperature1StdDev\", \"DisplayName\" : \"Temperature (CE1, stddev)\", \"Type\" : \"double\"},"
+"{ \"Name\": \"Humidity1Min\", \"DisplayName\" : \"Humidity (CE1, min)\", \"Type\" : \"double\" },"
+"{ \"Name\": \"Humidity1Max\", \"DisplayName\" : \"Humidity (CE1, max)\", \"Type\" : \"double\" },"
+"{ \"Name\": \"Humidity1StdDev\", \"DisplayName\" : \"Humidity (CE1, stddev)\", \"Type\" : \"double\" },"
+"{ \"Name\": \"SampleCount1\", \"DisplayName\" : \"Samples in window (CE1)\", \"Type\" : \"int\" }] }";
+
+/* Precision matches the BME280's resolution, see TELEMETRY_TEMPERATURE_DECIMALS */
 static const char* telemetryData = "{"
 "\"DeviceID\": \"%s\","
-"\"Temperature\" : %f,"
-"\"Humidity\" : %f } ";
+"\"Timestamp\" : %llu,"
+"\"Temperature\" : %.2f,"
+"\"Humidity\" : %.3f } ";
+
+static const char* telemetryDataDualSensor = "{"
+"\"DeviceID\": \"%s\","
+"\"Timestamp\" : %llu,"
+"\"Temperature\" : %.2f,"
+"\"Humidity\" : %.3f,"
+"\"Temperature1\" : %.2f,"
+"\"Humidity1\" : %.3f } ";
+
+/* telemetryData or telemetryDataDualSensor compiled with the device id, by CompileTelemetryTemplate */
+static TELEMETRY_TEMPLATE Telemetry_template;
+
+/* Aggregated telemetry of one sensor over a window; the suffix is "" for CE0 and "1" for CE1 */
+static const char* telemetryAggregateFields = ""
+"\"Temperature%s\" : %f,"
+"\"Temperature%sMin\" : %f,"
+"\"Temperature%sMax\" : %f,"
+"\"Temperature%sStdDev\" : %f,"
+"\"Humidity%s\" : %f,"
+"\"Humidity%sMin\" : %f,"
+"\"Humidity%sMax\" : %f,"
+"\"Humidity%sStdDev\" : %f,"
+"\"SampleCount%s\" : %u";
 
 static char* lastUpdateBegin;
 static char* lastRebootBegin;
 
-static IOTHUB_CLIENT_HANDLE g_iotHubClientHandle = NULL;
+static HUB_CLIENT_HANDLE g_iotHubClientHandle = NULL;
+
+/* Direct methods run on a small worker pool; a method answers with its
+   outcome when it finishes within METHOD_REPLY_WAIT_MS and "accepted"
+   otherwise, so the SDK's callback thread is never held for long */
+#define METHOD_WORKERS 2
+#define METHOD_QUEUE_LENGTH 8
+#define METHOD_REPLY_WAIT_MS 200
+static METHOD_POOL_HANDLE Method_pool = NULL;
+static Thermostat* g_thermostat = NULL;
+
+/* Reported properties are coalesced: patches that arrive within
+   REPORTED_COALESCE_WINDOW_MS of the first one go out as one merged
+   report, unless a state change flushes them sooner */
+#define REPORTED_COALESCE_WINDOW_MS 250
+static REPORTED_STATE_HANDLE Reported_state = NULL;
 
 static const int Spi_channel = 0;
+static const int Spi_channel_aux = 1;
 static const int Spi_clock = 1000000L;
 
+/* BME280 on CE0 is required, a second one on CE1 is optional */
+#define MAX_SENSORS SAMPLE_MAX_SENSORS
+static bme280_dev_t Sensors[MAX_SENSORS];
+static int Num_sensors = 0;
+
+/* Sampling runs on its own thread and hands samples to the uplink through a lock-free ring */
+#define SAMPLE_RING_CAPACITY 1024
+static SAMPLE_RING_HANDLE Sample_ring;
+static pthread_t Sampling_thread;
+static volatile int Sampling_running = 0;
+static volatile unsigned int Sampling_interval_ms = 3000;
+
+/* TelemetryIntervalMs allows 10 ms to an hour. The uplink drains the ring at
+   most once a second whatever the sampling rate, per-sample logging stops
+   below one second, and the achieved rate is reported once a minute. */
+#define TELEMETRY_INTERVAL_MIN_MS 10
+#define TELEMETRY_INTERVAL_MAX_MS 3600000
+#define UPLINK_MIN_PERIOD_MS 1000
+#define ACHIEVED_RATE_REPORT_MS 60000
+
+/* The twin model belongs to the SDK's callback thread, which writes desired
+   properties into it and serializes it. The uplink only publishes the
+   achieved rate here and reports it as a patch of its own; the model takes
+   the value the next time its thread serializes it. */
+static unsigned int Achieved_rate_centihz = 0;
+
+/* Samples are taken on a fixed grid of CLOCK_MONOTONIC deadlines; the uplink
+   reads the schedule's counters and jitter histogram through a snapshot */
+#define SAMPLING_MAX_BURST 10
+static volatile SCHEDULE_CATCH_UP Sampling_catch_up = SCHEDULE_CATCH_UP_SKIP;
+static pthread_mutex_t Sampling_schedule_lock = PTHREAD_MUTEX_INITIALIZER;
+static PERIODIC_SCHEDULE Sampling_schedule_snapshot;
+
+/* The sampling thread sleeps on a condition variable rather than in
+   clock_nanosleep, so a stop or a new interval does not wait for the end
+   of a period that can last an hour */
+static pthread_once_t Sampling_wake_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t Sampling_wake_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t Sampling_wake;
+static int Sampling_woken = 0;
+
+/* Seconds of samples reduced into one aggregated message, 0 sends every sample as is */
+static volatile int Aggregation_window_s = 0;
+static TELEMETRY_WINDOW Telemetry_window;
+
+/* Swinging-door deadband in front of sendMessage; a band of 0 sends every sample */
+static volatile double Temperature_deadband = 0;
+static volatile double Humidity_deadband = 0;
+static volatile int Heartbeat_interval_s = 300;
+static TELEMETRY_DEADBAND Telemetry_deadband;
+
+/* Samples packed into one message; both limits 0 sends one message per sample */
+static volatile int Batch_size = 0;
+static volatile int Batch_age_ms = 0;
+static TELEMETRY_BATCH Telemetry_batch;
+
+/* Wire format of sample and batch telemetry; aggregates and device info are always JSON */
+#define JSON_CONTENT_TYPE "application/json"
+#define JSON_CONTENT_ENCODING "utf-8"
+typedef enum TELEMETRY_ENCODING_TAG
+{
+	TELEMETRY_ENCODING_JSON,
+	TELEMETRY_ENCODING_CBOR
+} TELEMETRY_ENCODING;
+static volatile TELEMETRY_ENCODING Telemetry_encoding = TELEMETRY_ENCODING_JSON;
+
+/* Every outgoing payload is built in one of these; the largest is a full JSON batch */
+#define MESSAGE_POOL_BUFFERS 4
+#define MESSAGE_POOL_BUFFER_SIZE 16384
+static MESSAGE_POOL_HANDLE Message_pool;
+#ifdef COUNT_MALLOCS
+static uint64_t Allocations_at_last_message = 0;
+#endif
+
+/* Messages wait on disk while the hub is unreachable, and drain in order once it is back */
+#define SPOOL_DIRECTORY "//home//pi//azure-remote-monitoring-raspberry-pi-c//advanced//spool"
+#define SPOOL_SEGMENT_BYTES (1024 * 1024)
+#define SPOOL_COMMIT_INTERVAL_MS 5000
+#define SPOOL_COMMIT_BYTES (64 * 1024)
+#define SPOOL_DRAIN_PER_SECOND 20
+#define SPOOL_DRAIN_BURST 100
+#define SPOOL_FLAG_CBOR 0x01
+static volatile int Spool_limit_mb = 64;
+static STORE_FORWARD_HANDLE Spool;
+static volatile int Hub_connected = 0;
+
+#ifdef USE_HUB_STANDIN
+/* Local stand-in for the hub to exercise the spool: while up, telemetry is
+   appended to this file one message per line; SIGUSR1 takes it down and up */
+#define HUB_STANDIN_FILE "hub_standin.out"
+#endif
+
+/* Messages handed to the SDK and not yet confirmed are bounded by the
+   in-flight window; Inflight_policy says what happens to new ones while it
+   is full. Delivery counters, the ack latency histogram and the sampling
+   jitter histogram are rewritten to STATS_FILE on every pass of the main
+   loop, followed by the direct method counters. */
+#define INFLIGHT_WINDOW_SIZE 8
+#define INFLIGHT_BLOCK_TIMEOUT_MS 5000
+#define STATS_FILE "/dev/shm/remote_monitoring_stats"
+#define DELIVER_OK 0
+#define DELIVER_FAILED 1
+#define DELIVER_WINDOW_FULL 2
+static INFLIGHT_WINDOW_HANDLE Inflight_window;
+static volatile INFLIGHT_POLICY Inflight_policy = INFLIGHT_POLICY_BLOCK;
+
+#ifdef USE_EVENT_LOOP
+/* DoWork runs at least this often, and right after telemetry is queued. The
+   lower layer client is not thread safe: the loop holds Hub_client_lock while
+   it uses the client and reported properties are sent under it from other threads.
+   CONTROL_SOCKET_PATH answers "stats", "sampling", "usage", "methods", "reported",
+   "startup" and "stop", one per connection. */
+#define EVENT_LOOP_DOWORK_MS 100
+#define CONTROL_SOCKET_PATH "/dev/shm/remote_monitoring.sock"
+static EVENT_LOOP_HANDLE Event_loop;
+static pthread_mutex_t Hub_client_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* SIGINT and SIGTERM stop the loop. main blocks them before any thread
+   starts, so they only ever arrive through the loop's signalfd. */
+static void GetStopSignals(sigset_t* signals)
+{
+	sigemptyset(signals);
+	sigaddset(signals, SIGINT);
+	sigaddset(signals, SIGTERM);
+}
+#endif
+
+/* Longest wait for queued messages to go out on shutdown */
+#define SHUTDOWN_FLUSH_TIMEOUT_MS 10000
+static volatile sig_atomic_t Stop_requested = 0;
+
 static const int Grn_led_pin = 7;
 
+/* The green LED is configured once and driven by the pattern engine; while
+   the hub is unreachable it flashes briefly every LINK_DOWN_PERIOD_MS */
+#define LINK_DOWN_PERIOD_MS 2000
+#define LINK_DOWN_DUTY_PERCENT 10
+static LED_ENGINE_HANDLE Led_engine = NULL;
+
 static int Lock_fd;
 
+/* After a firmware update the new binary replaces this process through
+   exec() and inherits the samples not yet sent and the update timestamps.
+   It resumes sampling on the same wall clock grid as soon as it is up. The
+   lock is closed on exec and taken again, so an image without the handoff
+   simply starts afresh. firmwarereboot.sh only runs when the exec fails. */
+#define HOT_RESTART_FLUSH_TIMEOUT_MS 1000
+static volatile sig_atomic_t Hot_restart_requested = 0;
+static pthread_t Main_thread;
+static HOT_RESTART_STATE Handoff;       /* what the process before this one handed over */
+static int Handoff_received = 0;
+static TELEMETRY_SAMPLE* Handoff_samples = NULL;
+static size_t Handoff_sample_count = 0;
+static HOT_RESTART_HANDLE Hot_restart = NULL;
+static uint64_t Last_sample_ms = 0;     /* wall clock of the newest sample */
+
+/* The sensors are set up on their own thread while the hub client is created
+   and connects. The read that checks them becomes the first sample, and the
+   first telemetry goes out as soon as the hub is up rather than at the first
+   telemetry deadline; the device info follows it. The time to each phase is
+   reported once the first message is confirmed. */
+#define STARTUP_POLL_MS 50
+static pthread_t Sensor_thread;
+static int Sensor_thread_started = 0;
+static int Sensors_done = 0;            /* set, with release, once Sensors_result is final */
+static int Sensors_result = 0;
+static TELEMETRY_SAMPLE First_sample;
+static int First_telemetry_pending = 1;
+static int Startup_reported = 0;
+
+#ifdef USE_BME280_EMULATOR
+static bme280_emul_bus_t Bme280_emul_bus;
+#endif
+
 /*json of supported methods*/
 static char* supportedMethod = "{ \"LightBlink\": \"light blink\", \"ChangeLightStatus--LightStatusValue-int\""
 ": \"Change light status, on and off\", \"InitiateFirmwareUpdate--FwPackageURI-string\": "
@@ -68,7 +373,19 @@ ascii_char_ptr, FirmwareVersion
 );
 
 DECLARE_MODEL(ConfigProperties,
-WITH_REPORTED_PROPERTY(uint8_t, TelemetryInterval)
+WITH_REPORTED_PROPERTY(uint8_t, TelemetryInterval),
+WITH_REPORTED_PROPERTY(int, TelemetryIntervalMs),
+WITH_REPORTED_PROPERTY(double, AchievedSampleRate),
+WITH_REPORTED_PROPERTY(int, AggregationWindow),
+WITH_REPORTED_PROPERTY(double, TemperatureDeadband),
+WITH_REPORTED_PROPERTY(double, HumidityDeadband),
+WITH_REPORTED_PROPERTY(int, HeartbeatInterval),
+WITH_REPORTED_PROPERTY(int, BatchSize),
+WITH_REPORTED_PROPERTY(int, BatchAge),
+WITH_REPORTED_PROPERTY(ascii_char_ptr, TelemetryEncoding),
+WITH_REPORTED_PROPERTY(int, SpoolLimit),
+WITH_REPORTED_PROPERTY(ascii_char_ptr, InflightPolicy),
+WITH_REPORTED_PROPERTY(ascii_char_ptr, SamplingCatchUp)
 );
 
 DECLARE_DEVICETWIN_MODEL(Thermostat,
@@ -77,6 +394,17 @@ WITH_REPORTED_PROPERTY(ConfigProperties, Config),
 WITH_REPORTED_PROPERTY(SystemProperties, System),
 
 WITH_DESIRED_PROPERTY(uint8_t, TelemetryInterval, onDesiredTelemetryInterval),
+WITH_DESIRED_PROPERTY(int, TelemetryIntervalMs, onDesiredTelemetryIntervalMs),
+WITH_DESIRED_PROPERTY(int, AggregationWindow, onDesiredAggregationWindow),
+WITH_DESIRED_PROPERTY(double, TemperatureDeadband, onDesiredTemperatureDeadband),
+WITH_DESIRED_PROPERTY(double, HumidityDeadband, onDesiredHumidityDeadband),
+WITH_DESIRED_PROPERTY(int, HeartbeatInterval, onDesiredHeartbeatInterval),
+WITH_DESIRED_PROPERTY(int, BatchSize, onDesiredBatchSize),
+WITH_DESIRED_PROPERTY(int, BatchAge, onDesiredBatchAge),
+WITH_DESIRED_PROPERTY(ascii_char_ptr, TelemetryEncoding, onDesiredTelemetryEncoding),
+WITH_DESIRED_PROPERTY(int, SpoolLimit, onDesiredSpoolLimit),
+WITH_DESIRED_PROPERTY(ascii_char_ptr, InflightPolicy, onDesiredInflightPolicy),
+WITH_DESIRED_PROPERTY(ascii_char_ptr, SamplingCatchUp, onDesiredSamplingCatchUp),
 
 /* Direct methods implemented by the device */
 WITH_METHOD(LightBlink),
@@ -96,31 +424,394 @@ void deviceTwinCallback(int status_code, void* userContextCallback)
 	printf("IoTHub: reported properties delivered with status_code = %u\n", status_code);
 }
 
+/* Sends one coalesced report */
+static int SendReportedPatch(void* context, const unsigned char* report, size_t length)
+{
+	IOTHUB_CLIENT_RESULT result = IOTHUB_CLIENT_ERROR;
+	(void)context;
+
+#ifdef USE_EVENT_LOOP
+	pthread_mutex_lock(&Hub_client_lock);
+#endif
+	if (g_iotHubClientHandle != NULL)
+	{
+		result = HubClient_SendReportedState(g_iotHubClientHandle, report, length, deviceTwinCallback, NULL);
+	}
+#ifdef USE_EVENT_LOOP
+	pthread_mutex_unlock(&Hub_client_lock);
+#endif
+	if (result != IOTHUB_CLIENT_OK)
+	{
+		(void)printf("Failed to update reported properties: %.*s\r\n", (int)length, report);
+	}
+	return result != IOTHUB_CLIENT_OK;
+}
+
+/* Queues the model's reported properties for the next coalesced report */
+IOTHUB_CLIENT_RESULT ReportThermostat(Thermostat* thermostat)
+{
+	unsigned char* buffer;
+	size_t size;
+	int result;
+
+	thermostat->Config.AchievedSampleRate = __atomic_load_n(&Achieved_rate_centihz, __ATOMIC_RELAXED) / 100.0;
+	if (SERIALIZE_REPORTED_PROPERTIES(&buffer, &size, *thermostat) != CODEFIRST_OK)
+	{
+		return IOTHUB_CLIENT_ERROR;
+	}
+	result = ReportedState_Add(Reported_state, (const char*)buffer, size, 0);
+	free(buffer);
+	return result == 0 ? IOTHUB_CLIENT_OK : IOTHUB_CLIENT_ERROR;
+}
+
+static void InitSamplingWake(void)
+{
+	pthread_condattr_t attributes;
+	/* The schedule's deadlines are on the monotonic clock */
+	pthread_condattr_init(&attributes);
+	pthread_condattr_setclock(&attributes, CLOCK_MONOTONIC);
+	pthread_cond_init(&Sampling_wake, &attributes);
+	pthread_condattr_destroy(&attributes);
+}
+
+/* Cuts the sampling thread's sleep short */
+static void WakeSampling(void)
+{
+	pthread_once(&Sampling_wake_once, InitSamplingWake);
+	pthread_mutex_lock(&Sampling_wake_lock);
+	Sampling_woken = 1;
+	pthread_cond_signal(&Sampling_wake);
+	pthread_mutex_unlock(&Sampling_wake_lock);
+}
+
+/* Applies a sampling interval from either twin property; the sampling thread
+   is woken to pick it up and the uplink takes it at its next deadline, so
+   nothing restarts */
+void ApplyTelemetryInterval(Thermostat* thermostat, int intervalMs)
+{
+	unsigned int seconds;
+
+	if (intervalMs < TELEMETRY_INTERVAL_MIN_MS)
+	{
+		intervalMs = TELEMETRY_INTERVAL_MIN_MS;
+	}
+	else if (intervalMs > TELEMETRY_INTERVAL_MAX_MS)
+	{
+		intervalMs = TELEMETRY_INTERVAL_MAX_MS;
+	}
+	Sampling_interval_ms = (unsigned int)intervalMs;
+	WakeSampling();
+
+	/* The legacy property holds whole seconds, 1 to 255 */
+	seconds = ((unsigned int)intervalMs + 500) / 1000;
+	thermostat->Config.TelemetryInterval = (uint8_t)(seconds < 1 ? 1 : seconds > 255 ? 255 : seconds);
+	thermostat->Config.TelemetryIntervalMs = intervalMs;
+	if (ReportThermostat(thermostat) != IOTHUB_CLIENT_OK)
+	{
+		printf("Report Config.TelemetryInterval property failed");
+	}
+	else
+	{
+		printf("Report new value of Config.TelemetryInterval property: %d s, %d ms\r\n",
+			thermostat->Config.TelemetryInterval, thermostat->Config.TelemetryIntervalMs);
+	}
+}
+
 /*Callback for desired property changed*/
 void onDesiredTelemetryInterval(void* argument)
 {
 	/* By convention 'argument' is of the type of the MODEL */
 	Thermostat* thermostat = argument;
 	printf("Received a new desired_TelemetryInterval = %d\r\n", thermostat->TelemetryInterval);
-	thermostat->Config.TelemetryInterval = thermostat->TelemetryInterval;
-	if (IoTHubDeviceTwin_SendReportedStateThermostat(thermostat, deviceTwinCallback, NULL) != IOTHUB_CLIENT_OK)
+	ApplyTelemetryInterval(thermostat, thermostat->TelemetryInterval * 1000);
+}
+
+/*Callback for desired property changed*/
+void onDesiredTelemetryIntervalMs(void* argument)
+{
+	Thermostat* thermostat = argument;
+	printf("Received a new desired_TelemetryIntervalMs = %d\r\n", thermostat->TelemetryIntervalMs);
+	ApplyTelemetryInterval(thermostat, thermostat->TelemetryIntervalMs);
+}
+
+/*Callback for desired property changed*/
+void onDesiredAggregationWindow(void* argument)
+{
+	Thermostat* thermostat = argument;
+	printf("Received a new desired_AggregationWindow = %d\r\n", thermostat->AggregationWindow);
+	if (thermostat->AggregationWindow < 0)
 	{
-		printf("Report Config.TelemetryInterval property failed");
+		thermostat->AggregationWindow = 0;
+	}
+	thermostat->Config.AggregationWindow = thermostat->AggregationWindow;
+	Aggregation_window_s = thermostat->AggregationWindow;
+	if (ReportThermostat(thermostat) != IOTHUB_CLIENT_OK)
+	{
+		printf("Report Config.AggregationWindow property failed");
 	}
 	else
 	{
-		printf("Report new value of Config.TelemetryInterval property: %d\r\n", thermostat->Config.TelemetryInterval);
+		printf("Report new value of Config.AggregationWindow property: %d\r\n", thermostat->Config.AggregationWindow);
 	}
 }
 
-/*change light status on Raspberry Pi to received value*/
-METHODRETURN_HANDLE ChangeLightStatus(Thermostat* thermostat, int lightstatus)
+void ReportDeadbandConfig(Thermostat* thermostat)
+{
+	thermostat->Config.TemperatureDeadband = Temperature_deadband;
+	thermostat->Config.HumidityDeadband = Humidity_deadband;
+	thermostat->Config.HeartbeatInterval = Heartbeat_interval_s;
+	if (ReportThermostat(thermostat) != IOTHUB_CLIENT_OK)
+	{
+		printf("Report deadband properties failed");
+	}
+	else
+	{
+		printf("Report new deadband: Temperature %f, Humidity %f, heartbeat %d s\r\n",
+			Temperature_deadband, Humidity_deadband, Heartbeat_interval_s);
+	}
+}
+
+/*Callback for desired property changed*/
+void onDesiredTemperatureDeadband(void* argument)
+{
+	Thermostat* thermostat = argument;
+	printf("Received a new desired_TemperatureDeadband = %f\r\n", thermostat->TemperatureDeadband);
+	Temperature_deadband = thermostat->TemperatureDeadband > 0 ? thermostat->TemperatureDeadband : 0;
+	ReportDeadbandConfig(thermostat);
+}
+
+/*Callback for desired property changed*/
+void onDesiredHumidityDeadband(void* argument)
+{
+	Thermostat* thermostat = argument;
+	printf("Received a new desired_HumidityDeadband = %f\r\n", thermostat->HumidityDeadband);
+	Humidity_deadband = thermostat->HumidityDeadband > 0 ? thermostat->HumidityDeadband : 0;
+	ReportDeadbandConfig(thermostat);
+}
+
+/*Callback for desired property changed*/
+void onDesiredHeartbeatInterval(void* argument)
+{
+	Thermostat* thermostat = argument;
+	printf("Received a new desired_HeartbeatInterval = %d\r\n", thermostat->HeartbeatInterval);
+	Heartbeat_interval_s = thermostat->HeartbeatInterval > 0 ? thermostat->HeartbeatInterval : 0;
+	ReportDeadbandConfig(thermostat);
+}
+
+void ReportBatchConfig(Thermostat* thermostat)
+{
+	thermostat->Config.BatchSize = Batch_size;
+	thermostat->Config.BatchAge = Batch_age_ms;
+	if (ReportThermostat(thermostat) != IOTHUB_CLIENT_OK)
+	{
+		printf("Report batch properties failed");
+	}
+	else
+	{
+		printf("Report new batch limits: %d samples, %d ms\r\n", Batch_size, Batch_age_ms);
+	}
+}
+
+/*Callback for desired property changed*/
+void onDesiredBatchSize(void* argument)
+{
+	Thermostat* thermostat = argument;
+	printf("Received a new desired_BatchSize = %d\r\n", thermostat->BatchSize);
+	if (thermostat->BatchSize < 0)
+	{
+		Batch_size = 0;
+	}
+	else
+	{
+		Batch_size = thermostat->BatchSize > TELEMETRY_BATCH_MAX_SAMPLES ? TELEMETRY_BATCH_MAX_SAMPLES : thermostat->BatchSize;
+	}
+	ReportBatchConfig(thermostat);
+}
+
+/*Callback for desired property changed*/
+void onDesiredBatchAge(void* argument)
+{
+	Thermostat* thermostat = argument;
+	printf("Received a new desired_BatchAge = %d\r\n", thermostat->BatchAge);
+	Batch_age_ms = thermostat->BatchAge > 0 ? thermostat->BatchAge : 0;
+	ReportBatchConfig(thermostat);
+}
+
+/*Callback for desired property changed*/
+void onDesiredTelemetryEncoding(void* argument)
+{
+	Thermostat* thermostat = argument;
+	const char* encoding = thermostat->TelemetryEncoding;
+	printf("Received a new desired_TelemetryEncoding = %s\r\n", encoding == NULL ? "(null)" : encoding);
+	if (encoding != NULL && strcmp(encoding, "cbor") == 0)
+	{
+		Telemetry_encoding = TELEMETRY_ENCODING_CBOR;
+	}
+	else if (encoding != NULL && strcmp(encoding, "json") == 0)
+	{
+		Telemetry_encoding = TELEMETRY_ENCODING_JSON;
+	}
+	else
+	{
+		printf("Unknown telemetry encoding, keeping the current one\r\n");
+	}
+	thermostat->Config.TelemetryEncoding = Telemetry_encoding == TELEMETRY_ENCODING_CBOR ? "cbor" : "json";
+	if (ReportThermostat(thermostat) != IOTHUB_CLIENT_OK)
+	{
+		printf("Report Config.TelemetryEncoding property failed");
+	}
+	else
+	{
+		printf("Report new value of Config.TelemetryEncoding property: %s\r\n", thermostat->Config.TelemetryEncoding);
+	}
+}
+
+/*Callback for desired property changed, the limit is in MB*/
+void onDesiredSpoolLimit(void* argument)
+{
+	Thermostat* thermostat = argument;
+	printf("Received a new desired_SpoolLimit = %d\r\n", thermostat->SpoolLimit);
+	/* Applied to the spool by the uplink thread, which owns it */
+	Spool_limit_mb = thermostat->SpoolLimit > 1 ? thermostat->SpoolLimit : 1;
+	thermostat->Config.SpoolLimit = Spool_limit_mb;
+	if (ReportThermostat(thermostat) != IOTHUB_CLIENT_OK)
+	{
+		printf("Report Config.SpoolLimit property failed");
+	}
+	else
+	{
+		printf("Report new value of Config.SpoolLimit property: %d\r\n", thermostat->Config.SpoolLimit);
+	}
+}
+
+static const char* InflightPolicyName(INFLIGHT_POLICY policy)
+{
+	return policy == INFLIGHT_POLICY_DROP ? "drop" : policy == INFLIGHT_POLICY_BATCH ? "batch" : "block";
+}
+
+/*Callback for desired property changed*/
+void onDesiredInflightPolicy(void* argument)
+{
+	Thermostat* thermostat = argument;
+	const char* policy = thermostat->InflightPolicy;
+	printf("Received a new desired_InflightPolicy = %s\r\n", policy == NULL ? "(null)" : policy);
+	if (policy != NULL && strcmp(policy, "block") == 0)
+	{
+		Inflight_policy = INFLIGHT_POLICY_BLOCK;
+	}
+	else if (policy != NULL && strcmp(policy, "batch") == 0)
+	{
+		Inflight_policy = INFLIGHT_POLICY_BATCH;
+	}
+	else if (policy != NULL && strcmp(policy, "drop") == 0)
+	{
+		Inflight_policy = INFLIGHT_POLICY_DROP;
+	}
+	else
+	{
+		printf("Unknown in-flight policy, keeping the current one\r\n");
+	}
+	thermostat->Config.InflightPolicy = (char*)InflightPolicyName(Inflight_policy);
+	if (ReportThermostat(thermostat) != IOTHUB_CLIENT_OK)
+	{
+		printf("Report Config.InflightPolicy property failed");
+	}
+	else
+	{
+		printf("Report new value of Config.InflightPolicy property: %s\r\n", thermostat->Config.InflightPolicy);
+	}
+}
+
+/*Callback for desired property changed*/
+void onDesiredSamplingCatchUp(void* argument)
+{
+	Thermostat* thermostat = argument;
+	const char* catchUp = thermostat->SamplingCatchUp;
+	printf("Received a new desired_SamplingCatchUp = %s\r\n", catchUp == NULL ? "(null)" : catchUp);
+	if (catchUp != NULL && strcmp(catchUp, "skip") == 0)
+	{
+		Sampling_catch_up = SCHEDULE_CATCH_UP_SKIP;
+	}
+	else if (catchUp != NULL && strcmp(catchUp, "burst") == 0)
+	{
+		Sampling_catch_up = SCHEDULE_CATCH_UP_BURST;
+	}
+	else
+	{
+		printf("Unknown sampling catch-up policy, keeping the current one\r\n");
+	}
+	thermostat->Config.SamplingCatchUp = Sampling_catch_up == SCHEDULE_CATCH_UP_BURST ? "burst" : "skip";
+	if (ReportThermostat(thermostat) != IOTHUB_CLIENT_OK)
+	{
+		printf("Report Config.SamplingCatchUp property failed");
+	}
+	else
+	{
+		printf("Report new value of Config.SamplingCatchUp property: %s\r\n", thermostat->Config.SamplingCatchUp);
+	}
+}
+
+/*Callback for connection status changes*/
+void connectionStatusCallback(IOTHUB_CLIENT_CONNECTION_STATUS result, IOTHUB_CLIENT_CONNECTION_STATUS_REASON reason, void* userContextCallback)
+{
+	int wasConnected = Hub_connected;
+	(void)userContextCallback;
+	Hub_connected = result == IOTHUB_CLIENT_CONNECTION_AUTHENTICATED;
+	printf("IoTHub: connection %s (reason %d)\r\n", Hub_connected ? "up" : "down", reason);
+	if (wasConnected && !Hub_connected)
+	{
+		(void)LedEngine_DutyCycle(Led_engine, LINK_DOWN_PERIOD_MS, LINK_DOWN_DUTY_PERCENT);
+	}
+	else if (!wasConnected && Hub_connected)
+	{
+		LedEngine_Stop(Led_engine);
+		(void)StartupPhases_Mark(STARTUP_PHASE_HUB_CONNECTED);
+	}
+}
+
+static void WriteGreenLed(void* context, int level)
+{
+	(void)context;
+	digitalWrite(Grn_led_pin, level);
+}
+
+/* Maps the pool's outcome to the reply for a method; done is the reply
+   when the job finished within the wait */
+static METHODRETURN_HANDLE MethodReply(METHOD_POOL_RESULT result, const char* done)
+{
+	switch (result)
+	{
+	case METHOD_POOL_SUCCEEDED:
+		return MethodReturn_Create(201, done);
+	case METHOD_POOL_FAILED:
+		return MethodReturn_Create(500, "\"method failed\"");
+	case METHOD_POOL_ACCEPTED:
+		return MethodReturn_Create(202, "\"accepted\"");
+	default:
+		return MethodReturn_Create(503, "\"busy, try again later\"");
+	}
+}
+
+static int ChangeLightStatusJob(void* argument)
 {
+	int lightstatus = *(int*)argument;
 	printf("Raspberry Pi light status change\n");
-	pinMode(Grn_led_pin, OUTPUT);
 	printf("LED value\n %d", lightstatus);
-	digitalWrite(Grn_led_pin, lightstatus);
-	return MethodReturn_Create(201, "\"light status changed\"");
+	LedEngine_Set(Led_engine, lightstatus != 0);
+	return 0;
+}
+
+/*change light status on Raspberry Pi to received value*/
+METHODRETURN_HANDLE ChangeLightStatus(Thermostat* thermostat, int lightstatus)
+{
+	int* argument = malloc(sizeof(int));
+	if (argument == NULL)
+	{
+		return MethodReturn_Create(500, "\"out of memory\"");
+	}
+	*argument = lightstatus;
+	return MethodReply(MethodPool_Submit(Method_pool, "ChangeLightStatus", ChangeLightStatusJob, argument,
+		METHOD_REPLY_WAIT_MS), "\"light status changed\"");
 }
 
 
@@ -221,13 +912,68 @@ char* FormatTime(time_t* time)
 	return buffer;
 }
 
-//download file in target url by wget as example
-bool DownloadFile(ascii_char_ptr url)
+/* The package lands where ApplyFirmware expects it. A URL fragment of the
+   form #sha256=<hex> names the digest it must have. Download progress is
+   reported at most every FIRMWARE_PROGRESS_INTERVAL_S seconds. */
+#define FIRMWARE_PACKAGE_PATH "remote_monitoring.zip"
+#define FIRMWARE_DOWNLOAD_ATTEMPTS 8
+#define FIRMWARE_RETRY_DELAY_MS 2000
+#define FIRMWARE_STALL_TIMEOUT_MS 30000
+#define FIRMWARE_PROGRESS_INTERVAL_S 5
+
+void UpdateReportedProperties(const char* format, ...);
+void FlushReportedProperties(void);
+
+typedef struct DOWNLOAD_PROGRESS_TAG
+{
+	time_t begin;
+	time_t lastReport;
+} DOWNLOAD_PROGRESS;
+
+static void onDownloadProgress(void* context, uint64_t received, uint64_t total)
+{
+	DOWNLOAD_PROGRESS* progress = context;
+	time_t now;
+
+	time(&now);
+	if (now - progress->lastReport < FIRMWARE_PROGRESS_INTERVAL_S && received != total)
+	{
+		return;
+	}
+	progress->lastReport = now;
+	UpdateReportedProperties(
+		"{ 'Method' : { 'UpdateFirmware': { 'Download' : { 'Duration-s': %u, 'LastUpdate': '%s', 'Status': 'Running', "
+		"'BytesReceived': %llu, 'BytesTotal': %llu, 'Percent': %u } } } }",
+		(unsigned int)(now - progress->begin), FormatTime(&now), (unsigned long long)received,
+		(unsigned long long)total, total > 0 ? (unsigned int)(received * 100 / total) : 0);
+}
+
+//download the package in process, resuming after a dropped connection
+bool DownloadFile(ascii_char_ptr url, FIRMWARE_DOWNLOAD_RESULT* result)
 {
+	FIRMWARE_DOWNLOAD_CONFIG config;
+	DOWNLOAD_PROGRESS progress;
+	const char* digest = strstr(url, "#sha256=");
+
 	printf("Download url: %s\r\n", url);
-	char str[256];
-	sprintf(str, "wget %s", url);
-	return system(str) == 0;
+	time(&progress.begin);
+	progress.lastReport = progress.begin;
+	config.url = url;
+	config.path = FIRMWARE_PACKAGE_PATH;
+	config.sha256 = digest != NULL ? digest + strlen("#sha256=") : NULL;
+	config.attempts = FIRMWARE_DOWNLOAD_ATTEMPTS;
+	config.retryDelayMs = FIRMWARE_RETRY_DELAY_MS;
+	config.stallTimeoutMs = FIRMWARE_STALL_TIMEOUT_MS;
+	config.progress = onDownloadProgress;
+	config.context = &progress;
+	if (FirmwareDownload_Run(&config, result) != 0)
+	{
+		printf("Firmware download failed after %u attempts: %s\r\n", result->attempts, result->error);
+		return false;
+	}
+	printf("Downloaded %llu bytes in %u attempts, %llu resumed, sha256 %s\r\n", (unsigned long long)result->bytes,
+		result->attempts, (unsigned long long)result->resumedBytes, result->sha256);
+	return true;
 }
 
 void AllocAndVPrintf(unsigned char** buffer, size_t* size, const char* format, va_list argptr)
@@ -248,31 +994,77 @@ void UpdateReportedProperties(const char* format, ...)
 	AllocAndVPrintf(&report, &len, format, args);
 	va_end(args);
 
-	if (IoTHubClient_SendReportedState(g_iotHubClientHandle, report, len, NULL, NULL) != IOTHUB_CLIENT_OK)
-	{
-		(void)printf("Failed to update reported properties: %.*s\r\n", len, report);
-	}
-	else
+	if (ReportedState_Add(Reported_state, (const char*)report, len, 0) != 0)
 	{
-		(void)printf("Succeeded in updating reported properties: %.*s\r\n", len, report);
+		(void)printf("Failed to update reported properties: %.*s\r\n", (int)len, report);
 	}
 
 	free(report);
 }
 
+/* Sends the coalesced reported properties now, for state changes that must show up at once */
+void FlushReportedProperties(void)
+{
+	ReportedState_Flush(Reported_state);
+}
+
+/* The package is installed into cmake/remote_monitoring.a or .b and
+   cmake/remote_monitoring becomes a symlink to the new slot, so the reboot
+   script still finds the agent where it always has. */
+#define FIRMWARE_INSTALL_PATH "cmake/remote_monitoring"
+#define FIRMWARE_REBOOT_SCRIPT FIRMWARE_INSTALL_PATH "/firmwarereboot.sh"
+#define FIRMWARE_REBOOT_LOG "/tmp/reboot.txt"
+
+extern char** environ;
+
+static uint64_t MonotonicMs(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000 + (uint64_t)(now.tv_nsec / 1000000);
+}
+
 //this method is an example for apply firmware
-void ApplyFirmware()
+bool ApplyFirmware(FIRMWARE_INSTALL_RESULT* install)
+{
+	if (FirmwareInstall_Apply(FIRMWARE_INSTALL_PATH, FIRMWARE_PACKAGE_PATH, install) != 0)
+	{
+		printf("Failed to install firmware: %s\r\n", install->error);
+		return false;
+	}
+	(void)unlink(FIRMWARE_PACKAGE_PATH);
+	printf("Firmware installed in slot %s: %zu files, %llu bytes\r\n",
+		install->slot, install->files, (unsigned long long)install->bytes);
+	return true;
+}
+
+/* Starts the reboot script from the new slot in its own session so it
+   outlives this process, with its output appended to the reboot log */
+static bool LaunchRebootScript(void)
 {
-	system("unzip -o remote_monitoring.zip -d cmake/remote_monitoring/");
-	system("sudo mv cmake/remote_monitoring/firmwarereboot.sh .");
-	system("sudo chmod +x firmwarereboot.sh");
-	system("sed -i 's/\r//' firmwarereboot.sh");
-	system("sudo chmod +x cmake/remote_monitoring/remote_monitoring");
-	system("rm -f remote_monitoring.zip");
-	system("sudo nohup sh ./firmwarereboot.sh > /tmp/reboot.txt &");
+	char* const argv[] = { "sudo", "sh", FIRMWARE_REBOOT_SCRIPT, NULL };
+	posix_spawn_file_actions_t actions;
+	posix_spawnattr_t attributes;
+	pid_t pid;
+	int result;
+
+	posix_spawn_file_actions_init(&actions);
+	posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, FIRMWARE_REBOOT_LOG, O_WRONLY | O_CREAT | O_APPEND, 0644);
+	posix_spawn_file_actions_adddup2(&actions, STDOUT_FILENO, STDERR_FILENO);
+	posix_spawnattr_init(&attributes);
+	posix_spawnattr_setflags(&attributes, POSIX_SPAWN_SETSID);
+	result = posix_spawnp(&pid, argv[0], &actions, &attributes, argv, environ);
+	posix_spawnattr_destroy(&attributes);
+	posix_spawn_file_actions_destroy(&actions);
+	if (result != 0)
+	{
+		printf("Failed to start %s: %s\r\n", FIRMWARE_REBOOT_SCRIPT, strerror(result));
+		return false;
+	}
+	return true;
 }
 
-void* FirmwareUpdateThread(void* arg)
+int FirmwareUpdateJob(void* arg)
 {
 	time_t begin, end, stepBegin, stepEnd;
 	printf("Firmware thread start, download url: %s\r\n", (char*)arg);
@@ -280,6 +1072,8 @@ void* FirmwareUpdateThread(void* arg)
 
 	// Clear all reportes
 	UpdateReportedProperties("{ 'Method' : { 'UpdateFirmware': null } }");
+	(void)LedEngine_Heartbeat(Led_engine);
+	FIRMWARE_DOWNLOAD_RESULT download;
 	time(&begin);
 	char * beginUpdate = FormatTime(&begin);
 	lastUpdateBegin = malloc(strlen(beginUpdate) + 1);
@@ -292,46 +1086,71 @@ void* FirmwareUpdateThread(void* arg)
 	UpdateReportedProperties(
 		"{ 'Method' : { 'UpdateFirmware': { 'Download' : { 'Duration-s': 0, 'LastUpdate': '%s', 'Status': 'Running' } } } }",
 		FormatTime(&stepBegin));
+	FlushReportedProperties();
 
-	time(&stepEnd);
 	//downloadfile
-	if (!DownloadFile(url))
+	if (!DownloadFile(url, &download))
 	{
+		time(&stepEnd);
 		UpdateReportedProperties(
-			"{ 'Method' : { 'UpdateFirmware': { 'Download' : { 'Duration-s': %u, 'LastUpdate': '%s', 'Status': 'Failed' } } } }",
+			"{ 'Method' : { 'UpdateFirmware': { 'Download' : { 'Duration-s': %u, 'LastUpdate': '%s', 'Status': 'Failed', "
+			"'BytesReceived': %llu, 'BytesTotal': %llu, 'Error': '%s' } } } }",
 			stepEnd - stepBegin,
-			FormatTime(&stepEnd));
+			FormatTime(&stepEnd), (unsigned long long)download.bytes, (unsigned long long)download.total,
+			download.error);
 
 		time(&end);
 		UpdateReportedProperties(
 			"{ 'Method' : { 'UpdateFirmware': { 'Duration-s': %u, 'LastUpdate': '%s', 'Status': 'Failed' } } }",
 			end - begin,
 			FormatTime(&end));
-		return NULL;
+		FlushReportedProperties();
+		LedEngine_Stop(Led_engine);
+		return 1;
 	}
 
 	time(&stepEnd);
 
 	UpdateReportedProperties(
-		"{ 'Method' : { 'UpdateFirmware': { 'Download' : { 'Duration-s': %u, 'LastUpdate': '%s', 'Status': 'Complete' } } } }",
+		"{ 'Method' : { 'UpdateFirmware': { 'Download' : { 'Duration-s': %u, 'LastUpdate': '%s', 'Status': 'Complete', "
+		"'BytesReceived': %llu, 'BytesTotal': %llu, 'Attempts': %u, 'Sha256': '%s' } } } }",
 		stepEnd - stepBegin,
-		FormatTime(&stepEnd));
+		FormatTime(&stepEnd), (unsigned long long)download.bytes, (unsigned long long)download.total,
+		download.attempts, download.sha256);
 
 	time(&stepBegin);
 	UpdateReportedProperties(
 		"{ 'Method' : { 'UpdateFirmware': { 'Applied' : { 'Duration-s': 0, 'LastUpdate': '%s', 'Status': 'Running' } } } }",
 		FormatTime(&stepBegin));
 
-	printf("unlock file before apply new firmware\r\n");
-	close_lockfile(Lock_fd);
-
-	ApplyFirmware();
+	FIRMWARE_INSTALL_RESULT install;
+	uint64_t applyBeginMs = MonotonicMs();
+	bool applied = ApplyFirmware(&install);
+	uint64_t applyMs = MonotonicMs() - applyBeginMs;
 
 	time(&stepEnd);
+	if (!applied)
+	{
+		UpdateReportedProperties(
+			"{ 'Method' : { 'UpdateFirmware': { 'Applied' : { 'Duration-s': %u, 'Duration-ms': %llu, 'LastUpdate': '%s', "
+			"'Status': 'Failed', 'Error': '%s' } } } }",
+			stepEnd - stepBegin, (unsigned long long)applyMs,
+			FormatTime(&stepEnd), install.error);
+
+		time(&end);
+		UpdateReportedProperties(
+			"{ 'Method' : { 'UpdateFirmware': { 'Duration-s': %u, 'LastUpdate': '%s', 'Status': 'Failed' } } }",
+			end - begin,
+			FormatTime(&end));
+		FlushReportedProperties();
+		LedEngine_Stop(Led_engine);
+		return 1;
+	}
 	UpdateReportedProperties(
-		"{ 'Method' : { 'UpdateFirmware': { 'Applied' : { 'Duration-s': %u, 'LastUpdate': '%s', 'Status': 'Complete' } } } }",
-		stepEnd - stepBegin,
-		FormatTime(&stepEnd));
+		"{ 'Method' : { 'UpdateFirmware': { 'Applied' : { 'Duration-s': %u, 'Duration-ms': %llu, 'LastUpdate': '%s', "
+		"'Status': 'Complete', 'Slot': '%s', 'Files': %u, 'Bytes': %llu } } } }",
+		stepEnd - stepBegin, (unsigned long long)applyMs,
+		FormatTime(&stepEnd), install.slot, (unsigned int)install.files, (unsigned long long)install.bytes);
 
 	time(&stepBegin);
 	char * rebootBegin = FormatTime(&stepBegin);
@@ -341,15 +1160,88 @@ void* FirmwareUpdateThread(void* arg)
 
 	lastRebootBegin = malloc(strlen(rebootBegin) + 1);
 	strcpy(lastRebootBegin, rebootBegin);
+	Handoff.rebootBeginNs = PeriodicSchedule_Now();
 	WriteConfig();
-	free(arg);
-	exit(0);
+	FlushReportedProperties();
+
+	/* The main thread stops sampling, hands over and execs the new slot */
+	printf("Restarting into the new firmware\r\n");
+	Hot_restart_requested = 1;
+	pthread_kill(Main_thread, SIGTERM);
+	return 0;
 }
 
-void UpdateFirmwareComplete()
+/* The first sample after a hot restart closes the telemetry gap it caused */
+static void ReportRestartGap(const TELEMETRY_SAMPLE* sample)
 {
-	if (lastRebootBegin == NULL || lastUpdateBegin == NULL)
-		return;
+	uint64_t gapMs = sample->timestampMs - Handoff.lastSampleMs;
+	Handoff.lastSampleMs = 0;
+	printf("Hot restart: %llu ms from the last sample before it to the first after, %zu samples handed over\r\n",
+		(unsigned long long)gapMs, Handoff_sample_count);
+	UpdateReportedProperties(
+		"{ 'Method' : { 'UpdateFirmware': { 'Reboot' : { 'Gap-ms': %llu, 'SamplingInterval-ms': %u, 'SamplesHandedOver': %u } } } }",
+		(unsigned long long)gapMs, Handoff.samplingIntervalMs, (unsigned int)Handoff_sample_count);
+}
+
+/* Moves the samples still in the ring into the handoff, so the new binary sends them */
+static void HandOffSamples(void)
+{
+	TELEMETRY_SAMPLE sample;
+
+	Hot_restart = HotRestart_Create();
+	if (Hot_restart == NULL)
+	{
+		/* RestartIntoFirmware still runs, and without a handoff goes straight to the script */
+		printf("Failed to create the hot restart handoff, restarting through the reboot script\r\n");
+		return;
+	}
+	while (SampleRing_Pop(Sample_ring, &sample) == 0)
+	{
+		if (HotRestart_AddSample(Hot_restart, &sample) != 0)
+		{
+			printf("Failed to hand over a sample\r\n");
+		}
+	}
+}
+
+/* Execs the new firmware with the handoff; falls back to firmwarereboot.sh,
+   and to the previous slot when even that cannot be started */
+static void RestartIntoFirmware(void)
+{
+	HOT_RESTART_STATE state;
+
+#ifdef USE_EVENT_LOOP
+	/* The mask survives exec and spawn; the next binary must be stoppable */
+	sigset_t stopSignals;
+	GetStopSignals(&stopSignals);
+	pthread_sigmask(SIG_UNBLOCK, &stopSignals, NULL);
+#endif
+	if (Hot_restart != NULL)
+	{
+		memset(&state, 0, sizeof(state));
+		state.samplingIntervalMs = Sampling_interval_ms;
+		state.lastSampleMs = Last_sample_ms;
+		state.rebootBeginNs = Handoff.rebootBeginNs;
+		snprintf(state.lastUpdateBegin, sizeof(state.lastUpdateBegin), "%s", lastUpdateBegin);
+		snprintf(state.lastRebootBegin, sizeof(state.lastRebootBegin), "%s", lastRebootBegin);
+		printf("Handing %zu samples to %s\r\n", HotRestart_SampleCount(Hot_restart), FIRMWARE_INSTALL_PATH "/remote_monitoring");
+		(void)HotRestart_Exec(Hot_restart, &state, FIRMWARE_INSTALL_PATH "/remote_monitoring");
+		Hot_restart = NULL;
+	}
+
+	printf("unlock file before starting new firmware\r\n");
+	close_lockfile(Lock_fd);
+	if (!LaunchRebootScript())
+	{
+		/* Nothing will start the new slot, so the next start runs the one we came from */
+		(void)FirmwareInstall_Rollback(FIRMWARE_INSTALL_PATH);
+	}
+}
+
+void UpdateFirmwareComplete()
+{
+	if (lastRebootBegin == NULL || lastUpdateBegin == NULL)
+		return;
 	printf("start send firmware update complete");
 	time_t begin, end, stepBegin, stepEnd;
 	stepBegin = ReadFormatedTime(lastRebootBegin);
@@ -359,129 +1251,1397 @@ void UpdateFirmwareComplete()
 		stepEnd - stepBegin,
 		FormatTime(&stepEnd));
 
-	begin = ReadFormatedTime(lastUpdateBegin);
-	time(&end);
-	UpdateReportedProperties(
-		"{ 'Method' : { 'UpdateFirmware': { 'Duration-s': %u, 'LastUpdate': '%s', 'Status': 'Complete' } } }",
-		end - begin,
-		FormatTime(&end));
-	printf("finsh send firmware update complete");
-	//clean up lastupdate log
-	FILE* fp;
-	if (NULL == (fp = fopen("//home//pi//azure-remote-monitoring-raspberry-pi-c//advanced//config//lastupdate", "w")))
+	if (Handoff_received)
+	{
+		UpdateReportedProperties(
+			"{ 'Method' : { 'UpdateFirmware': { 'Reboot' : { 'Mode': 'exec', 'Duration-ms': %llu } } } }",
+			(unsigned long long)((PeriodicSchedule_Now() - Handoff.rebootBeginNs) / 1000000));
+	}
+
+	begin = ReadFormatedTime(lastUpdateBegin);
+	time(&end);
+	UpdateReportedProperties(
+		"{ 'Method' : { 'UpdateFirmware': { 'Duration-s': %u, 'LastUpdate': '%s', 'Status': 'Complete' } } }",
+		end - begin,
+		FormatTime(&end));
+	FlushReportedProperties();
+	printf("finsh send firmware update complete");
+	//clean up lastupdate log
+	FILE* fp;
+	if (NULL == (fp = fopen("//home//pi//azure-remote-monitoring-raspberry-pi-c//advanced//config//lastupdate", "w")))
+	{
+		printf("Failed to open lastupdate file to write\r\n");
+	}
+	else
+	{
+		fclose(fp);
+	}
+}
+
+/*Callback for InitiateFirmwareUpdate*/
+METHODRETURN_HANDLE InitiateFirmwareUpdate(Thermostat* thermostat, ascii_char_ptr FwPackageURI)
+{
+	(void)(thermostat);
+
+	printf("Recieved firmware update request. Use package at: %s\r\n", FwPackageURI);
+	ascii_char_ptr url = malloc(strlen(FwPackageURI) + 1);
+	if (url == NULL)
+	{
+		return MethodReturn_Create(500, "\"out of memory\"");
+	}
+	strcpy(url, FwPackageURI);
+	printf("receive and strcpy url: %s\r\n", url);
+	/* The update reports its progress through the twin, so answer straight away */
+	if (MethodPool_Submit(Method_pool, "InitiateFirmwareUpdate", FirmwareUpdateJob, url, 0) == METHOD_POOL_BUSY)
+	{
+		return MethodReturn_Create(503, "\"busy, try again later\"");
+	}
+	return MethodReturn_Create(201, "\"Initiating Firmware Update\"");
+}
+
+static int LightBlinkJob(void* argument)
+{
+	(void)argument;
+	printf("Raspberry Pi light blink\n");
+	return LedEngine_Blink(Led_engine, 2, 1000, 1000);
+}
+
+/*Callback for LightBlink*/
+METHODRETURN_HANDLE LightBlink(Thermostat* thermostat)
+{
+	/* The engine plays the blink, so the job returns as soon as it has started */
+	return MethodReply(MethodPool_Submit(Method_pool, "LightBlink", LightBlinkJob, NULL, METHOD_REPLY_WAIT_MS),
+		"\"light blink started\"");
+}
+
+static uint64_t GetTimestampMs(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	return (uint64_t)now.tv_sec * 1000 + (uint64_t)(now.tv_nsec / 1000000);
+}
+
+/* Takes a buffer from the message pool, or NULL with the reason logged */
+static MESSAGE_BUFFER* acquireMessage(const char* purpose)
+{
+	MESSAGE_BUFFER* message = MessagePool_Acquire(Message_pool);
+	if (message == NULL)
+	{
+		printf("Message pool exhausted, dropping %s\r\n", purpose);
+	}
+	return message;
+}
+
+static const char* contentTypeOf(uint8_t flags)
+{
+	return (flags & SPOOL_FLAG_CBOR) ? CBOR_CONTENT_TYPE : JSON_CONTENT_TYPE;
+}
+
+#ifdef USE_HUB_STANDIN
+static void onStandinToggle(int signum)
+{
+	(void)signum;
+	Hub_connected = !Hub_connected;
+}
+
+/* The stand-in confirms each message as soon as it is written */
+static int deliverMessage(HUB_CLIENT_HANDLE iotHubClientHandle, const unsigned char* data, size_t length,
+	uint8_t flags, unsigned int waitMs)
+{
+	int result = DELIVER_FAILED;
+	INFLIGHT_TICKET ticket;
+	(void)iotHubClientHandle;
+	if (!Hub_connected)
+	{
+		return DELIVER_FAILED;
+	}
+	ticket = InflightWindow_Acquire(Inflight_window, data, length, flags, waitMs);
+	if (ticket == NULL)
+	{
+		return DELIVER_WINDOW_FULL;
+	}
+
+	FILE* fp = fopen(HUB_STANDIN_FILE, "a");
+	if (fp == NULL)
+	{
+		InflightWindow_Cancel(ticket);
+	}
+	else
+	{
+		fprintf(fp, "%s %zu ", contentTypeOf(flags), length);
+		fwrite(data, 1, length, fp);
+		fputc('\n', fp);
+		fclose(fp);
+		InflightWindow_Complete(ticket, 1);
+		(void)StartupPhases_Mark(STARTUP_PHASE_FIRST_MESSAGE_SENT);
+		(void)StartupPhases_Mark(STARTUP_PHASE_FIRST_MESSAGE_CONFIRMED);
+		result = DELIVER_OK;
+	}
+	return result;
+}
+#else
+/*Callback for a message confirmed, failed or timed out by the SDK*/
+static void sendConfirmationCallback(IOTHUB_CLIENT_CONFIRMATION_RESULT result, void* userContextCallback)
+{
+	if (result != IOTHUB_CLIENT_CONFIRMATION_OK)
+	{
+		printf("IoTHubClient failed to deliver a message: %d\r\n", result);
+	}
+	else
+	{
+		(void)StartupPhases_Mark(STARTUP_PHASE_FIRST_MESSAGE_CONFIRMED);
+	}
+	InflightWindow_Complete((INFLIGHT_TICKET)userContextCallback, result == IOTHUB_CLIENT_CONFIRMATION_OK);
+}
+
+/* Hands one message to the SDK, waiting up to waitMs for room in the in-flight
+   window. The SDK and the window each keep a copy of the payload, so data can be
+   reused as soon as this returns. */
+static int deliverMessage(HUB_CLIENT_HANDLE iotHubClientHandle, const unsigned char* data, size_t length,
+	uint8_t flags, unsigned int waitMs)
+{
+	int result = DELIVER_FAILED;
+	INFLIGHT_TICKET ticket = InflightWindow_Acquire(Inflight_window, data, length, flags, waitMs);
+	if (ticket == NULL)
+	{
+		return DELIVER_WINDOW_FULL;
+	}
+
+	IOTHUB_MESSAGE_HANDLE messageHandle = IoTHubMessage_CreateFromByteArray(data, length);
+	if (messageHandle == NULL)
+	{
+		printf("unable to create a new IoTHubMessage\r\n");
+	}
+	else
+	{
+		if (IoTHubMessage_SetContentTypeSystemProperty(messageHandle, contentTypeOf(flags)) != IOTHUB_MESSAGE_OK ||
+			(!(flags & SPOOL_FLAG_CBOR) && IoTHubMessage_SetContentEncodingSystemProperty(messageHandle, JSON_CONTENT_ENCODING) != IOTHUB_MESSAGE_OK))
+		{
+			printf("failed to set the content type of the message\r\n");
+		}
+
+		if (HubClient_SendEventAsync(iotHubClientHandle, messageHandle, sendConfirmationCallback, ticket) != IOTHUB_CLIENT_OK)
+		{
+			printf("failed to hand over the message to IoTHubClient");
+		}
+		else
+		{
+			printf("IoTHubClient accepted the message for delivery\r\n");
+			(void)StartupPhases_Mark(STARTUP_PHASE_FIRST_MESSAGE_SENT);
+			result = DELIVER_OK;
+		}
+
+		IoTHubMessage_Destroy(messageHandle);
+	}
+	if (result != DELIVER_OK)
+	{
+		InflightWindow_Cancel(ticket);
+	}
+	return result;
+}
+#endif
+
+static int deliverSpooled(void* context, const unsigned char* payload, size_t length, uint8_t flags)
+{
+	if (!Hub_connected)
+	{
+		return 1;
+	}
+#ifdef USE_EVENT_LOOP
+	/* Never waits: a full window just ends this drain, and the DoWork timer drains again */
+	return deliverMessage((HUB_CLIENT_HANDLE)context, payload, length, flags, 0);
+#else
+	/* Waits for room like a live send, so one drain keeps pace with the confirmations */
+	return deliverMessage((HUB_CLIENT_HANDLE)context, payload, length, flags,
+		Inflight_policy == INFLIGHT_POLICY_DROP ? 0 : INFLIGHT_BLOCK_TIMEOUT_MS);
+#endif
+}
+
+/* Puts a message the hub did not confirm back in the spool, or drops it when there is none */
+static void requeueFailed(void* context, const unsigned char* payload, size_t length, uint8_t flags)
+{
+	(void)context;
+	if (Spool == NULL || StoreForward_Append(Spool, payload, length, flags, GetTimestampMs()) != 0)
+	{
+		printf("failed to requeue an unconfirmed message, dropping it\r\n");
+		InflightWindow_CountDropped(Inflight_window);
+	}
+}
+
+/* Send data to IoT Hub, or to the spool while the hub is unreachable, and return the buffer to the pool;
+   contentType is kept in the message flags, and deliverMessage sets the type and encoding from them */
+static void sendMessage(HUB_CLIENT_HANDLE iotHubClientHandle, MESSAGE_BUFFER* message, const char* contentType)
+{
+	uint8_t flags = strcmp(contentType, CBOR_CONTENT_TYPE) == 0 ? SPOOL_FLAG_CBOR : 0;
+#ifdef USE_EVENT_LOOP
+	/* This runs in a loop callback, which must not block: with the window full
+	   the message is spooled and goes out with the next drain */
+	unsigned int waitMs = 0;
+#else
+	unsigned int waitMs = Inflight_policy == INFLIGHT_POLICY_DROP ? 0 : INFLIGHT_BLOCK_TIMEOUT_MS;
+#endif
+	int result = DELIVER_FAILED;
+
+	/* Failed sends hold window slots until they are requeued; requeue them now
+	   rather than wait behind them, and they go out ahead of this message */
+	if (InflightWindow_TakeFailed(Inflight_window, requeueFailed, NULL) > 0)
+	{
+		printf("Requeued unconfirmed messages before sending\r\n");
+	}
+
+	/* While anything is spooled new messages queue behind it, so the hub sees them in order */
+	if (Spool == NULL || (Hub_connected && StoreForward_Pending(Spool) == 0))
+	{
+		result = deliverMessage(iotHubClientHandle, message->data, message->length, flags, waitMs);
+	}
+	if (result == DELIVER_WINDOW_FULL && Inflight_policy == INFLIGHT_POLICY_DROP)
+	{
+		printf("In-flight window full, dropping the message\r\n");
+		InflightWindow_CountDropped(Inflight_window);
+	}
+	else if (result != DELIVER_OK &&
+		(Spool == NULL || StoreForward_Append(Spool, message->data, message->length, flags, GetTimestampMs()) != 0))
+	{
+		printf("failed to spool the message, dropping it\r\n");
+		InflightWindow_CountDropped(Inflight_window);
+	}
+	MessagePool_Release(message);
+
+#ifdef COUNT_MALLOCS
+	uint64_t allocations = AllocCounter_Get();
+	printf("Heap allocations since the previous message: %llu\r\n",
+		(unsigned long long)(allocations - Allocations_at_last_message));
+	Allocations_at_last_message = allocations;
+#endif
+}
+
+void SendDeviceInfo(HUB_CLIENT_HANDLE iotHubClientHandle)
+{
+	MESSAGE_BUFFER* message = acquireMessage("device info");
+	if (message != NULL)
+	{
+		if (MessageBuffer_Printf(message, Num_sensors > 1 ? deviceInfoDualSensor : deviceInfo, deviceId) != 0)
+		{
+			printf("Device info does not fit in %zu bytes\r\n", message->capacity);
+			MessagePool_Release(message);
+		}
+		else
+		{
+			printf("send device info: %s %zu\r\n", (char*)message->data, message->length);
+			sendMessage(iotHubClientHandle, message, JSON_CONTENT_TYPE);
+		}
+	}
+}
+
+/* Read every attached sensor once; failed sensors carry the simulated -300 values */
+void AcquireSample(TELEMETRY_SAMPLE* sample)
+{
+	bme280_sample_t samples[MAX_SENSORS];
+
+	/* Trigger one forced-mode conversion on every sensor and collect them together;
+	   the sensors sleep between samples */
+	bme280_read_all_forced(Sensors, Num_sensors, samples);
+
+	sample->timestampMs = GetTimestampMs();
+	sample->sensorCount = Num_sensors;
+	for (int i = 0; i < Num_sensors; i++)
+	{
+		sample->status[i] = samples[i].Status__i;
+		if (samples[i].Status__i == 1)
+		{
+			sample->temperature[i] = samples[i].Temp_C__f;
+			sample->humidity[i] = samples[i].Hum_pct__f;
+			sample->pressure[i] = samples[i].Pres_Pa__f;
+			if (Sampling_interval_ms >= UPLINK_MIN_PERIOD_MS)
+			{
+				printf("Read Sensor %d Data: Humidity = %.1f%% Temperature = %.1f*C (conversion latency %u us)\n",
+					i, sample->humidity[i], sample->temperature[i], samples[i].Latency_us__u32);
+			}
+		}
+		else
+		{
+			sample->temperature[i] = -300.0;
+			sample->humidity[i] = -300;
+			sample->pressure[i] = -300;
+			printf("Read Sensor %d Data Failed, send simulated data Humidity = %.1f%% Temperature = %.1f*C \n",
+				i, sample->humidity[i], sample->temperature[i]);
+		}
+	}
+}
+
+/* Queues a sample for telemetry; the first one after a hot restart reports the gap */
+static void PushSample(const TELEMETRY_SAMPLE* sample)
+{
+	if (SampleRing_Push(Sample_ring, sample) != 0)
+	{
+		printf("Sample ring full, dropping sample\r\n");
+	}
+	Last_sample_ms = sample->timestampMs;
+	if (Handoff.lastSampleMs != 0)
+	{
+		ReportRestartGap(sample);
+	}
+}
+
+void SampleOnce(void)
+{
+	TELEMETRY_SAMPLE sample;
+	AcquireSample(&sample);
+	PushSample(&sample);
+}
+
+/* Picks the highest pressure oversampling, x16 down to x1, whose conversion
+   fits in half the sampling period; x16 needs 41 ms, x1 allows about 100 Hz */
+static void FitOversamplingToPeriod(unsigned int periodMs)
+{
+	for (int i = 0; i < Num_sensors; i++)
+	{
+		uint8_t humidity = Sensors[i].Ctrl_hum_setting__u8;
+		uint8_t pressure = 5;
+		while (pressure > 1 && bme280_measurement_time_us(1, pressure, humidity) * 2 > periodMs * 1000)
+		{
+			pressure--;
+		}
+		if (bme280_dev_set_oversampling(&Sensors[i], 1, pressure, humidity) != 1)
+		{
+			printf("Failed to set the oversampling of sensor %d\r\n", i);
+		}
+	}
+}
+
+/* Takes the samples due, follows TelemetryInterval and SamplingCatchUp
+   changes and publishes the schedule's statistics */
+static void RunSamplingSchedule(PERIODIC_SCHEDULE* schedule, uint32_t runs, unsigned int* periodMs)
+{
+	while (runs-- > 0)
+	{
+		SampleOnce();
+	}
+	if (Sampling_interval_ms != *periodMs)
+	{
+		*periodMs = Sampling_interval_ms;
+		FitOversamplingToPeriod(*periodMs);
+		PeriodicSchedule_SetPeriod(schedule, *periodMs);
+	}
+	schedule->catchUp = Sampling_catch_up;
+
+	pthread_mutex_lock(&Sampling_schedule_lock);
+	Sampling_schedule_snapshot = *schedule;
+	pthread_mutex_unlock(&Sampling_schedule_lock);
+}
+
+/* Sleeps until the schedule's next deadline, or until WakeSampling, and
+   polls; like PeriodicSchedule_Wait it returns 0 when woken early */
+static uint32_t WaitForSamplingDeadline(PERIODIC_SCHEDULE* schedule)
+{
+	struct timespec deadline;
+
+	deadline.tv_sec = (time_t)(schedule->nextNs / 1000000000);
+	deadline.tv_nsec = (long)(schedule->nextNs % 1000000000);
+	pthread_once(&Sampling_wake_once, InitSamplingWake);
+	pthread_mutex_lock(&Sampling_wake_lock);
+	while (!Sampling_woken && pthread_cond_timedwait(&Sampling_wake, &Sampling_wake_lock, &deadline) != ETIMEDOUT)
+	{
+	}
+	Sampling_woken = 0;
+	pthread_mutex_unlock(&Sampling_wake_lock);
+	return PeriodicSchedule_Poll(schedule, PeriodicSchedule_Now());
+}
+
+void* SamplingThread(void* arg)
+{
+	PERIODIC_SCHEDULE schedule;
+	unsigned int periodMs = Sampling_interval_ms;
+	(void)arg;
+
+	FitOversamplingToPeriod(periodMs);
+	PeriodicSchedule_Init(&schedule, periodMs, 0, Sampling_catch_up, SAMPLING_MAX_BURST);
+	while (Sampling_running)
+	{
+		RunSamplingSchedule(&schedule, WaitForSamplingDeadline(&schedule), &periodMs);
+	}
+	return NULL;
+}
+
+void SendTelemetrySample(HUB_CLIENT_HANDLE iotHubClientHandle, const TELEMETRY_SAMPLE* sample)
+{
+	MESSAGE_BUFFER* message = acquireMessage("sample");
+	if (message == NULL)
+	{
+		return;
+	}
+
+	if (Telemetry_encoding == TELEMETRY_ENCODING_CBOR)
+	{
+		size_t available, length;
+		unsigned char* tail = MessageBuffer_Tail(message, &available);
+		if (TelemetryCbor_EncodeSample(sample, tail, available, &length) != 0)
+		{
+			printf("Failed to encode sample as CBOR\r\n");
+			MessagePool_Release(message);
+		}
+		else
+		{
+			MessageBuffer_Commit(message, length);
+			if (Sampling_interval_ms >= UPLINK_MIN_PERIOD_MS)
+			{
+				printf("Sending sensor value as %zu bytes of CBOR\r\n", length);
+			}
+			sendMessage(iotHubClientHandle, message, CBOR_CONTENT_TYPE);
+		}
+		return;
+	}
+
+	int result;
+	if (Telemetry_template.text != NULL && (size_t)sample->sensorCount * 2 + 1 == Telemetry_template.slotCount)
+	{
+		TEMPLATE_VALUE values[1 + 2 * MAX_SENSORS];
+		size_t available, length;
+		char* tail = (char*)MessageBuffer_Tail(message, &available);
+
+		values[0].u = sample->timestampMs;
+		for (int i = 0; i < sample->sensorCount; i++)
+		{
+			values[1 + 2 * i].d = sample->temperature[i];
+			values[2 + 2 * i].d = sample->humidity[i];
+		}
+		/* The pool keeps a byte past capacity for the terminator */
+		result = TelemetryTemplate_Render(&Telemetry_template, values, Telemetry_template.slotCount, tail, available + 1, &length);
+		if (result == 0)
+		{
+			MessageBuffer_Commit(message, length);
+		}
+	}
+	else if (sample->sensorCount > 1)
+	{
+		result = MessageBuffer_Printf(message, telemetryDataDualSensor, deviceId, (unsigned long long)sample->timestampMs,
+			sample->temperature[0], sample->humidity[0], sample->temperature[1], sample->humidity[1]);
+	}
+	else
+	{
+		result = MessageBuffer_Printf(message, telemetryData, deviceId, (unsigned long long)sample->timestampMs,
+			sample->temperature[0], sample->humidity[0]);
+	}
+	if (result != 0)
+	{
+		printf("Sensor value does not fit in %zu bytes\r\n", message->capacity);
+		MessagePool_Release(message);
+	}
+	else
+	{
+		if (Sampling_interval_ms >= UPLINK_MIN_PERIOD_MS)
+		{
+			printf("Sending sensor value: %s %zu\r\n", (char*)message->data, message->length);
+		}
+		sendMessage(iotHubClientHandle, message, JSON_CONTENT_TYPE);
+	}
+}
+
+/* Falls back to MessageBuffer_Printf when compiling fails */
+void CompileTelemetryTemplate(void)
+{
+	if (TelemetryTemplate_Compile(&Telemetry_template, Num_sensors > 1 ? telemetryDataDualSensor : telemetryData, deviceId) != 0)
+	{
+		printf("Failed to compile the telemetry template, formatting every message in full\r\n");
+	}
+}
+
+void SendTelemetryBatch(HUB_CLIENT_HANDLE iotHubClientHandle)
+{
+	int count = Telemetry_batch.count;
+	MESSAGE_BUFFER* message = acquireMessage("batch");
+
+	if (message == NULL)
+	{
+		TelemetryBatch_Init(&Telemetry_batch);
+	}
+	else if (Telemetry_encoding == TELEMETRY_ENCODING_CBOR)
+	{
+		size_t available, length;
+		unsigned char* tail = MessageBuffer_Tail(message, &available);
+		if (TelemetryCbor_EncodeBatch(&Telemetry_batch, tail, available, &length) != 0)
+		{
+			printf("Failed to encode a batch of %d samples as CBOR\r\n", count);
+			MessagePool_Release(message);
+		}
+		else
+		{
+			MessageBuffer_Commit(message, length);
+			printf("Sending batch of %d samples as %zu bytes of CBOR\r\n", count, length);
+			sendMessage(iotHubClientHandle, message, CBOR_CONTENT_TYPE);
+		}
+	}
+	else
+	{
+		if (TelemetryBatch_Format(&Telemetry_batch, deviceId, message) != 0)
+		{
+			printf("A batch of %d samples does not fit in %zu bytes\r\n", count, message->capacity);
+			MessagePool_Release(message);
+		}
+		else
+		{
+			printf("Sending batch of %d samples: %s %zu\r\n", count, (char*)message->data, message->length);
+			sendMessage(iotHubClientHandle, message, JSON_CONTENT_TYPE);
+		}
+	}
+}
+
+static int IsBatching(void)
+{
+	return Batch_size > 1 || Batch_age_ms > 0;
+}
+
+/* Under the batch policy samples collect in the batch while the in-flight window is full */
+static int IsHoldingBack(void)
+{
+	return Inflight_policy == INFLIGHT_POLICY_BATCH && InflightWindow_IsFull(Inflight_window);
+}
+
+/* Sends sample on its own or adds it to the pending batch */
+void QueueTelemetrySample(HUB_CLIENT_HANDLE iotHubClientHandle, const TELEMETRY_SAMPLE* sample)
+{
+	if (!IsBatching() && !IsHoldingBack())
+	{
+		SendTelemetrySample(iotHubClientHandle, sample);
+	}
+	else if (TelemetryBatch_Add(&Telemetry_batch, sample, GetTimestampMs()) != 0)
+	{
+		SendTelemetryBatch(iotHubClientHandle);
+		(void)TelemetryBatch_Add(&Telemetry_batch, sample, GetTimestampMs());
+	}
+}
+
+void SendTelemetryWindow(HUB_CLIENT_HANDLE iotHubClientHandle, const TELEMETRY_WINDOW* window)
+{
+	static const char* suffixes[MAX_SENSORS] = { "", "1" };
+	MESSAGE_BUFFER* message = acquireMessage("aggregate");
+	int result;
+
+	if (message == NULL)
+	{
+		return;
+	}
+
+	result = MessageBuffer_Printf(message, "{\"DeviceID\": \"%s\",", deviceId);
+	for (int i = 0; i < window->sensorCount && result == 0; i++)
+	{
+		const RUNNING_STATS* temperature = &window->temperature[i];
+		const RUNNING_STATS* humidity = &window->humidity[i];
+		const char* suffix = suffixes[i];
+		/* Keep the simulated -300 convention when every read in the window failed */
+		int valid = temperature->count > 0;
+
+		result = MessageBuffer_Printf(message, "%s", i > 0 ? "," : "");
+		if (result == 0)
+		{
+			result = MessageBuffer_Printf(message, telemetryAggregateFields,
+				suffix, valid ? temperature->mean : -300.0,
+				suffix, valid ? temperature->min : -300.0,
+				suffix, valid ? temperature->max : -300.0,
+				suffix, RunningStats_StdDev(temperature),
+				suffix, valid ? humidity->mean : -300.0,
+				suffix, valid ? humidity->min : -300.0,
+				suffix, valid ? humidity->max : -300.0,
+				suffix, RunningStats_StdDev(humidity),
+				suffix, temperature->count);
+		}
+	}
+	if (result == 0)
+	{
+		result = MessageBuffer_Printf(message, " } ");
+	}
+
+	if (result != 0)
+	{
+		printf("Aggregated telemetry does not fit in %zu bytes, dropping window\r\n", message->capacity);
+		MessagePool_Release(message);
+	}
+	else
+	{
+		printf("Sending aggregate of %u samples: %s %zu\r\n", window->samples, (char*)message->data, message->length);
+		sendMessage(iotHubClientHandle, message, JSON_CONTENT_TYPE);
+	}
+}
+
+/* Writes the delivery counters and the ack latency histogram as "name value" lines */
+static int FormatDeliveryReport(char* report, size_t size)
+{
+	INFLIGHT_STATS stats;
+	int length;
+
+	InflightWindow_GetStats(Inflight_window, &stats);
+	length = snprintf(report, size,
+		"policy %s\nin_flight %zu\ncapacity %zu\nhigh_watermark %zu\nsent %llu\nacknowledged %llu\n"
+		"failed %llu\nblocked %llu\nfull %llu\ndropped %llu\n",
+		InflightPolicyName(Inflight_policy), stats.inFlight, stats.capacity, stats.highWatermark,
+		(unsigned long long)stats.sent, (unsigned long long)stats.acknowledged, (unsigned long long)stats.failed,
+		(unsigned long long)stats.blocked, (unsigned long long)stats.full, (unsigned long long)stats.dropped);
+	if (length < 0 || (size_t)length >= size)
+	{
+		return 1;
+	}
+	return LatencyHistogram_Format(&stats.ackLatency, "ack_latency", report + length, size - length);
+}
+
+/* Writes the sampling schedule's counters and jitter histogram */
+static int FormatSamplingReport(char* report, size_t size)
+{
+	PERIODIC_SCHEDULE schedule;
+	int length;
+
+	pthread_mutex_lock(&Sampling_schedule_lock);
+	schedule = Sampling_schedule_snapshot;
+	pthread_mutex_unlock(&Sampling_schedule_lock);
+
+	length = snprintf(report, size,
+		"sampling_period_ms %llu\nsampling_catch_up %s\nsampling_ticks %llu\nsampling_missed %llu\n"
+		"sampling_skipped %llu\nsampling_burst %llu\n",
+		(unsigned long long)(schedule.periodNs / 1000000), schedule.catchUp == SCHEDULE_CATCH_UP_BURST ? "burst" : "skip",
+		(unsigned long long)schedule.ticks, (unsigned long long)schedule.missed,
+		(unsigned long long)schedule.skipped, (unsigned long long)schedule.burst);
+	if (length < 0 || (size_t)length >= size)
+	{
+		return 1;
+	}
+	return LatencyHistogram_Format(&schedule.jitter, "sampling_jitter", report + length, size - length);
+}
+
+/* Writes how many reported-property patches were merged rather than sent on their own */
+static int FormatReportedReport(char* report, size_t size)
+{
+	REPORTED_STATE_STATS stats;
+	int length;
+
+	ReportedState_GetStats(Reported_state, &stats);
+	length = snprintf(report, size,
+		"reported_patches %llu\nreported_merged %llu\nreported_sent %llu\nreported_failed %llu\n"
+		"reported_hard_flushes %llu\nreported_split_flushes %llu\nreported_patch_bytes %llu\nreported_sent_bytes %llu\n",
+		(unsigned long long)stats.patches, (unsigned long long)stats.merged, (unsigned long long)stats.reports,
+		(unsigned long long)stats.failed, (unsigned long long)stats.hardFlushes, (unsigned long long)stats.splitFlushes,
+		(unsigned long long)stats.patchBytes, (unsigned long long)stats.reportBytes);
+	return length < 0 || (size_t)length >= size;
+}
+
+static unsigned int UplinkPeriodMs(void)
+{
+	return Sampling_interval_ms > UPLINK_MIN_PERIOD_MS ? Sampling_interval_ms : UPLINK_MIN_PERIOD_MS;
+}
+
+/* Measures samples per second entering the ring and reports it to the twin once a minute */
+void ReportAchievedRate(void)
+{
+	static uint64_t windowStartNs = 0;
+	static uint64_t windowStartPushed = 0;
+	SAMPLE_RING_STATS stats;
+	uint64_t nowNs = PeriodicSchedule_Now();
+
+	SampleRing_GetStats(Sample_ring, &stats);
+	if (windowStartNs == 0)
+	{
+		windowStartNs = nowNs;
+		windowStartPushed = stats.pushed;
+		return;
+	}
+	if (nowNs - windowStartNs < (uint64_t)ACHIEVED_RATE_REPORT_MS * 1000000)
+	{
+		return;
+	}
+
+	double rate = (double)(stats.pushed - windowStartPushed) * 1e9 / (double)(nowNs - windowStartNs);
+	printf("Achieved sample rate %.2f Hz, requested %.2f Hz\r\n", rate, 1000.0 / Sampling_interval_ms);
+	windowStartNs = nowNs;
+	windowStartPushed = stats.pushed;
+	__atomic_store_n(&Achieved_rate_centihz, (unsigned int)(rate * 100.0 + 0.5), __ATOMIC_RELAXED);
+	if (g_thermostat != NULL)
+	{
+		UpdateReportedProperties("{ 'Config' : { 'AchievedSampleRate': %.2f } }", rate);
+	}
+}
+
+/* Once the first message is confirmed, reports how long this start took to reach each phase */
+void ReportStartupPhases(void)
+{
+	char report[512];
+	uint64_t confirmedUs;
+
+	if (Startup_reported || StartupPhases_Elapsed(STARTUP_PHASE_FIRST_MESSAGE_CONFIRMED, &confirmedUs) != 0)
 	{
-		printf("Failed to open lastupdate file to write\r\n");
+		return;
+	}
+	Startup_reported = 1;
+	printf("Startup: first message confirmed %llu ms after start\r\n", (unsigned long long)(confirmedUs / 1000));
+	if (StartupPhases_FormatPatch(report, sizeof(report), Handoff_received ? "hot" : "cold",
+		g_thermostat != NULL ? g_thermostat->System.FirmwareVersion : "") != 0)
+	{
+		printf("Startup phases do not fit in %zu bytes\r\n", sizeof(report));
 	}
 	else
 	{
-		fclose(fp);
+		UpdateReportedProperties("%s", report);
 	}
 }
 
-/*Callback for InitiateFirmwareUpdate*/
-METHODRETURN_HANDLE InitiateFirmwareUpdate(Thermostat* thermostat, ascii_char_ptr FwPackageURI)
+/* Requeues messages the hub did not confirm and publishes the delivery statistics */
+void ServiceInflightWindow(void)
 {
-	(void)(thermostat);
+	INFLIGHT_STATS stats;
+	char report[8192];
+	size_t requeued = InflightWindow_TakeFailed(Inflight_window, requeueFailed, NULL);
 
-	METHODRETURN_HANDLE result = MethodReturn_Create(201, "\"Initiating Firmware Update\"");
-	printf("Recieved firmware update request. Use package at: %s\r\n", FwPackageURI);
-	pthread_t tid;
-	ascii_char_ptr url = malloc(strlen(FwPackageURI) + 1);
-	strcpy(url, FwPackageURI);
-	printf("receive and strcpy url: %s\r\n", url);
-	pthread_create(&tid, NULL, &FirmwareUpdateThread, url);
-	return result;
+	if (requeued > 0)
+	{
+		printf("Requeued %zu unconfirmed messages\r\n", requeued);
+	}
+
+	InflightWindow_GetStats(Inflight_window, &stats);
+	printf("In flight: %zu/%zu, high watermark %zu, sent %llu, acknowledged %llu, failed %llu, dropped %llu, "
+		"ack p50 %llu ms, p99 %llu ms\r\n",
+		stats.inFlight, stats.capacity, stats.highWatermark, (unsigned long long)stats.sent,
+		(unsigned long long)stats.acknowledged, (unsigned long long)stats.failed, (unsigned long long)stats.dropped,
+		(unsigned long long)LatencyHistogram_Percentile(&stats.ackLatency, 0.5) / 1000,
+		(unsigned long long)LatencyHistogram_Percentile(&stats.ackLatency, 0.99) / 1000);
+
+	if (FormatDeliveryReport(report, sizeof(report)) == 0 &&
+		FormatSamplingReport(report + strlen(report), sizeof(report) - strlen(report)) == 0 &&
+		MethodPool_Format(Method_pool, report + strlen(report), sizeof(report) - strlen(report)) == 0 &&
+		FormatReportedReport(report + strlen(report), sizeof(report) - strlen(report)) == 0 &&
+		StartupPhases_Format(report + strlen(report), sizeof(report) - strlen(report)) == 0)
+	{
+		/* Written aside and renamed so readers never see a half written report */
+		FILE* fp = fopen(STATS_FILE ".tmp", "w");
+		if (fp != NULL)
+		{
+			fputs(report, fp);
+			if (fclose(fp) == 0)
+			{
+				rename(STATS_FILE ".tmp", STATS_FILE);
+			}
+		}
+	}
 }
 
-/*Callback for LightBlink*/
-METHODRETURN_HANDLE LightBlink(Thermostat* thermostat)
+/* Drains the spool while the hub is reachable. New messages queue behind a
+   backlog, so the drain rate is the send rate plus SPOOL_DRAIN_PER_SECOND to
+   catch up, and the burst covers the messages of one uplink period. */
+static size_t DrainSpool(HUB_CLIENT_HANDLE iotHubClientHandle, uint64_t now)
 {
-	int blinkCount = 2;
-	printf("Raspberry Pi light blink\n");
-	while (blinkCount--)
+	unsigned int intervalMs = Sampling_interval_ms > 0 ? Sampling_interval_ms : 1;
+	uint32_t perSecond = SPOOL_DRAIN_PER_SECOND + (1000 + intervalMs - 1) / intervalMs;
+	uint32_t burst = (uint32_t)((uint64_t)perSecond * UplinkPeriodMs() / 1000);
+
+	if (Spool == NULL || !Hub_connected || StoreForward_Pending(Spool) == 0)
 	{
-		pinMode(Grn_led_pin, OUTPUT);
-		printf("light on\n");
-		digitalWrite(Grn_led_pin, 1);
-		ThreadAPI_Sleep(1000);
-		printf("light off\n");
-		digitalWrite(Grn_led_pin, 0);
-		ThreadAPI_Sleep(1000);
+		return 0;
 	}
-	return MethodReturn_Create(201, "\"light blink success\"");
+	StoreForward_SetDrainRate(Spool, perSecond, burst > SPOOL_DRAIN_BURST ? burst : SPOOL_DRAIN_BURST);
+	return StoreForward_Drain(Spool, now, deliverSpooled, iotHubClientHandle);
 }
 
-/* Send data to IoT Hub */
-static void sendMessage(IOTHUB_CLIENT_HANDLE iotHubClientHandle, const unsigned char* buffer, size_t size)
+/* Group commits the spool and drains it at a bounded rate */
+void ServiceSpool(HUB_CLIENT_HANDLE iotHubClientHandle)
 {
-	IOTHUB_MESSAGE_HANDLE messageHandle = IoTHubMessage_CreateFromByteArray(buffer, size);
-	if (messageHandle == NULL)
+	STORE_FORWARD_STATS stats;
+	uint64_t now = GetTimestampMs();
+
+	if (Spool == NULL)
 	{
-		printf("unable to create a new IoTHubMessage\r\n");
+		return;
 	}
-	else
+
+	StoreForward_SetMaxBytes(Spool, (uint64_t)Spool_limit_mb * 1024 * 1024);
+	if (Hub_connected && StoreForward_Pending(Spool) > 0)
+	{
+		size_t delivered = DrainSpool(iotHubClientHandle, now);
+		printf("Spool: delivered %zu\r\n", delivered);
+	}
+	StoreForward_Tick(Spool, now);
+
+	StoreForward_GetStats(Spool, &stats);
+	if (stats.pending > 0 || stats.evicted > 0)
+	{
+		printf("Spool: pending %llu, %llu bytes on disk, evicted %llu, commits %llu\r\n",
+			(unsigned long long)stats.pending, (unsigned long long)stats.bytesOnDisk,
+			(unsigned long long)stats.evicted, (unsigned long long)stats.commits);
+	}
+}
+
+/* Drain everything the sampling thread has queued since the last call, either
+   sending each sample or folding it into the current aggregation window */
+void SendTelemetryData(HUB_CLIENT_HANDLE iotHubClientHandle)
+{
+	TELEMETRY_SAMPLE sample;
+	TELEMETRY_SAMPLE toSend[2];
+	SAMPLE_RING_STATS stats;
+	int windowSeconds = Aggregation_window_s;
+
+	TelemetryDeadband_Configure(&Telemetry_deadband, Temperature_deadband, Humidity_deadband,
+		(uint32_t)Heartbeat_interval_s * 1000);
+
+	while (SampleRing_Pop(Sample_ring, &sample) == 0)
 	{
-		if (IoTHubClient_SendEventAsync(iotHubClientHandle, messageHandle, NULL, NULL) != IOTHUB_CLIENT_OK)
+		if (windowSeconds > 0)
 		{
-			printf("failed to hand over the message to IoTHubClient");
+			TelemetryWindow_Add(&Telemetry_window, &sample);
 		}
 		else
 		{
-			printf("IoTHubClient accepted the message for delivery\r\n");
+			int count = TelemetryDeadband_Offer(&Telemetry_deadband, &sample, toSend);
+			for (int i = 0; i < count; i++)
+			{
+				QueueTelemetrySample(iotHubClientHandle, &toSend[i]);
+			}
 		}
+	}
 
-		IoTHubMessage_Destroy(messageHandle);
+	/* A window left over from before aggregation was switched off goes out right away */
+	if (Telemetry_window.samples > 0 &&
+		(windowSeconds == 0 || TelemetryWindow_IsDue(&Telemetry_window, GetTimestampMs(), (uint32_t)windowSeconds * 1000)))
+	{
+		SendTelemetryWindow(iotHubClientHandle, &Telemetry_window);
+		TelemetryWindow_Reset(&Telemetry_window);
+	}
+
+	/* As above, a batch left over from before batching was switched off goes out right away,
+	   unless it is holding samples back until the in-flight window has room */
+	if (Telemetry_batch.count > 0 && !IsHoldingBack() &&
+		(!IsBatching() || TelemetryBatch_IsDue(&Telemetry_batch, GetTimestampMs(), Batch_size, (uint32_t)Batch_age_ms)))
+	{
+		SendTelemetryBatch(iotHubClientHandle);
+	}
+
+	SampleRing_GetStats(Sample_ring, &stats);
+	printf("Sample ring: occupancy %zu/%zu, high watermark %zu, pushed %llu, overflows %llu\r\n",
+		stats.occupancy, stats.capacity, stats.highWatermark,
+		(unsigned long long)stats.pushed, (unsigned long long)stats.overflows);
+	pthread_mutex_lock(&Sampling_schedule_lock);
+	printf("Sampling: ticks %llu, missed %llu, jitter p50 %llu us, p99 %llu us\r\n",
+		(unsigned long long)Sampling_schedule_snapshot.ticks, (unsigned long long)Sampling_schedule_snapshot.missed,
+		(unsigned long long)LatencyHistogram_Percentile(&Sampling_schedule_snapshot.jitter, 0.5),
+		(unsigned long long)LatencyHistogram_Percentile(&Sampling_schedule_snapshot.jitter, 0.99));
+	pthread_mutex_unlock(&Sampling_schedule_lock);
+	if (Telemetry_deadband.stats.offered > 0)
+	{
+		printf("Deadband: offered %llu, sent %llu, suppressed %llu (%.1f%%), heartbeats %llu\r\n",
+			(unsigned long long)Telemetry_deadband.stats.offered, (unsigned long long)Telemetry_deadband.stats.sent,
+			(unsigned long long)Telemetry_deadband.stats.suppressed,
+			100.0 * Telemetry_deadband.stats.suppressed / Telemetry_deadband.stats.offered,
+			(unsigned long long)Telemetry_deadband.stats.heartbeats);
+	}
+
+	ServiceInflightWindow();
+	ServiceSpool(iotHubClientHandle);
+	ReportAchievedRate();
+	ReportStartupPhases();
+}
+
+/* Sends the first telemetry once the hub is up, without waiting for the
+   telemetry schedule, and the device info right behind it */
+static void SendFirstTelemetry(HUB_CLIENT_HANDLE iotHubClientHandle)
+{
+	if (First_telemetry_pending && Hub_connected)
+	{
+		First_telemetry_pending = 0;
+		SendTelemetryData(iotHubClientHandle);
+		printf("Send DeviceInfo object to IoT Hub at startup\n");
+		SendDeviceInfo(iotHubClientHandle);
+	}
+}
+
+/* Sends everything still held on the device: queued samples, the deadband's
+   held sample, a partial aggregation window and a partial batch */
+void FlushTelemetryData(HUB_CLIENT_HANDLE iotHubClientHandle)
+{
+	TELEMETRY_SAMPLE sample;
+
+	SendTelemetryData(iotHubClientHandle);
+
+	if (TelemetryDeadband_Flush(&Telemetry_deadband, &sample))
+	{
+		QueueTelemetrySample(iotHubClientHandle, &sample);
+	}
+	if (Telemetry_window.samples > 0)
+	{
+		SendTelemetryWindow(iotHubClientHandle, &Telemetry_window);
+		TelemetryWindow_Reset(&Telemetry_window);
+	}
+	if (Telemetry_batch.count > 0)
+	{
+		SendTelemetryBatch(iotHubClientHandle);
+	}
+}
+
+/* Gives the client a bounded amount of time to confirm the messages in flight;
+   whatever is still unconfirmed is requeued once the client is destroyed */
+void WaitForPendingMessages(HUB_CLIENT_HANDLE iotHubClientHandle, unsigned int timeoutMs)
+{
+#ifdef USE_EVENT_LOOP
+	/* Nothing else runs the lower layer client any more, so keep it going while waiting */
+	unsigned int waitedMs = 0;
+	int busy = 1;
+	while (busy && waitedMs < timeoutMs)
+	{
+		IoTHubClient_LL_DoWork(iotHubClientHandle);
+		busy = InflightWindow_WaitIdle(Inflight_window, 10) != 0;
+		waitedMs += 10;
+	}
+	if (busy)
+#else
+	(void)iotHubClientHandle;
+	if (InflightWindow_WaitIdle(Inflight_window, timeoutMs) != 0)
+#endif
+	{
+		printf("Gave up waiting for queued messages after %u ms\r\n", timeoutMs);
+	}
+	ServiceInflightWindow();
+}
+
+/* CPU time and context switches of the whole process, all threads included */
+static int FormatResourceUsage(char* buffer, size_t size)
+{
+	struct rusage usage;
+	int length;
+
+	if (getrusage(RUSAGE_SELF, &usage) != 0)
+	{
+		return 1;
+	}
+	length = snprintf(buffer, size,
+		"user_ms %ld\nsystem_ms %ld\nvoluntary_switches %ld\ninvoluntary_switches %ld\n",
+		(long)usage.ru_utime.tv_sec * 1000 + (long)usage.ru_utime.tv_usec / 1000,
+		(long)usage.ru_stime.tv_sec * 1000 + (long)usage.ru_stime.tv_usec / 1000,
+		usage.ru_nvcsw, usage.ru_nivcsw);
+#ifdef USE_EVENT_LOOP
+	if (length > 0 && (size_t)length < size)
+	{
+		length += snprintf(buffer + length, size - length, "wakeups %llu\n",
+			(unsigned long long)EventLoop_Wakeups(Event_loop));
+	}
+#endif
+	return length < 0 || (size_t)length >= size;
+}
+
+#ifndef USE_EVENT_LOOP
+static void OnStopSignal(int signum)
+{
+	(void)signum;
+	Stop_requested = 1;
+}
+#endif
+
+int StartSampling(void)
+{
+	CompileTelemetryTemplate();
+	TelemetryWindow_Reset(&Telemetry_window);
+	TelemetryDeadband_Init(&Telemetry_deadband);
+	TelemetryBatch_Init(&Telemetry_batch);
+
+	Sample_ring = SampleRing_Create(SAMPLE_RING_CAPACITY);
+	if (Sample_ring == NULL)
+	{
+		printf("Failed to create the sample ring\r\n");
+		return 1;
+	}
+	/* Samples the previous process took but did not send go out first */
+	for (size_t i = 0; i < Handoff_sample_count && Handoff_samples != NULL; i++)
+	{
+		(void)SampleRing_Push(Sample_ring, &Handoff_samples[i]);
+	}
+	free(Handoff_samples);
+	Handoff_samples = NULL;
+	/* The read that checked the sensors is the first sample */
+	PushSample(&First_sample);
+
+	/* The event loop samples from a timer instead of a thread */
+#ifndef USE_EVENT_LOOP
+	Sampling_running = 1;
+	if (pthread_create(&Sampling_thread, NULL, &SamplingThread, NULL) != 0)
+	{
+		printf("Failed to start the sampling thread\r\n");
+		Sampling_running = 0;
+		SampleRing_Destroy(Sample_ring);
+		Sample_ring = NULL;
+		return 1;
+	}
+#endif
+	return 0;
+}
+
+/* Stops the sampling thread; the ring stays so it can still be drained */
+void StopSampling(void)
+{
+	if (Sampling_running)
+	{
+		Sampling_running = 0;
+		WakeSampling();
+		pthread_join(Sampling_thread, NULL);
+	}
+}
+
+#ifdef USE_EVENT_LOOP
+/* Sampling and telemetry timers are one-shot, re-armed at the next deadline of their schedule */
+typedef struct EVENT_LOOP_CONTEXT_TAG
+{
+	HUB_CLIENT_HANDLE client;
+	int samplingTimer;
+	int telemetryTimer;
+	PERIODIC_SCHEDULE samplingSchedule;
+	PERIODIC_SCHEDULE telemetrySchedule;
+	unsigned int samplingPeriodMs;
+	unsigned int telemetryPeriodMs;
+} EVENT_LOOP_CONTEXT;
+
+static void onSamplingTimer(void* context, uint64_t expirations)
+{
+	EVENT_LOOP_CONTEXT* loopContext = context;
+	(void)expirations;
+	RunSamplingSchedule(&loopContext->samplingSchedule,
+		PeriodicSchedule_Poll(&loopContext->samplingSchedule, PeriodicSchedule_Now()), &loopContext->samplingPeriodMs);
+	EventLoop_SetTimerDeadline(loopContext->samplingTimer, loopContext->samplingSchedule.nextNs);
+}
+
+static void onTelemetryTimer(void* context, uint64_t expirations)
+{
+	EVENT_LOOP_CONTEXT* loopContext = context;
+	(void)expirations;
+	if (PeriodicSchedule_Poll(&loopContext->telemetrySchedule, PeriodicSchedule_Now()) > 0)
+	{
+		pthread_mutex_lock(&Hub_client_lock);
+		SendTelemetryData(loopContext->client);
+		IoTHubClient_LL_DoWork(loopContext->client);
+		pthread_mutex_unlock(&Hub_client_lock);
+	}
+	if (UplinkPeriodMs() != loopContext->telemetryPeriodMs)
+	{
+		loopContext->telemetryPeriodMs = UplinkPeriodMs();
+		PeriodicSchedule_Init(&loopContext->telemetrySchedule, loopContext->telemetryPeriodMs,
+			loopContext->telemetryPeriodMs / 2, SCHEDULE_CATCH_UP_SKIP, 0);
+	}
+	EventLoop_SetTimerDeadline(loopContext->telemetryTimer, loopContext->telemetrySchedule.nextNs);
+}
+
+static void onDoWorkTimer(void* context, uint64_t expirations)
+{
+	EVENT_LOOP_CONTEXT* loopContext = context;
+	(void)expirations;
+	/* A new interval re-arms the sampling timer now rather than at the old deadline */
+	if (Sampling_interval_ms != loopContext->samplingPeriodMs)
+	{
+		onSamplingTimer(loopContext, 0);
+	}
+	pthread_mutex_lock(&Hub_client_lock);
+	/* Tops the in-flight window up from the spool as confirmations free slots */
+	(void)DrainSpool(loopContext->client, GetTimestampMs());
+	IoTHubClient_LL_DoWork(loopContext->client);
+	if (First_telemetry_pending && Hub_connected)
+	{
+		SendFirstTelemetry(loopContext->client);
+		IoTHubClient_LL_DoWork(loopContext->client);
+	}
+	pthread_mutex_unlock(&Hub_client_lock);
+}
+
+static void onStopSignalEvent(void* context, uint64_t signum)
+{
+	(void)context;
+	printf("Received signal %d, stopping\r\n", (int)signum);
+	Stop_requested = 1;
+	EventLoop_Stop(Event_loop);
+}
+
+/* One request per connection: read a command, write the answer, close */
+static void onControlRequest(void* context, uint64_t events)
+{
+	int fd = (int)(intptr_t)context;
+	char request[64];
+	char reply[2048];
+	ssize_t length = read(fd, request, sizeof(request) - 1);
+	(void)events;
+
+	reply[0] = '\0';
+	if (length > 0)
+	{
+		request[length] = '\0';
+		request[strcspn(request, "\r\n")] = '\0';
+		if (strcmp(request, "stats") == 0)
+		{
+			(void)FormatDeliveryReport(reply, sizeof(reply));
+		}
+		else if (strcmp(request, "sampling") == 0)
+		{
+			(void)FormatSamplingReport(reply, sizeof(reply));
+		}
+		else if (strcmp(request, "usage") == 0)
+		{
+			(void)FormatResourceUsage(reply, sizeof(reply));
+		}
+		else if (strcmp(request, "methods") == 0)
+		{
+			(void)MethodPool_Format(Method_pool, reply, sizeof(reply));
+		}
+		else if (strcmp(request, "reported") == 0)
+		{
+			(void)FormatReportedReport(reply, sizeof(reply));
+		}
+		else if (strcmp(request, "startup") == 0)
+		{
+			(void)StartupPhases_Format(reply, sizeof(reply));
+		}
+		else if (strcmp(request, "stop") == 0)
+		{
+			onStopSignalEvent(NULL, SIGTERM);
+			strcpy(reply, "stopping\n");
+		}
+		else
+		{
+			strcpy(reply, "commands: stats, sampling, usage, methods, reported, startup, stop\n");
+		}
+		/* The socket is fresh and the reply small, so this does not block */
+		(void)write(fd, reply, strlen(reply));
+	}
+	if (length >= 0 || errno != EAGAIN)
+	{
+		EventLoop_Remove(Event_loop, fd);
+		close(fd);
+	}
+}
+
+static void onControlConnection(void* context, uint64_t events)
+{
+	int listenFd = (int)(intptr_t)context;
+	int fd = accept4(listenFd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	(void)events;
+	if (fd >= 0 && EventLoop_Add(Event_loop, fd, EPOLLIN, onControlRequest, (void*)(intptr_t)fd) != 0)
+	{
+		close(fd);
 	}
-	free((void*)buffer);
 }
 
-void SendDeviceInfo(IOTHUB_CLIENT_HANDLE iotHubClientHandle)
+static int OpenControlSocket(void)
 {
-	char* buffer = malloc(sizeof(char) * 512);
-	sprintf(buffer, deviceInfo, deviceId);
-	printf("send device info: %s %d\r\n", buffer, strlen(buffer));
-	sendMessage(iotHubClientHandle, buffer, strlen(buffer));
+	struct sockaddr_un address;
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+	{
+		return -1;
+	}
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	strncpy(address.sun_path, CONTROL_SOCKET_PATH, sizeof(address.sun_path) - 1);
+	unlink(CONTROL_SOCKET_PATH);
+	if (bind(fd, (struct sockaddr*)&address, sizeof(address)) != 0 || listen(fd, 4) != 0)
+	{
+		close(fd);
+		return -1;
+	}
+	return fd;
 }
 
-void SendTelemetryData(IOTHUB_CLIENT_HANDLE iotHubClientHandle)
+/* Runs sampling, telemetry, the client and the control socket on this thread until SIGINT, SIGTERM or "stop" */
+void RunEventLoop(HUB_CLIENT_HANDLE iotHubClientHandle)
 {
-	float tempC = -300.0;
-	float pressurePa = -300;
-	float humidityPct = -300;
+	EVENT_LOOP_CONTEXT loopContext;
+	sigset_t stopSignals;
+	int controlFd;
+
+	Event_loop = EventLoop_Create();
+	if (Event_loop == NULL)
+	{
+		printf("Failed to create the event loop\r\n");
+		return;
+	}
+
+	loopContext.client = iotHubClientHandle;
+	loopContext.samplingPeriodMs = Sampling_interval_ms;
+	loopContext.telemetryPeriodMs = UplinkPeriodMs();
+	/* Telemetry runs half a period after sampling so the sample is already in the ring */
+	FitOversamplingToPeriod(loopContext.samplingPeriodMs);
+	PeriodicSchedule_Init(&loopContext.samplingSchedule, loopContext.samplingPeriodMs, 0,
+		Sampling_catch_up, SAMPLING_MAX_BURST);
+	PeriodicSchedule_Init(&loopContext.telemetrySchedule, loopContext.telemetryPeriodMs,
+		loopContext.telemetryPeriodMs / 2, SCHEDULE_CATCH_UP_SKIP, 0);
+	loopContext.samplingTimer = EventLoop_AddTimer(Event_loop, 0, onSamplingTimer, &loopContext);
+	loopContext.telemetryTimer = EventLoop_AddTimer(Event_loop, 0, onTelemetryTimer, &loopContext);
+	GetStopSignals(&stopSignals);
+
+	if (loopContext.samplingTimer < 0 || loopContext.telemetryTimer < 0 ||
+		EventLoop_AddTimer(Event_loop, EVENT_LOOP_DOWORK_MS, onDoWorkTimer, &loopContext) < 0 ||
+		EventLoop_AddSignals(Event_loop, &stopSignals, onStopSignalEvent, NULL) < 0)
+	{
+		printf("Failed to set up the event loop timers and signals\r\n");
+	}
+	else
+	{
+		EventLoop_SetTimerDeadline(loopContext.samplingTimer, loopContext.samplingSchedule.nextNs);
+		EventLoop_SetTimerDeadline(loopContext.telemetryTimer, loopContext.telemetrySchedule.nextNs);
+		/* The hub may be up already; then the first telemetry need not wait for the DoWork timer */
+		onDoWorkTimer(&loopContext, 0);
+		controlFd = OpenControlSocket();
+		if (controlFd < 0 || EventLoop_Add(Event_loop, controlFd, EPOLLIN, onControlConnection, (void*)(intptr_t)controlFd) != 0)
+		{
+			printf("Control socket %s unavailable\r\n", CONTROL_SOCKET_PATH);
+		}
+
+		EventLoop_Run(Event_loop);
 
-	int sensorResult = bme280_read_sensors(&tempC, &pressurePa, &humidityPct);
+		if (controlFd >= 0)
+		{
+			close(controlFd);
+			unlink(CONTROL_SOCKET_PATH);
+		}
+	}
+}
+#endif
 
-	if (sensorResult == 1)
+/* Sets up SPI and the sensors and takes the first sample, while the main
+   thread creates the hub client */
+static void* SetupSensors(void* arg)
+{
+	int result;
+	(void)arg;
+
+#ifdef USE_BME280_EMULATOR
+	/* Talk to in-memory sensors; BME280_EMUL_SENSORS=2 attaches one on CE1 too and
+	   BME280_EMUL_SPI_LATENCY_US models a slow bus */
+	bme280_transport_t transport;
+	const char* spiLatency = getenv("BME280_EMUL_SPI_LATENCY_US");
+	const char* emulSensors = getenv("BME280_EMUL_SENSORS");
+	Bme280_emul_bus.Chips__pa[0] = bme280_emul_create();
+	if (emulSensors != NULL && atoi(emulSensors) > 1)
+	{
+		Bme280_emul_bus.Chips__pa[1] = bme280_emul_create();
+	}
+	for (int i = 0; i < MAX_SENSORS; i++)
+	{
+		if (Bme280_emul_bus.Chips__pa[i] != NULL && spiLatency != NULL)
+		{
+			bme280_emul_set_spi_latency_us(Bme280_emul_bus.Chips__pa[i], (uint32_t)strtoul(spiLatency, NULL, 10));
+		}
+	}
+	bme280_emul_get_bus_transport(&Bme280_emul_bus, &transport);
+	bme280_set_transport(&transport);
+	result = (Bme280_emul_bus.Chips__pa[0] == NULL) ? -1 : 0;
+#else
+	result = wiringPiSPISetup(Spi_channel, Spi_clock);
+	if (result >= 0 && wiringPiSPISetup(Spi_channel_aux, Spi_clock) < 0)
+	{
+		printf("Can't setup SPI on Chip Enable %i, only reading Chip Enable %i\n", Spi_channel_aux, Spi_channel);
+	}
+#endif
+	if (result < 0)
 	{
-		printf("Read Sensor Data: Humidity = %.1f%% Temperature = %.1f*C \n",
-			humidityPct, tempC);
+		printf("Can't setup SPI, error %i calling wiringPiSPISetup(%i, %i)  %sn",
+			result, Spi_channel, Spi_clock, strerror(result));
 	}
 	else
 	{
-		printf("Read Sensor Data Failed, send simulated data Humidity = %.1f%% Temperature = %.1f*C \n", humidityPct, tempC);
+		int sensorResult = bme280_dev_init(&Sensors[0], Spi_channel);
+		if (sensorResult != 1)
+		{
+			printf("It appears that no BMP280 module on Chip Enable %i is attached. Aborting.\n", Spi_channel);
+			result = 1;
+		}
+		else if (bme280_dev_set_forced_mode(&Sensors[0]) != 1)
+		{
+			printf("Unable to put BME280 on pin %i into forced mode. Aborting.\n", Spi_channel);
+			result = 1;
+		}
+		else
+		{
+			Num_sensors = 1;
+			if (bme280_dev_init(&Sensors[1], Spi_channel_aux) == 1 && bme280_dev_set_forced_mode(&Sensors[1]) == 1)
+			{
+				printf("Found a second BME280 on Chip Enable %i\n", Spi_channel_aux);
+				Num_sensors = 2;
+			}
+			(void)StartupPhases_Mark(STARTUP_PHASE_HARDWARE_READY);
+
+			// Read the Temp & Pressure modules.
+			AcquireSample(&First_sample);
+			if (First_sample.status[0] == 1)
+			{
+				(void)StartupPhases_Mark(STARTUP_PHASE_FIRST_SAMPLE);
+				result = 0;
+			}
+			else
+			{
+				printf("Unable to read BME280 on pin %i. Aborting.\n", Spi_channel);
+				result = 1;
+			}
+		}
 	}
+	Sensors_result = result;
+	__atomic_store_n(&Sensors_done, 1, __ATOMIC_RELEASE);
+	return NULL;
+}
 
-	char* buffer = malloc(sizeof(char) * 256);
-	sprintf(buffer, telemetryData, deviceId, tempC, humidityPct);
-	printf("Sending sensor value: %s %d\r\n", buffer, strlen(buffer));
-	sendMessage(iotHubClientHandle, buffer, strlen(buffer));
+/* Returns the result of the sensor setup once it has finished. The lower
+   layer client only connects while DoWork runs, so it runs it meanwhile. */
+static int WaitForSensors(HUB_CLIENT_HANDLE iotHubClientHandle)
+{
+	if (Sensor_thread_started)
+	{
+#ifdef USE_EVENT_LOOP
+		while (iotHubClientHandle != NULL && !__atomic_load_n(&Sensors_done, __ATOMIC_ACQUIRE))
+		{
+			pthread_mutex_lock(&Hub_client_lock);
+			IoTHubClient_LL_DoWork(iotHubClientHandle);
+			pthread_mutex_unlock(&Hub_client_lock);
+			ThreadAPI_Sleep(10);
+		}
+#else
+		(void)iotHubClientHandle;
+#endif
+		pthread_join(Sensor_thread, NULL);
+		Sensor_thread_started = 0;
+	}
+	return Sensors_result;
 }
 
 void remote_monitoring_run(void)
 {
-	if (platform_init() != 0)
+	Main_thread = pthread_self();
+	Message_pool = MessagePool_Create(MESSAGE_POOL_BUFFERS, MESSAGE_POOL_BUFFER_SIZE);
+	Inflight_window = InflightWindow_Create(INFLIGHT_WINDOW_SIZE, MESSAGE_POOL_BUFFER_SIZE);
+	Method_pool = MethodPool_Create(METHOD_WORKERS, METHOD_QUEUE_LENGTH);
+	Reported_state = ReportedState_Create(REPORTED_COALESCE_WINDOW_MS, SendReportedPatch, NULL);
+	pinMode(Grn_led_pin, OUTPUT);
+	Led_engine = LedEngine_Create(WriteGreenLed, NULL);
+	if (Message_pool == NULL || Inflight_window == NULL || Method_pool == NULL || Reported_state == NULL ||
+		Led_engine == NULL)
+	{
+		printf("Failed to allocate the message pool.\n");
+	}
+	else if (platform_init() != 0)
 	{
 		printf("Failed to initialize the platform.\n");
 	}
 	else
 	{
+		STORE_FORWARD_CONFIG spoolConfig;
+		spoolConfig.directory = SPOOL_DIRECTORY;
+		spoolConfig.segmentBytes = SPOOL_SEGMENT_BYTES;
+		spoolConfig.maxBytes = (uint64_t)Spool_limit_mb * 1024 * 1024;
+		spoolConfig.commitIntervalMs = SPOOL_COMMIT_INTERVAL_MS;
+		spoolConfig.commitBytes = SPOOL_COMMIT_BYTES;
+		spoolConfig.drainPerSecond = SPOOL_DRAIN_PER_SECOND;
+		spoolConfig.drainBurst = SPOOL_DRAIN_BURST;
+		Spool = StoreForward_Open(&spoolConfig);
+		if (Spool == NULL)
+		{
+			printf("Failed to open the spool in %s, messages are lost while the hub is unreachable\n", SPOOL_DIRECTORY);
+		}
+		else if (StoreForward_Pending(Spool) > 0)
+		{
+			printf("Spool holds %llu messages from a previous run\n", (unsigned long long)StoreForward_Pending(Spool));
+		}
+
 		if (SERIALIZER_REGISTER_NAMESPACE(Contoso) == NULL)
 		{
 			printf("Unable to SERIALIZER_REGISTER_NAMESPACE\n");
 		}
 		else
 		{
-			IOTHUB_CLIENT_HANDLE iotHubClientHandle = IoTHubClient_CreateFromConnectionString(connectionString, MQTT_Protocol);
+			HUB_CLIENT_HANDLE iotHubClientHandle = HubClient_CreateFromConnectionString(connectionString, MQTT_Protocol);
 			g_iotHubClientHandle = iotHubClientHandle;
 			if (iotHubClientHandle == NULL)
 			{
@@ -489,14 +2649,30 @@ void remote_monitoring_run(void)
 			}
 			else
 			{
+				(void)StartupPhases_Mark(STARTUP_PHASE_CLIENT_CREATED);
 #ifdef MBED_BUILD_TIMESTAMP
 				// For mbed add the certificate information
-				if (IoTHubClient_SetOption(iotHubClientHandle, "TrustedCerts", certificates) != IOTHUB_CLIENT_OK)
+				if (HubClient_SetOption(iotHubClientHandle, "TrustedCerts", certificates) != IOTHUB_CLIENT_OK)
 				{
 					printf("Failed to set option \"TrustedCerts\"\n");
 				}
 #endif // MBED_BUILD_TIMESTAMP
-				Thermostat* thermostat = IoTHubDeviceTwin_CreateThermostat(iotHubClientHandle);
+#ifdef USE_HUB_STANDIN
+				struct sigaction standinAction;
+				memset(&standinAction, 0, sizeof(standinAction));
+				standinAction.sa_handler = onStandinToggle;
+				sigaction(SIGUSR1, &standinAction, NULL);
+				Hub_connected = 1;
+				(void)StartupPhases_Mark(STARTUP_PHASE_HUB_CONNECTED);
+#else
+				if (HubClient_SetConnectionStatusCallback(iotHubClientHandle, connectionStatusCallback, NULL) != IOTHUB_CLIENT_OK)
+				{
+					/* Without status updates assume the hub is reachable and rely on send failures */
+					printf("Failed to set the connection status callback\n");
+					Hub_connected = 1;
+				}
+#endif
+				Thermostat* thermostat = HubDeviceTwin_CreateThermostat(iotHubClientHandle);
 				if (thermostat == NULL)
 				{
 					printf("Failure in IoTHubDeviceTwin_CreateThermostat\n");
@@ -505,41 +2681,157 @@ void remote_monitoring_run(void)
 				{
 					/* Set values for reported properties */
 					thermostat->Config.TelemetryInterval = 3;
+					thermostat->Config.TelemetryIntervalMs = 3000;
+					thermostat->Config.AchievedSampleRate = 0;
+					thermostat->Config.AggregationWindow = Aggregation_window_s;
+					thermostat->Config.TemperatureDeadband = Temperature_deadband;
+					thermostat->Config.HumidityDeadband = Humidity_deadband;
+					thermostat->Config.HeartbeatInterval = Heartbeat_interval_s;
+					thermostat->Config.BatchSize = Batch_size;
+					thermostat->Config.BatchAge = Batch_age_ms;
+					thermostat->Config.TelemetryEncoding = "json";
+					thermostat->Config.SpoolLimit = Spool_limit_mb;
+					thermostat->Config.InflightPolicy = (char*)InflightPolicyName(Inflight_policy);
+					thermostat->Config.SamplingCatchUp = "skip";
+					g_thermostat = thermostat;
 					thermostat->System.FirmwareVersion = "1.0";
 					/* Specify the signatures of the supported direct methods */
 					thermostat->SupportedMethods = supportedMethod;
 
 					/* Send reported properties to IoT Hub */
-					if (IoTHubDeviceTwin_SendReportedStateThermostat(thermostat, deviceTwinCallback, NULL) != IOTHUB_CLIENT_OK)
+					if (ReportThermostat(thermostat) != IOTHUB_CLIENT_OK)
 					{
 						printf("Failed sending serialized reported state\n");
 					}
 					else
 					{
 						UpdateFirmwareComplete();
-						printf("Send DeviceInfo object to IoT Hub at startup\n");
 
-						SendDeviceInfo(iotHubClientHandle);
-						
 						/* set default telemetry interval */
 						thermostat->TelemetryInterval = 3;
+						Sampling_interval_ms = Handoff_received ? Handoff.samplingIntervalMs : thermostat->TelemetryInterval * 1000;
 
-						while (1)
-						{
-							SendTelemetryData(iotHubClientHandle);
+#ifndef USE_EVENT_LOOP
+						struct sigaction stopAction;
+						memset(&stopAction, 0, sizeof(stopAction));
+						stopAction.sa_handler = OnStopSignal;
+						sigaction(SIGINT, &stopAction, NULL);
+						sigaction(SIGTERM, &stopAction, NULL);
+#endif
 
-							ThreadAPI_Sleep(thermostat->TelemetryInterval * 1000);
+						if (WaitForSensors(iotHubClientHandle) != 0)
+						{
+							printf("Sensor setup failed, stopping\n");
+						}
+						else if (StartSampling() == 0)
+						{
+#ifdef USE_EVENT_LOOP
+							RunEventLoop(iotHubClientHandle);
+#else
+							/* Telemetry runs half a period after sampling so the sample is already in the ring */
+							PERIODIC_SCHEDULE telemetrySchedule;
+							unsigned int telemetryPeriodMs = UplinkPeriodMs();
+							PeriodicSchedule_Init(&telemetrySchedule, telemetryPeriodMs, telemetryPeriodMs / 2, SCHEDULE_CATCH_UP_SKIP, 0);
+							while (!Stop_requested)
+							{
+								uint32_t due;
+								if (First_telemetry_pending)
+								{
+									/* Until the first telemetry is out, look for the hub every STARTUP_POLL_MS */
+									SendFirstTelemetry(iotHubClientHandle);
+									if (First_telemetry_pending)
+									{
+										ThreadAPI_Sleep(STARTUP_POLL_MS);
+									}
+									due = PeriodicSchedule_Poll(&telemetrySchedule, PeriodicSchedule_Now());
+								}
+								else
+								{
+									due = PeriodicSchedule_Wait(&telemetrySchedule);
+								}
+								if (due > 0)
+								{
+									SendTelemetryData(iotHubClientHandle);
+								}
+
+								if (UplinkPeriodMs() != telemetryPeriodMs)
+								{
+									telemetryPeriodMs = UplinkPeriodMs();
+									PeriodicSchedule_Init(&telemetrySchedule, telemetryPeriodMs, telemetryPeriodMs / 2, SCHEDULE_CATCH_UP_SKIP, 0);
+								}
+							}
+#endif
+
+							printf("Shutting down, flushing telemetry\r\n");
+							StopSampling();
+							if (Hot_restart_requested)
+							{
+								HandOffSamples();
+							}
+							FlushTelemetryData(iotHubClientHandle);
+							/* On a hot restart unconfirmed messages are spooled for the new binary instead;
+							   without a handoff the reboot script restarts it, so the flush gets its usual time */
+							WaitForPendingMessages(iotHubClientHandle,
+								Hot_restart != NULL ? HOT_RESTART_FLUSH_TIMEOUT_MS : SHUTDOWN_FLUSH_TIMEOUT_MS);
+							char usage[256];
+							if (FormatResourceUsage(usage, sizeof(usage)) == 0)
+							{
+								printf("Resource usage:\n%s", usage);
+							}
+							SampleRing_Destroy(Sample_ring);
+							Sample_ring = NULL;
 						}
+						TelemetryTemplate_Destroy(&Telemetry_template);
 
-						IoTHubDeviceTwin_DestroyThermostat(thermostat);
+						g_thermostat = NULL;
+						HubDeviceTwin_DestroyThermostat(thermostat);
 					}
 				}
-				IoTHubClient_Destroy(iotHubClientHandle);
+				/* Let a running method finish while the client can still report */
+				MethodPool_Stop(Method_pool);
+				FlushReportedProperties();
+				HubClient_Destroy(iotHubClientHandle);
+				g_iotHubClientHandle = NULL;
 			}
 			serializer_deinit();
 		}
+		/* Destroying the client failed everything it still held; keep those for the next run */
+		InflightWindow_TakeFailed(Inflight_window, requeueFailed, NULL);
+		StoreForward_Close(Spool);
+		Spool = NULL;
+		platform_deinit();
+	}
+	/* Also when the run ended before it needed the sensors */
+	(void)WaitForSensors(NULL);
+#ifdef USE_EVENT_LOOP
+	EventLoop_Destroy(Event_loop);
+	Event_loop = NULL;
+#endif
+	InflightWindow_Destroy(Inflight_window);
+	Inflight_window = NULL;
+	MethodPool_Destroy(Method_pool);
+	Method_pool = NULL;
+	if (Reported_state != NULL)
+	{
+		char reported[256];
+		(void)FormatReportedReport(reported, sizeof(reported));
+		printf("%s", reported);
+		ReportedState_Destroy(Reported_state);
+		Reported_state = NULL;
+	}
+	if (Led_engine != NULL)
+	{
+		LED_ENGINE_STATS ledStats;
+		LedEngine_GetStats(Led_engine, &ledStats);
+		printf("LED: %llu patterns, %llu preempted, %llu pin writes, %llu unchanged, worst step lateness %llu us\r\n",
+			(unsigned long long)ledStats.patterns, (unsigned long long)ledStats.preempted,
+			(unsigned long long)ledStats.writes, (unsigned long long)ledStats.unchanged,
+			(unsigned long long)ledStats.lateUs);
+		LedEngine_Destroy(Led_engine);
+		Led_engine = NULL;
 	}
-	platform_deinit();
+	MessagePool_Destroy(Message_pool);
+	Message_pool = NULL;
 }
 
 int remote_monitoring_init(void)
@@ -560,42 +2852,15 @@ int remote_monitoring_init(void)
 		{
 			perror("Wiring Pi setup failed.");
 		}
+		else if (pthread_create(&Sensor_thread, NULL, &SetupSensors, NULL) == 0)
+		{
+			Sensor_thread_started = 1;
+		}
 		else
 		{
-			result = wiringPiSPISetup(Spi_channel, Spi_clock);
-			if (result < 0)
-			{
-				printf("Can't setup SPI, error %i calling wiringPiSPISetup(%i, %i)  %sn",
-					result, Spi_channel, Spi_clock, strerror(result));
-			}
-			else
-			{
-				int sensorResult = bme280_init(Spi_channel);
-				if (sensorResult != 1)
-				{
-					printf("It appears that no BMP280 module on Chip Enable %i is attached. Aborting.\n", Spi_channel);
-					result = 1;
-				}
-				else
-				{
-					// Read the Temp & Pressure module.
-					float tempC = -300.0;
-					float pressurePa = -300;
-					float humidityPct = -300;
-					sensorResult = bme280_read_sensors(&tempC, &pressurePa, &humidityPct);
-					if (sensorResult == 1)
-					{
-						printf("Temperature = %.1f *C  Pressure = %.1f Pa  Humidity = %1f %%\n",
-							tempC, pressurePa, humidityPct);
-						result = 0;
-					}
-					else
-					{
-						printf("Unable to read BME280 on pin %i. Aborting.\n", Spi_channel);
-						result = 1;
-					}
-				}
-			}
+			printf("Failed to start the sensor setup thread, setting up the sensors first\n");
+			(void)SetupSensors(NULL);
+			result = Sensors_result;
 		}
 	}
 	return result;
@@ -603,11 +2868,32 @@ int remote_monitoring_init(void)
 
 int main(void)
 {
+#ifdef USE_EVENT_LOOP
+	sigset_t stopSignals;
+	GetStopSignals(&stopSignals);
+	pthread_sigmask(SIG_BLOCK, &stopSignals, NULL);
+#endif
+	StartupPhases_Begin();
 	LoadConfig();
+	if (HotRestart_Receive(&Handoff, &Handoff_samples, &Handoff_sample_count) == 0)
+	{
+		printf("Hot restart: received %zu samples, sampling every %u ms\r\n", Handoff_sample_count,
+			Handoff.samplingIntervalMs);
+		Handoff_received = 1;
+		lastUpdateBegin = strdup(Handoff.lastUpdateBegin);
+		lastRebootBegin = strdup(Handoff.lastRebootBegin);
+	}
+	(void)StartupPhases_Mark(STARTUP_PHASE_CONFIG_LOADED);
 	int result = remote_monitoring_init();
 	if (result == 0)
 	{
 		remote_monitoring_run();
+		/* The run stops early when the sensors could not be set up */
+		result = Sensors_result;
+		if (Hot_restart_requested)
+		{
+			RestartIntoFirmware();
+		}
 	}
 	return result;
 }
\ No newline at end of file
@@ -0,0 +1,535 @@
+// Copyright (c) Microsoft. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+#include <ctype.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "reported_state.h"
+
+#define MAX_DEPTH 32
+
+/* One member of a JSON object. Objects are kept as trees so they can be
+   merged; any other value is kept as its normalised JSON text. */
+typedef struct PATCH_NODE_TAG
+{
+	char* key;                  /* quoted JSON string */
+	char* value;                /* NULL for an object */
+	struct PATCH_NODE_TAG* members;
+	struct PATCH_NODE_TAG* next;
+} PATCH_NODE;
+
+typedef struct TEXT_TAG
+{
+	char* data;
+	size_t length;
+	size_t capacity;
+	int failed;
+} TEXT;
+
+typedef struct PARSER_TAG
+{
+	const char* next;
+	const char* end;
+} PARSER;
+
+typedef struct REPORTED_STATE_TAG
+{
+	pthread_mutex_t lock;
+	pthread_mutex_t sendLock;   /* held from taking a report to sending it, so reports leave in order */
+	pthread_cond_t changed;     /* signalled when a report becomes pending or the coalescer stops */
+	pthread_t thread;
+	int stopping;
+	unsigned int windowMs;
+	REPORTED_STATE_SEND send;
+	void* context;
+	PATCH_NODE pending;         /* nothing is pending while it has no members */
+	struct timespec deadline;   /* when the pending report goes out */
+	REPORTED_STATE_STATS stats;
+} REPORTED_STATE;
+
+static void AppendChar(TEXT* text, char c)
+{
+	if (text->length + 2 > text->capacity)
+	{
+		size_t capacity = text->capacity == 0 ? 256 : text->capacity * 2;
+		char* data = realloc(text->data, capacity);
+		if (data == NULL)
+		{
+			text->failed = 1;
+			return;
+		}
+		text->data = data;
+		text->capacity = capacity;
+	}
+	text->data[text->length++] = c;
+	text->data[text->length] = '\0';
+}
+
+static void AppendText(TEXT* text, const char* value)
+{
+	while (*value != '\0')
+	{
+		AppendChar(text, *value++);
+	}
+}
+
+static void FreeNodes(PATCH_NODE* node)
+{
+	while (node != NULL)
+	{
+		PATCH_NODE* next = node->next;
+		FreeNodes(node->members);
+		free(node->key);
+		free(node->value);
+		free(node);
+		node = next;
+	}
+}
+
+static void SkipSpace(PARSER* parser)
+{
+	while (parser->next < parser->end && isspace((unsigned char)*parser->next))
+	{
+		parser->next++;
+	}
+}
+
+static int Expect(PARSER* parser, char c)
+{
+	SkipSpace(parser);
+	if (parser->next < parser->end && *parser->next == c)
+	{
+		parser->next++;
+		return 1;
+	}
+	return 0;
+}
+
+/* Copies a single or double quoted string as a double quoted one */
+static int ParseString(PARSER* parser, TEXT* out)
+{
+	char quote;
+
+	SkipSpace(parser);
+	if (parser->next == parser->end || (*parser->next != '"' && *parser->next != '\''))
+	{
+		return 1;
+	}
+	quote = *parser->next++;
+	AppendChar(out, '"');
+	while (parser->next < parser->end)
+	{
+		char c = *parser->next++;
+		if (c == quote)
+		{
+			AppendChar(out, '"');
+			return out->failed;
+		}
+		if (c == '\\')
+		{
+			if (parser->next == parser->end)
+			{
+				return 1;
+			}
+			c = *parser->next++;
+			/* \' is not JSON; inside double quotes the quote needs no escape */
+			if (c != '\'')
+			{
+				AppendChar(out, '\\');
+			}
+			AppendChar(out, c);
+		}
+		else if (c == '"')
+		{
+			AppendText(out, "\\\"");
+		}
+		else
+		{
+			AppendChar(out, c);
+		}
+	}
+	return 1;
+}
+
+/* Copies any value as normalised JSON text */
+static int ParseValue(PARSER* parser, TEXT* out, int depth)
+{
+	char open, close;
+	int first = 1;
+
+	SkipSpace(parser);
+	if (depth > MAX_DEPTH || parser->next == parser->end)
+	{
+		return 1;
+	}
+	open = *parser->next;
+	if (open == '"' || open == '\'')
+	{
+		return ParseString(parser, out);
+	}
+	if (open != '{' && open != '[')
+	{
+		/* numbers, true, false and null */
+		const char* start = parser->next;
+		while (parser->next < parser->end &&
+			(isalnum((unsigned char)*parser->next) || strchr("+-.", *parser->next) != NULL))
+		{
+			AppendChar(out, *parser->next++);
+		}
+		return parser->next == start || out->failed;
+	}
+
+	close = open == '{' ? '}' : ']';
+	parser->next++;
+	AppendChar(out, open);
+	if (Expect(parser, close))
+	{
+		AppendChar(out, close);
+		return out->failed;
+	}
+	do
+	{
+		if (!first)
+		{
+			AppendChar(out, ',');
+		}
+		first = 0;
+		if (open == '{')
+		{
+			if (ParseString(parser, out) != 0 || !Expect(parser, ':'))
+			{
+				return 1;
+			}
+			AppendChar(out, ':');
+		}
+		if (ParseValue(parser, out, depth + 1) != 0)
+		{
+			return 1;
+		}
+	} while (Expect(parser, ','));
+	AppendChar(out, close);
+	return !Expect(parser, close) || out->failed;
+}
+
+/* Parses an object into object's members; on failure the caller frees what was built */
+static int ParseObject(PARSER* parser, PATCH_NODE* object, int depth)
+{
+	PATCH_NODE** tail = &object->members;
+
+	if (depth > MAX_DEPTH || !Expect(parser, '{'))
+	{
+		return 1;
+	}
+	if (Expect(parser, '}'))
+	{
+		return 0;
+	}
+	do
+	{
+		TEXT key = { 0 };
+		PATCH_NODE* member = calloc(1, sizeof(PATCH_NODE));
+		if (member == NULL)
+		{
+			return 1;
+		}
+		*tail = member;
+		tail = &member->next;
+
+		if (ParseString(parser, &key) != 0 || !Expect(parser, ':'))
+		{
+			free(key.data);
+			return 1;
+		}
+		member->key = key.data;
+		SkipSpace(parser);
+		if (parser->next < parser->end && *parser->next == '{')
+		{
+			if (ParseObject(parser, member, depth + 1) != 0)
+			{
+				return 1;
+			}
+		}
+		else
+		{
+			TEXT value = { 0 };
+			if (ParseValue(parser, &value, depth + 1) != 0)
+			{
+				free(value.data);
+				return 1;
+			}
+			member->value = value.data;
+		}
+	} while (Expect(parser, ','));
+	return !Expect(parser, '}');
+}
+
+static PATCH_NODE* FindMember(PATCH_NODE* object, const char* key)
+{
+	PATCH_NODE* member;
+	for (member = object->members; member != NULL; member = member->next)
+	{
+		if (strcmp(member->key, key) == 0)
+		{
+			return member;
+		}
+	}
+	return NULL;
+}
+
+/* Whether merging source would put an object where target holds a pending
+   value; the hub merges an object into what it has, which would lose the
+   effect of that value */
+static int MustSplit(PATCH_NODE* target, const PATCH_NODE* source)
+{
+	const PATCH_NODE* member;
+	for (member = source->members; member != NULL; member = member->next)
+	{
+		PATCH_NODE* existing = FindMember(target, member->key);
+		if (existing != NULL && member->value == NULL)
+		{
+			if (existing->value != NULL || MustSplit(existing, member))
+			{
+				return 1;
+			}
+		}
+	}
+	return 0;
+}
+
+/* Moves source's members into target; a later value replaces an earlier one */
+static void Merge(PATCH_NODE* target, PATCH_NODE* source)
+{
+	while (source->members != NULL)
+	{
+		PATCH_NODE* member = source->members;
+		PATCH_NODE* existing = FindMember(target, member->key);
+		source->members = member->next;
+		member->next = NULL;
+
+		if (existing == NULL)
+		{
+			PATCH_NODE** tail = &target->members;
+			while (*tail != NULL)
+			{
+				tail = &(*tail)->next;
+			}
+			*tail = member;
+		}
+		else if (existing->value == NULL && member->value == NULL)
+		{
+			Merge(existing, member);
+			FreeNodes(member);
+		}
+		else
+		{
+			FreeNodes(existing->members);
+			free(existing->value);
+			existing->members = member->members;
+			existing->value = member->value;
+			member->members = NULL;
+			member->value = NULL;
+			FreeNodes(member);
+		}
+	}
+}
+
+static void Serialize(const PATCH_NODE* object, TEXT* out)
+{
+	const PATCH_NODE* member;
+
+	AppendChar(out, '{');
+	for (member = object->members; member != NULL; member = member->next)
+	{
+		AppendText(out, member->key);
+		AppendChar(out, ':');
+		if (member->value != NULL)
+		{
+			AppendText(out, member->value);
+		}
+		else
+		{
+			Serialize(member, out);
+		}
+		if (member->next != NULL)
+		{
+			AppendChar(out, ',');
+		}
+	}
+	AppendChar(out, '}');
+}
+
+/* Takes the pending report and sends it; reason counts why it went out early */
+static void SendPending(REPORTED_STATE* state, uint64_t* reason)
+{
+	PATCH_NODE document = { 0 };
+	TEXT report = { 0 };
+	int failed;
+
+	pthread_mutex_lock(&state->sendLock);
+	pthread_mutex_lock(&state->lock);
+	document.members = state->pending.members;
+	state->pending.members = NULL;
+	if (document.members != NULL && reason != NULL)
+	{
+		(*reason)++;
+	}
+	pthread_mutex_unlock(&state->lock);
+
+	if (document.members != NULL)
+	{
+		Serialize(&document, &report);
+		FreeNodes(document.members);
+		failed = report.failed || state->send(state->context, (const unsigned char*)report.data, report.length) != 0;
+
+		pthread_mutex_lock(&state->lock);
+		state->stats.reports++;
+		state->stats.reportBytes += report.length;
+		if (failed)
+		{
+			state->stats.failed++;
+		}
+		pthread_mutex_unlock(&state->lock);
+		free(report.data);
+	}
+	pthread_mutex_unlock(&state->sendLock);
+}
+
+static void* CoalescerThread(void* context)
+{
+	REPORTED_STATE* state = context;
+
+	pthread_mutex_lock(&state->lock);
+	while (!state->stopping)
+	{
+		if (state->pending.members == NULL)
+		{
+			pthread_cond_wait(&state->changed, &state->lock);
+		}
+		else if (pthread_cond_timedwait(&state->changed, &state->lock, &state->deadline) == ETIMEDOUT &&
+			state->pending.members != NULL)
+		{
+			pthread_mutex_unlock(&state->lock);
+			SendPending(state, NULL);
+			pthread_mutex_lock(&state->lock);
+		}
+	}
+	pthread_mutex_unlock(&state->lock);
+	return NULL;
+}
+
+REPORTED_STATE_HANDLE ReportedState_Create(unsigned int windowMs, REPORTED_STATE_SEND send, void* context)
+{
+	REPORTED_STATE* state = calloc(1, sizeof(REPORTED_STATE));
+	pthread_condattr_t attributes;
+
+	if (state == NULL)
+	{
+		return NULL;
+	}
+	state->windowMs = windowMs;
+	state->send = send;
+	state->context = context;
+
+	pthread_mutex_init(&state->lock, NULL);
+	pthread_mutex_init(&state->sendLock, NULL);
+	pthread_condattr_init(&attributes);
+	pthread_condattr_setclock(&attributes, CLOCK_MONOTONIC);
+	pthread_cond_init(&state->changed, &attributes);
+	pthread_condattr_destroy(&attributes);
+
+	if (pthread_create(&state->thread, NULL, &CoalescerThread, state) != 0)
+	{
+		pthread_cond_destroy(&state->changed);
+		pthread_mutex_destroy(&state->sendLock);
+		pthread_mutex_destroy(&state->lock);
+		free(state);
+		return NULL;
+	}
+	return state;
+}
+
+void ReportedState_Destroy(REPORTED_STATE_HANDLE state)
+{
+	if (state != NULL)
+	{
+		pthread_mutex_lock(&state->lock);
+		state->stopping = 1;
+		pthread_cond_signal(&state->changed);
+		pthread_mutex_unlock(&state->lock);
+		pthread_join(state->thread, NULL);
+
+		SendPending(state, NULL);
+		pthread_cond_destroy(&state->changed);
+		pthread_mutex_destroy(&state->sendLock);
+		pthread_mutex_destroy(&state->lock);
+		free(state);
+	}
+}
+
+int ReportedState_Add(REPORTED_STATE_HANDLE state, const char* patch, size_t length, int flush)
+{
+	PATCH_NODE document = { 0 };
+	PARSER parser;
+	int invalid;
+
+	parser.next = patch;
+	parser.end = patch + length;
+	invalid = ParseObject(&parser, &document, 0);
+	SkipSpace(&parser);
+	if (invalid || parser.next != parser.end)
+	{
+		FreeNodes(document.members);
+		return 1;
+	}
+
+	pthread_mutex_lock(&state->lock);
+	while (state->pending.members != NULL && MustSplit(&state->pending, &document))
+	{
+		pthread_mutex_unlock(&state->lock);
+		SendPending(state, &state->stats.splitFlushes);
+		pthread_mutex_lock(&state->lock);
+	}
+	state->stats.patches++;
+	state->stats.patchBytes += length;
+	if (state->pending.members != NULL)
+	{
+		state->stats.merged++;
+	}
+	else if (document.members != NULL)
+	{
+		/* The window starts with the first patch, so a steady trickle still goes out */
+		clock_gettime(CLOCK_MONOTONIC, &state->deadline);
+		state->deadline.tv_sec += state->windowMs / 1000;
+		state->deadline.tv_nsec += (long)(state->windowMs % 1000) * 1000000;
+		if (state->deadline.tv_nsec >= 1000000000)
+		{
+			state->deadline.tv_sec++;
+			state->deadline.tv_nsec -= 1000000000;
+		}
+		pthread_cond_signal(&state->changed);
+	}
+	Merge(&state->pending, &document);
+	pthread_mutex_unlock(&state->lock);
+
+	if (flush)
+	{
+		SendPending(state, &state->stats.hardFlushes);
+	}
+	return 0;
+}
+
+void ReportedState_Flush(REPORTED_STATE_HANDLE state)
+{
+	SendPending(state, &state->stats.hardFlushes);
+}
+
+void ReportedState_GetStats(REPORTED_STATE_HANDLE state, REPORTED_STATE_STATS* stats)
+{
+	pthread_mutex_lock(&state->lock);
+	*stats = state->stats;
+	pthread_mutex_unlock(&state->lock);
+}
@@ -0,0 +1,67 @@
+// Copyright (c) Microsoft. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+#ifndef REPORTED_STATE_H
+#define REPORTED_STATE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Coalesces reported-property patches. Patches that arrive within a short
+   window are deep merged into one pending document, and that document goes
+   out as a single report. When two patches set the same field, the later
+   value wins. A patch can ask for a hard flush, which sends everything
+   pending straight away.
+
+   An object that replaces a pending null or scalar cannot be merged: the
+   hub merges an object into what it already holds, so "delete, then set"
+   would become "set". The pending report is sent first in that case, so
+   the twin ends up as it would have with one report per patch.
+
+   Patches are JSON objects. Strings may use single quotes, as the existing
+   reports do; they are sent with double quotes. Reports are sent in the
+   order they were taken, either on the caller's thread for a flush or on
+   the coalescer's timer thread when the window ends. Every call is safe
+   from any thread. */
+
+typedef struct REPORTED_STATE_TAG* REPORTED_STATE_HANDLE;
+
+/* Sends one report; returns 0 when the transport accepted it */
+typedef int(*REPORTED_STATE_SEND)(void* context, const unsigned char* report, size_t length);
+
+typedef struct REPORTED_STATE_STATS_TAG
+{
+	uint64_t patches;           /* patches accepted */
+	uint64_t merged;            /* patches folded into a report that was already pending */
+	uint64_t reports;           /* reports handed to the transport */
+	uint64_t failed;            /* reports the transport refused */
+	uint64_t hardFlushes;       /* reports sent early by a flushing patch or ReportedState_Flush */
+	uint64_t splitFlushes;      /* reports sent early because an object replaced a pending value */
+	uint64_t patchBytes;        /* bytes of patch text accepted */
+	uint64_t reportBytes;       /* bytes of report text sent */
+} REPORTED_STATE_STATS;
+
+REPORTED_STATE_HANDLE ReportedState_Create(unsigned int windowMs, REPORTED_STATE_SEND send, void* context);
+
+/* Sends whatever is pending and stops the timer thread */
+void ReportedState_Destroy(REPORTED_STATE_HANDLE state);
+
+/* Merges a patch into the pending report. With flush set, the report is
+   sent before this returns. Returns non-zero, and keeps nothing, when the
+   patch is not a JSON object. */
+int ReportedState_Add(REPORTED_STATE_HANDLE state, const char* patch, size_t length, int flush);
+
+/* Sends the pending report now, if there is one */
+void ReportedState_Flush(REPORTED_STATE_HANDLE state);
+
+void ReportedState_GetStats(REPORTED_STATE_HANDLE state, REPORTED_STATE_STATS* stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* REPORTED_STATE_H */
@@ -0,0 +1,113 @@
+// Copyright (c) Microsoft. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+#include <stdlib.h>
+
+#include "sample_ring.h"
+
+#define CACHE_LINE_SIZE 64
+
+/* head is only written by the consumer and tail only by the producer; each
+   sits on its own cache line so the two threads do not false-share. */
+typedef struct SAMPLE_RING_TAG
+{
+	size_t mask;
+	TELEMETRY_SAMPLE* slots;
+
+	size_t head;
+	uint64_t popped;
+	char padHead[CACHE_LINE_SIZE];
+
+	size_t tail;
+	uint64_t pushed;
+	uint64_t overflows;
+	size_t highWatermark;
+	char padTail[CACHE_LINE_SIZE];
+} SAMPLE_RING;
+
+SAMPLE_RING_HANDLE SampleRing_Create(size_t capacity)
+{
+	SAMPLE_RING* ring = calloc(1, sizeof(SAMPLE_RING));
+	if (ring != NULL)
+	{
+		size_t size = 1;
+		while (size < capacity)
+		{
+			size <<= 1;
+		}
+
+		ring->slots = malloc(size * sizeof(TELEMETRY_SAMPLE));
+		if (ring->slots == NULL)
+		{
+			free(ring);
+			ring = NULL;
+		}
+		else
+		{
+			ring->mask = size - 1;
+		}
+	}
+	return ring;
+}
+
+void SampleRing_Destroy(SAMPLE_RING_HANDLE ring)
+{
+	if (ring != NULL)
+	{
+		free(ring->slots);
+		free(ring);
+	}
+}
+
+int SampleRing_Push(SAMPLE_RING_HANDLE ring, const TELEMETRY_SAMPLE* sample)
+{
+	size_t tail = ring->tail;
+	size_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	size_t occupancy = tail - head;
+
+	if (occupancy > ring->mask)
+	{
+		__atomic_store_n(&ring->overflows, ring->overflows + 1, __ATOMIC_RELAXED);
+		return 1;
+	}
+
+	ring->slots[tail & ring->mask] = *sample;
+	/* Publish the slot contents before the new tail */
+	__atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+	__atomic_store_n(&ring->pushed, ring->pushed + 1, __ATOMIC_RELAXED);
+	if (occupancy + 1 > ring->highWatermark)
+	{
+		__atomic_store_n(&ring->highWatermark, occupancy + 1, __ATOMIC_RELAXED);
+	}
+	return 0;
+}
+
+int SampleRing_Pop(SAMPLE_RING_HANDLE ring, TELEMETRY_SAMPLE* sample)
+{
+	size_t head = ring->head;
+	size_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+
+	if (head == tail)
+	{
+		return 1;
+	}
+
+	*sample = ring->slots[head & ring->mask];
+	/* Hand the slot back to the producer only after it has been copied */
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+	__atomic_store_n(&ring->popped, ring->popped + 1, __ATOMIC_RELAXED);
+	return 0;
+}
+
+void SampleRing_GetStats(SAMPLE_RING_HANDLE ring, SAMPLE_RING_STATS* stats)
+{
+	size_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	size_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+
+	stats->capacity = ring->mask + 1;
+	stats->occupancy = tail - head;
+	stats->highWatermark = __atomic_load_n(&ring->highWatermark, __ATOMIC_RELAXED);
+	stats->pushed = __atomic_load_n(&ring->pushed, __ATOMIC_RELAXED);
+	stats->popped = __atomic_load_n(&ring->popped, __ATOMIC_RELAXED);
+	stats->overflows = __atomic_load_n(&ring->overflows, __ATOMIC_RELAXED);
+}
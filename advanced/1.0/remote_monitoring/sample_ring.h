@@ -0,0 +1,61 @@
+// Copyright (c) Microsoft. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+#ifndef SAMPLE_RING_H
+#define SAMPLE_RING_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define SAMPLE_MAX_SENSORS 2
+
+/* One acquisition cycle across all attached sensors */
+typedef struct TELEMETRY_SAMPLE_TAG
+{
+	uint64_t timestampMs;   /* wall clock at acquisition, ms since the epoch */
+	int sensorCount;
+	int status[SAMPLE_MAX_SENSORS];
+	float temperature[SAMPLE_MAX_SENSORS];
+	float humidity[SAMPLE_MAX_SENSORS];
+	float pressure[SAMPLE_MAX_SENSORS];
+} TELEMETRY_SAMPLE;
+
+typedef struct SAMPLE_RING_STATS_TAG
+{
+	size_t capacity;
+	size_t occupancy;       /* samples waiting right now */
+	size_t highWatermark;   /* largest occupancy seen */
+	uint64_t pushed;
+	uint64_t popped;
+	uint64_t overflows;     /* samples dropped because the ring was full */
+} SAMPLE_RING_STATS;
+
+typedef struct SAMPLE_RING_TAG* SAMPLE_RING_HANDLE;
+
+/* Lock-free single-producer/single-consumer ring of telemetry samples.
+   Exactly one thread may push and exactly one thread may pop. capacity is
+   rounded up to a power of two. */
+SAMPLE_RING_HANDLE SampleRing_Create(size_t capacity);
+void SampleRing_Destroy(SAMPLE_RING_HANDLE ring);
+
+/* Producer side. Returns 0 on success, non-zero (and counts an overflow)
+   when the ring is full; the oldest samples are kept. */
+int SampleRing_Push(SAMPLE_RING_HANDLE ring, const TELEMETRY_SAMPLE* sample);
+
+/* Consumer side. Returns 0 and copies the oldest sample out, non-zero when
+   the ring is empty. */
+int SampleRing_Pop(SAMPLE_RING_HANDLE ring, TELEMETRY_SAMPLE* sample);
+
+/* Safe to call from any thread; the counters are a consistent-enough
+   snapshot for reporting. */
+void SampleRing_GetStats(SAMPLE_RING_HANDLE ring, SAMPLE_RING_STATS* stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* SAMPLE_RING_H */
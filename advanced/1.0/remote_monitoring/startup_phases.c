@@ -0,0 +1,116 @@
+// Copyright (c) Microsoft. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+#include <stdio.h>
+#include <time.h>
+
+#include "startup_phases.h"
+
+typedef struct PHASE_NAME_TAG
+{
+	const char* key;            /* in the stats report */
+	const char* property;       /* in the reported properties */
+} PHASE_NAME;
+
+static const PHASE_NAME Phase_names[STARTUP_PHASE_COUNT] =
+{
+	{ "config_loaded", "ConfigLoaded-ms" },
+	{ "hardware_ready", "HardwareReady-ms" },
+	{ "first_sample", "FirstSample-ms" },
+	{ "client_created", "ClientCreated-ms" },
+	{ "hub_connected", "HubConnected-ms" },
+	{ "first_message_sent", "FirstMessageSent-ms" },
+	{ "first_message_confirmed", "FirstMessageConfirmed-ms" }
+};
+
+static uint64_t Begin_ns = 0;
+static uint64_t Marks_ns[STARTUP_PHASE_COUNT];     /* 0 until marked */
+
+static uint64_t NowNs(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000 + (uint64_t)now.tv_nsec;
+}
+
+void StartupPhases_Begin(void)
+{
+	__atomic_store_n(&Begin_ns, NowNs(), __ATOMIC_RELEASE);
+}
+
+int StartupPhases_Mark(STARTUP_PHASE phase)
+{
+	uint64_t unmarked = 0;
+
+	if (phase >= STARTUP_PHASE_COUNT)
+	{
+		return 0;
+	}
+	return __atomic_compare_exchange_n(&Marks_ns[phase], &unmarked, NowNs(), 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+}
+
+int StartupPhases_Elapsed(STARTUP_PHASE phase, uint64_t* elapsedUs)
+{
+	uint64_t markNs;
+	uint64_t beginNs = __atomic_load_n(&Begin_ns, __ATOMIC_ACQUIRE);
+
+	if (phase >= STARTUP_PHASE_COUNT)
+	{
+		return 1;
+	}
+	markNs = __atomic_load_n(&Marks_ns[phase], __ATOMIC_ACQUIRE);
+	if (markNs == 0)
+	{
+		return 1;
+	}
+	*elapsedUs = markNs > beginNs ? (markNs - beginNs) / 1000 : 0;
+	return 0;
+}
+
+int StartupPhases_Format(char* report, size_t size)
+{
+	size_t length = 0;
+	uint64_t elapsedUs;
+
+	if (size == 0)
+	{
+		return 1;
+	}
+	report[0] = '\0';
+	for (int i = 0; i < STARTUP_PHASE_COUNT; i++)
+	{
+		if (StartupPhases_Elapsed((STARTUP_PHASE)i, &elapsedUs) == 0)
+		{
+			int written = snprintf(report + length, size - length, "startup_%s_us %llu\n",
+				Phase_names[i].key, (unsigned long long)elapsedUs);
+			if (written < 0 || (size_t)written >= size - length)
+			{
+				return 1;
+			}
+			length += (size_t)written;
+		}
+	}
+	return 0;
+}
+
+int StartupPhases_FormatPatch(char* patch, size_t size, const char* mode, const char* firmwareVersion)
+{
+	uint64_t elapsedUs;
+	int length = snprintf(patch, size, "{ 'Startup' : { 'Mode': '%s', 'FirmwareVersion': '%s'", mode, firmwareVersion);
+
+	for (int i = 0; i < STARTUP_PHASE_COUNT && length >= 0 && (size_t)length < size; i++)
+	{
+		if (StartupPhases_Elapsed((STARTUP_PHASE)i, &elapsedUs) == 0)
+		{
+			int written = snprintf(patch + length, size - length, ", '%s': %llu",
+				Phase_names[i].property, (unsigned long long)(elapsedUs / 1000));
+			length = written < 0 ? written : length + written;
+		}
+	}
+	if (length >= 0 && (size_t)length < size)
+	{
+		int written = snprintf(patch + length, size - length, " } }");
+		length = written < 0 ? written : length + written;
+	}
+	return length < 0 || (size_t)length >= size;
+}
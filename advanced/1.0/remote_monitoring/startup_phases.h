@@ -0,0 +1,50 @@
+// Copyright (c) Microsoft. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+#ifndef STARTUP_PHASES_H
+#define STARTUP_PHASES_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Timestamps the milestones of one start, on CLOCK_MONOTONIC from
+   StartupPhases_Begin, so cold-start-to-first-message can be compared
+   across firmware versions. Only the first mark of a phase counts. Marks
+   can come from any thread. */
+
+typedef enum STARTUP_PHASE_TAG
+{
+	STARTUP_PHASE_CONFIG_LOADED,
+	STARTUP_PHASE_HARDWARE_READY,       /* sensors configured */
+	STARTUP_PHASE_FIRST_SAMPLE,
+	STARTUP_PHASE_CLIENT_CREATED,
+	STARTUP_PHASE_HUB_CONNECTED,
+	STARTUP_PHASE_FIRST_MESSAGE_SENT,   /* handed to the transport */
+	STARTUP_PHASE_FIRST_MESSAGE_CONFIRMED,
+	STARTUP_PHASE_COUNT
+} STARTUP_PHASE;
+
+void StartupPhases_Begin(void);
+
+/* Returns non-zero when this call recorded the phase */
+int StartupPhases_Mark(STARTUP_PHASE phase);
+
+/* Returns 0 and the time from StartupPhases_Begin once the phase is marked */
+int StartupPhases_Elapsed(STARTUP_PHASE phase, uint64_t* elapsedUs);
+
+/* Writes "startup_<phase>_us value" lines for the phases marked so far */
+int StartupPhases_Format(char* report, size_t size);
+
+/* Writes a reported-property patch with the milliseconds to every phase
+   marked so far, under 'Startup' */
+int StartupPhases_FormatPatch(char* patch, size_t size, const char* mode, const char* firmwareVersion);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* STARTUP_PHASES_H */
@@ -0,0 +1,632 @@
+// Copyright (c) Microsoft. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "store_forward.h"
+
+#define RECORD_HEADER_SIZE 9
+#define SEGMENT_SUFFIX ".seg"
+/* Anything longer is corruption; the largest message IoT Hub takes is 256 KB */
+#define MAX_RECORD_LENGTH (1024 * 1024)
+
+typedef struct STORE_FORWARD_TAG
+{
+	STORE_FORWARD_CONFIG config;
+	char* directory;
+
+	uint64_t firstSeq;          /* oldest segment on disk */
+	uint64_t writeSeq;          /* segment appends go to */
+	int writeFd;
+	uint64_t writeSize;         /* committed bytes in the write segment */
+
+	unsigned char* buffer;      /* appends waiting for the next group commit */
+	size_t bufferLength;
+	size_t bufferCapacity;
+	uint64_t bufferSinceMs;
+
+	uint64_t readSeq;           /* cursor: next record to deliver */
+	uint64_t readOffset;
+	int readFd;
+	uint64_t readFdSeq;
+	unsigned char* readBuffer;
+	size_t readCapacity;
+	int cursorDirty;
+	uint64_t lastCommitMs;
+
+	double tokens;
+	uint64_t lastDrainMs;
+
+	STORE_FORWARD_STATS stats;
+} STORE_FORWARD;
+
+static uint32_t Crc_table[256];
+
+static void InitCrcTable(void)
+{
+	for (uint32_t i = 0; i < 256; i++)
+	{
+		uint32_t crc = i;
+		for (int k = 0; k < 8; k++)
+		{
+			crc = (crc & 1) ? (crc >> 1) ^ 0xEDB88320u : crc >> 1;
+		}
+		Crc_table[i] = crc;
+	}
+}
+
+static uint32_t Crc32(uint32_t crc, const unsigned char* data, size_t length)
+{
+	crc = ~crc;
+	for (size_t i = 0; i < length; i++)
+	{
+		crc = Crc_table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+	}
+	return ~crc;
+}
+
+static uint32_t RecordCrc(uint8_t flags, const unsigned char* payload, size_t length)
+{
+	return Crc32(Crc32(0, &flags, 1), payload, length);
+}
+
+static void SegmentPath(const STORE_FORWARD* store, uint64_t seq, char* path, size_t size)
+{
+	snprintf(path, size, "%s/%016llu" SEGMENT_SUFFIX, store->directory, (unsigned long long)seq);
+}
+
+static void SyncDirectory(const STORE_FORWARD* store)
+{
+	int fd = open(store->directory, O_RDONLY);
+	if (fd >= 0)
+	{
+		(void)fsync(fd);
+		close(fd);
+	}
+}
+
+static int WriteAll(int fd, const unsigned char* data, size_t length)
+{
+	while (length > 0)
+	{
+		ssize_t written = write(fd, data, length);
+		if (written < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			return 1;
+		}
+		data += written;
+		length -= (size_t)written;
+	}
+	return 0;
+}
+
+/* Walks the records of a segment from offset, checking every CRC. Returns the
+   offset just past the last good record and, if wanted, how many there were. */
+static uint64_t ScanSegment(const STORE_FORWARD* store, uint64_t seq, uint64_t offset, uint64_t* records, uint64_t* fileSize)
+{
+	char path[512];
+	struct stat info;
+	unsigned char* data = NULL;
+	uint64_t end = offset;
+	uint64_t count = 0;
+	int fd;
+
+	SegmentPath(store, seq, path, sizeof(path));
+	fd = open(path, O_RDONLY);
+	if (fd >= 0 && fstat(fd, &info) == 0)
+	{
+		size_t size = (size_t)info.st_size;
+		*fileSize = info.st_size;
+		data = malloc(size > 0 ? size : 1);
+		if (data != NULL && pread(fd, data, size, 0) == (ssize_t)size)
+		{
+			while (end + RECORD_HEADER_SIZE <= size)
+			{
+				uint32_t length, crc;
+				memcpy(&length, data + end, sizeof(length));
+				memcpy(&crc, data + end + 4, sizeof(crc));
+				if (length > MAX_RECORD_LENGTH || end + RECORD_HEADER_SIZE + length > size ||
+					RecordCrc(data[end + 8], data + end + RECORD_HEADER_SIZE, length) != crc)
+				{
+					break;
+				}
+				end += RECORD_HEADER_SIZE + length;
+				count++;
+			}
+		}
+		free(data);
+	}
+	else
+	{
+		*fileSize = 0;
+	}
+	if (fd >= 0)
+	{
+		close(fd);
+	}
+	if (records != NULL)
+	{
+		*records = count;
+	}
+	return end;
+}
+
+static void WriteCursor(STORE_FORWARD* store)
+{
+	char path[512], temporary[512], text[64];
+	int fd;
+	int length = snprintf(text, sizeof(text), "%llu %llu\n",
+		(unsigned long long)store->readSeq, (unsigned long long)store->readOffset);
+
+	snprintf(path, sizeof(path), "%s/cursor", store->directory);
+	snprintf(temporary, sizeof(temporary), "%s/cursor.tmp", store->directory);
+	fd = open(temporary, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd >= 0)
+	{
+		/* Write, sync, then rename over the old cursor so a crash leaves one or the other */
+		int failed = WriteAll(fd, (const unsigned char*)text, (size_t)length) != 0 || fdatasync(fd) != 0;
+		close(fd);
+		if (!failed && rename(temporary, path) == 0)
+		{
+			SyncDirectory(store);
+			store->cursorDirty = 0;
+		}
+	}
+}
+
+static void ReadCursor(STORE_FORWARD* store)
+{
+	char path[512];
+	unsigned long long seq, offset;
+	FILE* fp;
+
+	store->readSeq = store->firstSeq;
+	store->readOffset = 0;
+
+	snprintf(path, sizeof(path), "%s/cursor", store->directory);
+	fp = fopen(path, "r");
+	if (fp != NULL)
+	{
+		if (fscanf(fp, "%llu %llu", &seq, &offset) == 2 && seq >= store->firstSeq && seq <= store->writeSeq)
+		{
+			store->readSeq = seq;
+			store->readOffset = offset;
+		}
+		fclose(fp);
+	}
+}
+
+static void CloseReadFd(STORE_FORWARD* store)
+{
+	if (store->readFd >= 0)
+	{
+		close(store->readFd);
+		store->readFd = -1;
+	}
+}
+
+static int OpenWriteSegment(STORE_FORWARD* store)
+{
+	char path[512];
+	SegmentPath(store, store->writeSeq, path, sizeof(path));
+	store->writeFd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+	return store->writeFd < 0;
+}
+
+/* Removes the oldest segment; undelivered records in it count as evicted */
+static void RemoveOldestSegment(STORE_FORWARD* store)
+{
+	char path[512];
+	uint64_t fileSize;
+
+	if (store->readSeq == store->firstSeq)
+	{
+		uint64_t records;
+		(void)ScanSegment(store, store->firstSeq, store->readOffset, &records, &fileSize);
+		store->stats.evicted += records;
+		store->stats.pending -= records < store->stats.pending ? records : store->stats.pending;
+		store->readSeq = store->firstSeq + 1;
+		store->readOffset = 0;
+		store->cursorDirty = 1;
+	}
+	else
+	{
+		struct stat info;
+		SegmentPath(store, store->firstSeq, path, sizeof(path));
+		fileSize = stat(path, &info) == 0 ? (uint64_t)info.st_size : 0;
+	}
+
+	if (store->readFdSeq == store->firstSeq)
+	{
+		CloseReadFd(store);
+	}
+	SegmentPath(store, store->firstSeq, path, sizeof(path));
+	(void)unlink(path);
+	store->stats.bytesOnDisk -= fileSize < store->stats.bytesOnDisk ? fileSize : store->stats.bytesOnDisk;
+	store->firstSeq++;
+}
+
+static void EnforceCap(STORE_FORWARD* store)
+{
+	/* The segment being written is never evicted, so the cap is at least one segment */
+	while (store->stats.bytesOnDisk > store->config.maxBytes && store->firstSeq < store->writeSeq)
+	{
+		RemoveOldestSegment(store);
+	}
+}
+
+static void Recover(STORE_FORWARD* store)
+{
+	DIR* dir = opendir(store->directory);
+	uint64_t minSeq = 0, maxSeq = 0;
+
+	if (dir != NULL)
+	{
+		struct dirent* entry;
+		while ((entry = readdir(dir)) != NULL)
+		{
+			unsigned long long seq;
+			char suffix[8];
+			if (sscanf(entry->d_name, "%16llu%7s", &seq, suffix) == 2 && strcmp(suffix, SEGMENT_SUFFIX) == 0)
+			{
+				if (minSeq == 0 || seq < minSeq)
+				{
+					minSeq = seq;
+				}
+				if (seq > maxSeq)
+				{
+					maxSeq = seq;
+				}
+			}
+		}
+		closedir(dir);
+	}
+
+	store->firstSeq = minSeq == 0 ? 1 : minSeq;
+	store->writeSeq = maxSeq == 0 ? 1 : maxSeq;
+	ReadCursor(store);
+
+	for (uint64_t seq = store->firstSeq; seq <= store->writeSeq; seq++)
+	{
+		uint64_t records, fileSize;
+		uint64_t start = seq == store->readSeq ? store->readOffset : 0;
+		uint64_t end = ScanSegment(store, seq, 0, NULL, &fileSize);
+
+		/* Only the newest segment can have a torn tail; cut it off */
+		if (seq == store->writeSeq && end < fileSize)
+		{
+			char path[512];
+			SegmentPath(store, seq, path, sizeof(path));
+			if (truncate(path, (off_t)end) == 0)
+			{
+				store->stats.recoveredBytesDropped += fileSize - end;
+				fileSize = end;
+			}
+		}
+		if (seq == store->writeSeq)
+		{
+			store->writeSize = fileSize;
+		}
+		store->stats.bytesOnDisk += fileSize;
+
+		if (seq >= store->readSeq)
+		{
+			if (start > end)
+			{
+				start = end;
+				store->readOffset = end;
+			}
+			(void)ScanSegment(store, seq, start, &records, &fileSize);
+			store->stats.pending += records;
+		}
+	}
+}
+
+STORE_FORWARD_HANDLE StoreForward_Open(const STORE_FORWARD_CONFIG* config)
+{
+	STORE_FORWARD* store = calloc(1, sizeof(STORE_FORWARD));
+
+	if (Crc_table[1] == 0)
+	{
+		InitCrcTable();
+	}
+
+	if (store != NULL)
+	{
+		store->config = *config;
+		store->directory = malloc(strlen(config->directory) + 1);
+		store->bufferCapacity = config->commitBytes * 2 + RECORD_HEADER_SIZE;
+		store->buffer = malloc(store->bufferCapacity);
+		store->readFd = -1;
+		store->writeFd = -1;
+		store->tokens = config->drainPerSecond;
+
+		if (store->directory == NULL || store->buffer == NULL ||
+			(mkdir(config->directory, 0755) != 0 && errno != EEXIST))
+		{
+			StoreForward_Close(store);
+			store = NULL;
+		}
+		else
+		{
+			strcpy(store->directory, config->directory);
+			Recover(store);
+			if (OpenWriteSegment(store) != 0)
+			{
+				StoreForward_Close(store);
+				store = NULL;
+			}
+			else
+			{
+				EnforceCap(store);
+			}
+		}
+	}
+	return store;
+}
+
+void StoreForward_Close(STORE_FORWARD_HANDLE store)
+{
+	if (store != NULL)
+	{
+		if (store->writeFd >= 0)
+		{
+			(void)StoreForward_Commit(store);
+			close(store->writeFd);
+		}
+		CloseReadFd(store);
+		free(store->readBuffer);
+		free(store->buffer);
+		free(store->directory);
+		free(store);
+	}
+}
+
+int StoreForward_Commit(STORE_FORWARD_HANDLE store)
+{
+	int result = 0;
+
+	if (store->bufferLength > 0)
+	{
+		/* One write and one sync per group of appends keeps SD card wear down */
+		if (WriteAll(store->writeFd, store->buffer, store->bufferLength) != 0 || fdatasync(store->writeFd) != 0)
+		{
+			result = 1;
+		}
+		else
+		{
+			store->writeSize += store->bufferLength;
+			store->stats.bytesOnDisk += store->bufferLength;
+			store->bufferLength = 0;
+			store->stats.commits++;
+		}
+	}
+	if (store->cursorDirty)
+	{
+		WriteCursor(store);
+	}
+	EnforceCap(store);
+	return result;
+}
+
+int StoreForward_Append(STORE_FORWARD_HANDLE store, const unsigned char* payload, size_t length, uint8_t flags, uint64_t nowMs)
+{
+	size_t recordSize = RECORD_HEADER_SIZE + length;
+	uint32_t length32 = (uint32_t)length;
+	uint32_t crc;
+
+	if (length > MAX_RECORD_LENGTH)
+	{
+		return 1;
+	}
+
+	/* Start a new segment rather than grow this one past its size */
+	if (store->writeSize + store->bufferLength > 0 &&
+		store->writeSize + store->bufferLength + recordSize > store->config.segmentBytes)
+	{
+		if (StoreForward_Commit(store) != 0)
+		{
+			return 1;
+		}
+		close(store->writeFd);
+		store->writeSeq++;
+		store->writeSize = 0;
+		if (OpenWriteSegment(store) != 0)
+		{
+			return 1;
+		}
+		SyncDirectory(store);
+	}
+
+	if (store->bufferLength + recordSize > store->bufferCapacity)
+	{
+		unsigned char* grown = realloc(store->buffer, store->bufferLength + recordSize);
+		if (grown == NULL)
+		{
+			return 1;
+		}
+		store->buffer = grown;
+		store->bufferCapacity = store->bufferLength + recordSize;
+	}
+
+	if (store->bufferLength == 0)
+	{
+		store->bufferSinceMs = nowMs;
+	}
+	crc = RecordCrc(flags, payload, length);
+	memcpy(store->buffer + store->bufferLength, &length32, sizeof(length32));
+	memcpy(store->buffer + store->bufferLength + 4, &crc, sizeof(crc));
+	store->buffer[store->bufferLength + 8] = flags;
+	memcpy(store->buffer + store->bufferLength + RECORD_HEADER_SIZE, payload, length);
+	store->bufferLength += recordSize;
+	store->stats.appended++;
+	store->stats.pending++;
+
+	if (store->bufferLength >= store->config.commitBytes)
+	{
+		(void)StoreForward_Commit(store);
+	}
+	return 0;
+}
+
+void StoreForward_Tick(STORE_FORWARD_HANDLE store, uint64_t nowMs)
+{
+	if ((store->bufferLength > 0 && nowMs - store->bufferSinceMs >= store->config.commitIntervalMs) ||
+		(store->cursorDirty && nowMs - store->lastCommitMs >= store->config.commitIntervalMs))
+	{
+		(void)StoreForward_Commit(store);
+		store->lastCommitMs = nowMs;
+	}
+}
+
+/* Reads the record at the cursor; returns 0, 1 at the end of the segment or -1 when it is corrupt */
+static int ReadRecord(STORE_FORWARD* store, uint32_t* length, uint8_t* flags)
+{
+	unsigned char header[RECORD_HEADER_SIZE];
+	uint32_t crc;
+	ssize_t got;
+
+	if (store->readFd < 0 || store->readFdSeq != store->readSeq)
+	{
+		char path[512];
+		CloseReadFd(store);
+		SegmentPath(store, store->readSeq, path, sizeof(path));
+		store->readFd = open(path, O_RDONLY);
+		store->readFdSeq = store->readSeq;
+		if (store->readFd < 0)
+		{
+			return 1;
+		}
+	}
+
+	got = pread(store->readFd, header, sizeof(header), (off_t)store->readOffset);
+	if (got == 0)
+	{
+		return 1;
+	}
+	if (got != (ssize_t)sizeof(header))
+	{
+		return -1;
+	}
+	memcpy(length, header, sizeof(*length));
+	memcpy(&crc, header + 4, sizeof(crc));
+	*flags = header[8];
+	if (*length > MAX_RECORD_LENGTH)
+	{
+		return -1;
+	}
+	if (*length > store->readCapacity)
+	{
+		unsigned char* grown = realloc(store->readBuffer, *length);
+		if (grown == NULL)
+		{
+			return -1;
+		}
+		store->readBuffer = grown;
+		store->readCapacity = *length;
+	}
+	if (pread(store->readFd, store->readBuffer, *length, (off_t)(store->readOffset + RECORD_HEADER_SIZE)) != (ssize_t)*length ||
+		RecordCrc(*flags, store->readBuffer, *length) != crc)
+	{
+		return -1;
+	}
+	return 0;
+}
+
+size_t StoreForward_Drain(STORE_FORWARD_HANDLE store, uint64_t nowMs, STORE_FORWARD_DELIVER deliver, void* context)
+{
+	size_t delivered = 0;
+	double burst = store->config.drainBurst > 0 ? store->config.drainBurst : 1;
+
+	/* Records still in memory are only read back from disk */
+	if (store->bufferLength > 0)
+	{
+		(void)StoreForward_Commit(store);
+	}
+
+	store->tokens += (double)(nowMs - store->lastDrainMs) * store->config.drainPerSecond / 1000.0;
+	if (store->tokens > burst)
+	{
+		store->tokens = burst;
+	}
+	store->lastDrainMs = nowMs;
+
+	while (store->tokens >= 1.0 && store->stats.pending > 0)
+	{
+		uint32_t length;
+		uint8_t flags;
+		int status;
+
+		if (store->readSeq < store->firstSeq)
+		{
+			store->readSeq = store->firstSeq;
+			store->readOffset = 0;
+		}
+
+		status = ReadRecord(store, &length, &flags);
+		if (status != 0)
+		{
+			if (store->readSeq >= store->writeSeq)
+			{
+				/* Nothing more on disk; the count was off */
+				store->stats.pending = 0;
+				break;
+			}
+			/* Past the end of a finished segment, or a damaged one: move on and drop it */
+			store->readSeq++;
+			store->readOffset = 0;
+			store->cursorDirty = 1;
+			while (store->firstSeq < store->readSeq)
+			{
+				RemoveOldestSegment(store);
+			}
+			continue;
+		}
+
+		if (deliver(context, store->readBuffer, length, flags) != 0)
+		{
+			break;
+		}
+		store->readOffset += RECORD_HEADER_SIZE + length;
+		store->cursorDirty = 1;
+		store->stats.pending--;
+		store->stats.delivered++;
+		store->tokens -= 1.0;
+		delivered++;
+	}
+	return delivered;
+}
+
+void StoreForward_SetMaxBytes(STORE_FORWARD_HANDLE store, uint64_t maxBytes)
+{
+	store->config.maxBytes = maxBytes;
+	EnforceCap(store);
+}
+
+void StoreForward_SetDrainRate(STORE_FORWARD_HANDLE store, uint32_t drainPerSecond, uint32_t drainBurst)
+{
+	store->config.drainPerSecond = drainPerSecond;
+	store->config.drainBurst = drainBurst;
+}
+
+uint64_t StoreForward_Pending(STORE_FORWARD_HANDLE store)
+{
+	return store->stats.pending;
+}
+
+void StoreForward_GetStats(STORE_FORWARD_HANDLE store, STORE_FORWARD_STATS* stats)
+{
+	*stats = store->stats;
+}
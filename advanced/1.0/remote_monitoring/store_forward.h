@@ -0,0 +1,84 @@
+// Copyright (c) Microsoft. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+#ifndef STORE_FORWARD_H
+#define STORE_FORWARD_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* On-disk FIFO of outgoing messages for when the hub is unreachable.
+   Messages are appended to numbered segment files in a spool directory:
+       <directory>/0000000000000001.seg, 0000000000000002.seg, ...
+   each holding records of
+       uint32 length | uint32 crc32 of flags and payload | uint8 flags | payload
+   Appends are buffered and written with a single write and fdatasync per
+   group commit, so a power cut loses at most one commit interval. On open
+   the newest segment is scanned and cut at the first torn or corrupt
+   record. The read position lives in <directory>/cursor and is replaced
+   atomically at each commit; after a crash the messages delivered since
+   the last commit are sent again, so delivery is at least once.
+   Not thread safe: one thread appends and drains. */
+
+typedef struct STORE_FORWARD_TAG* STORE_FORWARD_HANDLE;
+
+typedef struct STORE_FORWARD_CONFIG_TAG
+{
+	const char* directory;
+	size_t segmentBytes;        /* a new segment is started past this size */
+	uint64_t maxBytes;          /* oldest segments are evicted beyond this, delivered or not */
+	uint32_t commitIntervalMs;  /* longest an append waits for its commit */
+	size_t commitBytes;         /* commit early once this much is buffered */
+	uint32_t drainPerSecond;    /* rate limit when draining after reconnect */
+	uint32_t drainBurst;        /* most records one drain may send after a pause */
+} STORE_FORWARD_CONFIG;
+
+typedef struct STORE_FORWARD_STATS_TAG
+{
+	uint64_t pending;           /* records not yet delivered */
+	uint64_t bytesOnDisk;
+	uint64_t appended;
+	uint64_t delivered;
+	uint64_t evicted;           /* records dropped undelivered by the size cap */
+	uint64_t commits;
+	uint64_t recoveredBytesDropped; /* torn tail cut off when opening */
+} STORE_FORWARD_STATS;
+
+/* Returns 0 when the message was handed over, non-zero to stop draining and retry later */
+typedef int(*STORE_FORWARD_DELIVER)(void* context, const unsigned char* payload, size_t length, uint8_t flags);
+
+/* Creates the directory if needed and recovers what a previous run left */
+STORE_FORWARD_HANDLE StoreForward_Open(const STORE_FORWARD_CONFIG* config);
+
+/* Commits anything buffered and closes the files */
+void StoreForward_Close(STORE_FORWARD_HANDLE store);
+
+/* Queues one message; flags travel with it to the deliver callback */
+int StoreForward_Append(STORE_FORWARD_HANDLE store, const unsigned char* payload, size_t length, uint8_t flags, uint64_t nowMs);
+
+/* Writes buffered records and the cursor to disk now */
+int StoreForward_Commit(STORE_FORWARD_HANDLE store);
+
+/* Commits when the oldest buffered record has waited commitIntervalMs */
+void StoreForward_Tick(STORE_FORWARD_HANDLE store, uint64_t nowMs);
+
+/* Delivers records oldest first, as many as the rate limit allows, stopping
+   at the first failure. Returns how many were delivered. */
+size_t StoreForward_Drain(STORE_FORWARD_HANDLE store, uint64_t nowMs, STORE_FORWARD_DELIVER deliver, void* context);
+
+void StoreForward_SetMaxBytes(STORE_FORWARD_HANDLE store, uint64_t maxBytes);
+
+/* Changes the drain rate limit; tokens saved up so far are kept, up to the new burst */
+void StoreForward_SetDrainRate(STORE_FORWARD_HANDLE store, uint32_t drainPerSecond, uint32_t drainBurst);
+uint64_t StoreForward_Pending(STORE_FORWARD_HANDLE store);
+void StoreForward_GetStats(STORE_FORWARD_HANDLE store, STORE_FORWARD_STATS* stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* STORE_FORWARD_H */
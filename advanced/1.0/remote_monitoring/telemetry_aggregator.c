@@ -0,0 +1,91 @@
+// Copyright (c) Microsoft. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+#include <math.h>
+#include <string.h>
+
+#include "telemetry_aggregator.h"
+
+void RunningStats_Reset(RUNNING_STATS* stats)
+{
+	memset(stats, 0, sizeof(*stats));
+}
+
+void RunningStats_Add(RUNNING_STATS* stats, double value)
+{
+	double delta;
+
+	if (stats->count == 0)
+	{
+		stats->min = value;
+		stats->max = value;
+	}
+	else
+	{
+		if (value < stats->min)
+		{
+			stats->min = value;
+		}
+		if (value > stats->max)
+		{
+			stats->max = value;
+		}
+	}
+
+	/* Updating the mean first and using both deltas keeps m2 accurate even
+	   when the values sit far from zero, unlike sum and sum of squares */
+	stats->count++;
+	delta = value - stats->mean;
+	stats->mean += delta / stats->count;
+	stats->m2 += delta * (value - stats->mean);
+}
+
+double RunningStats_StdDev(const RUNNING_STATS* stats)
+{
+	return stats->count < 2 ? 0.0 : sqrt(stats->m2 / (stats->count - 1));
+}
+
+void TelemetryWindow_Reset(TELEMETRY_WINDOW* window)
+{
+	int i;
+
+	window->startMs = 0;
+	window->samples = 0;
+	window->sensorCount = 0;
+	for (i = 0; i < SAMPLE_MAX_SENSORS; i++)
+	{
+		RunningStats_Reset(&window->temperature[i]);
+		RunningStats_Reset(&window->humidity[i]);
+		RunningStats_Reset(&window->pressure[i]);
+	}
+}
+
+void TelemetryWindow_Add(TELEMETRY_WINDOW* window, const TELEMETRY_SAMPLE* sample)
+{
+	int i;
+
+	if (window->samples == 0)
+	{
+		window->startMs = sample->timestampMs;
+	}
+	window->samples++;
+	if (sample->sensorCount > window->sensorCount)
+	{
+		window->sensorCount = sample->sensorCount;
+	}
+
+	for (i = 0; i < sample->sensorCount && i < SAMPLE_MAX_SENSORS; i++)
+	{
+		if (sample->status[i] == 1)
+		{
+			RunningStats_Add(&window->temperature[i], sample->temperature[i]);
+			RunningStats_Add(&window->humidity[i], sample->humidity[i]);
+			RunningStats_Add(&window->pressure[i], sample->pressure[i]);
+		}
+	}
+}
+
+int TelemetryWindow_IsDue(const TELEMETRY_WINDOW* window, uint64_t nowMs, uint32_t windowMs)
+{
+	return window->samples > 0 && nowMs - window->startMs >= windowMs;
+}
@@ -0,0 +1,55 @@
+// Copyright (c) Microsoft. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+#ifndef TELEMETRY_AGGREGATOR_H
+#define TELEMETRY_AGGREGATOR_H
+
+#include <stdint.h>
+
+#include "sample_ring.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Single-pass min/max/mean/variance of one channel (Welford's algorithm) */
+typedef struct RUNNING_STATS_TAG
+{
+	uint32_t count;
+	double min;
+	double max;
+	double mean;
+	double m2;              /* sum of squared deviations from the running mean */
+} RUNNING_STATS;
+
+void RunningStats_Reset(RUNNING_STATS* stats);
+void RunningStats_Add(RUNNING_STATS* stats, double value);
+
+/* Sample standard deviation; 0 with fewer than two values */
+double RunningStats_StdDev(const RUNNING_STATS* stats);
+
+/* Aggregates of every channel over one reporting window */
+typedef struct TELEMETRY_WINDOW_TAG
+{
+	uint64_t startMs;       /* timestamp of the first sample in the window */
+	uint32_t samples;       /* acquisition cycles added, including failed reads */
+	int sensorCount;
+	RUNNING_STATS temperature[SAMPLE_MAX_SENSORS];
+	RUNNING_STATS humidity[SAMPLE_MAX_SENSORS];
+	RUNNING_STATS pressure[SAMPLE_MAX_SENSORS];
+} TELEMETRY_WINDOW;
+
+void TelemetryWindow_Reset(TELEMETRY_WINDOW* window);
+
+/* Adds one acquisition cycle. Sensors whose read failed are counted in
+   samples but not in their channel statistics. */
+void TelemetryWindow_Add(TELEMETRY_WINDOW* window, const TELEMETRY_SAMPLE* sample);
+
+/* Non-zero once the window holds samples spanning at least windowMs */
+int TelemetryWindow_IsDue(const TELEMETRY_WINDOW* window, uint64_t nowMs, uint32_t windowMs);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* TELEMETRY_AGGREGATOR_H */
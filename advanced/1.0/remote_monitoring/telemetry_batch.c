@@ -0,0 +1,98 @@
+// Copyright (c) Microsoft. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+#include "telemetry_batch.h"
+#include "telemetry_template.h"
+
+static int AppendFixed(MESSAGE_BUFFER* message, double value, int decimals)
+{
+	size_t available;
+	unsigned char* tail = MessageBuffer_Tail(message, &available);
+	/* Leading comma, then the number */
+	size_t written = available > 1 ? TelemetryTemplate_FormatFixed(value, decimals, (char*)tail + 1, available - 1) : 0;
+	int result = 1;
+	if (written > 0)
+	{
+		tail[0] = ',';
+		MessageBuffer_Commit(message, written + 1);
+		tail[written + 1] = '\0';
+		result = 0;
+	}
+	return result;
+}
+
+void TelemetryBatch_Init(TELEMETRY_BATCH* batch)
+{
+	batch->count = 0;
+	batch->openedMs = 0;
+}
+
+int TelemetryBatch_Add(TELEMETRY_BATCH* batch, const TELEMETRY_SAMPLE* sample, uint64_t nowMs)
+{
+	int result;
+	if (batch->count >= TELEMETRY_BATCH_MAX_SAMPLES)
+	{
+		result = 1;
+	}
+	else
+	{
+		if (batch->count == 0)
+		{
+			batch->openedMs = nowMs;
+		}
+		batch->samples[batch->count++] = *sample;
+		result = 0;
+	}
+	return result;
+}
+
+int TelemetryBatch_IsDue(const TELEMETRY_BATCH* batch, uint64_t nowMs, int maxSamples, uint32_t maxAgeMs)
+{
+	return batch->count > 0 &&
+		(batch->count >= TELEMETRY_BATCH_MAX_SAMPLES ||
+		(maxSamples > 0 && batch->count >= maxSamples) ||
+		(maxAgeMs > 0 && nowMs - batch->openedMs >= maxAgeMs));
+}
+
+int TelemetryBatch_Format(TELEMETRY_BATCH* batch, const char* deviceId, MESSAGE_BUFFER* message)
+{
+	int result = 0;
+
+	if (batch->count > 0)
+	{
+		/* Every sample in a batch comes from the same set of sensors */
+		int sensorCount = batch->samples[0].sensorCount;
+		uint64_t start = batch->samples[0].timestampMs;
+
+		result = MessageBuffer_Printf(message, "{\"DeviceID\": \"%s\", \"BatchStart\": %llu, \"Fields\": [\"Offset\", \"Temperature\", \"Humidity\"%s], \"Samples\": [",
+			deviceId, (unsigned long long)start, sensorCount > 1 ? ", \"Temperature1\", \"Humidity1\"" : "");
+
+		for (int i = 0; i < batch->count && result == 0; i++)
+		{
+			const TELEMETRY_SAMPLE* sample = &batch->samples[i];
+			/* Deadband segments can end on a sample older than BatchStart */
+			long long offset = (long long)(sample->timestampMs - start);
+
+			result = MessageBuffer_Printf(message, "%s[%lld", i > 0 ? "," : "", offset);
+			for (int s = 0; s < sensorCount && s < SAMPLE_MAX_SENSORS && result == 0; s++)
+			{
+				result = AppendFixed(message, sample->temperature[s], TELEMETRY_TEMPERATURE_DECIMALS);
+				if (result == 0)
+				{
+					result = AppendFixed(message, sample->humidity[s], TELEMETRY_HUMIDITY_DECIMALS);
+				}
+			}
+			if (result == 0)
+			{
+				result = MessageBuffer_Printf(message, "]");
+			}
+		}
+		if (result == 0)
+		{
+			result = MessageBuffer_Printf(message, "] }");
+		}
+	}
+
+	TelemetryBatch_Init(batch);
+	return result;
+}
@@ -0,0 +1,55 @@
+// Copyright (c) Microsoft. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+#ifndef TELEMETRY_BATCH_H
+#define TELEMETRY_BATCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "message_pool.h"
+#include "sample_ring.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Digits that match the BME280's output resolution: 0.01 DegC and 1/1024 %RH */
+#define TELEMETRY_TEMPERATURE_DECIMALS 2
+#define TELEMETRY_HUMIDITY_DECIMALS 3
+
+/* Largest batch; keeps a dual sensor batch well below the 256 KB message limit */
+#define TELEMETRY_BATCH_MAX_SAMPLES 256
+
+/* Samples waiting to be packed into one message */
+typedef struct TELEMETRY_BATCH_TAG
+{
+	int count;
+	uint64_t openedMs;      /* when the first sample of the batch was added */
+	TELEMETRY_SAMPLE samples[TELEMETRY_BATCH_MAX_SAMPLES];
+} TELEMETRY_BATCH;
+
+void TelemetryBatch_Init(TELEMETRY_BATCH* batch);
+
+/* Returns 0, or non-zero when the batch is already full */
+int TelemetryBatch_Add(TELEMETRY_BATCH* batch, const TELEMETRY_SAMPLE* sample, uint64_t nowMs);
+
+/* Non-zero once the batch holds maxSamples samples or its first sample was
+   added maxAgeMs ago; a limit of 0 is not checked */
+int TelemetryBatch_IsDue(const TELEMETRY_BATCH* batch, uint64_t nowMs, int maxSamples, uint32_t maxAgeMs);
+
+/* Packs the batch into one JSON message and empties it. Timestamps are
+   offsets in ms from BatchStart and each sample is an array in the order
+   given by Fields:
+   { "DeviceID": "...", "BatchStart": 1500000000000,
+     "Fields": ["Offset", "Temperature", "Humidity"],
+     "Samples": [[0,21.52,40.176],[3000,21.53,40.113]] }
+   Appends to message and empties the batch. Returns 0, or non-zero when
+   the batch did not fit. */
+int TelemetryBatch_Format(TELEMETRY_BATCH* batch, const char* deviceId, MESSAGE_BUFFER* message);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* TELEMETRY_BATCH_H */
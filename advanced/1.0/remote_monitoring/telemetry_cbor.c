@@ -0,0 +1,172 @@
+// Copyright (c) Microsoft. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+#include <string.h>
+
+#include "telemetry_cbor.h"
+
+#define CBOR_MAJOR_UINT 0
+#define CBOR_MAJOR_NEGINT 1
+#define CBOR_MAJOR_TEXT 3
+#define CBOR_MAJOR_ARRAY 4
+#define CBOR_MAJOR_MAP 5
+#define CBOR_FLOAT32 0xfa
+
+static void PutBytes(CBOR_WRITER* writer, const unsigned char* bytes, size_t count)
+{
+	if (writer->used + count > writer->size)
+	{
+		writer->overflow = 1;
+	}
+	else
+	{
+		memcpy(writer->buffer + writer->used, bytes, count);
+		writer->used += count;
+	}
+}
+
+/* Major type and argument in the shortest form, multi byte values big endian */
+static void PutHead(CBOR_WRITER* writer, int major, uint64_t value)
+{
+	unsigned char head[9];
+	size_t count;
+
+	if (value < 24)
+	{
+		head[0] = (unsigned char)((major << 5) | value);
+		count = 1;
+	}
+	else
+	{
+		int bytes = value <= 0xff ? 1 : value <= 0xffff ? 2 : value <= 0xffffffffu ? 4 : 8;
+		head[0] = (unsigned char)((major << 5) | (bytes == 1 ? 24 : bytes == 2 ? 25 : bytes == 4 ? 26 : 27));
+		for (int i = 0; i < bytes; i++)
+		{
+			head[bytes - i] = (unsigned char)(value >> (8 * i));
+		}
+		count = 1 + bytes;
+	}
+	PutBytes(writer, head, count);
+}
+
+void Cbor_Init(CBOR_WRITER* writer, unsigned char* buffer, size_t size)
+{
+	writer->buffer = buffer;
+	writer->size = size;
+	writer->used = 0;
+	writer->overflow = 0;
+}
+
+void Cbor_Map(CBOR_WRITER* writer, size_t pairs)
+{
+	PutHead(writer, CBOR_MAJOR_MAP, pairs);
+}
+
+void Cbor_Array(CBOR_WRITER* writer, size_t items)
+{
+	PutHead(writer, CBOR_MAJOR_ARRAY, items);
+}
+
+void Cbor_Text(CBOR_WRITER* writer, const char* text)
+{
+	size_t length = strlen(text);
+	PutHead(writer, CBOR_MAJOR_TEXT, length);
+	PutBytes(writer, (const unsigned char*)text, length);
+}
+
+void Cbor_Uint(CBOR_WRITER* writer, uint64_t value)
+{
+	PutHead(writer, CBOR_MAJOR_UINT, value);
+}
+
+void Cbor_Int(CBOR_WRITER* writer, int64_t value)
+{
+	if (value < 0)
+	{
+		PutHead(writer, CBOR_MAJOR_NEGINT, (uint64_t)(-(value + 1)));
+	}
+	else
+	{
+		PutHead(writer, CBOR_MAJOR_UINT, (uint64_t)value);
+	}
+}
+
+void Cbor_Float(CBOR_WRITER* writer, float value)
+{
+	unsigned char bytes[5];
+	uint32_t bits;
+
+	memcpy(&bits, &value, sizeof(bits));
+	bytes[0] = CBOR_FLOAT32;
+	bytes[1] = (unsigned char)(bits >> 24);
+	bytes[2] = (unsigned char)(bits >> 16);
+	bytes[3] = (unsigned char)(bits >> 8);
+	bytes[4] = (unsigned char)bits;
+	PutBytes(writer, bytes, sizeof(bytes));
+}
+
+int TelemetryCbor_EncodeSample(const TELEMETRY_SAMPLE* sample, unsigned char* buffer, size_t size, size_t* length)
+{
+	static const char* temperatureKeys[SAMPLE_MAX_SENSORS] = { "Temperature", "Temperature1" };
+	static const char* humidityKeys[SAMPLE_MAX_SENSORS] = { "Humidity", "Humidity1" };
+	CBOR_WRITER writer;
+	int sensorCount = sample->sensorCount < SAMPLE_MAX_SENSORS ? sample->sensorCount : SAMPLE_MAX_SENSORS;
+
+	Cbor_Init(&writer, buffer, size);
+	Cbor_Map(&writer, 1 + 2 * (size_t)sensorCount);
+	Cbor_Text(&writer, "Timestamp");
+	Cbor_Uint(&writer, sample->timestampMs);
+	for (int i = 0; i < sensorCount; i++)
+	{
+		Cbor_Text(&writer, temperatureKeys[i]);
+		Cbor_Float(&writer, sample->temperature[i]);
+		Cbor_Text(&writer, humidityKeys[i]);
+		Cbor_Float(&writer, sample->humidity[i]);
+	}
+
+	*length = writer.used;
+	return writer.overflow;
+}
+
+int TelemetryCbor_EncodeBatch(TELEMETRY_BATCH* batch, unsigned char* buffer, size_t size, size_t* length)
+{
+	CBOR_WRITER writer;
+
+	Cbor_Init(&writer, buffer, size);
+	if (batch->count > 0)
+	{
+		int sensorCount = batch->samples[0].sensorCount < SAMPLE_MAX_SENSORS ? batch->samples[0].sensorCount : SAMPLE_MAX_SENSORS;
+		uint64_t start = batch->samples[0].timestampMs;
+
+		Cbor_Map(&writer, 3);
+		Cbor_Text(&writer, "BatchStart");
+		Cbor_Uint(&writer, start);
+		Cbor_Text(&writer, "Fields");
+		Cbor_Array(&writer, 1 + 2 * (size_t)sensorCount);
+		Cbor_Text(&writer, "Offset");
+		Cbor_Text(&writer, "Temperature");
+		Cbor_Text(&writer, "Humidity");
+		if (sensorCount > 1)
+		{
+			Cbor_Text(&writer, "Temperature1");
+			Cbor_Text(&writer, "Humidity1");
+		}
+		Cbor_Text(&writer, "Samples");
+		Cbor_Array(&writer, (size_t)batch->count);
+		for (int i = 0; i < batch->count; i++)
+		{
+			const TELEMETRY_SAMPLE* sample = &batch->samples[i];
+			Cbor_Array(&writer, 1 + 2 * (size_t)sensorCount);
+			Cbor_Int(&writer, (int64_t)(sample->timestampMs - start));
+			for (int s = 0; s < sensorCount; s++)
+			{
+				Cbor_Float(&writer, sample->temperature[s]);
+				Cbor_Float(&writer, sample->humidity[s]);
+			}
+		}
+	}
+
+	TelemetryBatch_Init(batch);
+	*length = writer.used;
+	return writer.overflow;
+}
@@ -0,0 +1,55 @@
+// Copyright (c) Microsoft. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+#ifndef TELEMETRY_CBOR_H
+#define TELEMETRY_CBOR_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "sample_ring.h"
+#include "telemetry_batch.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define CBOR_CONTENT_TYPE "application/cbor"
+
+/* Minimal RFC 7049 writer for the subset telemetry needs: definite length
+   maps and arrays, text strings, integers and single precision floats.
+   Writes past the end of the buffer are dropped and flagged in overflow. */
+typedef struct CBOR_WRITER_TAG
+{
+	unsigned char* buffer;
+	size_t size;
+	size_t used;
+	int overflow;
+} CBOR_WRITER;
+
+void Cbor_Init(CBOR_WRITER* writer, unsigned char* buffer, size_t size);
+void Cbor_Map(CBOR_WRITER* writer, size_t pairs);
+void Cbor_Array(CBOR_WRITER* writer, size_t items);
+void Cbor_Text(CBOR_WRITER* writer, const char* text);
+void Cbor_Uint(CBOR_WRITER* writer, uint64_t value);
+void Cbor_Int(CBOR_WRITER* writer, int64_t value);
+void Cbor_Float(CBOR_WRITER* writer, float value);
+
+/* The same fields as the JSON telemetry, minus DeviceID: IoT Hub already
+   stamps every message with the sending device's id.
+   { "Timestamp": 1500000000000, "Temperature": 21.52, "Humidity": 40.18 }
+   bench/telemetry_cbor_bench.c compares its size and encode time with the
+   sprintf JSON.
+   Writes at most size bytes to buffer and returns 0 with the encoded length
+   in length, or non-zero when it did not fit. */
+int TelemetryCbor_EncodeSample(const TELEMETRY_SAMPLE* sample, unsigned char* buffer, size_t size, size_t* length);
+
+/* A batch in the layout of TelemetryBatch_Format, again without DeviceID.
+   Empties the batch. */
+int TelemetryCbor_EncodeBatch(TELEMETRY_BATCH* batch, unsigned char* buffer, size_t size, size_t* length);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* TELEMETRY_CBOR_H */
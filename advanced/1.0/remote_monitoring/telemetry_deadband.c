@@ -0,0 +1,233 @@
+// Copyright (c) Microsoft. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+#include <float.h>
+#include <string.h>
+
+#include "telemetry_deadband.h"
+
+static int GetChannels(const TELEMETRY_DEADBAND* deadband, const TELEMETRY_SAMPLE* sample, double* values, double* deviations)
+{
+	int count = 0;
+	for (int i = 0; i < sample->sensorCount && i < SAMPLE_MAX_SENSORS; i++)
+	{
+		values[count] = sample->temperature[i];
+		deviations[count++] = deadband->temperatureDeviation;
+		values[count] = sample->humidity[i];
+		deviations[count++] = deadband->humidityDeviation;
+	}
+	return count;
+}
+
+/* Samples only share a door when the same sensors read successfully */
+static int SameShape(const TELEMETRY_SAMPLE* a, const TELEMETRY_SAMPLE* b)
+{
+	if (a->sensorCount != b->sensorCount)
+	{
+		return 0;
+	}
+	for (int i = 0; i < a->sensorCount && i < SAMPLE_MAX_SENSORS; i++)
+	{
+		if ((a->status[i] == 1) != (b->status[i] == 1))
+		{
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static void OpenDoor(TELEMETRY_DEADBAND* deadband, const TELEMETRY_SAMPLE* archive)
+{
+	deadband->archive = *archive;
+	deadband->hasArchive = 1;
+	deadband->hasHeld = 0;
+	deadband->lastSentMs = archive->timestampMs;
+	for (int c = 0; c < DEADBAND_MAX_CHANNELS; c++)
+	{
+		deadband->upperSlope[c] = DBL_MAX;
+		deadband->lowerSlope[c] = -DBL_MAX;
+	}
+}
+
+/* Narrows the door with sample; returns 0 when the door closed, leaving the slopes untouched */
+static int NarrowDoor(TELEMETRY_DEADBAND* deadband, const TELEMETRY_SAMPLE* sample)
+{
+	double values[DEADBAND_MAX_CHANNELS], deviations[DEADBAND_MAX_CHANNELS];
+	double archived[DEADBAND_MAX_CHANNELS], unused[DEADBAND_MAX_CHANNELS];
+	double upper[DEADBAND_MAX_CHANNELS], lower[DEADBAND_MAX_CHANNELS];
+	int count = GetChannels(deadband, sample, values, deviations);
+	double dt = (double)(sample->timestampMs - deadband->archive.timestampMs);
+
+	GetChannels(deadband, &deadband->archive, archived, unused);
+	if (dt < 1.0)
+	{
+		dt = 1.0;
+	}
+
+	for (int c = 0; c < count; c++)
+	{
+		/* Failed sensors carry the fixed -300 placeholder and never move */
+		if (sample->status[c / 2] != 1)
+		{
+			upper[c] = deadband->upperSlope[c];
+			lower[c] = deadband->lowerSlope[c];
+			continue;
+		}
+
+		upper[c] = (values[c] + deviations[c] - archived[c]) / dt;
+		lower[c] = (values[c] - deviations[c] - archived[c]) / dt;
+		if (upper[c] > deadband->upperSlope[c])
+		{
+			upper[c] = deadband->upperSlope[c];
+		}
+		if (lower[c] < deadband->lowerSlope[c])
+		{
+			lower[c] = deadband->lowerSlope[c];
+		}
+		if (lower[c] > upper[c])
+		{
+			return 0;
+		}
+	}
+
+	memcpy(deadband->upperSlope, upper, count * sizeof(double));
+	memcpy(deadband->lowerSlope, lower, count * sizeof(double));
+	return 1;
+}
+
+/* The raw value of the sample ending a segment can sit up to one deviation
+   outside the door, which would double the reconstruction error of the
+   suppressed samples. Pull each channel onto the nearest line through the
+   door instead; that moves it by at most the deviation. */
+static void ProjectIntoDoor(const TELEMETRY_DEADBAND* deadband, TELEMETRY_SAMPLE* sample)
+{
+	double dt = (double)(sample->timestampMs - deadband->archive.timestampMs);
+
+	if (dt < 1.0)
+	{
+		dt = 1.0;
+	}
+
+	for (int i = 0; i < sample->sensorCount && i < SAMPLE_MAX_SENSORS; i++)
+	{
+		if (sample->status[i] == 1)
+		{
+			float* values[2] = { &sample->temperature[i], &sample->humidity[i] };
+			const float archived[2] = { deadband->archive.temperature[i], deadband->archive.humidity[i] };
+			for (int k = 0; k < 2; k++)
+			{
+				double slope = (*values[k] - archived[k]) / dt;
+				if (slope > deadband->upperSlope[2 * i + k])
+				{
+					slope = deadband->upperSlope[2 * i + k];
+				}
+				if (slope < deadband->lowerSlope[2 * i + k])
+				{
+					slope = deadband->lowerSlope[2 * i + k];
+				}
+				*values[k] = (float)(archived[k] + slope * dt);
+			}
+		}
+	}
+}
+
+void TelemetryDeadband_Init(TELEMETRY_DEADBAND* deadband)
+{
+	memset(deadband, 0, sizeof(*deadband));
+}
+
+void TelemetryDeadband_Configure(TELEMETRY_DEADBAND* deadband, double temperatureDeviation, double humidityDeviation, uint32_t heartbeatMs)
+{
+	if (deadband->temperatureDeviation != temperatureDeviation ||
+		deadband->humidityDeviation != humidityDeviation ||
+		deadband->heartbeatMs != heartbeatMs)
+	{
+		deadband->temperatureDeviation = temperatureDeviation;
+		deadband->humidityDeviation = humidityDeviation;
+		deadband->heartbeatMs = heartbeatMs;
+		/* The held sample was judged against the old band; the next sample opens a new door */
+		deadband->hasArchive = 0;
+	}
+}
+
+int TelemetryDeadband_Offer(TELEMETRY_DEADBAND* deadband, const TELEMETRY_SAMPLE* sample, TELEMETRY_SAMPLE toSend[2])
+{
+	int count = 0;
+
+	deadband->stats.offered++;
+
+	if (deadband->temperatureDeviation <= 0 && deadband->humidityDeviation <= 0)
+	{
+		if (deadband->hasHeld)
+		{
+			toSend[count++] = deadband->held;
+			deadband->hasHeld = 0;
+		}
+		deadband->hasArchive = 0;
+		toSend[count++] = *sample;
+	}
+	else if (!deadband->hasArchive)
+	{
+		if (deadband->hasHeld)
+		{
+			toSend[count++] = deadband->held;
+		}
+		toSend[count++] = *sample;
+		OpenDoor(deadband, sample);
+	}
+	else if (!SameShape(&deadband->archive, sample))
+	{
+		/* A sensor failed or recovered: close the series on both sides of the change */
+		if (deadband->hasHeld)
+		{
+			toSend[count++] = deadband->held;
+		}
+		toSend[count++] = *sample;
+		OpenDoor(deadband, sample);
+	}
+	else if (!NarrowDoor(deadband, sample))
+	{
+		/* The door closed: the held sample ends this segment and hinges the next */
+		ProjectIntoDoor(deadband, &deadband->held);
+		toSend[count++] = deadband->held;
+		OpenDoor(deadband, &deadband->held);
+		(void)NarrowDoor(deadband, sample);
+		deadband->held = *sample;
+		deadband->hasHeld = 1;
+	}
+	else if (deadband->heartbeatMs > 0 && sample->timestampMs - deadband->lastSentMs >= deadband->heartbeatMs)
+	{
+		/* Still inside the band, so ending the segment here keeps the bound */
+		toSend[count] = *sample;
+		ProjectIntoDoor(deadband, &toSend[count]);
+		OpenDoor(deadband, &toSend[count++]);
+		deadband->stats.heartbeats++;
+	}
+	else
+	{
+		deadband->held = *sample;
+		deadband->hasHeld = 1;
+	}
+
+	deadband->stats.sent += count;
+	/* Every offered sample is either sent now, sent later as the held one, or never */
+	deadband->stats.suppressed = deadband->stats.offered - deadband->stats.sent - (deadband->hasHeld ? 1 : 0);
+	return count;
+}
+
+int TelemetryDeadband_Flush(TELEMETRY_DEADBAND* deadband, TELEMETRY_SAMPLE* toSend)
+{
+	int result = 0;
+	if (deadband->hasHeld)
+	{
+		*toSend = deadband->held;
+		if (deadband->hasArchive)
+		{
+			ProjectIntoDoor(deadband, toSend);
+		}
+		deadband->stats.sent++;
+		OpenDoor(deadband, toSend);
+		result = 1;
+	}
+	return result;
+}
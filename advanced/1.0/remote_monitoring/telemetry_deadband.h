@@ -0,0 +1,65 @@
+// Copyright (c) Microsoft. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+#ifndef TELEMETRY_DEADBAND_H
+#define TELEMETRY_DEADBAND_H
+
+#include <stdint.h>
+
+#include "sample_ring.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define DEADBAND_MAX_CHANNELS (2 * SAMPLE_MAX_SENSORS)
+
+typedef struct DEADBAND_STATS_TAG
+{
+	uint64_t offered;       /* samples passed to TelemetryDeadband_Offer */
+	uint64_t sent;          /* samples handed back to be sent, heartbeats included */
+	uint64_t suppressed;    /* samples that never need to be sent */
+	uint64_t heartbeats;    /* samples sent only because the heartbeat expired */
+} DEADBAND_STATS;
+
+/* Swinging-door compression of the temperature and humidity channels.
+   Linear interpolation between the samples it lets through reproduces every
+   suppressed sample within the configured deviation, so a sample is only
+   sent once the series leaves the band. Because the door closes one sample
+   late, the sample sent is usually the one before the current one. */
+typedef struct TELEMETRY_DEADBAND_TAG
+{
+	double temperatureDeviation;
+	double humidityDeviation;
+	uint32_t heartbeatMs;
+
+	int hasArchive;
+	TELEMETRY_SAMPLE archive;   /* last sample sent, the hinge of the door */
+	int hasHeld;
+	TELEMETRY_SAMPLE held;      /* last sample offered and not yet sent */
+	uint64_t lastSentMs;
+	double upperSlope[DEADBAND_MAX_CHANNELS];
+	double lowerSlope[DEADBAND_MAX_CHANNELS];
+
+	DEADBAND_STATS stats;
+} TELEMETRY_DEADBAND;
+
+void TelemetryDeadband_Init(TELEMETRY_DEADBAND* deadband);
+
+/* Changing the band or heartbeat restarts compression from the next sample.
+   A deviation of 0 on every channel disables suppression. */
+void TelemetryDeadband_Configure(TELEMETRY_DEADBAND* deadband, double temperatureDeviation, double humidityDeviation, uint32_t heartbeatMs);
+
+/* Offers the next sample. Copies up to two samples that must be sent, oldest
+   first, into toSend and returns how many. */
+int TelemetryDeadband_Offer(TELEMETRY_DEADBAND* deadband, const TELEMETRY_SAMPLE* sample, TELEMETRY_SAMPLE toSend[2]);
+
+/* Returns 1 and copies out the held sample when one is pending, so the
+   series ends on its true last value. */
+int TelemetryDeadband_Flush(TELEMETRY_DEADBAND* deadband, TELEMETRY_SAMPLE* toSend);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* TELEMETRY_DEADBAND_H */
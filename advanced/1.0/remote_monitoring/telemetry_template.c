@@ -0,0 +1,217 @@
+// Copyright (c) Microsoft. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "telemetry_template.h"
+
+#define MAX_DECIMALS 6
+/* Beyond this the scaled value no longer fits the integer path */
+#define MAX_FIXED_MAGNITUDE 1e12
+
+static const double Powers_of_ten[MAX_DECIMALS + 1] = { 1, 10, 100, 1000, 10000, 100000, 1000000 };
+
+/* Writes the digits of value backwards from end, returns where they start */
+static char* WriteDigits(char* end, uint64_t value, int minDigits)
+{
+	do
+	{
+		*--end = (char)('0' + value % 10);
+		value /= 10;
+		minDigits--;
+	} while (value != 0 || minDigits > 0);
+	return end;
+}
+
+static size_t FormatUint(uint64_t value, char* buffer, size_t size)
+{
+	char digits[20];
+	char* start = WriteDigits(digits + sizeof(digits), value, 1);
+	size_t length = (size_t)(digits + sizeof(digits) - start);
+	if (length > size)
+	{
+		return 0;
+	}
+	memcpy(buffer, start, length);
+	return length;
+}
+
+size_t TelemetryTemplate_FormatFixed(double value, int decimals, char* buffer, size_t size)
+{
+	char digits[32];
+	char* end = digits + sizeof(digits);
+	char* start;
+	size_t length;
+	int negative = value < 0;
+	double magnitude = negative ? -value : value;
+
+	if (decimals < 0 || decimals > MAX_DECIMALS || !(magnitude < MAX_FIXED_MAGNITUDE))
+	{
+		/* NaN, infinities and huge values are rare enough for libc */
+		int written = snprintf(buffer, size, "%.*f", decimals, value);
+		return (written < 0 || (size_t)written >= size) ? 0 : (size_t)written;
+	}
+
+	/* Round in the scaled integer domain. Humidity comes in 1/1024 steps, so
+	   exact ties are common; break them to even like printf, using fma to
+	   tell a real tie from one made by rounding the product. */
+	double product = magnitude * Powers_of_ten[decimals];
+	uint64_t scaled = (uint64_t)product;
+	double fraction = product - (double)scaled;
+	uint64_t divisor = (uint64_t)Powers_of_ten[decimals];
+
+	if (fraction > 0.5)
+	{
+		scaled++;
+	}
+	else if (fraction == 0.5)
+	{
+		double error = fma(magnitude, Powers_of_ten[decimals], -product);
+		if (error > 0 || (error == 0 && (scaled & 1) != 0))
+		{
+			scaled++;
+		}
+	}
+
+	start = end;
+	if (decimals > 0)
+	{
+		start = WriteDigits(start, scaled % divisor, decimals);
+		*--start = '.';
+	}
+	start = WriteDigits(start, scaled / divisor, 1);
+	/* Like printf, keep the sign of values that round to zero */
+	if (negative)
+	{
+		*--start = '-';
+	}
+
+	length = (size_t)(end - start);
+	if (length > size)
+	{
+		return 0;
+	}
+	memcpy(buffer, start, length);
+	return length;
+}
+
+int TelemetryTemplate_Compile(TELEMETRY_TEMPLATE* compiled, const char* format, const char* constant)
+{
+	size_t constantLength = constant == NULL ? 0 : strlen(constant);
+	size_t used = 0;
+	int constantUsed = 0;
+	int result = 0;
+
+	memset(compiled, 0, sizeof(*compiled));
+	compiled->text = malloc(strlen(format) + constantLength + 1);
+	if (compiled->text == NULL)
+	{
+		return 1;
+	}
+
+	for (const char* p = format; *p != '\0' && result == 0; p++)
+	{
+		if (*p != '%')
+		{
+			compiled->text[used++] = *p;
+		}
+		else if (p[1] == '%')
+		{
+			compiled->text[used++] = '%';
+			p++;
+		}
+		else if (p[1] == 's' && !constantUsed && constant != NULL)
+		{
+			memcpy(compiled->text + used, constant, constantLength);
+			used += constantLength;
+			constantUsed = 1;
+			p++;
+		}
+		else if (compiled->slotCount == TELEMETRY_TEMPLATE_MAX_SLOTS)
+		{
+			result = 1;
+		}
+		else if (strncmp(p, "%llu", 4) == 0)
+		{
+			compiled->literalEnd[compiled->slotCount] = used;
+			compiled->slotType[compiled->slotCount++] = TEMPLATE_SLOT_UINT;
+			p += 3;
+		}
+		else if (p[1] == '.' && p[2] >= '0' && p[2] <= '0' + MAX_DECIMALS && p[3] == 'f')
+		{
+			compiled->literalEnd[compiled->slotCount] = used;
+			compiled->decimals[compiled->slotCount] = p[2] - '0';
+			compiled->slotType[compiled->slotCount++] = TEMPLATE_SLOT_FIXED;
+			p += 3;
+		}
+		else
+		{
+			result = 1;
+		}
+	}
+
+	if (result != 0)
+	{
+		TelemetryTemplate_Destroy(compiled);
+	}
+	else
+	{
+		compiled->literalEnd[compiled->slotCount] = used;
+		compiled->text[used] = '\0';
+	}
+	return result;
+}
+
+void TelemetryTemplate_Destroy(TELEMETRY_TEMPLATE* compiled)
+{
+	free(compiled->text);
+	compiled->text = NULL;
+	compiled->slotCount = 0;
+}
+
+int TelemetryTemplate_Render(const TELEMETRY_TEMPLATE* compiled, const TEMPLATE_VALUE* values, size_t count,
+	char* buffer, size_t size, size_t* length)
+{
+	size_t used = 0;
+	size_t literalStart = 0;
+
+	if (count != compiled->slotCount || size == 0)
+	{
+		return 1;
+	}
+
+	for (size_t i = 0; i <= compiled->slotCount; i++)
+	{
+		size_t literalLength = compiled->literalEnd[i] - literalStart;
+		size_t written;
+
+		/* Keep room for the terminator */
+		if (literalLength >= size - used)
+		{
+			return 1;
+		}
+		memcpy(buffer + used, compiled->text + literalStart, literalLength);
+		used += literalLength;
+		literalStart = compiled->literalEnd[i];
+
+		if (i == compiled->slotCount)
+		{
+			break;
+		}
+		written = compiled->slotType[i] == TEMPLATE_SLOT_UINT ?
+			FormatUint(values[i].u, buffer + used, size - used - 1) :
+			TelemetryTemplate_FormatFixed(values[i].d, compiled->decimals[i], buffer + used, size - used - 1);
+		if (written == 0)
+		{
+			return 1;
+		}
+		used += written;
+	}
+
+	buffer[used] = '\0';
+	*length = used;
+	return 0;
+}
@@ -0,0 +1,62 @@
+// Copyright (c) Microsoft. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+#ifndef TELEMETRY_TEMPLATE_H
+#define TELEMETRY_TEMPLATE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define TELEMETRY_TEMPLATE_MAX_SLOTS 8
+
+typedef enum TEMPLATE_SLOT_TYPE_TAG
+{
+	TEMPLATE_SLOT_UINT,     /* %llu */
+	TEMPLATE_SLOT_FIXED     /* %.Nf, N from 0 to 6 */
+} TEMPLATE_SLOT_TYPE;
+
+typedef union TEMPLATE_VALUE_TAG
+{
+	uint64_t u;
+	double d;
+} TEMPLATE_VALUE;
+
+/* A printf format split once into literal text and numeric slots, so that
+   rendering only formats the numbers. Numbers are written with integer
+   arithmetic at the precision of the format, and the output is byte for
+   byte what sprintf prints, ties included.
+   bench/telemetry_template_bench.c times rendering against sprintf. */
+typedef struct TELEMETRY_TEMPLATE_TAG
+{
+	char* text;             /* all literal text, slots removed */
+	size_t slotCount;
+	size_t literalEnd[TELEMETRY_TEMPLATE_MAX_SLOTS + 1];   /* end of the literal before slot i, and of the tail */
+	TEMPLATE_SLOT_TYPE slotType[TELEMETRY_TEMPLATE_MAX_SLOTS];
+	int decimals[TELEMETRY_TEMPLATE_MAX_SLOTS];
+} TELEMETRY_TEMPLATE;
+
+/* Compiles format. The first %s is replaced by constant, which is copied.
+   Besides that only %%, %llu and %.Nf are accepted. Returns 0, or non-zero
+   for an unsupported format. */
+int TelemetryTemplate_Compile(TELEMETRY_TEMPLATE* compiled, const char* format, const char* constant);
+void TelemetryTemplate_Destroy(TELEMETRY_TEMPLATE* compiled);
+
+/* Writes the template with values in slot order into buffer, NUL terminated.
+   Returns 0 and the length without the terminator, or non-zero when it did
+   not fit in size bytes or count does not match the slots. */
+int TelemetryTemplate_Render(const TELEMETRY_TEMPLATE* compiled, const TEMPLATE_VALUE* values, size_t count,
+	char* buffer, size_t size, size_t* length);
+
+/* Fixed precision formatting of one value, as "%.*f" would print it.
+   Returns the number of characters written, or 0 when they do not fit. */
+size_t TelemetryTemplate_FormatFixed(double value, int decimals, char* buffer, size_t size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* TELEMETRY_TEMPLATE_H */
@@ -0,0 +1,388 @@
+// Copyright (c) Microsoft. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+/* Runs FirmwareDownload_Run against a throttled local HTTP server that drops
+   connections mid-transfer, keeps them open after the body, answers 416 for
+   a complete part file and changes the package between attempts. Exits
+   non-zero on the first failed check. */
+
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <openssl/evp.h>
+
+#include "firmware_download.h"
+
+#define PACKAGE_SIZE (300 * 1024)
+#define DROP_AFTER (100 * 1024)
+#define THROTTLE_BYTES (16 * 1024)
+#define THROTTLE_US 1000
+#define MAX_PLANS 8
+
+/* What the server does for one request */
+typedef struct PLAN_TAG
+{
+	size_t dropAfter;           /* body bytes sent before closing, 0 for all of them */
+	int keepOpen;               /* leave the connection open after the body until the client closes it */
+	int switchPackage;          /* serve the second package from this request on */
+} PLAN;
+
+typedef struct SERVER_TAG
+{
+	int listenFd;
+	int port;
+	pthread_t thread;
+	volatile int stop;
+	const unsigned char* package;
+	const char* etag;
+	PLAN plans[MAX_PLANS];
+	int requests;
+	char lastRequest[2048];
+} SERVER;
+
+static unsigned char Package[PACKAGE_SIZE];
+static unsigned char New_package[PACKAGE_SIZE];
+static char Directory[] = "/tmp/firmware_download_testXXXXXX";
+static int Failures = 0;
+
+#define CHECK(condition) \
+	do { if (!(condition)) { printf("%s:%d: check failed: %s\r\n", __FILE__, __LINE__, #condition); Failures++; } } while (0)
+
+static void Sha256Hex(const unsigned char* data, size_t length, char* hex)
+{
+	unsigned char digest[EVP_MAX_MD_SIZE];
+	unsigned int digestLength = 0;
+	EVP_Digest(data, length, digest, &digestLength, EVP_sha256(), NULL);
+	for (unsigned int i = 0; i < digestLength; i++)
+	{
+		sprintf(hex + 2 * i, "%02x", digest[i]);
+	}
+}
+
+static int SendAll(int fd, const void* data, size_t length)
+{
+	const unsigned char* next = data;
+	while (length > 0)
+	{
+		ssize_t sent = send(fd, next, length, MSG_NOSIGNAL);
+		if (sent <= 0)
+		{
+			return 1;
+		}
+		next += sent;
+		length -= (size_t)sent;
+	}
+	return 0;
+}
+
+static void Serve(SERVER* server, int fd)
+{
+	char* request = server->lastRequest;
+	size_t used = 0;
+	PLAN plan = server->requests < MAX_PLANS ? server->plans[server->requests] : (PLAN){ 0, 0, 0 };
+	char headers[512];
+	unsigned long long first = 0;
+	size_t start = 0, end = PACKAGE_SIZE;
+	int status = 200;
+	int length;
+
+	while (strstr(request, "\r\n\r\n") == NULL)
+	{
+		ssize_t received = used < sizeof(server->lastRequest) - 1 ?
+			recv(fd, request + used, sizeof(server->lastRequest) - 1 - used, 0) : -1;
+		if (received <= 0)
+		{
+			return;
+		}
+		used += (size_t)received;
+		request[used] = '\0';
+	}
+	server->requests++;
+	if (plan.switchPackage)
+	{
+		server->package = New_package;
+		server->etag = "\"v2\"";
+	}
+
+	const char* range = strcasestr(request, "\r\nRange: bytes=");
+	const char* ifRange = strcasestr(request, "\r\nIf-Range: ");
+	int rangeValid = ifRange == NULL || strncmp(ifRange + 12, server->etag, strlen(server->etag)) == 0;
+	if (range != NULL && rangeValid && sscanf(range, "\r\nRange: bytes=%llu-", &first) == 1)
+	{
+		if (first >= PACKAGE_SIZE)
+		{
+			length = snprintf(headers, sizeof(headers), "HTTP/1.1 416 Range Not Satisfiable\r\n"
+				"Content-Range: bytes */%d\r\nContent-Length: 0\r\n\r\n", PACKAGE_SIZE);
+			(void)SendAll(fd, headers, (size_t)length);
+			return;
+		}
+		status = 206;
+		start = (size_t)first;
+	}
+	if (status == 206)
+	{
+		length = snprintf(headers, sizeof(headers), "HTTP/1.1 206 Partial Content\r\nETag: %s\r\n"
+			"Content-Range: bytes %zu-%zu/%d\r\nContent-Length: %zu\r\n\r\n",
+			server->etag, start, end - 1, PACKAGE_SIZE, end - start);
+	}
+	else
+	{
+		length = snprintf(headers, sizeof(headers), "HTTP/1.1 200 OK\r\nETag: %s\r\nContent-Length: %d\r\n\r\n",
+			server->etag, PACKAGE_SIZE);
+	}
+	if (SendAll(fd, headers, (size_t)length) != 0)
+	{
+		return;
+	}
+
+	if (plan.dropAfter > 0 && start + plan.dropAfter < end)
+	{
+		end = start + plan.dropAfter;
+	}
+	for (size_t offset = start; offset < end; offset += THROTTLE_BYTES)
+	{
+		size_t piece = end - offset < THROTTLE_BYTES ? end - offset : THROTTLE_BYTES;
+		if (SendAll(fd, server->package + offset, piece) != 0)
+		{
+			return;
+		}
+		usleep(THROTTLE_US);
+	}
+
+	if (plan.keepOpen)
+	{
+		char discard[256];
+		struct pollfd waiting = { fd, POLLIN, 0 };
+		while (!server->stop && poll(&waiting, 1, 100) >= 0)
+		{
+			if (waiting.revents != 0 && recv(fd, discard, sizeof(discard), 0) <= 0)
+			{
+				break;
+			}
+		}
+	}
+}
+
+static void* ServerThread(void* context)
+{
+	SERVER* server = context;
+	while (!server->stop)
+	{
+		struct pollfd listening = { server->listenFd, POLLIN, 0 };
+		if (poll(&listening, 1, 100) > 0)
+		{
+			int fd = accept(server->listenFd, NULL, NULL);
+			if (fd >= 0)
+			{
+				server->lastRequest[0] = '\0';
+				Serve(server, fd);
+				close(fd);
+			}
+		}
+	}
+	return NULL;
+}
+
+static int StartServer(SERVER* server, const PLAN* plans, size_t planCount)
+{
+	struct sockaddr_in address;
+	socklen_t addressLength = sizeof(address);
+
+	memset(server, 0, sizeof(SERVER));
+	memcpy(server->plans, plans, planCount * sizeof(PLAN));
+	server->package = Package;
+	server->etag = "\"v1\"";
+	memset(&address, 0, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	server->listenFd = socket(AF_INET, SOCK_STREAM, 0);
+	if (server->listenFd < 0 ||
+		bind(server->listenFd, (struct sockaddr*)&address, sizeof(address)) != 0 ||
+		listen(server->listenFd, 4) != 0 ||
+		getsockname(server->listenFd, (struct sockaddr*)&address, &addressLength) != 0 ||
+		pthread_create(&server->thread, NULL, ServerThread, server) != 0)
+	{
+		return 1;
+	}
+	server->port = ntohs(address.sin_port);
+	return 0;
+}
+
+static void StopServer(SERVER* server)
+{
+	server->stop = 1;
+	pthread_join(server->thread, NULL);
+	close(server->listenFd);
+}
+
+static int FileEquals(const char* path, const unsigned char* expected, size_t length)
+{
+	static unsigned char contents[PACKAGE_SIZE + 1];
+	FILE* file = fopen(path, "rb");
+	size_t read = 0;
+	if (file != NULL)
+	{
+		read = fread(contents, 1, sizeof(contents), file);
+		fclose(file);
+	}
+	return file != NULL && read == length && memcmp(contents, expected, length) == 0;
+}
+
+static void SetUp(FIRMWARE_DOWNLOAD_CONFIG* config, SERVER* server, char* url, char* path, const char* sha256)
+{
+	sprintf(url, "http://127.0.0.1:%d/remote_monitoring.zip", server->port);
+	sprintf(path, "%s/remote_monitoring.zip", Directory);
+	(void)unlink(path);
+	memset(config, 0, sizeof(FIRMWARE_DOWNLOAD_CONFIG));
+	config->url = url;
+	config->path = path;
+	config->sha256 = sha256;
+	config->attempts = 5;
+	config->retryDelayMs = 10;
+	config->stallTimeoutMs = 5000;
+}
+
+static double NowS(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (double)now.tv_sec + (double)now.tv_nsec / 1e9;
+}
+
+/* Two drops mid-transfer; each retry resumes where the last one stopped */
+static void TestResumeAfterDrops(const char* sha256)
+{
+	static const PLAN plans[] = { { DROP_AFTER, 0, 0 }, { DROP_AFTER, 0, 0 } };
+	FIRMWARE_DOWNLOAD_CONFIG config;
+	FIRMWARE_DOWNLOAD_RESULT result;
+	SERVER server;
+	char url[128], path[128], stale[160];
+
+	CHECK(StartServer(&server, plans, 2) == 0);
+	SetUp(&config, &server, url, path, sha256);
+	/* A part file of another package must not be resumed, and is cleared away */
+	sprintf(stale, "%s.0123456789abcdef.part", path);
+	FILE* file = fopen(stale, "wb");
+	CHECK(file != NULL && fwrite("stale", 1, 5, file) == 5);
+	if (file != NULL)
+	{
+		fclose(file);
+	}
+
+	CHECK(FirmwareDownload_Run(&config, &result) == 0);
+	CHECK(result.attempts == 3);
+	CHECK(result.resumedBytes == 3 * DROP_AFTER);
+	CHECK(result.bytes == PACKAGE_SIZE && result.total == PACKAGE_SIZE);
+	CHECK(strcmp(result.sha256, sha256) == 0);
+	CHECK(strcasestr(server.lastRequest, "If-Range: \"v1\"") != NULL);
+	CHECK(FileEquals(path, Package, PACKAGE_SIZE));
+	CHECK(access(stale, F_OK) != 0);
+	StopServer(&server);
+}
+
+/* The body is complete when Content-Length bytes are in, even if the server keeps the connection */
+static void TestCompleteBodyOnOpenConnection(const char* sha256)
+{
+	static const PLAN plans[] = { { 0, 1, 0 } };
+	FIRMWARE_DOWNLOAD_CONFIG config;
+	FIRMWARE_DOWNLOAD_RESULT result;
+	SERVER server;
+	char url[128], path[128];
+	double start;
+
+	CHECK(StartServer(&server, plans, 1) == 0);
+	SetUp(&config, &server, url, path, sha256);
+	start = NowS();
+	CHECK(FirmwareDownload_Run(&config, &result) == 0);
+	CHECK(NowS() - start < config.stallTimeoutMs / 2000.0);
+	CHECK(result.attempts == 1 && result.error == NULL);
+	CHECK(FileEquals(path, Package, PACKAGE_SIZE));
+	StopServer(&server);
+}
+
+/* A part file holding the whole package gets 416 for its Range; that is a finished download */
+static void TestCompletePartFile(const char* sha256)
+{
+	FIRMWARE_DOWNLOAD_CONFIG config;
+	FIRMWARE_DOWNLOAD_RESULT result;
+	SERVER server;
+	char url[128], path[128], part[160];
+
+	CHECK(StartServer(&server, NULL, 0) == 0);
+	SetUp(&config, &server, url, path, sha256);
+	sprintf(part, "%s.%.16s.part", path, sha256);
+	FILE* file = fopen(part, "wb");
+	CHECK(file != NULL && fwrite(Package, 1, PACKAGE_SIZE, file) == PACKAGE_SIZE);
+	if (file != NULL)
+	{
+		fclose(file);
+	}
+
+	CHECK(FirmwareDownload_Run(&config, &result) == 0);
+	CHECK(result.attempts == 1 && result.resumedBytes == PACKAGE_SIZE);
+	CHECK(strstr(server.lastRequest, "Range: bytes=307200-") != NULL);
+	CHECK(FileEquals(path, Package, PACKAGE_SIZE));
+	CHECK(access(part, F_OK) != 0);
+	StopServer(&server);
+}
+
+/* The package changes between attempts: If-Range no longer matches and the new one is fetched whole */
+static void TestPackageChangedBetweenAttempts(void)
+{
+	static const PLAN plans[] = { { DROP_AFTER, 0, 0 }, { 0, 0, 1 } };
+	FIRMWARE_DOWNLOAD_CONFIG config;
+	FIRMWARE_DOWNLOAD_RESULT result;
+	SERVER server;
+	char url[128], path[128], sha256[65];
+
+	Sha256Hex(New_package, PACKAGE_SIZE, sha256);
+	CHECK(StartServer(&server, plans, 2) == 0);
+	SetUp(&config, &server, url, path, NULL);
+	CHECK(FirmwareDownload_Run(&config, &result) == 0);
+	CHECK(result.attempts == 2 && result.resumedBytes == 0);
+	CHECK(strcmp(result.sha256, sha256) == 0);
+	CHECK(FileEquals(path, New_package, PACKAGE_SIZE));
+	StopServer(&server);
+}
+
+int main(void)
+{
+	char sha256[65];
+
+	srand(21);
+	for (size_t i = 0; i < PACKAGE_SIZE; i++)
+	{
+		Package[i] = (unsigned char)rand();
+		New_package[i] = (unsigned char)rand();
+	}
+	Sha256Hex(Package, PACKAGE_SIZE, sha256);
+	if (mkdtemp(Directory) == NULL)
+	{
+		printf("Failed to create a scratch directory\r\n");
+		return EXIT_FAILURE;
+	}
+
+	TestResumeAfterDrops(sha256);
+	TestCompleteBodyOnOpenConnection(sha256);
+	TestCompletePartFile(sha256);
+	TestPackageChangedBetweenAttempts();
+
+	char path[128];
+	sprintf(path, "%s/remote_monitoring.zip", Directory);
+	(void)unlink(path);
+	(void)rmdir(Directory);
+	printf("firmware_download_test: %d failures\r\n", Failures);
+	return Failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}